@@ -17,7 +17,6 @@
 #include <errno.h>
 #include <limits.h>
 #include <time.h>
-#include <poll.h>
 #include <signal.h>
 #include <syslog.h>
 #include <dirent.h>
@@ -25,6 +24,7 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/signalfd.h>
+#include <sys/epoll.h>
 
 #include "sanlock.h"
 #include "sanlock_admin.h"
@@ -70,10 +70,9 @@ struct client {
 };
 
 #define CLIENT_NALLOC 3
-static int client_maxi;
 static int client_size = 0;
 static struct client *client = NULL;
-static struct pollfd *pollfd = NULL;
+static int epfd = -1;
 
 #define log_debug(fmt, args...) \
 do { \
@@ -103,29 +102,26 @@ static void client_alloc(void)
 
 	if (!client) {
 		client = malloc(CLIENT_NALLOC * sizeof(struct client));
-		pollfd = malloc(CLIENT_NALLOC * sizeof(struct pollfd));
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd < 0)
+			log_error("can't create epoll fd %d", errno);
 	} else {
 		client = realloc(client, (client_size + CLIENT_NALLOC) *
 				 sizeof(struct client));
-		pollfd = realloc(pollfd, (client_size + CLIENT_NALLOC) *
-				 sizeof(struct pollfd));
-		if (!pollfd)
-			log_error("can't alloc for pollfd");
 	}
-	if (!client || !pollfd)
+	if (!client)
 		log_error("can't alloc for client array");
 
 	for (i = client_size; i < client_size + CLIENT_NALLOC; i++) {
 		memset(&client[i], 0, sizeof(struct client));
 		client[i].fd = -1;
-		pollfd[i].fd = -1;
-		pollfd[i].revents = 0;
 	}
 	client_size += CLIENT_NALLOC;
 }
 
 static int client_add(int fd, void (*workfn)(int ci), void (*deadfn)(int ci))
 {
+	struct epoll_event ev;
 	int i;
 
 	if (!client)
@@ -137,10 +133,12 @@ static int client_add(int fd, void (*workfn)(int ci), void (*deadfn)(int ci))
 			client[i].workfn = workfn;
 			client[i].deadfn = deadfn;
 			client[i].fd = fd;
-			pollfd[i].fd = fd;
-			pollfd[i].events = POLLIN;
-			if (i > client_maxi)
-				client_maxi = i;
+
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN;
+			ev.data.u32 = i;
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+				log_error("client_add epoll_ctl fd %d error %d", fd, errno);
 			return i;
 		}
 	}
@@ -523,6 +521,7 @@ int main(int argc, char *argv[])
 {
 	void (*workfn) (int ci);
 	void (*deadfn) (int ci);
+	struct epoll_event events[CLIENT_NALLOC];
 	uint64_t live_time, now;
 	int poll_timeout;
 	int sleep_seconds;
@@ -530,7 +529,7 @@ int main(int argc, char *argv[])
 	int send_sigusr1 = 0;
 	int cont = 1;
 	int optchar;
-	int sock, con, rv, i;
+	int sock, con, rv, i, n, ci;
 	int align;
 	int victim_host_id;
 
@@ -727,25 +726,26 @@ int main(int argc, char *argv[])
 	poll_timeout = (sleep_seconds > 0) ? sleep_seconds * 1000 : 500;
 
 	while (1) {
-		rv = poll(pollfd, client_maxi + 1, poll_timeout);
-		if (rv == -1 && errno == EINTR)
+		n = epoll_wait(epfd, events, CLIENT_NALLOC, poll_timeout);
+		if (n == -1 && errno == EINTR)
 			continue;
-		if (rv < 0) {
+		if (n < 0) {
 			/* not sure */
 		}
 
-		for (i = 0; i <= client_maxi; i++) {
-			if (client[i].fd < 0)
+		for (i = 0; i < n; i++) {
+			ci = events[i].data.u32;
+			if (ci >= client_size || client[ci].fd < 0)
 				continue;
-			if (pollfd[i].revents & POLLIN) {
-				workfn = client[i].workfn;
+			if (events[i].events & EPOLLIN) {
+				workfn = client[ci].workfn;
 				if (workfn)
-					workfn(i);
+					workfn(ci);
 			}
-			if (pollfd[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
-				deadfn = client[i].deadfn;
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				deadfn = client[ci].deadfn;
 				if (deadfn)
-					deadfn(i);
+					deadfn(ci);
 			}
 		}
 
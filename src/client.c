@@ -27,6 +27,7 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/un.h>
+#include <sys/mman.h>
 
 #include "sanlock.h"
 #include "sanlock_internal.h"
@@ -70,8 +71,8 @@ static int connect_socket(int *sock_fd)
 	return 0;
 }
 
-static int send_header(int sock, int cmd, uint32_t cmd_flags, int datalen,
-		       uint32_t data, uint32_t data2)
+static int send_header_seq(int sock, int cmd, uint32_t cmd_flags, int datalen,
+			   uint32_t data, uint32_t data2, uint32_t seq)
 {
 	struct sm_header header;
 	int rv;
@@ -82,6 +83,7 @@ static int send_header(int sock, int cmd, uint32_t cmd_flags, int datalen,
 	header.cmd = cmd;
 	header.cmd_flags = cmd_flags;
 	header.length = sizeof(header) + datalen;
+	header.seq = seq;
 	header.data = data;
 	header.data2 = data2;
 
@@ -96,6 +98,12 @@ retry:
 	return 0;
 }
 
+static int send_header(int sock, int cmd, uint32_t cmd_flags, int datalen,
+		       uint32_t data, uint32_t data2)
+{
+	return send_header_seq(sock, cmd, cmd_flags, datalen, data, data2, 0);
+}
+
 static ssize_t send_data(int sockfd, const void *buf, size_t len, int flags)
 {
 	ssize_t rv;
@@ -187,6 +195,72 @@ int sanlock_add_lockspace_timeout(struct sanlk_lockspace *ls, uint32_t flags, ui
 	return cmd_lockspace(SM_CMD_ADD_LOCKSPACE, ls, flags, io_timeout);
 }
 
+int sanlock_add_lockspaces(struct sanlk_lockspace *lss, int count,
+			   uint32_t flags, uint32_t io_timeout, int *results)
+{
+	struct sm_add_result ar;
+	struct sm_header h;
+	int datalen, rv, fd, i, ret;
+
+	if (!lss || !results || count < 1 || count > SANLK_ADD_LOCKSPACES_MAX)
+		return -EINVAL;
+
+	datalen = count * sizeof(struct sanlk_lockspace);
+
+	rv = connect_socket(&fd);
+	if (rv < 0)
+		return rv;
+
+	rv = send_header(fd, SM_CMD_ADD_LOCKSPACES, flags, datalen, io_timeout, count);
+	if (rv < 0)
+		goto out;
+
+	rv = send_data(fd, (void *)lss, datalen, 0);
+	if (rv < 0) {
+		rv = -errno;
+		goto out;
+	}
+
+	/* receive result, then a result for each lockspace as it completes */
+
+	memset(&h, 0, sizeof(h));
+
+	rv = recv_data(fd, &h, sizeof(h), MSG_WAITALL);
+	if (rv < 0) {
+		rv = -errno;
+		goto out;
+	}
+
+	if (rv != sizeof(h)) {
+		rv = -1;
+		goto out;
+	}
+
+	rv = (int)h.data;
+	if (rv < 0)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		ret = recv_data(fd, &ar, sizeof(ar), MSG_WAITALL);
+		if (ret < 0) {
+			rv = -errno;
+			goto out;
+		}
+
+		if (ret != sizeof(ar)) {
+			rv = -1;
+			goto out;
+		}
+
+		if (ar.index < (uint32_t)count)
+			results[ar.index] = ar.result;
+	}
+	rv = 0;
+ out:
+	close(fd);
+	return rv;
+}
+
 int sanlock_inq_lockspace(struct sanlk_lockspace *ls, uint32_t flags)
 {
 	return cmd_lockspace(SM_CMD_INQ_LOCKSPACE, ls, flags, 0);
@@ -356,6 +430,108 @@ int sanlock_get_hosts(const char *ls_name, uint64_t host_id,
 	return rv;
 }
 
+/*
+ * The daemon updates the snapshot under a seqlock (see shm_state.c), so
+ * retry the copy until it is not changed while being copied.
+ */
+
+#define SHM_SNAPSHOT_TRIES 1000
+
+int sanlock_state_snapshot(struct sanlk_shm_header **snap, GNUC_UNUSED uint32_t flags)
+{
+	static const char *run_dir;
+	char path[PATH_MAX];
+	struct sanlk_shm_header *h;
+	struct stat st;
+	char *map = MAP_FAILED;
+	char *buf = NULL;
+	size_t map_len = 0;
+	uint32_t seq, size;
+	int fd, tries, rv;
+
+	if (!snap)
+		return -EINVAL;
+
+	if (run_dir == NULL)
+		run_dir = env_get("SANLOCK_RUN_DIR", DEFAULT_RUN_DIR);
+
+	snprintf(path, sizeof(path), "%s/%s", run_dir, SANLK_SHM_NAME);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	for (tries = 0; tries < SHM_SNAPSHOT_TRIES; tries++) {
+		if (map == MAP_FAILED) {
+			if (fstat(fd, &st) < 0) {
+				rv = -errno;
+				goto out;
+			}
+			if (st.st_size < (off_t)sizeof(struct sanlk_shm_header)) {
+				rv = -EAGAIN;
+				goto out;
+			}
+			map_len = st.st_size;
+			map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+			if (map == MAP_FAILED) {
+				rv = -errno;
+				goto out;
+			}
+		}
+
+		h = (struct sanlk_shm_header *)map;
+
+		seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			usleep(1000);
+			continue;
+		}
+
+		/* not yet written by the daemon */
+		if (!seq) {
+			rv = -EAGAIN;
+			goto out;
+		}
+
+		if (h->magic != SANLK_SHM_MAGIC || h->version != SANLK_SHM_VERSION) {
+			rv = -EPROTONOSUPPORT;
+			goto out;
+		}
+
+		size = h->size;
+		if (size > map_len) {
+			/* the daemon has grown the file */
+			munmap(map, map_len);
+			map = MAP_FAILED;
+			continue;
+		}
+
+		free(buf);
+		buf = malloc(size);
+		if (!buf) {
+			rv = -ENOMEM;
+			goto out;
+		}
+		memcpy(buf, map, size);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		*snap = (struct sanlk_shm_header *)buf;
+		buf = NULL;
+		rv = 0;
+		goto out;
+	}
+	rv = -EBUSY;
+ out:
+	free(buf);
+	if (map != MAP_FAILED)
+		munmap(map, map_len);
+	close(fd);
+	return rv;
+}
+
 int sanlock_set_config(const char *ls_name, uint32_t flags, uint32_t cmd, GNUC_UNUSED void *data)
 {
 	struct sanlk_lockspace ls;
@@ -1105,9 +1281,9 @@ int sanlock_killpath(int sock, uint32_t flags, const char *path, char *args)
 	return rv;
 }
 
-int sanlock_acquire(int sock, int pid, uint32_t flags, int res_count,
-		    struct sanlk_resource *res_args[],
-		    struct sanlk_options *opt_in)
+static int do_acquire(int sock, int pid, uint32_t flags, int res_count,
+		      struct sanlk_resource *res_args[],
+		      struct sanlk_options *opt_in, uint32_t wait_sec)
 {
 	struct sanlk_resource *res;
 	struct sanlk_options opt;
@@ -1152,7 +1328,9 @@ int sanlock_acquire(int sock, int pid, uint32_t flags, int res_count,
 		fd = sock;
 	}
 
-	rv = send_header(fd, SM_CMD_ACQUIRE, flags, datalen, res_count, data2);
+	/* the daemon reads the wait time from seq, which is otherwise unused */
+	rv = send_header_seq(fd, SM_CMD_ACQUIRE, flags, datalen, res_count, data2,
+			     wait_sec);
 	if (rv < 0)
 		return rv;
 
@@ -1192,6 +1370,21 @@ int sanlock_acquire(int sock, int pid, uint32_t flags, int res_count,
 	return rv;
 }
 
+int sanlock_acquire(int sock, int pid, uint32_t flags, int res_count,
+		    struct sanlk_resource *res_args[],
+		    struct sanlk_options *opt_in)
+{
+	return do_acquire(sock, pid, flags, res_count, res_args, opt_in, 0);
+}
+
+int sanlock_acquire_wait(int sock, int pid, uint32_t flags, int res_count,
+			 struct sanlk_resource *res_args[],
+			 struct sanlk_options *opt_in, uint32_t wait_sec)
+{
+	return do_acquire(sock, pid, flags | SANLK_ACQUIRE_WAIT, res_count,
+			  res_args, opt_in, wait_sec);
+}
+
 int sanlock_inquire(int sock, int pid, uint32_t flags, int *res_count,
 		    char **res_state)
 {
@@ -31,6 +31,7 @@
 #include "sanlock_sock.h"
 
 #include "client_cmd.h"
+#include "trace.h"
 
 #ifndef GNUC_UNUSED
 #define GNUC_UNUSED __attribute__((__unused__))
@@ -639,6 +640,246 @@ int sanlock_renewal(char *lockspace_name)
 	return rv;
 }
 
+int sanlock_latency(char *lockspace_name)
+{
+	struct sm_header h;
+	struct sanlk_state st;
+	struct sanlk_lockspace lockspace;
+	char str[SANLK_STATE_MAXSTR];
+	int fd, rv;
+
+	if (!lockspace_name || !lockspace_name[0])
+		return -1;
+
+	fd = send_command(SM_CMD_LATENCY, 0);
+	if (fd < 0)
+		return fd;
+
+	memset(&lockspace, 0, sizeof(lockspace));
+	snprintf(lockspace.name, SANLK_NAME_LEN, "%s", lockspace_name);
+
+	rv = send(fd, &lockspace, sizeof(lockspace), 0);
+	if (rv < 0)
+		goto out;
+
+	rv = recv(fd, &h, sizeof(h), MSG_WAITALL);
+	if (rv < 0) {
+		rv = -errno;
+		goto out;
+	}
+	if (rv != sizeof(h)) {
+		rv = -1;
+		goto out;
+	}
+
+	while (1) {
+		rv = recv(fd, &st, sizeof(st), MSG_WAITALL);
+		if (!rv)
+			break;
+		if (rv != sizeof(st))
+			break;
+
+		if (st.str_len) {
+			rv = recv(fd, str, st.str_len, MSG_WAITALL);
+			if (rv != st.str_len)
+				break;
+		}
+
+		printf("%s\n", str);
+	}
+
+	rv = h.data;
+ out:
+	close(fd);
+	return rv;
+}
+
+int sanlock_metrics(int max_size)
+{
+	struct sm_header h;
+	char *buf;
+	int fd, rv;
+
+	buf = malloc(max_size + 1);
+	if (!buf)
+		return -ENOMEM;
+
+	fd = send_command(SM_CMD_METRICS, 0);
+	if (fd < 0) {
+		free(buf);
+		return fd;
+	}
+
+	memset(&h, 0, sizeof(h));
+
+	rv = recv(fd, &h, sizeof(h), MSG_WAITALL);
+	if (rv < 0) {
+		rv = -errno;
+		goto out;
+	}
+	if (rv != sizeof(h)) {
+		rv = -1;
+		goto out;
+	}
+
+	if (h.data <= 0 || h.data > max_size) {
+		rv = 0;
+		goto out;
+	}
+
+	rv = recv(fd, buf, h.data, MSG_WAITALL);
+	if (rv != h.data) {
+		rv = -1;
+		goto out;
+	}
+	buf[rv] = '\0';
+
+	printf("%s", buf);
+	rv = 0;
+ out:
+	close(fd);
+	free(buf);
+	return rv;
+}
+
+static void print_trace_rec(struct trace_header *th, struct trace_rec *rec)
+{
+	struct tm time_info;
+	char time_str[32];
+	uint64_t ago_ns, real_ns;
+	time_t real_sec;
+	const char *op_str;
+
+	ago_ns = (th->now_ns > rec->ns) ? th->now_ns - rec->ns : 0;
+	real_ns = th->now_real_ns - ago_ns;
+	real_sec = real_ns / 1000000000;
+
+	localtime_r(&real_sec, &time_info);
+	strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &time_info);
+
+	printf("%llu %s.%06llu -%llu.%06llu [%u] %s ",
+	       (unsigned long long)rec->seq, time_str,
+	       (unsigned long long)(real_ns % 1000000000) / 1000,
+	       (unsigned long long)ago_ns / 1000000000,
+	       (unsigned long long)(ago_ns % 1000000000) / 1000,
+	       rec->tid, trace_event_str(rec->event));
+
+	op_str = (rec->op == TRACE_OP_RD) ? "RD" : "WR";
+
+	switch (rec->event) {
+	case TRACE_BALLOT_PHASE:
+		printf("r%u phase%u host_id %d lver %llu %s %llu\n",
+		       rec->id, rec->op, rec->result,
+		       (unsigned long long)rec->a1,
+		       (rec->op == 1) ? "mbal" : "inp",
+		       (unsigned long long)rec->a2);
+		break;
+	case TRACE_BALLOT_ABORT:
+		printf("r%u phase%u bk[%d] lver %llu mbal %llu\n",
+		       rec->id, rec->op, rec->result,
+		       (unsigned long long)rec->a1,
+		       (unsigned long long)rec->a2);
+		break;
+	case TRACE_BALLOT_DONE:
+		printf("r%u phase%u error %d lver %llu mbal %llu\n",
+		       rec->id, rec->op, rec->result,
+		       (unsigned long long)rec->a1,
+		       (unsigned long long)rec->a2);
+		break;
+	case TRACE_COMMIT:
+		printf("r%u error %d lver %llu owner_id %llu\n",
+		       rec->id, rec->result,
+		       (unsigned long long)rec->a1,
+		       (unsigned long long)rec->a2);
+		break;
+	case TRACE_IO_SUBMIT:
+		printf("%s fd %u len %d offset %llu\n",
+		       op_str, rec->id, rec->result,
+		       (unsigned long long)rec->a1);
+		break;
+	case TRACE_IO_DONE:
+	case TRACE_IO_TIMEOUT:
+		printf("%s fd %u rv %d offset %llu usec %llu\n",
+		       op_str, rec->id, rec->result,
+		       (unsigned long long)rec->a1,
+		       (unsigned long long)rec->a2);
+		break;
+	case TRACE_RENEWAL:
+		printf("s%u error %d read_ms %lld write_ms %lld\n",
+		       rec->id, rec->result,
+		       (long long)rec->a1, (long long)rec->a2);
+		break;
+	default:
+		printf("%u %u %d %llu %llu\n",
+		       rec->op, rec->id, rec->result,
+		       (unsigned long long)rec->a1,
+		       (unsigned long long)rec->a2);
+	}
+}
+
+int sanlock_trace(int max_size)
+{
+	struct sm_header h;
+	struct trace_header *th;
+	struct trace_rec *recs;
+	char *buf;
+	uint32_t i;
+	int fd, rv;
+
+	buf = malloc(max_size);
+	if (!buf)
+		return -ENOMEM;
+
+	fd = send_command(SM_CMD_TRACE, 0);
+	if (fd < 0) {
+		free(buf);
+		return fd;
+	}
+
+	memset(&h, 0, sizeof(h));
+
+	rv = recv(fd, &h, sizeof(h), MSG_WAITALL);
+	if (rv < 0) {
+		rv = -errno;
+		goto out;
+	}
+	if (rv != sizeof(h)) {
+		rv = -1;
+		goto out;
+	}
+
+	if (h.data < (int)sizeof(struct trace_header) || h.data > max_size) {
+		rv = -1;
+		goto out;
+	}
+
+	rv = recv(fd, buf, h.data, MSG_WAITALL);
+	if (rv != h.data) {
+		rv = -1;
+		goto out;
+	}
+
+	th = (struct trace_header *)buf;
+	recs = (struct trace_rec *)(buf + sizeof(struct trace_header));
+
+	if (th->magic != TRACE_MAGIC || th->rec_size != sizeof(struct trace_rec) ||
+	    sizeof(struct trace_header) + th->rec_count * sizeof(struct trace_rec) > (size_t)h.data) {
+		fprintf(stderr, "unknown trace format\n");
+		rv = -1;
+		goto out;
+	}
+
+	for (i = 0; i < th->rec_count; i++)
+		print_trace_rec(th, &recs[i]);
+
+	printf("%u events of %llu\n", th->rec_count, (unsigned long long)th->seq);
+	rv = 0;
+ out:
+	close(fd);
+	free(buf);
+	return rv;
+}
+
 int sanlock_log_dump(int max_size)
 {
 	struct sm_header h;
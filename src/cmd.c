@@ -12,6 +12,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
+#include <stdarg.h>
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
@@ -46,13 +47,17 @@
 #include "direct.h"
 #include "task.h"
 #include "cmd.h"
+#include "latency.h"
+#include "trace.h"
 
 /* from main.c */
 void client_resume(int ci);
 void client_free(int ci);
 void client_recv_all(int ci, struct sm_header *h_recv, int pos);
 void client_pid_dead(int ci);
+void client_set_pid(int ci, int pid);
 void send_result(int fd, struct sm_header *h_recv, int result);
+void thread_pool_stats(int *workers, int *free_workers, int *queued);
 
 static uint32_t token_id_counter = 1;
 
@@ -71,12 +76,14 @@ static void release_cl_tokens(struct task *task, struct client *cl)
 }
 
 static void release_new_tokens(struct task *task, struct token *new_tokens[],
-			       int alloc_count, int acquire_count)
+			       int alloc_count, int acquired[])
 {
 	int i;
 
-	for (i = 0; i < acquire_count; i++)
-		release_token(task, new_tokens[i], NULL);
+	for (i = 0; i < alloc_count; i++) {
+		if (acquired[i])
+			release_token(task, new_tokens[i], NULL);
+	}
 
 	for (i = 0; i < alloc_count; i++)
 		free(new_tokens[i]);
@@ -155,6 +162,294 @@ static const char *acquire_error_str(int error)
 	};
 }
 
+struct acquire_arg {
+	struct list_head list; /* acquire_work */
+	struct token *token;
+	char *killpath;
+	char *killargs;
+	uint32_t cmd_flags;
+	int result;
+	int queued;
+	int taken; /* by an acquire thread */
+	int done;
+};
+
+/*
+ * Acquire threads run the ballots of a request after its first, each
+ * with a task (aio context) that lives as long as the thread.  A read
+ * left in progress on a slow disk is reaped by later io on the task,
+ * so nothing waits for it.  They are not command workers, so a command
+ * waiting for them can't deadlock the command pool.
+ */
+
+#define ACQUIRE_THREADS 4
+
+static pthread_t acquire_pts[ACQUIRE_THREADS];
+static int acquire_pts_count;
+static int acquire_thread_stop;
+static struct list_head acquire_work;
+static pthread_mutex_t acquire_work_mutex;
+static pthread_cond_t acquire_work_cond;
+static pthread_cond_t acquire_done_cond;
+
+static void *acquire_thread(void *data)
+{
+	struct acquire_arg *arg;
+	struct task task;
+
+	memset(&task, 0, sizeof(struct task));
+	setup_task_aio(&task, main_task.use_aio, WORKER_AIO_CB_SIZE);
+	snprintf(task.name, NAME_ID_SIZE, "acquire%ld", (long)data);
+
+	pthread_mutex_lock(&acquire_work_mutex);
+	while (1) {
+		while (!acquire_thread_stop && list_empty(&acquire_work))
+			pthread_cond_wait(&acquire_work_cond, &acquire_work_mutex);
+
+		if (acquire_thread_stop)
+			break;
+
+		arg = list_first_entry(&acquire_work, struct acquire_arg, list);
+		list_del(&arg->list);
+		arg->queued = 0;
+		arg->taken = 1;
+		pthread_mutex_unlock(&acquire_work_mutex);
+
+		arg->result = acquire_token(&task, arg->token, arg->cmd_flags,
+					    arg->killpath, arg->killargs);
+
+		pthread_mutex_lock(&acquire_work_mutex);
+		arg->done = 1;
+		pthread_cond_broadcast(&acquire_done_cond);
+	}
+	pthread_mutex_unlock(&acquire_work_mutex);
+
+	close_task_aio(&task);
+	return NULL;
+}
+
+/* with no acquire threads, acquire_tokens does each ballot in turn */
+
+void setup_acquire_threads(void)
+{
+	int i, rv;
+
+	INIT_LIST_HEAD(&acquire_work);
+	pthread_mutex_init(&acquire_work_mutex, NULL);
+	pthread_cond_init(&acquire_work_cond, NULL);
+	pthread_cond_init(&acquire_done_cond, NULL);
+
+	for (i = 0; i < ACQUIRE_THREADS; i++) {
+		rv = pthread_create(&acquire_pts[i], NULL, acquire_thread, (void *)(long)i);
+		if (rv) {
+			log_error("acquire_thread %d create error %d", i, rv);
+			break;
+		}
+		acquire_pts_count++;
+	}
+}
+
+void close_acquire_threads(void)
+{
+	int i;
+
+	pthread_mutex_lock(&acquire_work_mutex);
+	acquire_thread_stop = 1;
+	pthread_cond_broadcast(&acquire_work_cond);
+	pthread_mutex_unlock(&acquire_work_mutex);
+
+	for (i = 0; i < acquire_pts_count; i++)
+		pthread_join(acquire_pts[i], NULL);
+
+	pthread_mutex_lock(&acquire_work_mutex);
+	acquire_pts_count = 0;
+	pthread_mutex_unlock(&acquire_work_mutex);
+}
+
+/*
+ * The paxos ballots for different resources are independent, so when
+ * acquiring multiple resources, do the ballots concurrently: the first
+ * in this thread, and the others queued for the acquire threads.  Any
+ * that no acquire thread has taken by then are done here, so a busy
+ * pool only makes the request sequential.
+ */
+
+static void acquire_tokens(struct task *task, struct token *tokens[], int count,
+			   uint32_t cmd_flags, char *killpath, char *killargs,
+			   int results[])
+{
+	struct acquire_arg args[SANLK_MAX_RESOURCES];
+	int i;
+
+	memset(args, 0, sizeof(args));
+
+	pthread_mutex_lock(&acquire_work_mutex);
+	for (i = 0; i < count; i++) {
+		args[i].token = tokens[i];
+		args[i].killpath = killpath;
+		args[i].killargs = killargs;
+		args[i].cmd_flags = cmd_flags;
+
+		if (!i || !acquire_pts_count)
+			continue;
+
+		list_add_tail(&args[i].list, &acquire_work);
+		args[i].queued = 1;
+		pthread_cond_signal(&acquire_work_cond);
+	}
+	pthread_mutex_unlock(&acquire_work_mutex);
+
+	for (i = 0; i < count; i++) {
+		pthread_mutex_lock(&acquire_work_mutex);
+		if (args[i].taken) {
+			pthread_mutex_unlock(&acquire_work_mutex);
+			continue;
+		}
+		if (args[i].queued) {
+			list_del(&args[i].list);
+			args[i].queued = 0;
+		}
+		pthread_mutex_unlock(&acquire_work_mutex);
+
+		args[i].result = acquire_token(task, tokens[i], cmd_flags, killpath, killargs);
+		args[i].done = 1;
+	}
+
+	pthread_mutex_lock(&acquire_work_mutex);
+	for (i = 0; i < count; i++) {
+		while (!args[i].done)
+			pthread_cond_wait(&acquire_done_cond, &acquire_work_mutex);
+		results[i] = args[i].result;
+	}
+	pthread_mutex_unlock(&acquire_work_mutex);
+}
+
+/*
+ * The connection a command arrived on is suspended from epoll while the
+ * command runs, so a client that goes away during a long command is not
+ * noticed by the main loop; look for the hangup directly.
+ */
+
+static int client_hungup(int fd)
+{
+	struct pollfd pollfd;
+
+	memset(&pollfd, 0, sizeof(pollfd));
+	pollfd.fd = fd;
+	pollfd.events = POLLRDHUP;
+
+	if (poll(&pollfd, 1, 0) <= 0)
+		return 0;
+
+	return (pollfd.revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL)) ? 1 : 0;
+}
+
+static int acquire_wait_client_gone(struct client *cl, int fd)
+{
+	int pid_dead;
+
+	pthread_mutex_lock(&cl->mutex);
+	pid_dead = cl->pid_dead;
+	pthread_mutex_unlock(&cl->mutex);
+
+	if (pid_dead || external_shutdown)
+		return 1;
+
+	if (client_hungup(fd)) {
+		log_debug("acquire_tokens_wait fd %d hangup", fd);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * SANLK_ACQUIRE_WAIT: while the only failures are resources held by others,
+ * release any that were acquired, wait in acquire_wait(), and try them all
+ * again, until all are acquired, the deadline passes, or the client goes
+ * away.  Nothing is held while waiting, so two requests for the same
+ * resources in a different order can't hold one each and wait forever.
+ * fd is the connection of the command, which may not be the client's.
+ */
+
+static void acquire_tokens_wait(struct task *task, struct client *cl, int fd,
+				struct token *tokens[], int count,
+				uint32_t cmd_flags, char *killpath, char *killargs,
+				int results[], uint32_t wait_sec)
+{
+	struct acquire_waiter *aw;
+	struct space_info spi;
+	uint64_t deadline = 0;
+	int attempt = 0;
+	int i, rv, failed;
+
+	aw = NULL;
+
+	while (1) {
+		failed = 0;
+		for (i = 0; i < count; i++) {
+			if (!results[i])
+				continue;
+			if (!acquire_wait_retry(results[i]))
+				goto out;
+			failed++;
+		}
+
+		if (!failed)
+			break;
+
+		if (!aw) {
+			aw = acquire_wait_add(tokens, count);
+			if (!aw)
+				return;
+			if (wait_sec)
+				deadline = monotime() + wait_sec;
+		}
+
+		if (acquire_wait_client_gone(cl, fd))
+			break;
+
+		/* the acquired ones are released by cmd_acquire along with the
+		   failure, which is reported as the last error */
+
+		if (deadline && monotime() >= deadline) {
+			log_debug("acquire_tokens_wait deadline %u attempts %d", wait_sec, attempt);
+			break;
+		}
+
+		for (i = 0; i < count; i++) {
+			if (results[i])
+				continue;
+			release_token(task, tokens[i], NULL);
+			results[i] = -EAGAIN;
+		}
+
+		/* returns at the deadline at the latest, for a final try */
+		acquire_wait(aw, results, deadline, attempt++);
+
+		/* the released ones are reported as -EAGAIN */
+		if (acquire_wait_client_gone(cl, fd))
+			break;
+
+		for (i = 0; i < count; i++) {
+			rv = lockspace_info(tokens[i]->r.lockspace_name, &spi);
+			if (rv < 0 || spi.killing_pids ||
+			    spi.host_id != tokens[i]->host_id ||
+			    spi.host_generation != tokens[i]->host_generation) {
+				results[i] = -ENOSPC;
+				goto out;
+			}
+		}
+
+		counter_add(counters.acquire_retries, count);
+
+		acquire_tokens(task, tokens, count, cmd_flags, killpath, killargs,
+			       results);
+	}
+ out:
+	if (aw)
+		acquire_wait_rem(aw);
+}
+
 static void cmd_acquire(struct task *task, struct cmd_args *ca)
 {
 	struct client *cl;
@@ -162,6 +457,7 @@ static void cmd_acquire(struct task *task, struct cmd_args *ca)
 	struct token *new_tokens[SANLK_MAX_RESOURCES];
 	struct token **grow_tokens;
 	struct sanlk_resource res;
+	int results[SANLK_MAX_RESOURCES];
 	struct sanlk_options opt;
 	struct space_info spi;
 	char killpath[SANLK_HELPER_PATH_LEN];
@@ -169,7 +465,8 @@ static void cmd_acquire(struct task *task, struct cmd_args *ca)
 	char *opt_str;
 	int token_len, disks_len;
 	int fd, rv, i, j, empty_slots, lvl;
-	int alloc_count = 0, acquire_count = 0;
+	int acquired[SANLK_MAX_RESOURCES];
+	int alloc_count = 0;
 	int pos = 0, pid_dead = 0;
 	int new_tokens_count;
 	int recv_done = 0;
@@ -182,6 +479,8 @@ static void cmd_acquire(struct task *task, struct cmd_args *ca)
 	cl = &client[cl_ci];
 	fd = client[ca->ci_in].fd;
 
+	memset(acquired, 0, sizeof(acquired));
+
 	new_tokens_count = ca->header.data;
 
 	log_debug("cmd_acquire %d,%d,%d ci_in %d fd %d count %d flags %x",
@@ -372,6 +671,7 @@ static void cmd_acquire(struct task *task, struct cmd_args *ca)
 		token->io_timeout = spi.io_timeout;
 		token->sector_size = spi.sector_size;
 		token->align_size = spi.align_size;
+		token->ls_max_hosts = spi.max_hosts;
 		if (cl->restricted & SANLK_RESTRICT_SIGKILL)
 			token->flags |= T_RESTRICT_SIGKILL;
 		if (cl->restricted & SANLK_RESTRICT_SIGTERM)
@@ -379,10 +679,32 @@ static void cmd_acquire(struct task *task, struct cmd_args *ca)
 
 	}
 
+	acquire_tokens(task, new_tokens, new_tokens_count, ca->header.cmd_flags,
+		       killpath, killargs, results);
+
+	if (ca->header.cmd_flags & SANLK_ACQUIRE_WAIT) {
+		log_debug("cmd_acquire %d,%d,%d wait %u",
+			  cl_ci, cl_fd, cl_pid, ca->header.seq);
+		acquire_tokens_wait(task, cl, fd, new_tokens, new_tokens_count,
+				    ca->header.cmd_flags, killpath, killargs,
+				    results, ca->header.seq);
+	}
+
+	/* counted once for the request, however many times it waited */
+
 	for (i = 0; i < new_tokens_count; i++) {
 		token = new_tokens[i];
+		rv = results[i];
+
+		counter_inc(counters.acquires);
+		if (rv < 0)
+			counter_inc(counters.acquire_errors);
+
+		if (!rv) {
+			acquired[i] = 1;
+			continue;
+		}
 
-		rv = acquire_token(task, token, ca->header.cmd_flags, killpath, killargs);
 		if (rv < 0) {
 			switch (rv) {
 			case -EEXIST:
@@ -409,12 +731,15 @@ static void cmd_acquire(struct task *task, struct cmd_args *ca)
 					  "cmd_acquire %d,%d,%d acquire_token %s %d %s",
 					  cl_ci, cl_fd, cl_pid,
 					  token->r.name, rv, acquire_error_str(rv));
-			result = rv;
-			goto done;
+			/* all the acquired tokens are released below */
+			if (!result)
+				result = rv;
 		}
-		acquire_count++;
 	}
 
+	if (result)
+		goto done;
+
 	/*
 	 * Success acquiring the leases:
 	 * lock mutex,
@@ -506,7 +831,7 @@ static void cmd_acquire(struct task *task, struct cmd_args *ca)
 	/* 2. Success acquiring leases, and pid is dead */
 
 	if (!result && pid_dead) {
-		release_new_tokens(task, new_tokens, alloc_count, acquire_count);
+		release_new_tokens(task, new_tokens, alloc_count, acquired);
 		release_cl_tokens(task, cl);
 		client_free(cl_ci);
 		result = -ENOTTY;
@@ -516,14 +841,14 @@ static void cmd_acquire(struct task *task, struct cmd_args *ca)
 	/* 3. Failure acquiring leases, and pid is live */
 
 	if (result && !pid_dead) {
-		release_new_tokens(task, new_tokens, alloc_count, acquire_count);
+		release_new_tokens(task, new_tokens, alloc_count, acquired);
 		goto reply;
 	}
 
 	/* 4. Failure acquiring leases, and pid is dead */
 
 	if (result && pid_dead) {
-		release_new_tokens(task, new_tokens, alloc_count, acquire_count);
+		release_new_tokens(task, new_tokens, alloc_count, acquired);
 		release_cl_tokens(task, cl);
 		client_free(cl_ci);
 		goto reply;
@@ -1315,6 +1640,131 @@ static void cmd_add_lockspace(struct cmd_args *ca)
 	client_resume(ca->ci_in);
 }
 
+static void send_add_result(int fd, int index, int result)
+{
+	struct sm_add_result ar;
+
+	ar.index = index;
+	ar.result = result;
+	send(fd, &ar, sizeof(ar), MSG_NOSIGNAL);
+}
+
+/*
+ * Start adding all the lockspaces, so their lockspace threads acquire
+ * the host_ids concurrently, then wait for them all here, sending the
+ * result of each add as it completes.  The adds must be completed even
+ * if the client goes away, so send errors are ignored.
+ */
+
+static void cmd_add_lockspaces(struct cmd_args *ca)
+{
+	struct sanlk_lockspace *lss = NULL;
+	struct space **sps = NULL;
+	struct sm_header h;
+	uint32_t io_timeout;
+	int async = ca->header.cmd_flags & SANLK_ADD_ASYNC;
+	int count = ca->header.data2;
+	int fd, rv, i, result, pending = 0;
+
+	fd = client[ca->ci_in].fd;
+
+	if (count < 1 || count > SANLK_ADD_LOCKSPACES_MAX) {
+		result = -EINVAL;
+		goto reply;
+	}
+
+	lss = malloc(count * sizeof(struct sanlk_lockspace));
+	sps = calloc(count, sizeof(struct space *));
+	if (!lss || !sps) {
+		result = -ENOMEM;
+		goto reply;
+	}
+
+	rv = recv(fd, lss, count * sizeof(struct sanlk_lockspace), MSG_WAITALL);
+	if (rv != count * sizeof(struct sanlk_lockspace)) {
+		log_error("cmd_add_lockspaces %d,%d recv %d %d",
+			   ca->ci_in, fd, rv, errno);
+		result = -ENOTCONN;
+		goto reply;
+	}
+
+	io_timeout = ca->header.data;
+	if (!io_timeout)
+		io_timeout = DEFAULT_IO_TIMEOUT;
+
+	log_debug("cmd_add_lockspaces %d,%d count %d flags %x timeout %u",
+		  ca->ci_in, fd, count, ca->header.cmd_flags, io_timeout);
+
+	memcpy(&h, &ca->header, sizeof(struct sm_header));
+	h.version = SM_PROTO;
+	h.length = sizeof(h) + count * sizeof(struct sm_add_result);
+	h.data = 0;
+	h.data2 = count;
+	send(fd, &h, sizeof(h), MSG_NOSIGNAL);
+
+	for (i = 0; i < count; i++) {
+		log_debug("cmd_add_lockspaces %d,%d %.48s:%llu:%s:%llu",
+			  ca->ci_in, fd, lss[i].name,
+			  (unsigned long long)lss[i].host_id,
+			  lss[i].host_id_disk.path,
+			  (unsigned long long)lss[i].host_id_disk.offset);
+
+		rv = add_lockspace_start(&lss[i], io_timeout, &sps[i]);
+		if (rv < 0) {
+			sps[i] = NULL;
+			send_add_result(fd, i, rv);
+			continue;
+		}
+
+		if (async)
+			send_add_result(fd, i, rv);
+		pending++;
+	}
+
+	if (async) {
+		log_debug("cmd_add_lockspaces %d,%d async started %d", ca->ci_in, fd, pending);
+		client_resume(ca->ci_in);
+	}
+
+	while (pending) {
+		for (i = 0; i < count; i++) {
+			if (!sps[i])
+				continue;
+
+			if (!add_lockspace_check(sps[i], &result))
+				continue;
+
+			/* sps[i] may be freed */
+			sps[i] = NULL;
+			pending--;
+
+			if (!async)
+				send_add_result(fd, i, result);
+		}
+
+		if (pending)
+			sleep(1);
+	}
+
+	free(lss);
+	free(sps);
+
+	if (!async) {
+		log_debug("cmd_add_lockspaces %d,%d done", ca->ci_in, fd);
+		client_resume(ca->ci_in);
+	}
+	return;
+
+ reply:
+	log_debug("cmd_add_lockspaces %d,%d done %d", ca->ci_in, fd, result);
+	if (lss)
+		free(lss);
+	if (sps)
+		free(sps);
+	send_result(fd, &ca->header, result);
+	client_resume(ca->ci_in);
+}
+
 static void cmd_inq_lockspace(struct cmd_args *ca)
 {
 	struct sanlk_lockspace lockspace;
@@ -1679,6 +2129,7 @@ static void cmd_read_resource_owners(struct task *task, struct cmd_args *ca)
 {
 	struct sm_header h;
 	struct sanlk_resource res;
+	struct space_info spi;
 	struct token *token = NULL;
 	char *send_buf;
 	int token_len, disks_len, send_len = 0;
@@ -1754,6 +2205,10 @@ static void cmd_read_resource_owners(struct task *task, struct cmd_args *ca)
 		token->sector_size = 4096;
 	token->align_size = sector_size_to_align_size(token->sector_size);
 
+	/* limit the dblocks read if the lockspace has been added */
+	if (!lockspace_info(token->r.lockspace_name, &spi))
+		token->ls_max_hosts = spi.max_hosts;
+
 	send_buf = NULL;
 	send_len = 0;
 
@@ -2049,6 +2504,10 @@ void call_cmd_thread(struct task *task, struct cmd_args *ca)
 		strcpy(client[ca->ci_in].owner_name, "add_lockspace");
 		cmd_add_lockspace(ca);
 		break;
+	case SM_CMD_ADD_LOCKSPACES:
+		strcpy(client[ca->ci_in].owner_name, "add_lockspaces");
+		cmd_add_lockspaces(ca);
+		break;
 	case SM_CMD_INQ_LOCKSPACE:
 		strcpy(client[ca->ci_in].owner_name, "inq_lockspace");
 		cmd_inq_lockspace(ca);
@@ -2100,23 +2559,113 @@ void call_cmd_thread(struct task *task, struct cmd_args *ca)
 /*
  * sanlock client status
  *
- * 1. send_state_daemon
+ * 1. add_state_daemon
  *
  * 2. for each cl in clients
- *     send_state_client() [sanlk_state + str_len]
+ *     add_state_client() [sanlk_state + str_len]
  *
  * 3. for each sp in spaces, spaces_add, spaces_rem
- *     send_state_lockspace() [sanlk_state + str_len + sanlk_lockspace]
+ *     add_state_lockspace() [sanlk_state + str_len + sanlk_lockspace]
  *
  * 4. for each r in resources, dispose_resources
- *     send_state_resource() [sanlk_state + str_len + sanlk_resource + sanlk_disk * num_disks]
+ *     add_state_resource() [sanlk_state + str_len + sanlk_resource + sanlk_disk * num_disks]
  *
  * sanlock client host_status <lockspace_name>
  *
  * 1. for each hs in sp->host_status
- * 	send_state_host()
+ * 	add_state_host()
+ *
+ * The reply is built in a state_buf and sent with a few large writes
+ * instead of a send for each piece.  The buffer is only sent when no
+ * locks are held (resources are sent after each resource shard), so
+ * locks are held for copying state and not for socket io.
  */
 
+#define STATE_BUF_SIZE  (64 * 1024)
+#define STATE_BUF_FLUSH (256 * 1024)
+
+struct state_buf {
+	int fd;
+	int len;
+	int size;
+	char *buf;
+};
+
+static void state_buf_init(struct state_buf *sb, int fd)
+{
+	memset(sb, 0, sizeof(struct state_buf));
+	sb->fd = fd;
+}
+
+static void state_buf_write(int fd, const char *buf, int len)
+{
+	int rv, pos = 0;
+
+	while (pos < len) {
+		rv = send(fd, buf + pos, len - pos, MSG_NOSIGNAL);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv <= 0)
+			return;
+		pos += rv;
+	}
+}
+
+/*
+ * If the buffer can't be grown, what's been added is sent, followed by
+ * this data, like before the reply was buffered.
+ */
+
+static void state_buf_add(struct state_buf *sb, const void *data, int len)
+{
+	char *buf;
+	int size;
+
+	if (sb->len + len > sb->size) {
+		size = sb->size ? sb->size : STATE_BUF_SIZE;
+		while (size < sb->len + len)
+			size *= 2;
+
+		buf = realloc(sb->buf, size);
+		if (!buf) {
+			state_buf_write(sb->fd, sb->buf, sb->len);
+			state_buf_write(sb->fd, data, len);
+			sb->len = 0;
+			return;
+		}
+		sb->buf = buf;
+		sb->size = size;
+	}
+
+	memcpy(sb->buf + sb->len, data, len);
+	sb->len += len;
+}
+
+static void state_buf_send(struct state_buf *sb)
+{
+	if (sb->len)
+		state_buf_write(sb->fd, sb->buf, sb->len);
+	sb->len = 0;
+}
+
+static void state_buf_free(struct state_buf *sb)
+{
+	state_buf_send(sb);
+	free(sb->buf);
+	sb->buf = NULL;
+	sb->size = 0;
+}
+
+/* called by resource.c between resource shards, with no locks held */
+
+void state_buf_flush(struct state_buf *sb);
+
+void state_buf_flush(struct state_buf *sb)
+{
+	if (sb->len >= STATE_BUF_FLUSH)
+		state_buf_send(sb);
+}
+
 static int print_state_daemon(char *str)
 {
 	memset(str, 0, SANLK_STATE_MAXSTR);
@@ -2226,7 +2775,9 @@ static int print_state_lockspace(struct space *sp, char *str, const char *list_n
 		 "acquire_last_attempt=%llu "
 		 "acquire_last_success=%llu "
 		 "renewal_last_attempt=%llu "
-		 "renewal_last_success=%llu",
+		 "renewal_last_success=%llu "
+		 "acquire_wait=%d "
+		 "acquire_delay=%d",
 		 list_name,
 		 sp->space_id,
 		 sp->io_timeout,
@@ -2245,7 +2796,9 @@ static int print_state_lockspace(struct space *sp, char *str, const char *list_n
 		 (unsigned long long)sp->lease_status.acquire_last_attempt,
 		 (unsigned long long)sp->lease_status.acquire_last_success,
 		 (unsigned long long)sp->lease_status.renewal_last_attempt,
-		 (unsigned long long)sp->lease_status.renewal_last_success);
+		 (unsigned long long)sp->lease_status.renewal_last_success,
+		 sp->lease_status.acquire_wait,
+		 sp->lease_status.acquire_delay);
 
 	return strlen(str) + 1;
 }
@@ -2262,14 +2815,18 @@ static int print_state_resource(struct resource *r, char *str, const char *list_
 		 "lver=%llu "
 		 "reused=%u "
 		 "res_id=%u "
-		 "token_id=%u",
+		 "token_id=%u "
+		 "ballot_aborts=%u "
+		 "sh_retries=%u",
 		 list_name,
 		 r->flags,
 		 r->sector_size,
 		 (unsigned long long)r->leader.lver,
 		 r->reused,
 		 r->res_id,
-		 token_id);
+		 token_id,
+		 r->ballot_aborts,
+		 r->sh_retries);
 
 	return strlen(str) + 1;
 }
@@ -2318,7 +2875,53 @@ static int print_state_renewal(struct renewal_history *hi, char *str)
 	return strlen(str) + 1;
 }
 
-static void send_state_daemon(int fd)
+static int print_state_lat(struct lat_hist *h, int op, const char *space_name,
+			   const char *res_name, char *str)
+{
+	char bucket_str[32];
+	uint32_t le;
+	int b, len;
+
+	memset(str, 0, SANLK_STATE_MAXSTR);
+
+	len = snprintf(str, SANLK_STATE_MAXSTR-1,
+		       "lockspace=%.48s "
+		       "resource=%.48s "
+		       "op=%s "
+		       "count=%llu "
+		       "avg_us=%llu "
+		       "max_us=%u "
+		       "errors=%u "
+		       "buckets=",
+		       space_name,
+		       res_name,
+		       lat_op_str(op),
+		       (unsigned long long)h->count,
+		       (unsigned long long)(h->count ? h->total_us / h->count : 0),
+		       h->max_us,
+		       h->errors);
+
+	/* "le_us:count" for each non-empty bucket, le_us 0 for the last */
+
+	for (b = 0; b < LAT_BUCKETS; b++) {
+		if (!h->bucket[b])
+			continue;
+
+		le = lat_bucket_us(b);
+
+		snprintf(bucket_str, sizeof(bucket_str), "%u:%u,", le, h->bucket[b]);
+
+		if (len + strlen(bucket_str) >= SANLK_STATE_MAXSTR-1)
+			break;
+
+		strcat(str, bucket_str);
+		len += strlen(bucket_str);
+	}
+
+	return strlen(str) + 1;
+}
+
+static void add_state_daemon(struct state_buf *sb)
 {
 	struct sanlk_state st;
 	char str[SANLK_STATE_MAXSTR];
@@ -2333,12 +2936,12 @@ static void send_state_daemon(int fd)
 
 	st.str_len = str_len;
 
-	send(fd, &st, sizeof(st), MSG_NOSIGNAL);
+	state_buf_add(sb, &st, sizeof(st));
 	if (str_len)
-		send(fd, str, str_len, MSG_NOSIGNAL);
+		state_buf_add(sb, str, str_len);
 }
 
-static void send_state_client(int fd, struct client *cl, int ci)
+static void add_state_client(struct state_buf *sb, struct client *cl, int ci)
 {
 	struct sanlk_state st;
 	char str[SANLK_STATE_MAXSTR];
@@ -2354,12 +2957,12 @@ static void send_state_client(int fd, struct client *cl, int ci)
 
 	st.str_len = str_len;
 
-	send(fd, &st, sizeof(st), MSG_NOSIGNAL);
+	state_buf_add(sb, &st, sizeof(st));
 	if (str_len)
-		send(fd, str, str_len, MSG_NOSIGNAL);
+		state_buf_add(sb, str, str_len);
 }
 
-static void send_state_lockspace(int fd, struct space *sp, const char *list_name)
+static void add_state_lockspace(struct state_buf *sb, struct space *sp, const char *list_name)
 {
 	struct sanlk_state st;
 	struct sanlk_lockspace lockspace;
@@ -2376,28 +2979,27 @@ static void send_state_lockspace(int fd, struct space *sp, const char *list_name
 
 	st.str_len = str_len;
 
-	send(fd, &st, sizeof(st), MSG_NOSIGNAL);
+	state_buf_add(sb, &st, sizeof(st));
 	if (str_len)
-		send(fd, str, str_len, MSG_NOSIGNAL);
+		state_buf_add(sb, str, str_len);
 
 	memset(&lockspace, 0, sizeof(struct sanlk_lockspace));
 	strncpy(lockspace.name, sp->space_name, NAME_ID_SIZE);
 	lockspace.host_id = sp->host_id;
 	memcpy(&lockspace.host_id_disk, &sp->host_id_disk, sizeof(struct sanlk_disk));
 
-	send(fd, &lockspace, sizeof(lockspace), MSG_NOSIGNAL);
+	state_buf_add(sb, &lockspace, sizeof(lockspace));
 }
 
-void send_state_resource(int fd, struct resource *r, const char *list_name,
-			 int pid, uint32_t token_id);
+void add_state_resource(struct state_buf *sb, struct resource *r, const char *list_name,
+			int pid, uint32_t token_id);
 
-void send_state_resource(int fd, struct resource *r, const char *list_name,
-			 int pid, uint32_t token_id)
+void add_state_resource(struct state_buf *sb, struct resource *r, const char *list_name,
+			int pid, uint32_t token_id)
 {
 	struct sanlk_state st;
 	char str[SANLK_STATE_MAXSTR];
 	int str_len;
-	int i;
 
 	memset(&st, 0, sizeof(st));
 
@@ -2410,18 +3012,16 @@ void send_state_resource(int fd, struct resource *r, const char *list_name,
 
 	st.str_len = str_len;
 
-	send(fd, &st, sizeof(st), MSG_NOSIGNAL);
+	state_buf_add(sb, &st, sizeof(st));
 	if (str_len)
-		send(fd, str, str_len, MSG_NOSIGNAL);
+		state_buf_add(sb, str, str_len);
 
-	send(fd, &r->r, sizeof(struct sanlk_resource), MSG_NOSIGNAL);
+	state_buf_add(sb, &r->r, sizeof(struct sanlk_resource));
 
-	for (i = 0; i < r->r.num_disks; i++) {
-		send(fd, &r->r.disks[i], sizeof(struct sanlk_disk), MSG_NOSIGNAL);
-	}
+	state_buf_add(sb, r->r.disks, r->r.num_disks * sizeof(struct sanlk_disk));
 }
 
-static void send_state_host(int fd, struct host_status *hs, int host_id)
+static void add_state_host(struct state_buf *sb, struct host_status *hs, int host_id)
 {
 	struct sanlk_state st;
 	char str[SANLK_STATE_MAXSTR];
@@ -2437,12 +3037,12 @@ static void send_state_host(int fd, struct host_status *hs, int host_id)
 
 	st.str_len = str_len;
 
-	send(fd, &st, sizeof(st), MSG_NOSIGNAL);
+	state_buf_add(sb, &st, sizeof(st));
 	if (str_len)
-		send(fd, str, str_len, MSG_NOSIGNAL);
+		state_buf_add(sb, str, str_len);
 }
 
-static void send_state_renewal(int fd, struct renewal_history *hi)
+static void add_state_renewal(struct state_buf *sb, struct renewal_history *hi)
 {
 	struct sanlk_state st;
 	char str[SANLK_STATE_MAXSTR];
@@ -2457,14 +3057,49 @@ static void send_state_renewal(int fd, struct renewal_history *hi)
 
 	st.str_len = str_len;
 
-	send(fd, &st, sizeof(st), MSG_NOSIGNAL);
+	state_buf_add(sb, &st, sizeof(st));
 	if (str_len)
-		send(fd, str, str_len, MSG_NOSIGNAL);
+		state_buf_add(sb, str, str_len);
+}
+
+/* one SANLK_STATE_LATENCY for each op done on the lockspace or resource */
+
+void add_state_lat(struct state_buf *sb, const char *space_name, const char *res_name,
+		   struct lat_stats *lat);
+
+void add_state_lat(struct state_buf *sb, const char *space_name, const char *res_name,
+		   struct lat_stats *lat)
+{
+	struct sanlk_state st;
+	char str[SANLK_STATE_MAXSTR];
+	int str_len, op;
+
+	for (op = 0; op < LAT_OPS; op++) {
+		if (!lat->op[op].count && !lat->op[op].errors)
+			continue;
+
+		memset(&st, 0, sizeof(st));
+
+		st.type = SANLK_STATE_LATENCY;
+		st.data32 = op;
+		st.data64 = lat->op[op].count;
+		memcpy(st.name, res_name ? res_name : space_name, NAME_ID_SIZE);
+
+		str_len = print_state_lat(&lat->op[op], op, space_name,
+					  res_name ? res_name : "", str);
+
+		st.str_len = str_len;
+
+		state_buf_add(sb, &st, sizeof(st));
+		if (str_len)
+			state_buf_add(sb, str, str_len);
+	}
 }
 
 static void cmd_status(int fd, struct sm_header *h_recv, int client_maxi)
 {
 	struct sm_header h;
+	struct state_buf sb;
 	struct client *cl;
 	struct space *sp;
 	int ci;
@@ -2475,22 +3110,24 @@ static void cmd_status(int fd, struct sm_header *h_recv, int client_maxi)
 	h.length = sizeof(h);
 	h.data = 0;
 
-	send(fd, &h, sizeof(h), MSG_NOSIGNAL);
+	state_buf_init(&sb, fd);
+
+	state_buf_add(&sb, &h, sizeof(h));
 
-	send_state_daemon(fd);
+	add_state_daemon(&sb);
 
 	if (h_recv->data == SANLK_STATE_DAEMON)
-		return;
+		goto out;
 
 	for (ci = 0; ci <= client_maxi; ci++) {
 		cl = &client[ci];
 		if (!cl->used)
 			continue;
-		send_state_client(fd, cl, ci);
+		add_state_client(&sb, cl, ci);
 	}
 
 	if (h_recv->data == SANLK_STATE_CLIENT)
-		return;
+		goto out;
 
 	/* N.B. the reporting function looks for the
 	   strings "add" and "rem", so if changed,
@@ -2498,26 +3135,29 @@ static void cmd_status(int fd, struct sm_header *h_recv, int client_maxi)
 
 	pthread_mutex_lock(&spaces_mutex);
 	list_for_each_entry(sp, &spaces, list)
-		send_state_lockspace(fd, sp, "spaces");
+		add_state_lockspace(&sb, sp, "spaces");
 	list_for_each_entry(sp, &spaces_add, list)
-		send_state_lockspace(fd, sp, "add");
+		add_state_lockspace(&sb, sp, "add");
 	list_for_each_entry(sp, &spaces_rem, list)
-		send_state_lockspace(fd, sp, "rem");
+		add_state_lockspace(&sb, sp, "rem");
 	pthread_mutex_unlock(&spaces_mutex);
 
 	if (h_recv->data == SANLK_STATE_LOCKSPACE)
-		return;
+		goto out;
 
 	/* resource.c will iterate through private lists and call
 	   back here for each r */
 
-	send_state_resources(fd);
+	add_state_resources(&sb);
+ out:
+	state_buf_free(&sb);
 }
 
 static void cmd_host_status(int fd, struct sm_header *h_recv)
 {
 	struct sm_header h;
 	struct sanlk_lockspace lockspace;
+	struct state_buf sb;
 	struct space *sp;
 	struct host_status *hs, *status = NULL;
 	int status_len;
@@ -2545,8 +3185,14 @@ static void cmd_host_status(int fd, struct sm_header *h_recv)
 
 	pthread_mutex_lock(&spaces_mutex);
 	sp = find_lockspace(lockspace.name);
-	if (sp)
-		memcpy(status, &sp->host_status, status_len);
+	if (sp) {
+		/* host_status is not set until the lockspace reads max_hosts */
+		memset(status, 0, status_len);
+		pthread_mutex_lock(&sp->mutex);
+		if (sp->host_status)
+			memcpy(status, sp->host_status, sizeof(struct host_status) * sp->max_hosts);
+		pthread_mutex_unlock(&sp->mutex);
+	}
 	pthread_mutex_unlock(&spaces_mutex);
 
 	if (!sp) {
@@ -2554,15 +3200,19 @@ static void cmd_host_status(int fd, struct sm_header *h_recv)
 		goto fail;
 	}
 
-	send(fd, &h, sizeof(h), MSG_NOSIGNAL);
+	state_buf_init(&sb, fd);
+
+	state_buf_add(&sb, &h, sizeof(h));
 
 	for (i = 0; i < DEFAULT_MAX_HOSTS; i++) {
 		hs = &status[i];
 		if (!hs->last_live && !hs->owner_id)
 			continue;
-		send_state_host(fd, hs, i+1);
+		add_state_host(&sb, hs, i+1);
 	}
 
+	state_buf_free(&sb);
+
 	if (status)
 		free(status);
 	return;
@@ -2573,10 +3223,56 @@ static void cmd_host_status(int fd, struct sm_header *h_recv)
 		free(status);
 }
 
+/*
+ * The lockspace totals include the delta lease renewals and the io of all
+ * its resources; the resource totals follow, for each resource that has
+ * done io and is still known.
+ */
+
+static void cmd_latency(int fd, struct sm_header *h_recv)
+{
+	struct sm_header h;
+	struct sanlk_lockspace lockspace;
+	struct state_buf sb;
+	struct lat_stats lat;
+	int rv;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(&h, h_recv, sizeof(struct sm_header));
+	h.version = SM_PROTO;
+	h.length = sizeof(h);
+	h.data = 0;
+
+	rv = recv(fd, &lockspace, sizeof(struct sanlk_lockspace), MSG_WAITALL);
+	if (rv != sizeof(struct sanlk_lockspace)) {
+		h.data = -ENOTCONN;
+		goto fail;
+	}
+
+	rv = lockspace_lat(lockspace.name, &lat);
+	if (rv < 0) {
+		h.data = rv;
+		goto fail;
+	}
+
+	state_buf_init(&sb, fd);
+
+	state_buf_add(&sb, &h, sizeof(h));
+
+	add_state_lat(&sb, lockspace.name, NULL, &lat);
+	add_lat_resources(&sb, lockspace.name);
+
+	state_buf_free(&sb);
+	return;
+ fail:
+	send(fd, &h, sizeof(h), MSG_NOSIGNAL);
+}
+
 static void cmd_renewal(int fd, struct sm_header *h_recv)
 {
 	struct sm_header h;
 	struct sanlk_lockspace lockspace;
+	struct state_buf sb;
 	struct space *sp;
 	uint32_t io_timeout = 0;
 	struct renewal_history *history = NULL;
@@ -2636,7 +3332,9 @@ static void cmd_renewal(int fd, struct sm_header *h_recv)
 
 	h.data2 = io_timeout;
 
-	send(fd, &h, sizeof(h), MSG_NOSIGNAL);
+	state_buf_init(&sb, fd);
+
+	state_buf_add(&sb, &h, sizeof(h));
 
 	/* If next slot is non-zero, then we've wrapped and
 	   should begin sending history from next to end
@@ -2645,15 +3343,17 @@ static void cmd_renewal(int fd, struct sm_header *h_recv)
 	if (history[history_next].timestamp) {
 		for (i = history_next; i < history_size; i++) {
 			hi = &history[i];
-			send_state_renewal(fd, hi);
+			add_state_renewal(&sb, hi);
 		}
 	
 	}
 	for (i = 0; i < history_next; i++) {
 		hi = &history[i];
-		send_state_renewal(fd, hi);
+		add_state_renewal(&sb, hi);
 	}
 
+	state_buf_free(&sb);
+
 	if (history)
 		free(history);
 	return;
@@ -2679,6 +3379,257 @@ static void cmd_log_dump(int fd, struct sm_header *h_recv)
 	send(fd, send_data_buf, len, MSG_NOSIGNAL);
 }
 
+/*
+ * Metrics in the Prometheus text format, for collectors that would
+ * otherwise parse the status output.  All samples of a metric are
+ * printed together after its HELP and TYPE lines.
+ */
+
+struct metrics_buf {
+	char *buf;
+	int len;
+	int size;
+	int full;
+};
+
+static void metrics_printf(struct metrics_buf *mb, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+static void metrics_printf(struct metrics_buf *mb, const char *fmt, ...)
+{
+	va_list ap;
+	int rv;
+
+	if (mb->full)
+		return;
+
+	va_start(ap, fmt);
+	rv = vsnprintf(mb->buf + mb->len, mb->size - mb->len, fmt, ap);
+	va_end(ap);
+
+	if (rv < 0 || rv >= mb->size - mb->len) {
+		/* drop the partial line */
+		mb->buf[mb->len] = '\0';
+		mb->full = 1;
+		return;
+	}
+	mb->len += rv;
+}
+
+static void metrics_head(struct metrics_buf *mb, const char *name,
+			 const char *type, const char *help)
+{
+	metrics_printf(mb, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void metrics_daemon(struct metrics_buf *mb, int client_maxi)
+{
+	int workers, free_workers, queued;
+	int ci, clients = 0, registered = 0;
+
+	for (ci = 0; ci <= client_maxi; ci++) {
+		if (!client[ci].used)
+			continue;
+		clients++;
+		if (client[ci].pid > 0 && client[ci].tokens)
+			registered++;
+	}
+
+	thread_pool_stats(&workers, &free_workers, &queued);
+
+	metrics_head(mb, "sanlock_acquires_total", "counter", "Resource lease acquires.");
+	metrics_printf(mb, "sanlock_acquires_total %llu\n",
+		       (unsigned long long)counter_get(counters.acquires));
+	metrics_head(mb, "sanlock_acquire_errors_total", "counter", "Resource lease acquires that failed.");
+	metrics_printf(mb, "sanlock_acquire_errors_total %llu\n",
+		       (unsigned long long)counter_get(counters.acquire_errors));
+	metrics_head(mb, "sanlock_acquire_retries_total", "counter",
+		     "Resource lease acquires retried by acquires waiting for a held resource.");
+	metrics_printf(mb, "sanlock_acquire_retries_total %llu\n",
+		       (unsigned long long)counter_get(counters.acquire_retries));
+	metrics_head(mb, "sanlock_releases_total", "counter", "Resource lease releases.");
+	metrics_printf(mb, "sanlock_releases_total %llu\n",
+		       (unsigned long long)counter_get(counters.releases));
+	metrics_head(mb, "sanlock_release_errors_total", "counter", "Resource lease releases that failed.");
+	metrics_printf(mb, "sanlock_release_errors_total %llu\n",
+		       (unsigned long long)counter_get(counters.release_errors));
+	metrics_head(mb, "sanlock_io_total", "counter", "Disk ios submitted.");
+	metrics_printf(mb, "sanlock_io_total %llu\n",
+		       (unsigned long long)counter_get(counters.io_count));
+	metrics_head(mb, "sanlock_io_timeouts_total", "counter", "Disk ios that timed out.");
+	metrics_printf(mb, "sanlock_io_timeouts_total %llu\n",
+		       (unsigned long long)counter_get(counters.io_timeouts));
+	metrics_head(mb, "sanlock_log_dropped_total", "counter", "Log entries dropped before the log file.");
+	metrics_printf(mb, "sanlock_log_dropped_total %llu\n",
+		       (unsigned long long)log_dropped_count());
+	metrics_head(mb, "sanlock_clients", "gauge", "Connected clients.");
+	metrics_printf(mb, "sanlock_clients %d\n", clients);
+	metrics_head(mb, "sanlock_clients_registered", "gauge", "Clients registered to hold leases.");
+	metrics_printf(mb, "sanlock_clients_registered %d\n", registered);
+	metrics_head(mb, "sanlock_worker_threads", "gauge", "Worker threads.");
+	metrics_printf(mb, "sanlock_worker_threads %d\n", workers);
+	metrics_head(mb, "sanlock_worker_threads_idle", "gauge", "Worker threads waiting for work.");
+	metrics_printf(mb, "sanlock_worker_threads_idle %d\n", free_workers);
+	metrics_head(mb, "sanlock_worker_queue_depth", "gauge", "Commands waiting for a worker thread.");
+	metrics_printf(mb, "sanlock_worker_queue_depth %d\n", queued);
+}
+
+static void metrics_spaces(struct metrics_buf *mb)
+{
+	struct space_metrics *sms = NULL, *sm;
+	struct lat_hist *h;
+	uint64_t now = monotime();
+	uint64_t cum;
+	int count = 0, i, op, b;
+
+	if (get_space_metrics(&sms, &count) < 0 || !count)
+		return;
+
+	resource_held_counts(sms, count);
+
+	metrics_head(mb, "sanlock_lockspace_renewal_result", "gauge",
+		     "Result of the last host_id lease renewal (0 success).");
+	for (i = 0; i < count; i++) {
+		sm = &sms[i];
+		metrics_printf(mb, "sanlock_lockspace_renewal_result{lockspace=\"%s\"} %d\n",
+			       sm->space_name, sm->renewal_last_result);
+	}
+
+	metrics_head(mb, "sanlock_lockspace_renewal_age_seconds", "gauge",
+		     "Seconds since the last successful host_id lease renewal.");
+	for (i = 0; i < count; i++) {
+		sm = &sms[i];
+		if (!sm->renewal_last_success)
+			continue;
+		metrics_printf(mb, "sanlock_lockspace_renewal_age_seconds{lockspace=\"%s\"} %llu\n",
+			       sm->space_name,
+			       (unsigned long long)(now - sm->renewal_last_success));
+	}
+
+	metrics_head(mb, "sanlock_lockspace_renewal_read_ms", "gauge",
+		     "Read time of the last successful renewal.");
+	for (i = 0; i < count; i++) {
+		sm = &sms[i];
+		if (sm->read_ms < 0)
+			continue;
+		metrics_printf(mb, "sanlock_lockspace_renewal_read_ms{lockspace=\"%s\"} %d\n",
+			       sm->space_name, sm->read_ms);
+	}
+
+	metrics_head(mb, "sanlock_lockspace_renewal_write_ms", "gauge",
+		     "Write time of the last successful renewal.");
+	for (i = 0; i < count; i++) {
+		sm = &sms[i];
+		if (sm->write_ms < 0)
+			continue;
+		metrics_printf(mb, "sanlock_lockspace_renewal_write_ms{lockspace=\"%s\"} %d\n",
+			       sm->space_name, sm->write_ms);
+	}
+
+	metrics_head(mb, "sanlock_lockspace_held_resources", "gauge",
+		     "Resource leases held in the lockspace.");
+	for (i = 0; i < count; i++)
+		metrics_printf(mb, "sanlock_lockspace_held_resources{lockspace=\"%s\"} %d\n",
+			       sms[i].space_name, sms[i].held);
+
+	metrics_head(mb, "sanlock_lockspace_ballots_total", "counter",
+		     "Paxos ballots run for resources in the lockspace.");
+	for (i = 0; i < count; i++)
+		metrics_printf(mb, "sanlock_lockspace_ballots_total{lockspace=\"%s\"} %llu\n",
+			       sms[i].space_name,
+			       (unsigned long long)sms[i].lat.op[LAT_PHASE1_WRITE].count);
+
+	metrics_head(mb, "sanlock_lockspace_ballot_aborts_total", "counter",
+		     "Paxos ballots aborted and retried for resources in the lockspace.");
+	for (i = 0; i < count; i++)
+		metrics_printf(mb, "sanlock_lockspace_ballot_aborts_total{lockspace=\"%s\"} %llu\n",
+			       sms[i].space_name, (unsigned long long)sms[i].ballot_aborts);
+
+	metrics_head(mb, "sanlock_lockspace_sh_retries_total", "counter",
+		     "Shared acquires retried for resources in the lockspace.");
+	for (i = 0; i < count; i++)
+		metrics_printf(mb, "sanlock_lockspace_sh_retries_total{lockspace=\"%s\"} %llu\n",
+			       sms[i].space_name, (unsigned long long)sms[i].sh_retries);
+
+	metrics_head(mb, "sanlock_lease_io_errors_total", "counter",
+		     "Lease io errors, and aborted ballots for phase reads.");
+	for (i = 0; i < count; i++) {
+		for (op = 0; op < LAT_OPS; op++) {
+			h = &sms[i].lat.op[op];
+			if (!h->count && !h->errors)
+				continue;
+			metrics_printf(mb, "sanlock_lease_io_errors_total{lockspace=\"%s\",op=\"%s\"} %u\n",
+				       sms[i].space_name, lat_op_str(op), h->errors);
+		}
+	}
+
+	metrics_head(mb, "sanlock_lease_io_seconds", "histogram",
+		     "Lease io time by op, see sanlock client latency.");
+	for (i = 0; i < count; i++) {
+		for (op = 0; op < LAT_OPS; op++) {
+			h = &sms[i].lat.op[op];
+			if (!h->count)
+				continue;
+
+			cum = 0;
+			for (b = 0; b < LAT_BUCKETS - 1; b++) {
+				cum += h->bucket[b];
+				metrics_printf(mb, "sanlock_lease_io_seconds_bucket{lockspace=\"%s\",op=\"%s\",le=\"%.6f\"} %llu\n",
+					       sms[i].space_name, lat_op_str(op),
+					       (double)lat_bucket_us(b) / 1000000,
+					       (unsigned long long)cum);
+			}
+			metrics_printf(mb, "sanlock_lease_io_seconds_bucket{lockspace=\"%s\",op=\"%s\",le=\"+Inf\"} %llu\n",
+				       sms[i].space_name, lat_op_str(op),
+				       (unsigned long long)h->count);
+			metrics_printf(mb, "sanlock_lease_io_seconds_sum{lockspace=\"%s\",op=\"%s\"} %.6f\n",
+				       sms[i].space_name, lat_op_str(op),
+				       (double)h->total_us / 1000000);
+			metrics_printf(mb, "sanlock_lease_io_seconds_count{lockspace=\"%s\",op=\"%s\"} %llu\n",
+				       sms[i].space_name, lat_op_str(op),
+				       (unsigned long long)h->count);
+		}
+	}
+	free(sms);
+}
+
+static void cmd_metrics(int fd, struct sm_header *h_recv, int client_maxi)
+{
+	struct metrics_buf mb;
+
+	memset(&mb, 0, sizeof(mb));
+	mb.buf = send_data_buf;
+	mb.size = LOG_DUMP_SIZE;
+	mb.buf[0] = '\0';
+
+	metrics_daemon(&mb, client_maxi);
+	metrics_spaces(&mb);
+
+	if (mb.full)
+		log_error("cmd_metrics output truncated at %d", mb.len);
+
+	h_recv->version = SM_PROTO;
+	h_recv->length = sizeof(struct sm_header) + mb.len;
+	h_recv->data = mb.len;
+
+	send(fd, h_recv, sizeof(struct sm_header), MSG_NOSIGNAL);
+	send(fd, send_data_buf, mb.len, MSG_NOSIGNAL);
+}
+
+static void cmd_trace(int fd, struct sm_header *h_recv)
+{
+	int len;
+
+	len = trace_copy(send_data_buf, LOG_DUMP_SIZE);
+
+	h_recv->version = SM_PROTO;
+	h_recv->length = sizeof(struct sm_header) + len;
+	h_recv->data = len;
+
+	send(fd, h_recv, sizeof(struct sm_header), MSG_NOSIGNAL);
+	send(fd, send_data_buf, len, MSG_NOSIGNAL);
+}
+
 static void cmd_get_lockspaces(int fd, struct sm_header *h_recv)
 {
 	int count, len, rv;
@@ -2854,7 +3805,7 @@ void call_cmd_daemon(int ci, struct sm_header *h_recv, int client_maxi)
 		}
 		log_debug("cmd_register ci %d fd %d pid %d", ci, fd, pid);
 		snprintf(client[ci].owner_name, SANLK_NAME_LEN, "%d", pid);
-		client[ci].pid = pid;
+		client_set_pid(ci, pid);
 		client[ci].deadfn = client_pid_dead;
 
 		if (client[ci].tokens) {
@@ -2908,6 +3859,18 @@ void call_cmd_daemon(int ci, struct sm_header *h_recv, int client_maxi)
 		strcpy(client[ci].owner_name, "renewal");
 		cmd_renewal(fd, h_recv);
 		break;
+	case SM_CMD_LATENCY:
+		strcpy(client[ci].owner_name, "latency");
+		cmd_latency(fd, h_recv);
+		break;
+	case SM_CMD_METRICS:
+		strcpy(client[ci].owner_name, "metrics");
+		cmd_metrics(fd, h_recv, client_maxi);
+		break;
+	case SM_CMD_TRACE:
+		strcpy(client[ci].owner_name, "trace");
+		cmd_trace(fd, h_recv);
+		break;
 	case SM_CMD_LOG_DUMP:
 		strcpy(client[ci].owner_name, "log_dump");
 		cmd_log_dump(fd, h_recv);
@@ -26,4 +26,8 @@ void call_cmd_daemon(int ci, struct sm_header *h_recv, int client_maxi);
 
 void daemon_shutdown_reply(void);
 
+/* acquire threads used by cmd_acquire */
+void setup_acquire_threads(void);
+void close_acquire_threads(void);
+
 #endif
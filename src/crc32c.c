@@ -9,6 +9,15 @@
  */
 #include <unistd.h>
 #include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#include "crc32c.h"
 
 /*
  * This is the CRC-32C table
@@ -91,12 +100,254 @@ static const uint32_t crc32c_table[256] = {
  * crc using table.
  */
 
-uint32_t crc32c(uint32_t crc, uint8_t *data, size_t length);
-
-uint32_t crc32c(uint32_t crc, uint8_t *data, size_t length)
+static uint32_t crc32c_byte(uint32_t crc, uint8_t *data, size_t length)
 {
 	while (length--)
 		crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
 
 	return crc;
 }
+
+/*
+ * Slicing-by-8: eight tables derived from crc32c_table (slice[0] is
+ * crc32c_table) let eight bytes be processed per step.  The bytes are
+ * assembled individually, so this is independent of host byte order.
+ */
+
+static uint32_t crc32c_slice[8][256];
+
+static void crc32c_slice_init(void)
+{
+	uint32_t crc;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc = crc32c_table[i];
+		crc32c_slice[0][i] = crc;
+		for (k = 1; k < 8; k++) {
+			crc = crc32c_table[crc & 0xFF] ^ (crc >> 8);
+			crc32c_slice[k][i] = crc;
+		}
+	}
+}
+
+static uint32_t crc32c_sw8(uint32_t crc, uint8_t *data, size_t length)
+{
+	uint32_t lo, hi;
+
+	while (length && ((uintptr_t)data & 7)) {
+		crc = crc32c_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+		length--;
+	}
+
+	while (length >= 8) {
+		lo = crc ^ ((uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+			    ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24));
+		hi = (uint32_t)data[4] | ((uint32_t)data[5] << 8) |
+		     ((uint32_t)data[6] << 16) | ((uint32_t)data[7] << 24);
+
+		crc = crc32c_slice[7][lo & 0xFF] ^
+		      crc32c_slice[6][(lo >> 8) & 0xFF] ^
+		      crc32c_slice[5][(lo >> 16) & 0xFF] ^
+		      crc32c_slice[4][lo >> 24] ^
+		      crc32c_slice[3][hi & 0xFF] ^
+		      crc32c_slice[2][(hi >> 8) & 0xFF] ^
+		      crc32c_slice[1][(hi >> 16) & 0xFF] ^
+		      crc32c_slice[0][hi >> 24];
+
+		data += 8;
+		length -= 8;
+	}
+
+	while (length--)
+		crc = crc32c_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+
+	return crc;
+}
+
+#ifdef CRC32C_X86
+
+/*
+ * The SSE4.2 crc32 instruction computes the same reflected crc32c (without
+ * the pre/post inversion, which callers handle) eight bytes at a time.
+ */
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, uint8_t *data, size_t length)
+{
+	uint64_t crc64 = crc;
+	uint64_t val;
+
+	while (length && ((uintptr_t)data & 7)) {
+		crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+		length--;
+	}
+
+	while (length >= 8) {
+		memcpy(&val, data, 8);
+		crc64 = _mm_crc32_u64(crc64, val);
+		data += 8;
+		length -= 8;
+	}
+
+	while (length--)
+		crc64 = _mm_crc32_u8((uint32_t)crc64, *data++);
+
+	return (uint32_t)crc64;
+}
+
+/*
+ * The crc32 instruction has a latency of three cycles but can start one per
+ * cycle, so a long buffer is split into three blocks that are run as
+ * independent streams, and the three crcs are then folded together.  The crc
+ * of a block followed by n bytes is the crc of the block multiplied by
+ * x^(8n) mod P; the multiply is a carryless multiply (PCLMULQDQ) by a
+ * constant, and the reduction mod P is done by the crc32 instruction itself,
+ * which multiplies by x^32 and an extra x from the reflected product, so the
+ * constants are x^(8n-33) mod P.
+ */
+
+#define CRC32C_BLOCK 256
+
+static uint32_t crc32c_k1; /* shift by one block */
+static uint32_t crc32c_k2; /* shift by two blocks */
+
+/* reflected polynomial multiply mod P (bit 31 is x^0) */
+
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = (uint32_t)1 << 31;
+	uint32_t p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ 0x82F63B78 : b >> 1;
+	}
+	return p;
+}
+
+/* x^n mod P */
+
+static uint32_t crc32c_xnmodp(uint64_t n)
+{
+	uint32_t p = (uint32_t)1 << 31;  /* x^0 */
+	uint32_t sq = (uint32_t)1 << 30; /* x^1 */
+
+	while (n) {
+		if (n & 1)
+			p = crc32c_multmodp(sq, p);
+		sq = crc32c_multmodp(sq, sq);
+		n >>= 1;
+	}
+	return p;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_shift(uint32_t crc, uint32_t k)
+{
+	__m128i prod;
+
+	prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+				    _mm_cvtsi32_si128(k), 0);
+
+	return (uint32_t)_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(prod));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_hw_pclmul(uint32_t crc, uint8_t *data, size_t length)
+{
+	uint64_t crc0, crc1, crc2;
+	uint64_t v0, v1, v2;
+	int i;
+
+	while (length && ((uintptr_t)data & 7)) {
+		crc = _mm_crc32_u8(crc, *data++);
+		length--;
+	}
+
+	while (length >= 3 * CRC32C_BLOCK) {
+		crc0 = crc;
+		crc1 = 0;
+		crc2 = 0;
+
+		for (i = 0; i < CRC32C_BLOCK; i += 8) {
+			memcpy(&v0, data + i, 8);
+			memcpy(&v1, data + CRC32C_BLOCK + i, 8);
+			memcpy(&v2, data + 2 * CRC32C_BLOCK + i, 8);
+			crc0 = _mm_crc32_u64(crc0, v0);
+			crc1 = _mm_crc32_u64(crc1, v1);
+			crc2 = _mm_crc32_u64(crc2, v2);
+		}
+
+		crc = crc32c_shift((uint32_t)crc0, crc32c_k2) ^
+		      crc32c_shift((uint32_t)crc1, crc32c_k1) ^
+		      (uint32_t)crc2;
+
+		data += 3 * CRC32C_BLOCK;
+		length -= 3 * CRC32C_BLOCK;
+	}
+
+	return crc32c_hw(crc, data, length);
+}
+
+#endif /* CRC32C_X86 */
+
+static struct crc32c_impl crc32c_impls[] = {
+	{ "byte", crc32c_byte },
+	{ "slice8", crc32c_sw8 },
+#ifdef CRC32C_X86
+	{ "sse42", crc32c_hw },
+	{ "pclmul", crc32c_hw_pclmul },
+#endif
+};
+
+static int crc32c_impls_supported;
+static uint32_t (*crc32c_fn)(uint32_t crc, uint8_t *data, size_t length) = crc32c_byte;
+
+/*
+ * Pick the fastest implementation the cpu supports, once, before main()
+ * (and before any thread in a program using libsanlock can checksum.)
+ */
+
+__attribute__((constructor))
+static void crc32c_init(void)
+{
+	crc32c_slice_init();
+	crc32c_impls_supported = 2;
+
+#ifdef CRC32C_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_impls_supported = 3;
+
+		if (__builtin_cpu_supports("pclmul")) {
+			crc32c_k1 = crc32c_xnmodp(8 * CRC32C_BLOCK - 33);
+			crc32c_k2 = crc32c_xnmodp(2 * 8 * CRC32C_BLOCK - 33);
+			crc32c_impls_supported = 4;
+		}
+	}
+#endif
+	crc32c_fn = crc32c_impls[crc32c_impls_supported - 1].fn;
+}
+
+int crc32c_get_impls(struct crc32c_impl **impls)
+{
+	*impls = crc32c_impls;
+	return crc32c_impls_supported;
+}
+
+const char *crc32c_impl_name(void)
+{
+	return crc32c_impls[crc32c_impls_supported - 1].name;
+}
+
+uint32_t crc32c(uint32_t crc, uint8_t *data, size_t length)
+{
+	return crc32c_fn(crc, data, length);
+}
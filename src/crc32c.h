@@ -0,0 +1,29 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+uint32_t crc32c(uint32_t crc, uint8_t *data, size_t length);
+
+/*
+ * crc32c() uses the fastest implementation supported by the cpu, which is
+ * chosen at startup.  All implementations produce identical results.
+ * crc32c_get_impls returns the number of supported implementations at the
+ * start of the array, slowest first (for testing and benchmarks.)
+ */
+
+struct crc32c_impl {
+	const char *name;
+	uint32_t (*fn)(uint32_t crc, uint8_t *data, size_t length);
+};
+
+int crc32c_get_impls(struct crc32c_impl **impls);
+const char *crc32c_impl_name(void);
+
+#endif
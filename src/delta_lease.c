@@ -230,6 +230,58 @@ int delta_read_lockspace_sector_size(struct task *task,
 	return SANLK_OK;
 }
 
+/*
+ * delta_lease_init writes max_hosts delta leases followed by zeros to the
+ * end of the align_size area, and max_hosts is not recorded on disk.  Find
+ * it from the last sector holding a delta lease for this lockspace, so that
+ * the renewals need only read the sectors that can hold host leases.
+ */
+
+int delta_read_lockspace_max_hosts(struct task *task,
+				   struct sync_disk *disk,
+				   int sector_size,
+				   int io_timeout,
+				   char *space_name,
+				   int *max_hosts)
+{
+	struct leader_record leader;
+	char *iobuf;
+	int iobuf_len, count, last = 0;
+	int i, rv;
+
+	iobuf_len = sector_size_to_align_size(sector_size);
+	count = iobuf_len / sector_size;
+	if (count > DEFAULT_MAX_HOSTS)
+		count = DEFAULT_MAX_HOSTS;
+	iobuf_len = count * sector_size;
+
+	rv = alloc_iobuf(&iobuf, iobuf_len);
+	if (rv)
+		return rv;
+
+	rv = read_iobuf(disk->fd, disk->offset, iobuf, iobuf_len, task, io_timeout, NULL);
+	if (rv < 0)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		leader_record_in((struct leader_record *)(iobuf + (i * sector_size)), &leader);
+
+		if (leader.magic != DELTA_DISK_MAGIC)
+			continue;
+		if (strncmp(leader.space_name, space_name, NAME_ID_SIZE))
+			continue;
+		last = i + 1;
+	}
+
+	/* shouldn't happen, our own lease should be found */
+	*max_hosts = last ? last : count;
+	rv = SANLK_OK;
+ out:
+	if (rv != SANLK_AIO_TIMEOUT)
+		free_iobuf(iobuf, iobuf_len);
+	return rv;
+}
+
 int delta_lease_leader_read(struct task *task, int sector_size, int io_timeout,
 			    struct sync_disk *disk,
 			    char *space_name,
@@ -307,6 +359,16 @@ int delta_lease_leader_clobber(struct task *task, int io_timeout,
  * resource is the ower_id, and the distinguishing id is the resource_name.
  */
 
+/* for status, the progress of the delay waiting for a host_id to be unused */
+
+static void set_acquire_wait(struct space *sp, int wait, int delay)
+{
+	pthread_mutex_lock(&sp->mutex);
+	sp->lease_status.acquire_wait = wait;
+	sp->lease_status.acquire_delay = delay;
+	pthread_mutex_unlock(&sp->mutex);
+}
+
 int delta_lease_acquire(struct task *task,
 			struct space *sp,
 			struct sync_disk *disk,
@@ -321,11 +383,13 @@ int delta_lease_acquire(struct task *task,
 	uint64_t new_ts;
 	uint32_t checksum;
 	int other_io_timeout, other_host_dead_seconds, other_id_renewal_seconds;
-	int i, error, rv, delay, delta_large_delay;
+	int i, error, rv, delay, delta_large_delay, reread;
 
 	log_space(sp, "delta_acquire begin %.48s:%llu",
 		  sp->space_name, (unsigned long long)host_id);
 
+	set_acquire_wait(sp, 0, 0);
+
 	error = delta_lease_leader_read(task, sp->sector_size, sp->io_timeout, disk, space_name, host_id, &leader,
 					"delta_acquire_begin");
 	if (error < 0) {
@@ -384,14 +448,22 @@ int delta_lease_acquire(struct task *task,
 	if (delta_large_delay > delay)
 		delay = delta_large_delay;
 
+	/*
+	 * A live owner renews its lease every other_id_renewal_seconds, so
+	 * rereading the leader every other_io_timeout seconds during the delay
+	 * lets us return HOSTID_BUSY soon after the owner renews, rather than
+	 * after the full delay.  The lease is only taken after a full delay in
+	 * which it has not changed.
+	 */
+	reread = other_io_timeout;
+
 	while (1) {
 		memcpy(&leader1, &leader, sizeof(struct leader_record));
 
-		log_space(sp, "delta_acquire delta_large_delay %d delay %d",
-			  delta_large_delay, delay);
+		log_space(sp, "delta_acquire delta_large_delay %d delay %d reread %d",
+			  delta_large_delay, delay, reread);
 
-		/* TODO: we could reread every several seconds to see if
-		   it has changed, so we can abort more quickly if so */
+		set_acquire_wait(sp, 0, delay);
 
 		for (i = 0; i < delay; i++) {
 			if (sp->external_remove || external_shutdown) {
@@ -400,6 +472,37 @@ int delta_lease_acquire(struct task *task,
 				return SANLK_ERROR;
 			}
 			sleep(1);
+
+			set_acquire_wait(sp, i + 1, delay);
+
+			/* the last second is followed by the read below */
+			if (((i + 1) % reread) || (i + 1 == delay))
+				continue;
+
+			error = delta_lease_leader_read(task, sp->sector_size, sp->io_timeout, disk, space_name, host_id,
+							&leader, "delta_acquire_reread");
+			if (error < 0) {
+				/* the read after the delay decides */
+				log_space(sp, "delta_acquire leader_reread error %d", error);
+				memcpy(&leader, &leader1, sizeof(struct leader_record));
+				continue;
+			}
+
+			if (!memcmp(&leader1, &leader, sizeof(struct leader_record)))
+				continue;
+
+			if (leader.timestamp == LEASE_FREE) {
+				log_space(sp, "delta_acquire free after %d sec", i + 1);
+				goto write_new;
+			}
+
+			log_erros(sp, "delta_acquire host_id %llu busy0 after %d sec %llu %llu %llu %.48s",
+				  (unsigned long long)host_id, i + 1,
+				  (unsigned long long)leader.owner_id,
+				  (unsigned long long)leader.owner_generation,
+				  (unsigned long long)leader.timestamp,
+				  leader.resource_name);
+			return SANLK_HOSTID_BUSY;
 		}
 
 		error = delta_lease_leader_read(task, sp->sector_size, sp->io_timeout, disk, space_name, host_id,
@@ -511,7 +614,6 @@ int delta_lease_renew(struct task *task,
 	struct leader_record leader;
 	struct leader_record leader_end;
 	char **p_iobuf;
-	char **p_wbuf;
 	char *wbuf;
 	struct timespec begin, end, diff;
 	uint32_t checksum;
@@ -531,13 +633,17 @@ int delta_lease_renew(struct task *task,
 
 	host_id = leader_last->owner_id;
 
-	iobuf_len = sp->align_size;
-
 	sector_size = sp->sector_size;
 
+	/* only read the sectors that can hold host leases */
+	if (sp->max_hosts)
+		iobuf_len = sp->max_hosts * sector_size;
+	else
+		iobuf_len = sp->align_size;
+
 	/* offset of our leader_record */
 	id_offset = (host_id - 1) * sector_size;
-	if (id_offset > iobuf_len) {
+	if (id_offset + sector_size > iobuf_len) {
 		log_erros(sp, "delta_renew bad offset %llu iobuf_len %d",
 			  (unsigned long long)id_offset, iobuf_len);
 		return -EINVAL;
@@ -612,9 +718,10 @@ int delta_lease_renew(struct task *task,
 	}
 
 	/*
-	 * NB. this task->iobuf is also copied by the lockspace thread
-	 * into renewal_read_buf, which is then copied in the main loop
-	 * by check_our_lease and passed to check_other_leases.
+	 * NB. after a successful read, this task->iobuf is swapped by the
+	 * lockspace thread with renewal_read_buf, which is then swapped in
+	 * the main loop by check_our_lease and passed to check_other_leases.
+	 * So task->iobuf can be a different buffer each time.
 	 */
 
 	if (!task->iobuf) {
@@ -629,6 +736,7 @@ int delta_lease_renew(struct task *task,
 			log_erros(sp, "dela_renew memalign rv %d", rv);
 			rv = -ENOMEM;
 		}
+		task->iobuf_len = iobuf_len;
 	}
 
 	if (log_renewal_level != -1)
@@ -710,10 +818,9 @@ int delta_lease_renew(struct task *task,
 		leader.write_timestamp = extra->field3;
 	}
 
-	p_wbuf = &wbuf;
-	rv = posix_memalign((void *)p_wbuf, getpagesize(), sector_size);
+	rv = alloc_iobuf(&wbuf, sector_size);
 	if (rv) {
-		log_erros(sp, "dela_renew write memalign rv %d", rv);
+		log_erros(sp, "dela_renew write alloc_iobuf rv %d", rv);
 		return -ENOMEM;
 	}
 	memset(wbuf, 0, sector_size);
@@ -739,7 +846,7 @@ int delta_lease_renew(struct task *task,
 			 calc_host_dead_seconds(sp->io_timeout), wr_ms);
 
 	if (rv != SANLK_AIO_TIMEOUT)
-		free(wbuf);
+		free_iobuf(wbuf, sector_size);
 
 	now = monotime();
 
@@ -822,7 +929,7 @@ int delta_lease_init(struct task *task,
 	struct leader_record leader_first;
 	struct leader_record leader_end;
 	struct leader_record leader;
-	char *iobuf, **p_iobuf;
+	char *iobuf;
 	int iobuf_len;
 	int sector_size;
 	int align_size;
@@ -852,9 +959,7 @@ int delta_lease_init(struct task *task,
 
 	iobuf_len = align_size;
 
-	p_iobuf = &iobuf;
-
-	rv = posix_memalign((void *)p_iobuf, getpagesize(), iobuf_len);
+	rv = alloc_iobuf(&iobuf, iobuf_len);
 	if (rv)
 		return rv;
 
@@ -912,10 +1017,11 @@ int delta_lease_init(struct task *task,
 
 	memcpy(iobuf, &leader_end, sizeof(struct leader_record));
 
-	rv = write_iobuf(disk->fd, disk->offset, iobuf, sector_size, task, io_timeout, NULL);
+	rv = write_iobuf_part(disk->fd, disk->offset, iobuf, sector_size, iobuf_len,
+			      task, io_timeout);
  out:
 	if (rv != SANLK_AIO_TIMEOUT)
-		free(iobuf);
+		free_iobuf(iobuf, iobuf_len);
 
 	return rv;
 }
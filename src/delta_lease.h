@@ -65,6 +65,13 @@ int delta_read_lockspace_sector_size(struct task *task,
                          int io_timeout,
                          int *sector_size);
 
+int delta_read_lockspace_max_hosts(struct task *task,
+				   struct sync_disk *disk,
+				   int sector_size,
+				   int io_timeout,
+				   char *space_name,
+				   int *max_hosts);
+
 int delta_lease_leader_clobber(struct task *task, int io_timeout,
                                struct sync_disk *disk,
                                uint64_t host_id,
@@ -21,6 +21,7 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <pthread.h>
 #include <blkid/blkid.h>
 
 #include <libaio.h> /* linux aio */
@@ -30,6 +31,8 @@
 #include "diskio.h"
 #include "direct.h"
 #include "log.h"
+#include "task.h"
+#include "trace.h"
 
 static int set_disk_properties(struct sync_disk *disk)
 {
@@ -67,6 +70,10 @@ static int set_disk_properties(struct sync_disk *disk)
 	return 0;
 }
 
+static int disk_cache_put(int fd);
+
+/* an fd from the disk cache is returned to the cache rather than closed */
+
 void close_disks(struct sync_disk *disks, int num_disks)
 {
 	int d;
@@ -74,7 +81,8 @@ void close_disks(struct sync_disk *disks, int num_disks)
 	for (d = 0; d < num_disks; d++) {
 		if (disks[d].fd == -1)
 			continue;
-		close(disks[d].fd);
+		if (!disk_cache_put(disks[d].fd))
+			close(disks[d].fd);
 		disks[d].fd = -1;
 	}
 }
@@ -101,6 +109,26 @@ int majority_disks(int num_disks, int num)
 	return 0;
 }
 
+static int open_disk_fd(struct sync_disk *disk)
+{
+	int fd, rv;
+
+	fd = open(disk->path, O_RDWR | O_DIRECT | O_SYNC, 0);
+	if (fd < 0) {
+		rv = -errno;
+		if (rv == -EACCES) {
+			log_error("open error %d EACCES: no permission to open %s", rv, disk->path);
+			log_error("check that daemon user %s %d group %s %d has access to disk or file.",
+				  com.uname, com.uid, com.gname, com.gid);
+		} else
+			log_error("open error %d %s", fd, disk->path);
+		return rv;
+	}
+
+	disk->fd = fd;
+	return 0;
+}
+
 /* 
  * set fd in each disk
  * returns 0 if majority of disks were opened successfully, -EXXX otherwise
@@ -110,7 +138,7 @@ int open_disks_fd(struct sync_disk *disks, int num_disks)
 {
 	struct sync_disk *disk;
 	int num_opens = 0;
-	int d, fd, rv = -1;
+	int d, err, rv = -1;
 
 	for (d = 0; d < num_disks; d++) {
 		disk = &disks[d];
@@ -121,19 +149,12 @@ int open_disks_fd(struct sync_disk *disks, int num_disks)
 			goto fail;
 		}
 
-		fd = open(disk->path, O_RDWR | O_DIRECT | O_SYNC, 0);
-		if (fd < 0) {
-			rv = -errno;
-			if (rv == -EACCES) {
-				log_error("open error %d EACCES: no permission to open %s", rv, disk->path);
-				log_error("check that daemon user %s %d group %s %d has access to disk or file.",
-					  com.uname, com.uid, com.gname, com.gid);
-			} else
-				log_error("open error %d %s", fd, disk->path);
+		err = open_disk_fd(disk);
+		if (err < 0) {
+			rv = err;
 			continue;
 		}
 
-		disk->fd = fd;
 		num_opens++;
 	}
 
@@ -266,21 +287,431 @@ int open_disks(struct sync_disk *disks, int num_disks)
 	return rv;
 }
 
+/*
+ * Lease io buffers are page aligned (for O_DIRECT) and most are used for a
+ * single io, so allocating each with posix_memalign and freeing it again
+ * is a large part of the cost of a ballot (which reads align_size from each
+ * disk.)  Freed buffers are kept on a free list for their length and reused.
+ * Only a few lengths are used (sector_size, align_size, sector multiples), so
+ * a small table of lists is enough; a buffer of any other length, or one that
+ * would push the cached total over IOBUF_POOL_MAX, is simply freed.  (With
+ * mlock_level set, cached buffers remain locked in memory, so the cache must
+ * stay bounded.)
+ *
+ * A free buffer is linked into its list through its first bytes.  A buffer
+ * that is left in flight by a timed out io (SANLK_AIO_TIMEOUT) is owned by
+ * the aicb until the io is reaped, and is then returned with free_iobuf.
+ * Pool buffers are ordinary posix_memalign allocations, so a buffer from
+ * either can be released through the other.
+ */
+
+#define IOBUF_POOL_LISTS 8
+#define IOBUF_POOL_MAX (32 * 1024 * 1024)
+
+struct iobuf_list {
+	int len;
+	int count;
+	char *head;
+};
+
+static struct iobuf_list iobuf_lists[IOBUF_POOL_LISTS];
+static uint64_t iobuf_pool_bytes;
+static pthread_mutex_t iobuf_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int alloc_iobuf(char **iobuf_out, int len)
+{
+	char *iobuf = NULL;
+	char **p_iobuf;
+	int i, rv;
+
+	pthread_mutex_lock(&iobuf_pool_mutex);
+	for (i = 0; i < IOBUF_POOL_LISTS; i++) {
+		if (iobuf_lists[i].len != len || !iobuf_lists[i].head)
+			continue;
+		iobuf = iobuf_lists[i].head;
+		memcpy(&iobuf_lists[i].head, iobuf, sizeof(char *));
+		iobuf_lists[i].count--;
+		iobuf_pool_bytes -= len;
+		break;
+	}
+	pthread_mutex_unlock(&iobuf_pool_mutex);
+
+	if (iobuf) {
+		*iobuf_out = iobuf;
+		return 0;
+	}
+
+	p_iobuf = &iobuf;
+
+	rv = posix_memalign((void *)p_iobuf, getpagesize(), len);
+	if (rv)
+		return rv;
+
+	*iobuf_out = iobuf;
+	return 0;
+}
+
+void free_iobuf(char *iobuf, int len)
+{
+	int i, empty = -1;
+
+	if (!iobuf)
+		return;
+
+	if (len < (int)sizeof(char *))
+		goto out;
+
+	pthread_mutex_lock(&iobuf_pool_mutex);
+	if (iobuf_pool_bytes + len > IOBUF_POOL_MAX)
+		goto out_unlock;
+
+	for (i = 0; i < IOBUF_POOL_LISTS; i++) {
+		if (iobuf_lists[i].len == len)
+			break;
+		if (!iobuf_lists[i].count && empty < 0)
+			empty = i;
+	}
+
+	if (i == IOBUF_POOL_LISTS) {
+		if (empty < 0)
+			goto out_unlock;
+		i = empty;
+		iobuf_lists[i].len = len;
+	}
+
+	memcpy(iobuf, &iobuf_lists[i].head, sizeof(char *));
+	iobuf_lists[i].head = iobuf;
+	iobuf_lists[i].count++;
+	iobuf_pool_bytes += len;
+	pthread_mutex_unlock(&iobuf_pool_mutex);
+	return;
+
+ out_unlock:
+	pthread_mutex_unlock(&iobuf_pool_mutex);
+ out:
+	free(iobuf);
+}
+
+/*
+ * The daemon opens the same lease disks for every acquire, release and
+ * request of a resource, so disks opened for a lockspace's resources can be
+ * kept open in a cache of fds (with the sector size found when each was
+ * first opened) instead of opening and probing the disk each time.  A cached
+ * fd is shared by all the users of the same lockspace and path, and close_disks
+ * returns it to the cache.  The cache entries for a lockspace are closed when
+ * the lockspace is removed, so the daemon does not keep its disks open; an
+ * entry still in use at that point is closed when the last user puts it.
+ */
+
+#define DISK_CACHE_MAX 256
+
+struct disk_cache_entry {
+	struct list_head list;
+	char space_name[NAME_ID_SIZE];
+	char path[SANLK_PATH_LEN];
+	uint32_t sector_size;	/* 0 if opened without probing the disk */
+	int fd;
+	int refs;
+	int purged;
+};
+
+/* lockspaces whose disks may be cached, between add and purge */
+
+struct disk_cache_space {
+	struct list_head list;
+	char space_name[NAME_ID_SIZE];
+};
+
+static LIST_HEAD(disk_cache);
+static LIST_HEAD(disk_cache_spaces);
+static pthread_mutex_t disk_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int disk_cache_count;
+
+static struct disk_cache_space *disk_cache_find_space(const char *space_name)
+{
+	struct disk_cache_space *cs;
+
+	list_for_each_entry(cs, &disk_cache_spaces, list) {
+		if (!strncmp(cs->space_name, space_name, NAME_ID_SIZE))
+			return cs;
+	}
+	return NULL;
+}
+
+static struct disk_cache_entry *disk_cache_find(const char *space_name, const char *path)
+{
+	struct disk_cache_entry *ce;
+
+	list_for_each_entry(ce, &disk_cache, list) {
+		if (ce->purged)
+			continue;
+		if (strncmp(ce->space_name, space_name, NAME_ID_SIZE))
+			continue;
+		if (strncmp(ce->path, path, SANLK_PATH_LEN))
+			continue;
+		return ce;
+	}
+	return NULL;
+}
+
+/* returns 1 if fd belongs to the cache */
+
+static int disk_cache_put(int fd)
+{
+	struct disk_cache_entry *ce;
+	int found = 0;
+
+	pthread_mutex_lock(&disk_cache_mutex);
+	list_for_each_entry(ce, &disk_cache, list) {
+		if (ce->fd != fd)
+			continue;
+		found = 1;
+		ce->refs--;
+		if (ce->purged && !ce->refs) {
+			list_del(&ce->list);
+			disk_cache_count--;
+			close(ce->fd);
+			free(ce);
+		}
+		break;
+	}
+	pthread_mutex_unlock(&disk_cache_mutex);
+
+	return found;
+}
+
+/*
+ * Add the fd just opened for disk to the cache, unless another thread has
+ * already added one (then ours is not cached and is closed by close_disks.)
+ */
+
+static void disk_cache_add(const char *space_name, struct sync_disk *disk, int probed)
+{
+	struct disk_cache_entry *ce;
+
+	pthread_mutex_lock(&disk_cache_mutex);
+	ce = disk_cache_find(space_name, disk->path);
+	if (ce) {
+		if (probed && !ce->sector_size)
+			ce->sector_size = disk->sector_size;
+		goto out;
+	}
+
+	/* don't cache the disks of a lockspace that has been purged */
+	if (!disk_cache_find_space(space_name))
+		goto out;
+
+	if (disk_cache_count >= DISK_CACHE_MAX)
+		goto out;
+
+	ce = malloc(sizeof(struct disk_cache_entry));
+	if (!ce)
+		goto out;
+	memset(ce, 0, sizeof(struct disk_cache_entry));
+
+	memcpy(ce->space_name, space_name, NAME_ID_SIZE);
+	strncpy(ce->path, disk->path, SANLK_PATH_LEN - 1);
+	ce->sector_size = probed ? disk->sector_size : 0;
+	ce->fd = disk->fd;
+	ce->refs = 1;
+	list_add(&ce->list, &disk_cache);
+	disk_cache_count++;
+ out:
+	pthread_mutex_unlock(&disk_cache_mutex);
+}
+
+/* returns 0 and sets disk fd (and sector_size if probe) from the cache */
+
+static int disk_cache_get(const char *space_name, struct sync_disk *disk, int probe)
+{
+	struct disk_cache_entry *ce;
+	int rv = -1;
+
+	pthread_mutex_lock(&disk_cache_mutex);
+	ce = disk_cache_find(space_name, disk->path);
+	if (ce && (!probe || ce->sector_size)) {
+		ce->refs++;
+		disk->fd = ce->fd;
+		if (probe)
+			disk->sector_size = ce->sector_size;
+		rv = 0;
+	}
+	pthread_mutex_unlock(&disk_cache_mutex);
+
+	return rv;
+}
+
+static int open_disk_cache(const char *space_name, struct sync_disk *disk, int probe)
+{
+	int align_size;
+	int rv;
+
+	if (!disk_cache_get(space_name, disk, probe)) {
+		if (!probe)
+			return 0;
+
+		/* open_disk checks the offset for each use of the disk */
+
+		align_size = direct_align(disk);
+		if (align_size < 0 || (disk->offset % align_size)) {
+			log_error("invalid offset %llu align size %d %s",
+				  (unsigned long long)disk->offset,
+				  align_size, disk->path);
+			close_disks(disk, 1);
+			return -EBADSLT;
+		}
+		return 0;
+	}
+
+	if (probe)
+		rv = open_disk(disk);
+	else
+		rv = open_disk_fd(disk);
+	if (rv < 0)
+		return rv;
+
+	disk_cache_add(space_name, disk, probe);
+	return 0;
+}
+
+/*
+ * Like open_disks and open_disks_fd, using fds from the disk cache for the
+ * lockspace.  The disks are closed with close_disks as usual.
+ */
+
+static int open_disks_cache(struct sync_disk *disks, int num_disks,
+			    const char *space_name, int probe)
+{
+	struct sync_disk *disk;
+	int num_opens = 0;
+	int d, err, rv = -1;
+	uint32_t ss = 0;
+
+	for (d = 0; d < num_disks; d++) {
+		disk = &disks[d];
+
+		if (disk->fd != -1) {
+			log_error("open fd %d exists %s", disk->fd, disk->path);
+			rv = -ENOTEMPTY;
+			goto fail;
+		}
+
+		err = open_disk_cache(space_name, disk, probe);
+		if (err < 0) {
+			rv = err;
+			continue;
+		}
+
+		if (!probe) {
+			/* sector size is not checked */
+		} else if (!ss) {
+			ss = disk->sector_size;
+		} else if (ss != disk->sector_size) {
+			log_error("inconsistent sector sizes %u %u %s",
+				  ss, disk->sector_size, disk->path);
+			goto fail;
+		}
+
+		num_opens++;
+	}
+
+	if (!majority_disks(num_disks, num_opens)) {
+		/* rv is from open err */
+		goto fail;
+	}
+
+	return 0;
+
+ fail:
+	close_disks(disks, num_disks);
+	return rv;
+}
+
+int open_disks_cached(struct sync_disk *disks, int num_disks, const char *space_name)
+{
+	return open_disks_cache(disks, num_disks, space_name, 1);
+}
+
+int open_disks_fd_cached(struct sync_disk *disks, int num_disks, const char *space_name)
+{
+	return open_disks_cache(disks, num_disks, space_name, 0);
+}
+
+/* allow disks of a lockspace being added to be cached */
+
+void add_disk_cache(const char *space_name)
+{
+	struct disk_cache_space *cs;
+
+	cs = malloc(sizeof(struct disk_cache_space));
+	if (!cs)
+		return;
+	memset(cs, 0, sizeof(struct disk_cache_space));
+	memcpy(cs->space_name, space_name, NAME_ID_SIZE);
+
+	pthread_mutex_lock(&disk_cache_mutex);
+	if (disk_cache_find_space(space_name))
+		free(cs);
+	else
+		list_add(&cs->list, &disk_cache_spaces);
+	pthread_mutex_unlock(&disk_cache_mutex);
+}
+
+/* close the cached fds for a lockspace that is being removed */
+
+void purge_disk_cache(const char *space_name)
+{
+	struct disk_cache_entry *ce, *safe;
+	struct disk_cache_space *cs;
+	int closed = 0, busy = 0;
+
+	pthread_mutex_lock(&disk_cache_mutex);
+	cs = disk_cache_find_space(space_name);
+	if (cs) {
+		list_del(&cs->list);
+		free(cs);
+	}
+
+	list_for_each_entry_safe(ce, safe, &disk_cache, list) {
+		if (ce->purged)
+			continue;
+		if (strncmp(ce->space_name, space_name, NAME_ID_SIZE))
+			continue;
+
+		if (ce->refs) {
+			ce->purged = 1;
+			busy++;
+			continue;
+		}
+
+		list_del(&ce->list);
+		disk_cache_count--;
+		close(ce->fd);
+		free(ce);
+		closed++;
+	}
+	pthread_mutex_unlock(&disk_cache_mutex);
+
+	if (closed || busy)
+		log_debug("purge_disk_cache %.48s closed %d busy %d", space_name, closed, busy);
+}
+
+/*
+ * Cached fds are shared by threads doing io at the same time, so the sync io
+ * functions use pread/pwrite rather than seeking the shared file offset.
+ */
+
 static int do_write(int fd, uint64_t offset, const char *buf, int len, struct task *task)
 {
-	off_t ret;
 	int rv;
 	int pos = 0;
 
 	if (task)
 		task->io_count++;
-
-	ret = lseek(fd, offset, SEEK_SET);
-	if (ret != offset)
-		return -1;
+	counter_inc(counters.io_count);
 
  retry:
-	rv = write(fd, buf + pos, len);
+	rv = pwrite(fd, buf + pos, len, offset + pos);
 	if (rv == -1 && errno == EINTR)
 		goto retry;
 	if (rv < 0)
@@ -301,18 +732,14 @@ static int do_write(int fd, uint64_t offset, const char *buf, int len, struct ta
 
 static int do_read(int fd, uint64_t offset, char *buf, int len, struct task *task)
 {
-	off_t ret;
 	int rv, pos = 0;
 
 	if (task)
 		task->io_count++;
-
-	ret = lseek(fd, offset, SEEK_SET);
-	if (ret != offset)
-		return -1;
+	counter_inc(counters.io_count);
 
 	while (pos < len) {
-		rv = read(fd, buf + pos, len - pos);
+		rv = pread(fd, buf + pos, len - pos, offset + pos);
 		if (rv == 0)
 			return -1;
 		if (rv == -1 && errno == EINTR)
@@ -348,7 +775,7 @@ static struct aicb *find_callback_slot(struct task *task, int ioto)
  retry:
 	memset(&event, 0, sizeof(event));
 
-	rv = io_getevents(task->aio_ctx, 1, 1, &event, &ts);
+	rv = task_aio_getevents(task, 1, 1, &event, &ts);
 	if (rv == -EINTR)
 		goto retry;
 	if (rv < 0)
@@ -369,7 +796,7 @@ static struct aicb *find_callback_slot(struct task *task, int ioto)
 		log_taskw(task, "aio collect %s %p:%p:%p result %ld:%ld old free",
 			  op_str, ev_aicb, ev_iocb, ev_aicb->buf, event.res, event.res2);
 		ev_aicb->used = 0;
-		free(ev_aicb->buf);
+		free_iobuf(ev_aicb->buf, ev_aicb->buf_len);
 		ev_aicb->buf = NULL;
 		goto find;
 	}
@@ -384,7 +811,7 @@ static struct aicb *find_callback_slot(struct task *task, int ioto)
  * what values we might return from event.res.)
  */
 
-static int do_linux_aio(int fd, uint64_t offset, char *buf, int len,
+static int do_linux_aio(int fd, uint64_t offset, char *buf, int len, int buf_len,
 			struct task *task, int ioto, int cmd, int *ms)
 {
 	struct timespec ts;
@@ -441,7 +868,7 @@ static int do_linux_aio(int fd, uint64_t offset, char *buf, int len,
 	if (ms)
 		clock_gettime(CLOCK_MONOTONIC_RAW, &begin);
 
-	rv = io_submit(task->aio_ctx, 1, &iocb);
+	rv = task_aio_submit(task, 1, &iocb);
 	if (rv < 0) {
 		log_taske(task, "aio submit %d %p:%p:%p rv %d fd %d",
 			  cmd, aicb, iocb, buf, rv, fd);
@@ -449,17 +876,19 @@ static int do_linux_aio(int fd, uint64_t offset, char *buf, int len,
 	}
 
 	task->io_count++;
+	counter_inc(counters.io_count);
 
 	/* don't reuse aicb->iocb or free the buf until we reap the event */
 	aicb->used = 1;
 	aicb->buf = buf;
+	aicb->buf_len = buf_len;
 
 	memset(&ts, 0, sizeof(struct timespec));
 	ts.tv_sec = ioto;
  retry:
 	memset(&event, 0, sizeof(event));
 
-	rv = io_getevents(task->aio_ctx, 1, 1, &event, &ts);
+	rv = task_aio_getevents(task, 1, 1, &event, &ts);
 	if (rv == -EINTR)
 		goto retry;
 	if (rv < 0) {
@@ -490,7 +919,7 @@ static int do_linux_aio(int fd, uint64_t offset, char *buf, int len,
 		if (ev_iocb != iocb) {
 			log_taskw(task, "aio collect %s %p:%p:%p result %ld:%ld other free",
 				  op_str, ev_aicb, ev_iocb, ev_aicb->buf, event.res, event.res2);
-			free(ev_aicb->buf);
+			free_iobuf(ev_aicb->buf, ev_aicb->buf_len);
 			ev_aicb->buf = NULL;
 			goto retry;
 		}
@@ -546,6 +975,7 @@ static int do_linux_aio(int fd, uint64_t offset, char *buf, int len,
 	   likely going to get -EINVAL from that call */
 
 	task->to_count++;
+	counter_inc(counters.io_timeouts);
 
 	if (cmd == IO_CMD_PREAD)
 		op_str = "RD";
@@ -557,7 +987,7 @@ static int do_linux_aio(int fd, uint64_t offset, char *buf, int len,
 	log_taskw(task, "aio timeout %s %p:%p:%p ioto %d to_count %d",
 		  op_str, aicb, iocb, buf, ioto, task->to_count);
 
-	rv = io_cancel(task->aio_ctx, iocb, &event);
+	rv = task_aio_cancel(task, iocb, &event);
 	if (!rv) {
 		aicb->used = 0;
 		rv = -ECANCELED;
@@ -572,16 +1002,16 @@ static int do_linux_aio(int fd, uint64_t offset, char *buf, int len,
 	return rv;
 }
 
-static int do_write_aio_linux(int fd, uint64_t offset, char *buf, int len,
+static int do_write_aio_linux(int fd, uint64_t offset, char *buf, int len, int buf_len,
 			      struct task *task, int ioto, int *wr_ms)
 {
-	return do_linux_aio(fd, offset, buf, len, task, ioto, IO_CMD_PWRITE, wr_ms);
+	return do_linux_aio(fd, offset, buf, len, buf_len, task, ioto, IO_CMD_PWRITE, wr_ms);
 }
 
 static int do_read_aio_linux(int fd, uint64_t offset, char *buf, int len,
 			     struct task *task, int ioto, int *rd_ms)
 {
-	return do_linux_aio(fd, offset, buf, len, task, ioto, IO_CMD_PREAD, rd_ms);
+	return do_linux_aio(fd, offset, buf, len, len, task, ioto, IO_CMD_PREAD, rd_ms);
 }
 
 static int do_write_aio_posix(int fd, uint64_t offset, char *buf, int len,
@@ -683,17 +1113,52 @@ static int do_read_aio_posix(int fd, uint64_t offset, char *buf, int len,
 	return -1;
 }
 
+static void trace_io_done(int op, int fd, int rv, uint64_t offset, uint64_t begin)
+{
+	int event;
+
+	if (!begin)
+		return;
+
+	if (rv == SANLK_AIO_TIMEOUT || rv == -ECANCELED)
+		event = TRACE_IO_TIMEOUT;
+	else
+		event = TRACE_IO_DONE;
+
+	trace_event(event, op, fd, rv, offset, (trace_ns() - begin) / 1000);
+}
+
 /* write aligned io buffer */
 
-int write_iobuf(int fd, uint64_t offset, char *iobuf, int iobuf_len,
-		struct task *task, int ioto, int *wr_ms)
+static int _write_iobuf(int fd, uint64_t offset, char *iobuf, int iobuf_len,
+			int buf_len, struct task *task, int ioto, int *wr_ms)
 {
-	if (task && task->use_aio == 1)
-		return do_write_aio_linux(fd, offset, iobuf, iobuf_len, task, ioto, wr_ms);
+	uint64_t begin;
+	int rv;
+
+	begin = trace_event(TRACE_IO_SUBMIT, TRACE_OP_WR, fd, iobuf_len, offset, 0);
+
+	if (task && (task->use_aio == 1 || task->use_aio == 3))
+		rv = do_write_aio_linux(fd, offset, iobuf, iobuf_len, buf_len, task, ioto, wr_ms);
 	else if (task && task->use_aio == 2)
-		return do_write_aio_posix(fd, offset, iobuf, iobuf_len, task, ioto);
+		rv = do_write_aio_posix(fd, offset, iobuf, iobuf_len, task, ioto);
 	else
-		return do_write(fd, offset, iobuf, iobuf_len, task);
+		rv = do_write(fd, offset, iobuf, iobuf_len, task);
+
+	trace_io_done(TRACE_OP_WR, fd, rv, offset, begin);
+	return rv;
+}
+
+int write_iobuf(int fd, uint64_t offset, char *iobuf, int iobuf_len,
+		struct task *task, int ioto, int *wr_ms)
+{
+	return _write_iobuf(fd, offset, iobuf, iobuf_len, iobuf_len, task, ioto, wr_ms);
+}
+
+int write_iobuf_part(int fd, uint64_t offset, char *iobuf, int iobuf_len,
+		     int buf_len, struct task *task, int ioto)
+{
+	return _write_iobuf(fd, offset, iobuf, iobuf_len, buf_len, task, ioto, NULL);
 }
 
 static int _write_sectors(const struct sync_disk *disk, int sector_size, uint64_t sector_nr,
@@ -702,17 +1167,15 @@ static int _write_sectors(const struct sync_disk *disk, int sector_size, uint64_
 			  struct task *task, int ioto,
 			  const char *blktype)
 {
-	char *iobuf, **p_iobuf;
+	char *iobuf;
 	uint64_t offset;
 	int rv;
 
 	offset = disk->offset + (sector_nr * sector_size);
 
-	p_iobuf = &iobuf;
-
-	rv = posix_memalign((void *)p_iobuf, getpagesize(), iobuf_len);
+	rv = alloc_iobuf(&iobuf, iobuf_len);
 	if (rv) {
-		log_error("write_sectors %s posix_memalign rv %d %s",
+		log_error("write_sectors %s alloc_iobuf rv %d %s",
 			  blktype, rv, disk->path);
 		rv = -ENOMEM;
 		goto out;
@@ -728,7 +1191,7 @@ static int _write_sectors(const struct sync_disk *disk, int sector_size, uint64_
 	}
 
 	if (rv != SANLK_AIO_TIMEOUT)
-		free(iobuf);
+		free_iobuf(iobuf, iobuf_len);
  out:
 	return rv;
 }
@@ -789,12 +1252,20 @@ int write_sectors(const struct sync_disk *disk, int sector_size, uint64_t sector
 int read_iobuf(int fd, uint64_t offset, char *iobuf, int iobuf_len,
 	       struct task *task, int ioto, int *rd_ms)
 {
-	if (task && task->use_aio == 1)
-		return do_read_aio_linux(fd, offset, iobuf, iobuf_len, task, ioto, rd_ms);
+	uint64_t begin;
+	int rv;
+
+	begin = trace_event(TRACE_IO_SUBMIT, TRACE_OP_RD, fd, iobuf_len, offset, 0);
+
+	if (task && (task->use_aio == 1 || task->use_aio == 3))
+		rv = do_read_aio_linux(fd, offset, iobuf, iobuf_len, task, ioto, rd_ms);
 	else if (task && task->use_aio == 2)
-		return do_read_aio_posix(fd, offset, iobuf, iobuf_len, task, ioto);
+		rv = do_read_aio_posix(fd, offset, iobuf, iobuf_len, task, ioto);
 	else
-		return do_read(fd, offset, iobuf, iobuf_len, task);
+		rv = do_read(fd, offset, iobuf, iobuf_len, task);
+
+	trace_io_done(TRACE_OP_RD, fd, rv, offset, begin);
+	return rv;
 }
 
 /* read sector_count sectors starting with sector_nr, where sector_nr
@@ -808,7 +1279,7 @@ int read_sectors(const struct sync_disk *disk, int sector_size, uint64_t sector_
 		 struct task *task, int ioto,
 		 const char *blktype)
 {
-	char *iobuf, **p_iobuf;
+	char *iobuf;
 	uint64_t offset;
 	int iobuf_len;
 	int rv;
@@ -821,11 +1292,9 @@ int read_sectors(const struct sync_disk *disk, int sector_size, uint64_t sector_
 	iobuf_len = sector_count * sector_size;
 	offset = disk->offset + (sector_nr * sector_size);
 
-	p_iobuf = &iobuf;
-
-	rv = posix_memalign((void *)p_iobuf, getpagesize(), iobuf_len);
+	rv = alloc_iobuf(&iobuf, iobuf_len);
 	if (rv) {
-		log_error("read_sectors %s posix_memalign rv %d %s",
+		log_error("read_sectors %s alloc_iobuf rv %d %s",
 			  blktype, rv, disk->path);
 		rv = -ENOMEM;
 		goto out;
@@ -842,7 +1311,7 @@ int read_sectors(const struct sync_disk *disk, int sector_size, uint64_t sector_
 	}
 
 	if (rv != SANLK_AIO_TIMEOUT)
-		free(iobuf);
+		free_iobuf(iobuf, iobuf_len);
  out:
 	return rv;
 }
@@ -882,7 +1351,7 @@ int read_iobuf_reap(int fd, uint64_t offset, char *iobuf, int iobuf_len,
  retry:
 	memset(&event, 0, sizeof(event));
 
-	rv = io_getevents(task->aio_ctx, 1, 1, &event, &ts);
+	rv = task_aio_getevents(task, 1, 1, &event, &ts);
 	if (rv == -EINTR)
 		goto retry;
 	if (rv < 0) {
@@ -908,7 +1377,7 @@ int read_iobuf_reap(int fd, uint64_t offset, char *iobuf, int iobuf_len,
 		if (ev_iocb != iocb) {
 			log_taskw(task, "aio collect %s %p:%p:%p result %ld:%ld other free r",
 				  op_str, ev_aicb, ev_iocb, ev_aicb->buf, event.res, event.res2);
-			free(ev_aicb->buf);
+			free_iobuf(ev_aicb->buf, ev_aicb->buf_len);
 			ev_aicb->buf = NULL;
 			goto retry;
 		}
@@ -938,3 +1407,247 @@ int read_iobuf_reap(int fd, uint64_t offset, char *iobuf, int iobuf_len,
 	return rv;
 }
 
+
+/*
+ * Do the same io (all reads or all writes) on a number of disks at once.
+ * With linux aio, the ios are submitted to all disks together and their
+ * events are reaped together, so the io takes as long as the slowest disk
+ * instead of the sum of all the disks.
+ *
+ * Returns when num_wait ios have completed successfully, when all ios have
+ * completed, or when ioto expires.  The return value is the number of ios
+ * that completed successfully, and ios[i].rv is the result of each.
+ *
+ * An io that has not completed when this returns has rv SANLK_AIO_TIMEOUT,
+ * either because it timed out, or because it was still in progress after
+ * num_wait ios had completed.  As with read_iobuf/write_iobuf, the caller
+ * cannot free the iobuf of that io; it will be freed when the event is
+ * reaped by a subsequent io.
+ */
+
+static int do_linux_aio_disks(struct disk_io *ios, int num_ios, int num_wait,
+			      struct task *task, int ioto, int cmd)
+{
+	struct iocb *iocbs[SANLK_MAX_DISKS];
+	struct aicb *aicbs[SANLK_MAX_DISKS];
+	struct io_event events[SANLK_MAX_DISKS];
+	uint64_t trace_begin[SANLK_MAX_DISKS];
+	struct timespec ts, begin, now, diff;
+	struct aicb *aicb;
+	struct iocb *iocb;
+	const char *op_str;
+	int trace_op = (cmd == IO_CMD_PREAD) ? TRACE_OP_RD : TRACE_OP_WR;
+	int num_submit = 0, num_pending, num_done = 0;
+	int elapsed_ms, remain_ms;
+	int i, j, rv;
+
+	if (!ioto) {
+		log_taske(task, "aio %d zero io timeout", cmd);
+		return -EINVAL;
+	}
+
+	if (num_ios > SANLK_MAX_DISKS)
+		return -EINVAL;
+
+	op_str = (cmd == IO_CMD_PREAD) ? "RD" : "WR";
+
+	for (i = 0; i < num_ios; i++) {
+		aicbs[i] = NULL;
+
+		aicb = find_callback_slot(task, ioto);
+		if (!aicb) {
+			ios[i].rv = -ENOENT;
+			continue;
+		}
+
+		/* reserve the slot so find_callback_slot won't return it again */
+		aicb->used = 1;
+		aicb->buf = ios[i].iobuf;
+		aicb->buf_len = ios[i].iobuf_len;
+
+		iocb = &aicb->iocb;
+		memset(iocb, 0, sizeof(struct iocb));
+		iocb->aio_fildes = ios[i].fd;
+		iocb->aio_lio_opcode = cmd;
+		iocb->u.c.buf = ios[i].iobuf;
+		iocb->u.c.nbytes = ios[i].iobuf_len;
+		iocb->u.c.offset = ios[i].offset;
+
+		if (com.debug_io_submit)
+			log_taskd(task, "%s %d at %llu fd %d", op_str, ios[i].iobuf_len,
+				  (unsigned long long)ios[i].offset, ios[i].fd);
+
+		aicbs[i] = aicb;
+		iocbs[num_submit++] = iocb;
+	}
+
+	if (!num_submit)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &begin);
+
+	rv = task_aio_submit(task, num_submit, iocbs);
+	if (rv < 0) {
+		log_taske(task, "aio submit %d disks %d rv %d", cmd, num_submit, rv);
+		num_submit = 0;
+	} else {
+		num_submit = rv;
+	}
+
+	/* iocbs were submitted in order, any after num_submit were not */
+
+	for (i = 0, j = 0; i < num_ios; i++) {
+		if (!aicbs[i])
+			continue;
+		if (j++ < num_submit) {
+			trace_begin[i] = trace_event(TRACE_IO_SUBMIT, trace_op, ios[i].fd,
+						     ios[i].iobuf_len, ios[i].offset, 0);
+			continue;
+		}
+		aicbs[i]->used = 0;
+		aicbs[i]->buf = NULL;
+		aicbs[i] = NULL;
+		ios[i].rv = (rv < 0) ? rv : -EAGAIN;
+	}
+
+	task->io_count += num_submit;
+	counter_add(counters.io_count, num_submit);
+	num_pending = num_submit;
+
+	while (num_pending && (num_done < num_wait)) {
+		clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+		ts_diff(&begin, &now, &diff);
+		elapsed_ms = (diff.tv_sec * 1000) + (diff.tv_nsec / 1000000);
+		remain_ms = (ioto * 1000) - elapsed_ms;
+		if (remain_ms <= 0)
+			break;
+
+		memset(&ts, 0, sizeof(struct timespec));
+		ts.tv_sec = remain_ms / 1000;
+		ts.tv_nsec = (remain_ms % 1000) * 1000000;
+
+		memset(events, 0, sizeof(events));
+
+		rv = task_aio_getevents(task, 1, SANLK_MAX_DISKS, events, &ts);
+		if (rv == -EINTR)
+			continue;
+		if (rv < 0) {
+			log_taske(task, "aio getevent disks %d rv %d", num_pending, rv);
+			break;
+		}
+		if (!rv)
+			break;
+
+		for (j = 0; j < rv; j++) {
+			struct iocb *ev_iocb = events[j].obj;
+			struct aicb *ev_aicb = container_of(ev_iocb, struct aicb, iocb);
+
+			ev_aicb->used = 0;
+
+			for (i = 0; i < num_ios; i++) {
+				if (aicbs[i] == ev_aicb)
+					break;
+			}
+
+			if (i == num_ios) {
+				log_taskw(task, "aio collect %p:%p:%p result %ld:%ld other free d",
+					  ev_aicb, ev_iocb, ev_aicb->buf, events[j].res, events[j].res2);
+				free_iobuf(ev_aicb->buf, ev_aicb->buf_len);
+				ev_aicb->buf = NULL;
+				continue;
+			}
+
+			ev_aicb->buf = NULL;
+			aicbs[i] = NULL;
+			num_pending--;
+
+			if ((int)events[j].res < 0) {
+				log_taskw(task, "aio collect %s %p:%p result %ld:%ld match res d",
+					  op_str, ev_aicb, ev_iocb, events[j].res, events[j].res2);
+				ios[i].rv = events[j].res;
+			} else if (events[j].res != ios[i].iobuf_len) {
+				log_taskw(task, "aio collect %s %p:%p result %ld:%ld match len %d d",
+					  op_str, ev_aicb, ev_iocb, events[j].res, events[j].res2,
+					  ios[i].iobuf_len);
+				ios[i].rv = -EMSGSIZE;
+			} else {
+				if (com.debug_io_complete)
+					log_taskd(task, "%s %d at %llu fd %d done", op_str, ios[i].iobuf_len,
+						  (unsigned long long)ios[i].offset, ios[i].fd);
+
+				ios[i].rv = 0;
+				num_done++;
+			}
+
+			trace_io_done(trace_op, ios[i].fd, ios[i].rv, ios[i].offset, trace_begin[i]);
+		}
+	}
+
+	/* ios that are still pending keep their aicb and buf until reaped */
+
+	for (i = 0; i < num_ios; i++) {
+		if (!aicbs[i])
+			continue;
+
+		ios[i].rv = SANLK_AIO_TIMEOUT;
+
+		if (num_done >= num_wait) {
+			log_taskd(task, "aio %s %p fd %d left in progress",
+				  op_str, aicbs[i], ios[i].fd);
+			continue;
+		}
+
+		trace_io_done(trace_op, ios[i].fd, ios[i].rv, ios[i].offset, trace_begin[i]);
+
+		task->to_count++;
+		counter_inc(counters.io_timeouts);
+
+		log_taskw(task, "aio timeout %s %p:%p:%p ioto %d to_count %d d",
+			  op_str, aicbs[i], &aicbs[i]->iocb, ios[i].iobuf, ioto, task->to_count);
+
+		rv = task_aio_cancel(task, &aicbs[i]->iocb, &events[0]);
+		if (!rv) {
+			aicbs[i]->used = 0;
+			aicbs[i]->buf = NULL;
+			ios[i].rv = -ECANCELED;
+		}
+	}
+
+	return num_done;
+}
+
+static int do_iobuf_disks(struct disk_io *ios, int num_ios, int num_wait,
+			  struct task *task, int ioto, int cmd)
+{
+	int i, num_done = 0;
+
+	if (task && (task->use_aio == 1 || task->use_aio == 3))
+		return do_linux_aio_disks(ios, num_ios, num_wait, task, ioto, cmd);
+
+	/* without linux aio the ios are done one after the other */
+
+	for (i = 0; i < num_ios; i++) {
+		if (cmd == IO_CMD_PWRITE)
+			ios[i].rv = write_iobuf(ios[i].fd, ios[i].offset, ios[i].iobuf,
+						ios[i].iobuf_len, task, ioto, NULL);
+		else
+			ios[i].rv = read_iobuf(ios[i].fd, ios[i].offset, ios[i].iobuf,
+					       ios[i].iobuf_len, task, ioto, NULL);
+		if (!ios[i].rv)
+			num_done++;
+	}
+
+	return num_done;
+}
+
+int write_iobuf_disks(struct disk_io *ios, int num_ios, int num_wait,
+		      struct task *task, int ioto)
+{
+	return do_iobuf_disks(ios, num_ios, num_wait, task, ioto, IO_CMD_PWRITE);
+}
+
+int read_iobuf_disks(struct disk_io *ios, int num_ios, int num_wait,
+		     struct task *task, int ioto)
+{
+	return do_iobuf_disks(ios, num_ios, num_wait, task, ioto, IO_CMD_PREAD);
+}
@@ -14,21 +14,60 @@ int open_disk(struct sync_disk *disks);
 int open_disks(struct sync_disk *disks, int num_disks);
 int open_disks_fd(struct sync_disk *disks, int num_disks);
 int majority_disks(int num_disks, int num);
+int open_disks_cached(struct sync_disk *disks, int num_disks, const char *space_name);
+int open_disks_fd_cached(struct sync_disk *disks, int num_disks, const char *space_name);
+void add_disk_cache(const char *space_name);
+void purge_disk_cache(const char *space_name);
 
 /*
- * iobuf functions require the caller to allocate iobuf using posix_memalign
- * and pass it into the function
+ * alloc_iobuf returns a page aligned buffer of len bytes, reusing one from
+ * the pool of freed io buffers when possible.  free_iobuf returns a buffer
+ * to the pool (or frees it when the pool is full.)  The buffer contents are
+ * not cleared.
+ */
+
+int alloc_iobuf(char **iobuf_out, int len);
+void free_iobuf(char *iobuf, int len);
+
+/*
+ * iobuf functions require the caller to allocate iobuf using alloc_iobuf
+ * (or posix_memalign) and pass it into the function
  */
 
 int write_iobuf(int fd, uint64_t offset, char *iobuf, int iobuf_len,
 		struct task *task, int ioto, int *wr_ms);
 
+/* writes the first iobuf_len bytes of an iobuf allocated with buf_len */
+int write_iobuf_part(int fd, uint64_t offset, char *iobuf, int iobuf_len,
+		     int buf_len, struct task *task, int ioto);
+
 int read_iobuf(int fd, uint64_t offset, char *iobuf, int iobuf_len,
 	       struct task *task, int ioto, int *rd_ms);
 
 int read_iobuf_reap(int fd, uint64_t offset, char *iobuf, int iobuf_len,
 		    struct task *task, uint32_t ioto_msec);
 
+/*
+ * iobuf_disks functions do the same io on multiple disks in parallel,
+ * returning the number of ios that succeeded once num_wait have succeeded,
+ * all are done, or ioto expires.  Each io's iobuf is allocated by the caller
+ * as above, and cannot be freed by the caller if its rv is SANLK_AIO_TIMEOUT.
+ */
+
+struct disk_io {
+	int fd;
+	uint64_t offset;
+	char *iobuf;
+	int iobuf_len;
+	int rv;
+};
+
+int write_iobuf_disks(struct disk_io *ios, int num_ios, int num_wait,
+		      struct task *task, int ioto);
+
+int read_iobuf_disks(struct disk_io *ios, int num_ios, int num_wait,
+		     struct task *task, int ioto);
+
 /*
  * sector functions allocate an iobuf themselves, copy into it for read, use it
  * for io, copy out of it for write, and free it
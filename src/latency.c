@@ -0,0 +1,129 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+/*
+ * Latency histograms for lease io.
+ *
+ * An op is timed by the thread doing it and counted in a lat_stats owned by
+ * that thread (the token during acquire/release, or the lockspace renewal),
+ * so nothing is locked on the io path.  The token counts are added to the
+ * resource and lockspace totals once the acquire or release is done.
+ *
+ * Bucket n counts ops that took less than LAT_BUCKET0_US << n microseconds,
+ * and the last bucket counts everything longer.
+ */
+
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "sanlock_internal.h"
+#include "latency.h"
+
+#define LAT_BUCKET0_US 128
+
+uint64_t lat_begin(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void lat_count(struct lat_stats *lat, int op, uint64_t us, int error)
+{
+	struct lat_hist *h;
+	int b;
+
+	if (op < 0 || op >= LAT_OPS)
+		return;
+
+	h = &lat->op[op];
+
+	for (b = 0; b < LAT_BUCKETS - 1; b++) {
+		if (us < ((uint64_t)LAT_BUCKET0_US << b))
+			break;
+	}
+
+	h->count++;
+	h->total_us += us;
+	if (us > h->max_us)
+		h->max_us = (uint32_t)us;
+	if (error)
+		h->errors++;
+	h->bucket[b]++;
+}
+
+void lat_end(struct lat_stats *lat, int op, uint64_t begin_us, int error)
+{
+	lat_count(lat, op, lat_begin() - begin_us, error);
+}
+
+void lat_add(struct lat_stats *dst, struct lat_stats *src)
+{
+	struct lat_hist *d, *s;
+	int op, b;
+
+	for (op = 0; op < LAT_OPS; op++) {
+		s = &src->op[op];
+		d = &dst->op[op];
+
+		if (!s->count && !s->errors)
+			continue;
+
+		d->count += s->count;
+		d->total_us += s->total_us;
+		if (s->max_us > d->max_us)
+			d->max_us = s->max_us;
+		d->errors += s->errors;
+
+		for (b = 0; b < LAT_BUCKETS; b++)
+			d->bucket[b] += s->bucket[b];
+	}
+}
+
+/* upper limit of a bucket, 0 for the last which has none */
+
+uint32_t lat_bucket_us(int bucket)
+{
+	if (bucket < 0 || bucket >= LAT_BUCKETS - 1)
+		return 0;
+	return (uint32_t)LAT_BUCKET0_US << bucket;
+}
+
+const char *lat_op_str(int op)
+{
+	switch (op) {
+	case LAT_LEADER_READ:
+		return "leader_read";
+	case LAT_PHASE1_WRITE:
+		return "phase1_write";
+	case LAT_PHASE1_READ:
+		return "phase1_read";
+	case LAT_PHASE2_WRITE:
+		return "phase2_write";
+	case LAT_PHASE2_READ:
+		return "phase2_read";
+	case LAT_COMMIT_WRITE:
+		return "commit_write";
+	case LAT_MODE_WRITE:
+		return "mode_write";
+	case LAT_LVB_READ:
+		return "lvb_read";
+	case LAT_LVB_WRITE:
+		return "lvb_write";
+	case LAT_DELTA_READ:
+		return "delta_read";
+	case LAT_DELTA_WRITE:
+		return "delta_write";
+	}
+	return "unknown";
+}
@@ -0,0 +1,19 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+uint64_t lat_begin(void);
+void lat_end(struct lat_stats *lat, int op, uint64_t begin_us, int error);
+void lat_count(struct lat_stats *lat, int op, uint64_t us, int error);
+void lat_add(struct lat_stats *dst, struct lat_stats *src);
+const char *lat_op_str(int op);
+uint32_t lat_bucket_us(int bucket);
+
+#endif
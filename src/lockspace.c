@@ -37,6 +37,9 @@
 #include "task.h"
 #include "timeouts.h"
 #include "direct.h"
+#include "latency.h"
+#include "trace.h"
+#include "shm_state.h"
 
 static uint32_t space_id_counter = 1;
 
@@ -106,6 +109,7 @@ int _lockspace_info(const char *space_name, struct space_info *spi)
 		spi->io_timeout = sp->io_timeout;
 		spi->sector_size = sp->sector_size;
 		spi->align_size = sp->align_size;
+		spi->max_hosts = sp->max_hosts;
 		spi->host_id = sp->host_id;
 		spi->host_generation = sp->host_generation;
 		spi->killing_pids = sp->killing_pids;
@@ -115,10 +119,65 @@ int _lockspace_info(const char *space_name, struct space_info *spi)
 	return -1;
 }
 
+void lockspace_add_lat(const char *space_name, struct lat_stats *lat)
+{
+	struct space *sp;
+
+	pthread_mutex_lock(&spaces_mutex);
+	sp = find_lockspace(space_name);
+	if (sp) {
+		pthread_mutex_lock(&sp->mutex);
+		lat_add(&sp->lat, lat);
+		pthread_mutex_unlock(&sp->mutex);
+	}
+	pthread_mutex_unlock(&spaces_mutex);
+}
+
+/*
+ * The per resource counts go away when free resources are purged,
+ * so the lockspace keeps its own totals for the metrics counters.
+ */
+
+void lockspace_add_retries(const char *space_name, uint32_t ballot_aborts,
+			   uint32_t sh_retries)
+{
+	struct space *sp;
+
+	pthread_mutex_lock(&spaces_mutex);
+	sp = find_lockspace(space_name);
+	if (sp) {
+		pthread_mutex_lock(&sp->mutex);
+		sp->ballot_aborts += ballot_aborts;
+		sp->sh_retries += sh_retries;
+		pthread_mutex_unlock(&sp->mutex);
+	}
+	pthread_mutex_unlock(&spaces_mutex);
+}
+
+int lockspace_lat(const char *space_name, struct lat_stats *lat)
+{
+	struct space *sp;
+	int rv = -ENOSPC;
+
+	pthread_mutex_lock(&spaces_mutex);
+	sp = find_lockspace(space_name);
+	if (sp) {
+		pthread_mutex_lock(&sp->mutex);
+		memcpy(lat, &sp->lat, sizeof(struct lat_stats));
+		pthread_mutex_unlock(&sp->mutex);
+		rv = 0;
+	}
+	pthread_mutex_unlock(&spaces_mutex);
+
+	return rv;
+}
+
 int lockspace_info(const char *space_name, struct space_info *spi)
 {
 	int rv;
 
+	check_resource_unlocked("lockspace_info");
+
 	pthread_mutex_lock(&spaces_mutex);
 	rv = _lockspace_info(space_name, spi);
 	pthread_mutex_unlock(&spaces_mutex);
@@ -131,6 +190,8 @@ int lockspace_disk(char *space_name, struct sync_disk *disk, int *sector_size)
 	struct space *sp;
 	int rv = -1;
 
+	check_resource_unlocked("lockspace_disk");
+
 	pthread_mutex_lock(&spaces_mutex);
 	list_for_each_entry(sp, &spaces, list) {
 		if (strncmp(sp->space_name, space_name, NAME_ID_SIZE))
@@ -203,6 +264,9 @@ int host_status_set_bit(char *space_name, uint64_t host_id)
 	if (!found)
 		return -ENOSPC;
 
+	if (host_id > sp->max_hosts)
+		return -EINVAL;
+
 	pthread_mutex_lock(&sp->mutex);
 	sp->host_status[host_id-1].set_bit_time = monotime();
 	pthread_mutex_unlock(&sp->mutex);
@@ -217,11 +281,17 @@ int host_info(char *space_name, uint64_t host_id, struct host_status *hs_out)
 	if (!host_id || host_id > DEFAULT_MAX_HOSTS)
 		return -EINVAL;
 
+	check_resource_unlocked("host_info");
+
 	pthread_mutex_lock(&spaces_mutex);
 	list_for_each_entry(sp, &spaces, list) {
 		if (strncmp(sp->space_name, space_name, NAME_ID_SIZE))
 			continue;
-		memcpy(hs_out, &sp->host_status[host_id-1], sizeof(struct host_status));
+		/* there is no lease for a host_id beyond max_hosts */
+		if (host_id <= sp->max_hosts)
+			memcpy(hs_out, &sp->host_status[host_id-1], sizeof(struct host_status));
+		else
+			memset(hs_out, 0, sizeof(struct host_status));
 		found = 1;
 
 		if (!hs_out->io_timeout) {
@@ -247,7 +317,7 @@ static void create_bitmap_and_extra(struct space *sp, char *bitmap, struct delta
 	now = monotime();
 
 	pthread_mutex_lock(&sp->mutex);
-	for (i = 0; i < DEFAULT_MAX_HOSTS; i++) {
+	for (i = 0; i < sp->max_hosts; i++) {
 		if (i+1 == sp->host_id)
 			continue;
 
@@ -275,14 +345,21 @@ static void create_bitmap_and_extra(struct space *sp, char *bitmap, struct delta
  * lockspace, checks if another host is notifying us (through their bitmap)
  * to look at resource requests or an event they've written.
  *
- * NB. the way that this gets the copy of all leases to look at is
+ * NB. the way that this gets the buffer of all leases to look at is
  * unfortunately very subtle and convoluted.
  *
- * The lockspace thread makes a copy of task iobuf, which holds all
- * delta leases that were read in the last renewal, into
+ * The lockspace thread swaps task iobuf, which holds all delta leases
+ * that were read in the last renewal, with
  * sp->lease_status.renewal_read_buf.  Then check_our_lease() called
- * by the main loop makes a copy of sp->lease_status.renewal_read_buf
- * to pass to this function.
+ * by the main loop swaps sp->lease_status.renewal_read_buf with
+ * sp->lease_status.check_buf, which it passes to this function.
+ *
+ * Most hosts' leases are unused or unchanged since the last check, so
+ * only the leases whose on-disk timestamp or checksum have changed are
+ * decoded and looked at.  A host always writes a new timestamp when it
+ * writes its lease, and the checksum covers the other leader fields.
+ * (The bitmap is written with a new timestamp, and is not looked at
+ * below unless the timestamp changes.)
  */
 
 void check_other_leases(struct space *sp, char *buf)
@@ -299,14 +376,23 @@ void check_other_leases(struct space *sp, char *buf)
 	now = monotime();
 	new = 0;
 
-	for (i = 0; i < DEFAULT_MAX_HOSTS; i++) {
+	for (i = 0; i < sp->max_hosts; i++) {
 		hs = &sp->host_status[i];
 		hs->last_check = now;
 
-		if (!hs->first_check)
+		leader_end = (struct leader_record *)(buf + (i * sp->sector_size));
+
+		if (!hs->first_check) {
 			hs->first_check = now;
+		} else if (!hs->lease_bad &&
+			   hs->disk_timestamp == leader_end->timestamp &&
+			   hs->disk_checksum == leader_end->checksum) {
+			/* unchanged, nothing below would be done */
+			continue;
+		}
 
-		leader_end = (struct leader_record *)(buf + (i * sp->sector_size));
+		hs->disk_timestamp = leader_end->timestamp;
+		hs->disk_checksum = leader_end->checksum;
 
 		leader_record_in(leader_end, &leader_in);
 		leader = &leader_in;
@@ -406,14 +492,14 @@ void check_other_leases(struct space *sp, char *buf)
 		he.data = leader->write_timestamp;
 
 		/*
-		 * Pass an event to the resource_thread which is a
+		 * Pass an event to the host_event_thread which is a
 		 * convenient place to do callbacks (we don't want
 		 * the main thread to be delayed with that.)
 		 */
 		if (he.event) {
 			/*
 			 * lock order: spaces_mutex (main_loop), then
-			 * resource_mutex (add_host_event).
+			 * host_event_mutex (add_host_event).
 			 */
 			log_space(sp, "host event from host_id %d", i+1);
 			add_host_event(sp->space_id, &he,
@@ -443,9 +529,10 @@ void check_other_leases(struct space *sp, char *buf)
  * check if our_host_id_thread has renewed within timeout
  */
 
-int check_our_lease(struct space *sp, int *check_all, char *check_buf)
+int check_our_lease(struct space *sp, int *check_all, char **check_buf)
 {
 	int id_renewal_fail_seconds, id_renewal_warn_seconds;
+	char *buf;
 	uint64_t last_success;
 	int corrupt_result;
 	int gap;
@@ -461,8 +548,10 @@ int check_our_lease(struct space *sp, int *check_all, char *check_buf)
 		 */
 		sp->lease_status.renewal_read_check = sp->lease_status.renewal_read_count;
 		*check_all = 1;
-		if (check_buf)
-			memcpy(check_buf, sp->lease_status.renewal_read_buf, sp->align_size);
+		buf = sp->lease_status.check_buf;
+		sp->lease_status.check_buf = sp->lease_status.renewal_read_buf;
+		sp->lease_status.renewal_read_buf = buf;
+		*check_buf = sp->lease_status.check_buf;
 	}
 	pthread_mutex_unlock(&sp->mutex);
 
@@ -568,42 +657,202 @@ static void save_renewal_history(struct space *sp, int delta_result,
 	}
 }
 
+/*
+ * The state used to renew a lockspace's host_id lease.  lockspace_thread
+ * uses it on its stack, or when renewal_threads is set, copies it to
+ * sp->renewal and hands it to the renewal scheduler after the host_id is
+ * acquired.
+ */
+
+struct lockspace_renewal {
+	struct list_head list;		/* on a renew_wheel slot or renew_ready */
+	struct space *sp;
+	struct task task;
+	struct leader_record leader;
+	uint64_t last_success;
+	uint64_t due_ms;		/* scheduler: when to next renew */
+	int delta_result;
+	int log_renewal_level;
+	int id_renewal_seconds;
+	int id_renewal_fail_seconds;
+	int opened;
+	int queued;			/* scheduler: on the wheel or renew_ready */
+	int stopping;			/* scheduler: end_lockspace at once */
+	int done;			/* scheduler: end_lockspace is complete */
+};
+
+/*
+ * do a renewal, measuring length of time spent in renewal,
+ * and the length of time between successful renewals
+ */
+
+static void renew_lockspace(struct lockspace_renewal *rn)
+{
+	char bitmap[HOSTID_BITMAP_SIZE];
+	struct delta_extra extra;
+	struct space *sp = rn->sp;
+	uint64_t delta_begin;
+	char *buf;
+	int delta_length, renewal_interval = 0;
+	int read_result, rd_ms, wr_ms;
+
+	memset(bitmap, 0, sizeof(bitmap));
+	memset(&extra, 0, sizeof(extra));
+	create_bitmap_and_extra(sp, bitmap, &extra);
+
+	delta_begin = monotime();
+
+	rn->delta_result = delta_lease_renew(&rn->task, sp, &sp->host_id_disk,
+					     sp->space_name, bitmap, &extra,
+					     rn->delta_result, &read_result,
+					     rn->log_renewal_level,
+					     &rn->leader, &rn->leader,
+					     &rd_ms, &wr_ms);
+	delta_length = monotime() - delta_begin;
+
+	trace_event(TRACE_RENEWAL, 0, sp->space_id, rn->delta_result,
+		    (int64_t)rd_ms, (int64_t)wr_ms);
+
+	if (rn->delta_result == SANLK_OK) {
+		renewal_interval = rn->leader.timestamp - rn->last_success;
+		rn->last_success = rn->leader.timestamp;
+	}
+
+
+	/*
+	 * publish the results
+	 */
+
+	pthread_mutex_lock(&sp->mutex);
+	sp->lease_status.renewal_last_result = rn->delta_result;
+	sp->lease_status.renewal_last_attempt = delta_begin;
+
+	if (rn->delta_result == SANLK_OK)
+		sp->lease_status.renewal_last_success = rn->last_success;
+
+	if (rn->delta_result != SANLK_OK && !sp->lease_status.corrupt_result)
+		sp->lease_status.corrupt_result = corrupt_result(rn->delta_result);
+
+	if (read_result == SANLK_OK && rn->task.iobuf) {
+		/*
+		 * NB. be careful with how this iobuf escapes.  The read is
+		 * complete so the iobuf is not in use by aio, and the next
+		 * renewal reads into the previous renewal_read_buf.
+		 */
+		buf = sp->lease_status.renewal_read_buf;
+		sp->lease_status.renewal_read_buf = rn->task.iobuf;
+		rn->task.iobuf = buf;
+		sp->lease_status.renewal_read_count++;
+	}
+
+	/*
+	 * pet the watchdog
+	 * (don't update on thread_stop because it's probably unlinked)
+	 */
+
+	if (rn->delta_result == SANLK_OK && !sp->thread_stop)
+		update_watchdog(sp, rn->last_success, rn->id_renewal_fail_seconds);
+
+	save_renewal_history(sp, rn->delta_result, rn->last_success, rd_ms, wr_ms);
+
+	/* diskio only times these in ms */
+	if (read_result == SANLK_OK && rd_ms >= 0)
+		lat_count(&sp->lat, LAT_DELTA_READ, (uint64_t)rd_ms * 1000, 0);
+	else if (read_result != SANLK_OK)
+		sp->lat.op[LAT_DELTA_READ].errors++;
+	if (wr_ms >= 0)
+		lat_count(&sp->lat, LAT_DELTA_WRITE, (uint64_t)wr_ms * 1000, 0);
+	pthread_mutex_unlock(&sp->mutex);
+
+
+	/*
+	 * log the results
+	 */
+
+	if (rn->delta_result != SANLK_OK) {
+		log_erros(sp, "renewal error %d delta_length %d last_success %llu",
+			  rn->delta_result, delta_length, (unsigned long long)rn->last_success);
+	} else if (delta_length > rn->id_renewal_seconds) {
+		log_erros(sp, "renewed %llu delta_length %d too long",
+			  (unsigned long long)rn->last_success, delta_length);
+	} else {
+		if (com.debug_renew) {
+			log_space(sp, "renewed %llu delta_length %d interval %d",
+				  (unsigned long long)rn->last_success, delta_length, renewal_interval);
+		}
+	}
+}
+
+/* release the host_id and clean up after the lockspace is stopped */
+
+static void end_lockspace(struct lockspace_renewal *rn)
+{
+	struct space *sp = rn->sp;
+
+	if (rn->delta_result == SANLK_OK)
+		delta_lease_release(&rn->task, sp, &sp->host_id_disk,
+				    sp->space_name, &rn->leader, &rn->leader);
+
+	if (rn->opened)
+		close(sp->host_id_disk.fd);
+
+	/*
+	 * TODO: are there cases where struct resources for this lockspace
+	 * still exist on resource_held/resource_add/resource_rem?  Is that ok?
+	 * Should we purge all of them here?  When a lockspace is removed and
+	 * pids are killed, their resources go through release_token_async,
+	 * which will see token->space_dead, and those resources are freed
+	 * directly.  resources that may have already been on resources_rem and
+	 * the resource_thread may be in the middle of releasing one of them.
+	 * For any further async releases, resource_thread will see that the
+	 * lockspace is going away and will just free the resource.
+	 */
+
+	purge_resource_orphans(sp->space_name);
+	purge_resource_free(sp->space_name);
+	purge_disk_cache(sp->space_name);
+
+	close_event_fds(sp);
+
+	close_task_aio(&rn->task);
+}
+
+static int renewal_sched_add(struct lockspace_renewal *rn_in);
+
 /*
  * This thread must not be stopped unless all pids that may be using any
  * resources in it are dead/gone.  (The USED flag in the lockspace represents
  * pids using resources in the lockspace, when those pids are not using actual
  * sanlock resources.  So the USED flag must also prevent this thread from
  * stopping.)
+ *
+ * With renewal_threads set, this thread exits once the host_id is acquired,
+ * and the renewal scheduler does the renewals and the end_lockspace.
  */
 
 static void *lockspace_thread(void *arg_in)
 {
-	char bitmap[HOSTID_BITMAP_SIZE];
-	struct delta_extra extra;
-	struct task task;
+	struct lockspace_renewal rn;
+	struct host_status *host_status;
 	struct space *sp;
-	struct leader_record leader;
-	uint64_t delta_begin, last_success = 0;
-	int log_renewal_level = -1;
-	int rv, delta_length, renewal_interval = 0;
-	int id_renewal_seconds, id_renewal_fail_seconds;
-	int acquire_result, delta_result, read_result;
-	int rd_ms, wr_ms;
-	int opened = 0;
+	uint64_t delta_begin;
+	int max_hosts;
+	int rv;
+	int acquire_result;
 	int stop = 0;
 	int wd_con;
 
-	if (com.debug_renew)
-		log_renewal_level = LOG_DEBUG;
-
 	sp = (struct space *)arg_in;
 
-	memset(&task, 0, sizeof(struct task));
-	setup_task_aio(&task, main_task.use_aio, HOSTID_AIO_CB_SIZE);
-	memcpy(task.name, sp->space_name, NAME_ID_SIZE);
+	memset(&rn, 0, sizeof(rn));
+	rn.sp = sp;
+	rn.log_renewal_level = com.debug_renew ? LOG_DEBUG : -1;
 
-	id_renewal_seconds = calc_id_renewal_seconds(sp->io_timeout);
-	id_renewal_fail_seconds = calc_id_renewal_fail_seconds(sp->io_timeout);
+	setup_task_aio(&rn.task, main_task.use_aio, HOSTID_AIO_CB_SIZE);
+	memcpy(rn.task.name, sp->space_name, NAME_ID_SIZE);
+
+	rn.id_renewal_seconds = calc_id_renewal_seconds(sp->io_timeout);
+	rn.id_renewal_fail_seconds = calc_id_renewal_fail_seconds(sp->io_timeout);
 
 	delta_begin = monotime();
 
@@ -611,26 +860,31 @@ static void *lockspace_thread(void *arg_in)
 	if (rv < 0) {
 		log_erros(sp, "open_disk %s error %d", sp->host_id_disk.path, rv);
 		acquire_result = -ENODEV;
-		delta_result = -1;
+		rn.delta_result = -1;
 		goto set_status;
 	}
-	opened = 1;
+	rn.opened = 1;
+
+	add_disk_cache(sp->space_name);
+
+	/* this fd is the only one the task uses until close_task_aio */
+	task_aio_register_fd(&rn.task, sp->host_id_disk.fd);
 
 	if (!sp->sector_size) {
 		int ss = 0;
 
-		rv = delta_read_lockspace_sector_size(&task, &sp->host_id_disk, sp->io_timeout, &ss);
+		rv = delta_read_lockspace_sector_size(&rn.task, &sp->host_id_disk, sp->io_timeout, &ss);
 		if (rv < 0) {
 			log_erros(sp, "failed to read device to find sector size error %d %s", rv, sp->host_id_disk.path);
 			acquire_result = rv;
-			delta_result = -1;
+			rn.delta_result = -1;
 			goto set_status;
 		}
 
 		if ((ss != 512) && (ss != 4096)) {
 			log_erros(sp, "failed to get valid sector size %d %s", ss, sp->host_id_disk.path);
 			acquire_result = SANLK_LEADER_SECTORSIZE;
-			delta_result = -1;
+			rn.delta_result = -1;
 			goto set_status;
 		}
 
@@ -638,10 +892,41 @@ static void *lockspace_thread(void *arg_in)
 		sp->align_size = sector_size_to_align_size(ss);
 	}
 
-	sp->lease_status.renewal_read_buf = malloc(sp->align_size);
-	if (!sp->lease_status.renewal_read_buf) {
+	/*
+	 * Renewals read, and host_status tracks, only the host leases that
+	 * exist, which may be far fewer than fit in align_size.
+	 */
+	rv = delta_read_lockspace_max_hosts(&rn.task, &sp->host_id_disk, sp->sector_size,
+					    sp->io_timeout, sp->space_name, &max_hosts);
+	if (rv < 0) {
+		log_erros(sp, "failed to read lockspace max_hosts error %d %s", rv, sp->host_id_disk.path);
+		acquire_result = rv;
+		rn.delta_result = -1;
+		goto set_status;
+	}
+
+	host_status = calloc(max_hosts, sizeof(struct host_status));
+	if (!host_status) {
+		acquire_result = -ENOMEM;
+		rn.delta_result = -1;
+		goto set_status;
+	}
+
+	/* cmd_host_status can look at sp on spaces_add */
+	pthread_mutex_lock(&sp->mutex);
+	sp->host_status = host_status;
+	sp->max_hosts = max_hosts;
+	pthread_mutex_unlock(&sp->mutex);
+
+	log_space(sp, "max_hosts %d", max_hosts);
+
+	/* these are swapped with the renewal task iobuf, so are allocated the same way */
+	rv = posix_memalign((void *)&sp->lease_status.renewal_read_buf, getpagesize(), max_hosts * sp->sector_size);
+	if (!rv)
+		rv = posix_memalign((void *)&sp->lease_status.check_buf, getpagesize(), max_hosts * sp->sector_size);
+	if (rv) {
 		acquire_result = -ENOMEM;
-		delta_result = -1;
+		rn.delta_result = -1;
 		goto set_status;
 	}
 
@@ -650,7 +935,7 @@ static void *lockspace_thread(void *arg_in)
 	if (wd_con < 0) {
 		log_erros(sp, "connect_watchdog failed %d", wd_con);
 		acquire_result = SANLK_WD_ERROR;
-		delta_result = -1;
+		rn.delta_result = -1;
 		goto set_status;
 	}
 
@@ -660,21 +945,20 @@ static void *lockspace_thread(void *arg_in)
 
 	delta_begin = monotime();
 
-	delta_result = delta_lease_acquire(&task, sp, &sp->host_id_disk,
-					   sp->space_name, our_host_name_global,
-					   sp->host_id, &leader);
-	delta_length = monotime() - delta_begin;
+	rn.delta_result = delta_lease_acquire(&rn.task, sp, &sp->host_id_disk,
+					      sp->space_name, our_host_name_global,
+					      sp->host_id, &rn.leader);
 
-	if (delta_result == SANLK_OK)
-		last_success = leader.timestamp;
+	if (rn.delta_result == SANLK_OK)
+		rn.last_success = rn.leader.timestamp;
 
-	acquire_result = delta_result;
+	acquire_result = rn.delta_result;
 
 	/* we need to start the watchdog after we acquire the host_id but
 	   before we allow any pid's to begin running */
 
-	if (delta_result == SANLK_OK) {
-		rv = activate_watchdog(sp, last_success, id_renewal_fail_seconds, wd_con);
+	if (rn.delta_result == SANLK_OK) {
+		rv = activate_watchdog(sp, rn.last_success, rn.id_renewal_fail_seconds, wd_con);
 		if (rv < 0) {
 			log_erros(sp, "activate_watchdog failed %d", rv);
 			acquire_result = SANLK_WD_ERROR;
@@ -688,20 +972,23 @@ static void *lockspace_thread(void *arg_in)
 	pthread_mutex_lock(&sp->mutex);
 	sp->lease_status.acquire_last_result = acquire_result;
 	sp->lease_status.acquire_last_attempt = delta_begin;
-	if (delta_result == SANLK_OK)
-		sp->lease_status.acquire_last_success = last_success;
+	if (rn.delta_result == SANLK_OK)
+		sp->lease_status.acquire_last_success = rn.last_success;
 	sp->lease_status.renewal_last_result = acquire_result;
 	sp->lease_status.renewal_last_attempt = delta_begin;
-	if (delta_result == SANLK_OK)
-		sp->lease_status.renewal_last_success = last_success;
+	if (rn.delta_result == SANLK_OK)
+		sp->lease_status.renewal_last_success = rn.last_success;
 	/* First renewal entry shows the acquire time with 0 latencies. */
-	save_renewal_history(sp, delta_result, last_success, 0, 0);
+	save_renewal_history(sp, rn.delta_result, rn.last_success, 0, 0);
 	pthread_mutex_unlock(&sp->mutex);
 
 	if (acquire_result < 0)
 		goto out;
 
-	sp->host_generation = leader.owner_generation;
+	sp->host_generation = rn.leader.owner_generation;
+
+	if (com.renewal_threads && !renewal_sched_add(&rn))
+		return NULL;
 
 	while (1) {
 		pthread_mutex_lock(&sp->mutex);
@@ -714,7 +1001,7 @@ static void *lockspace_thread(void *arg_in)
 		 * wait between each renewal
 		 */
 
-		if (monotime() - last_success < id_renewal_seconds) {
+		if (monotime() - rn.last_success < rn.id_renewal_seconds) {
 			sleep(1);
 			continue;
 		} else {
@@ -723,119 +1010,319 @@ static void *lockspace_thread(void *arg_in)
 			usleep(500000);
 		}
 
+		renew_lockspace(&rn);
+	}
 
-		/*
-		 * do a renewal, measuring length of time spent in renewal,
-		 * and the length of time between successful renewals
-		 */
+	/* watchdog unlink was done in main_loop when thread_stop was set, to
+	   get it done as quickly as possible in case the wd is about to fire. */
 
-		memset(bitmap, 0, sizeof(bitmap));
-		memset(&extra, 0, sizeof(extra));
-		create_bitmap_and_extra(sp, bitmap, &extra);
+	close_watchdog(sp);
+ out:
+	end_lockspace(&rn);
+	return NULL;
+}
 
-		delta_begin = monotime();
+/*
+ * Renewal scheduler (renewal_threads > 0)
+ *
+ * Rather than a thread per lockspace, a few renewal threads renew all the
+ * lockspaces.  Each lockspace's next renewal time (due_ms) is kept on a
+ * timer wheel with one slot per millisecond.  A slot holds the lockspaces
+ * due at any time congruent to it, so expiring a slot only takes the
+ * entries whose due_ms has been reached.  Due lockspaces move to renew_ready
+ * and are taken by the first free renewal thread, so up to renewal_threads
+ * renewals are in flight at once, and a slow disk in one lockspace doesn't
+ * delay the renewals of the others.  Each lockspace keeps its own task (aio
+ * context) so a timed out renewal read can still be reaped by its next
+ * renewal, and pets its own watchdog connection.
+ *
+ * renew_mutex protects the wheel, renew_ready and the queued, stopping
+ * and done fields.
+ * It is not held while a renewal is done, and is taken after sp->mutex
+ * and spaces_mutex.
+ */
+
+#define RENEW_WHEEL_SIZE 1024		/* slots, one per millisecond */
+#define RENEW_RETRY_MS 500		/* after a failed renewal */
+
+static struct list_head renew_wheel[RENEW_WHEEL_SIZE];
+static struct list_head renew_ready;
+static uint64_t renew_wheel_ms;		/* slots before this time are expired */
+static pthread_mutex_t renew_mutex;
+static pthread_cond_t renew_cond;
+static pthread_cond_t renew_done_cond;
+static pthread_t *renew_threads;
+static int renew_threads_count;
+static int renew_stop;
+
+/* renew_mutex held */
+
+static void renew_schedule(struct lockspace_renewal *rn, uint64_t due_ms)
+{
+	rn->due_ms = due_ms;
+	rn->queued = 1;
+
+	if (due_ms < renew_wheel_ms)
+		list_add_tail(&rn->list, &renew_ready);
+	else
+		list_add_tail(&rn->list, &renew_wheel[due_ms % RENEW_WHEEL_SIZE]);
+
+	pthread_cond_signal(&renew_cond);
+}
 
-		delta_result = delta_lease_renew(&task, sp, &sp->host_id_disk,
-						 sp->space_name, bitmap, &extra,
-						 delta_result, &read_result,
-						 log_renewal_level,
-						 &leader, &leader,
-						 &rd_ms, &wr_ms);
-		delta_length = monotime() - delta_begin;
+/* renew_mutex held, move the wheel entries due by now to renew_ready */
 
-		if (delta_result == SANLK_OK) {
-			renewal_interval = leader.timestamp - last_success;
-			last_success = leader.timestamp;
+static void renew_wheel_expire(uint64_t now_ms)
+{
+	struct lockspace_renewal *rn, *safe;
+	uint64_t ms, end_ms;
+
+	if (now_ms < renew_wheel_ms)
+		return;
+
+	/* after a full turn every slot has been visited */
+	end_ms = now_ms;
+	if (end_ms - renew_wheel_ms >= RENEW_WHEEL_SIZE)
+		end_ms = renew_wheel_ms + RENEW_WHEEL_SIZE - 1;
+
+	for (ms = renew_wheel_ms; ms <= end_ms; ms++) {
+		list_for_each_entry_safe(rn, safe, &renew_wheel[ms % RENEW_WHEEL_SIZE], list) {
+			if (rn->due_ms <= now_ms)
+				list_move_tail(&rn->list, &renew_ready);
 		}
+	}
 
+	renew_wheel_ms = now_ms + 1;
+}
 
-		/*
-		 * publish the results
-		 */
+/* renew_mutex held, the time of the next wheel entry in the coming turn */
 
-		pthread_mutex_lock(&sp->mutex);
-		sp->lease_status.renewal_last_result = delta_result;
-		sp->lease_status.renewal_last_attempt = delta_begin;
+static uint64_t renew_wheel_next(void)
+{
+	struct lockspace_renewal *rn;
+	uint64_t ms, next_ms = renew_wheel_ms + RENEW_WHEEL_SIZE;
 
-		if (delta_result == SANLK_OK)
-			sp->lease_status.renewal_last_success = last_success;
+	for (ms = renew_wheel_ms; ms < renew_wheel_ms + RENEW_WHEEL_SIZE; ms++) {
+		list_for_each_entry(rn, &renew_wheel[ms % RENEW_WHEEL_SIZE], list) {
+			if (rn->due_ms < next_ms)
+				next_ms = rn->due_ms;
+		}
+		if (next_ms < renew_wheel_ms + RENEW_WHEEL_SIZE)
+			break;
+	}
+	return next_ms;
+}
+
+static void *renewal_thread(void *arg GNUC_UNUSED)
+{
+	struct lockspace_renewal *rn;
+	struct space *sp;
+	struct timespec ts;
+	uint64_t begin_ms, next_ms;
+	int stop;
+
+	pthread_mutex_lock(&renew_mutex);
 
-		if (delta_result != SANLK_OK && !sp->lease_status.corrupt_result)
-			sp->lease_status.corrupt_result = corrupt_result(delta_result);
+	while (!renew_stop) {
+		renew_wheel_expire(monotime_ms());
 
-		if (read_result == SANLK_OK && task.iobuf) {
-			/* NB. be careful with how this iobuf escapes */
-			memcpy(sp->lease_status.renewal_read_buf, task.iobuf, sp->align_size);
-			sp->lease_status.renewal_read_count++;
+		if (list_empty(&renew_ready)) {
+			next_ms = renew_wheel_next();
+			ts.tv_sec = next_ms / 1000;
+			ts.tv_nsec = (next_ms % 1000) * 1000000;
+			pthread_cond_timedwait(&renew_cond, &renew_mutex, &ts);
+			continue;
 		}
 
-		/*
-		 * pet the watchdog
-		 * (don't update on thread_stop because it's probably unlinked)
-		 */
+		rn = list_first_entry(&renew_ready, struct lockspace_renewal, list);
+		list_del(&rn->list);
+		rn->queued = 0;
+
+		/* another thread can take the next one while we do this */
+		if (!list_empty(&renew_ready))
+			pthread_cond_signal(&renew_cond);
+		pthread_mutex_unlock(&renew_mutex);
 
-		if (delta_result == SANLK_OK && !sp->thread_stop)
-			update_watchdog(sp, last_success, id_renewal_fail_seconds);
+		sp = rn->sp;
 
-		save_renewal_history(sp, delta_result, last_success, rd_ms, wr_ms);
+		pthread_mutex_lock(&sp->mutex);
+		stop = sp->thread_stop;
 		pthread_mutex_unlock(&sp->mutex);
 
+		if (stop) {
+			/* watchdog unlink was done in main_loop when thread_stop was set */
+			close_watchdog(sp);
+			end_lockspace(rn);
 
-		/*
-		 * log the results
-		 */
+			pthread_mutex_lock(&renew_mutex);
+			rn->done = 1;
+			pthread_cond_broadcast(&renew_done_cond);
+			continue;
+		}
 
-		if (delta_result != SANLK_OK) {
-			log_erros(sp, "renewal error %d delta_length %d last_success %llu",
-				  delta_result, delta_length, (unsigned long long)last_success);
-		} else if (delta_length > id_renewal_seconds) {
-			log_erros(sp, "renewed %llu delta_length %d too long",
-				  (unsigned long long)last_success, delta_length);
-		} else {
-			if (com.debug_renew) {
-				log_space(sp, "renewed %llu delta_length %d interval %d",
-					  (unsigned long long)last_success, delta_length, renewal_interval);
-			}
+		begin_ms = monotime_ms();
+
+		renew_lockspace(rn);
+
+		pthread_mutex_lock(&renew_mutex);
+		if (rn->stopping)
+			renew_schedule(rn, 0);
+		else if (rn->delta_result == SANLK_OK)
+			renew_schedule(rn, begin_ms + rn->id_renewal_seconds * 1000);
+		else
+			renew_schedule(rn, monotime_ms() + RENEW_RETRY_MS);
+	}
+
+	pthread_mutex_unlock(&renew_mutex);
+	return NULL;
+}
+
+/* called by lockspace_thread after acquire, returns 0 if rn is taken over */
+
+static int renewal_sched_add(struct lockspace_renewal *rn_in)
+{
+	struct lockspace_renewal *rn;
+	struct space *sp = rn_in->sp;
+
+	rn = malloc(sizeof(struct lockspace_renewal));
+	if (!rn) {
+		log_erros(sp, "renewal_sched_add no mem, using lockspace thread");
+		return -ENOMEM;
+	}
+	memcpy(rn, rn_in, sizeof(struct lockspace_renewal));
+
+	pthread_mutex_lock(&sp->mutex);
+	sp->renewal = rn;
+	pthread_mutex_unlock(&sp->mutex);
+
+	pthread_mutex_lock(&renew_mutex);
+	renew_schedule(rn, (rn->last_success + rn->id_renewal_seconds) * 1000);
+	pthread_mutex_unlock(&renew_mutex);
+
+	log_space(sp, "renewal scheduled");
+	return 0;
+}
+
+/*
+ * After thread_stop is set, have the scheduler do end_lockspace right away
+ * rather than at the next renewal time.  Returns 0 once it's done.
+ */
+
+static int renewal_sched_stop(struct lockspace_renewal *rn, int wait)
+{
+	int rv;
+
+	pthread_mutex_lock(&renew_mutex);
+	rn->stopping = 1;
+	if (rn->queued && !rn->done) {
+		list_del(&rn->list);
+		renew_schedule(rn, 0);
+	}
+
+	while (wait && !rn->done)
+		pthread_cond_wait(&renew_done_cond, &renew_mutex);
+
+	rv = rn->done ? 0 : -EBUSY;
+	pthread_mutex_unlock(&renew_mutex);
+	return rv;
+}
+
+int setup_renewal_sched(void)
+{
+	pthread_condattr_t attr;
+	int i, rv;
+
+	if (!com.renewal_threads)
+		return 0;
+
+	for (i = 0; i < RENEW_WHEEL_SIZE; i++)
+		INIT_LIST_HEAD(&renew_wheel[i]);
+	INIT_LIST_HEAD(&renew_ready);
+	renew_wheel_ms = monotime_ms();
+
+	pthread_mutex_init(&renew_mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&renew_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&renew_done_cond, NULL);
+
+	renew_threads = malloc(com.renewal_threads * sizeof(pthread_t));
+	if (!renew_threads) {
+		com.renewal_threads = 0;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < com.renewal_threads; i++) {
+		rv = pthread_create(&renew_threads[i], NULL, renewal_thread, NULL);
+		if (rv) {
+			log_error("renewal_thread %d create error %d", i, rv);
+			break;
 		}
+		renew_threads_count++;
 	}
 
-	/* watchdog unlink was done in main_loop when thread_stop was set, to
-	   get it done as quickly as possible in case the wd is about to fire. */
+	if (!renew_threads_count) {
+		/* lockspaces will use their own threads */
+		com.renewal_threads = 0;
+		return -1;
+	}
 
-	close_watchdog(sp);
- out:
-	if (delta_result == SANLK_OK)
-		delta_lease_release(&task, sp, &sp->host_id_disk,
-				    sp->space_name, &leader, &leader);
+	log_debug("renewal scheduler threads %d", renew_threads_count);
+	return 0;
+}
 
-	if (opened)
-		close(sp->host_id_disk.fd);
+void close_renewal_sched(void)
+{
+	int i;
 
-	/*
-	 * TODO: are there cases where struct resources for this lockspace
-	 * still exist on resource_held/resource_add/resource_rem?  Is that ok?
-	 * Should we purge all of them here?  When a lockspace is removed and
-	 * pids are killed, their resources go through release_token_async,
-	 * which will see token->space_dead, and those resources are freed
-	 * directly.  resources that may have already been on resources_rem and
-	 * the resource_thread may be in the middle of releasing one of them.
-	 * For any further async releases, resource_thread will see that the
-	 * lockspace is going away and will just free the resource.
-	 */
+	if (!renew_threads_count)
+		return;
 
-	purge_resource_orphans(sp->space_name);
-	purge_resource_free(sp->space_name);
+	pthread_mutex_lock(&renew_mutex);
+	renew_stop = 1;
+	pthread_cond_broadcast(&renew_cond);
+	pthread_mutex_unlock(&renew_mutex);
 
-	close_event_fds(sp);
+	for (i = 0; i < renew_threads_count; i++)
+		pthread_join(renew_threads[i], NULL);
+}
 
-	close_task_aio(&task);
-	return NULL;
+/*
+ * Wait for lockspace_thread to exit (or check if it has with wait 0),
+ * and for the renewal scheduler to end the lockspace if it took it over.
+ */
+
+static int join_lockspace_thread(struct space *sp, int wait)
+{
+	int rv;
+
+	if (!sp->thread_joined) {
+		if (wait)
+			rv = pthread_join(sp->thread, NULL);
+		else
+			rv = pthread_tryjoin_np(sp->thread, NULL);
+		if (rv)
+			return rv;
+		sp->thread_joined = 1;
+	}
+
+	/* sp->renewal is set before lockspace_thread exits */
+	if (sp->renewal)
+		return renewal_sched_stop(sp->renewal, wait);
+	return 0;
 }
 
 static void free_sp(struct space *sp)
 {
 	if (sp->lease_status.renewal_read_buf)
 		free(sp->lease_status.renewal_read_buf);
+	if (sp->lease_status.check_buf)
+		free(sp->lease_status.check_buf);
+	if (sp->host_status)
+		free(sp->host_status);
+	if (sp->renewal)
+		free(sp->renewal);
 	free(sp);
 }
 
@@ -982,18 +1469,9 @@ int add_lockspace_start(struct sanlk_lockspace *ls, uint32_t io_timeout, struct
 	return rv;
 }
 
-int add_lockspace_wait(struct space *sp)
+static int add_lockspace_finish(struct space *sp, int result)
 {
-	int rv, result;
-
-	while (1) {
-		pthread_mutex_lock(&sp->mutex);
-		result = sp->lease_status.acquire_last_result;
-		pthread_mutex_unlock(&sp->mutex);
-		if (result)
-			break;
-		sleep(1);
-	}
+	int rv;
 
 	if (result != SANLK_OK) {
 		/* the thread exits right away if acquire fails */
@@ -1025,7 +1503,7 @@ int add_lockspace_wait(struct space *sp)
 		sp->thread_stop = 1;
 		deactivate_watchdog(sp);
 		pthread_mutex_unlock(&sp->mutex);
-		pthread_join(sp->thread, NULL);
+		join_lockspace_thread(sp, 1);
 		rv = -1;
 		log_space(sp, "add_lockspace undo complete");
 		goto fail_del;
@@ -1044,6 +1522,36 @@ int add_lockspace_wait(struct space *sp)
 	return rv;
 }
 
+/*
+ * Returns 0 while the lockspace thread is still acquiring the host_id.
+ * Once it's done, completes or undoes the add, sets the add result, and
+ * returns 1; sp may then be freed.
+ */
+
+int add_lockspace_check(struct space *sp, int *add_result)
+{
+	int result;
+
+	pthread_mutex_lock(&sp->mutex);
+	result = sp->lease_status.acquire_last_result;
+	pthread_mutex_unlock(&sp->mutex);
+	if (!result)
+		return 0;
+
+	*add_result = add_lockspace_finish(sp, result);
+	return 1;
+}
+
+int add_lockspace_wait(struct space *sp)
+{
+	int result;
+
+	while (!add_lockspace_check(sp, &result))
+		sleep(1);
+
+	return result;
+}
+
 int inq_lockspace(struct sanlk_lockspace *ls)
 {
 	int rv;
@@ -1155,6 +1663,63 @@ int rem_lockspace_wait(struct sanlk_lockspace *ls, unsigned int space_id)
 	return 0;
 }
 
+/* only lockspaces that have been added, the caller frees sms_out */
+
+int get_space_metrics(struct space_metrics **sms_out, int *count)
+{
+	struct space_metrics *sms = NULL, *sm;
+	struct renewal_history *hi;
+	struct space *sp;
+	int sp_count = 0;
+
+	*sms_out = NULL;
+	*count = 0;
+
+	pthread_mutex_lock(&spaces_mutex);
+	list_for_each_entry(sp, &spaces, list)
+		sp_count++;
+
+	if (!sp_count)
+		goto out;
+
+	sms = calloc(sp_count, sizeof(struct space_metrics));
+	if (!sms) {
+		pthread_mutex_unlock(&spaces_mutex);
+		return -ENOMEM;
+	}
+
+	sm = sms;
+
+	list_for_each_entry(sp, &spaces, list) {
+		memcpy(sm->space_name, sp->space_name, NAME_ID_SIZE);
+		sm->read_ms = -1;
+		sm->write_ms = -1;
+
+		pthread_mutex_lock(&sp->mutex);
+		sm->renewal_last_result = sp->lease_status.renewal_last_result;
+		sm->renewal_last_success = sp->lease_status.renewal_last_success;
+		if (sp->renewal_history_size && sp->renewal_history) {
+			hi = &sp->renewal_history[sp->renewal_history_prev];
+			if (hi->timestamp) {
+				sm->read_ms = hi->read_ms;
+				sm->write_ms = hi->write_ms;
+			}
+		}
+		memcpy(&sm->lat, &sp->lat, sizeof(struct lat_stats));
+		sm->ballot_aborts = sp->ballot_aborts;
+		sm->sh_retries = sp->sh_retries;
+		pthread_mutex_unlock(&sp->mutex);
+
+		sm++;
+	}
+ out:
+	pthread_mutex_unlock(&spaces_mutex);
+
+	*sms_out = sms;
+	*count = sp_count;
+	return 0;
+}
+
 int get_lockspaces(char *buf, int *len, int *count, int maxlen)
 {
 	struct sanlk_lockspace *ls;
@@ -1343,7 +1908,7 @@ int get_hosts(struct sanlk_lockspace *ls, char *buf, int *len, int *count, int m
 		goto out;
 	}
 
-	for (i = 0; i < DEFAULT_MAX_HOSTS; i++) {
+	for (i = 0; i < sp->max_hosts; i++) {
 		hs = &sp->host_status[i];
 
 		if (ls->host_id && (ls->host_id != (i + 1)))
@@ -1377,6 +1942,97 @@ int get_hosts(struct sanlk_lockspace *ls, char *buf, int *len, int *count, int m
 	return rv;
 }
 
+/*
+ * Copy the lockspaces, the hosts seen in each, and the renewal history of
+ * each into the sections of the shared memory snapshot.
+ */
+
+void shm_state_lockspaces(struct shm_build *lsb, struct shm_build *hostb,
+			  struct shm_build *renb)
+{
+	struct list_head *heads[] = {&spaces, &spaces_rem, &spaces_add};
+	struct sanlk_shm_lockspace *sls;
+	struct sanlk_shm_renewal *sr;
+	struct renewal_history *hi;
+	struct sanlk_host *host;
+	struct host_status *hs;
+	struct space *sp;
+	int i, j, n;
+
+	pthread_mutex_lock(&spaces_mutex);
+	for (i = 0; i < 3; i++) {
+		list_for_each_entry(sp, heads[i], list) {
+			sls = shm_build_add(lsb, sizeof(struct sanlk_shm_lockspace));
+			if (!sls)
+				goto out;
+
+			memcpy(sls->ls.name, sp->space_name, NAME_ID_SIZE);
+			memcpy(&sls->ls.host_id_disk, &sp->host_id_disk, sizeof(struct sync_disk));
+			sls->ls.host_id_disk.pad1 = 0;
+			sls->ls.host_id_disk.pad2 = 0;
+			sls->ls.host_id = sp->host_id;
+
+			if (i == 1)
+				sls->ls.flags |= SANLK_LSF_REM;
+			else if (i == 2)
+				sls->ls.flags |= SANLK_LSF_ADD;
+
+			sls->host_generation = sp->host_generation;
+			sls->io_timeout = sp->io_timeout;
+			sls->space_dead = sp->space_dead;
+			sls->host_first = hostb->count;
+			sls->renewal_first = renb->count;
+
+			pthread_mutex_lock(&sp->mutex);
+			sls->renewal_last_result = sp->lease_status.renewal_last_result;
+			sls->renewal_last_attempt = sp->lease_status.renewal_last_attempt;
+			sls->renewal_last_success = sp->lease_status.renewal_last_success;
+
+			/* see get_hosts */
+			if (sp->host_status && sp->host_status[0].last_check) {
+				for (j = 0; j < sp->max_hosts; j++) {
+					hs = &sp->host_status[j];
+					if (!hs->timestamp)
+						continue;
+
+					host = shm_build_add(hostb, sizeof(struct sanlk_host));
+					if (!host)
+						break;
+
+					host->host_id = j + 1;
+					host->generation = hs->owner_generation;
+					host->timestamp = hs->timestamp;
+					host->io_timeout = hs->io_timeout;
+					host->flags = get_host_flag(sp, hs);
+					sls->host_count++;
+				}
+			}
+
+			/* oldest first, see cmd_renewal */
+			for (n = 0; sp->renewal_history && n < sp->renewal_history_size; n++) {
+				j = (sp->renewal_history_next + n) % sp->renewal_history_size;
+				hi = &sp->renewal_history[j];
+				if (!hi->timestamp)
+					continue;
+
+				sr = shm_build_add(renb, sizeof(struct sanlk_shm_renewal));
+				if (!sr)
+					break;
+
+				sr->timestamp = hi->timestamp;
+				sr->read_ms = hi->read_ms;
+				sr->write_ms = hi->write_ms;
+				sr->next_timeouts = hi->next_timeouts;
+				sr->next_errors = hi->next_errors;
+				sls->renewal_count++;
+			}
+			pthread_mutex_unlock(&sp->mutex);
+		}
+	}
+ out:
+	pthread_mutex_unlock(&spaces_mutex);
+}
+
 int lockspace_set_config(struct sanlk_lockspace *ls, GNUC_UNUSED uint32_t flags, uint32_t cmd)
 {
 	struct space *sp;
@@ -1557,6 +2213,12 @@ int lockspace_set_event(struct sanlk_lockspace *ls, struct sanlk_host_event *he,
 	}
 	pthread_mutex_unlock(&spaces_mutex);
 
+	if (he->host_id > sp->max_hosts) {
+		log_erros(sp, "set_event host_id %llu beyond max_hosts %d",
+			  (unsigned long long)he->host_id, sp->max_hosts);
+		return -EINVAL;
+	}
+
 	if (!he->generation && (flags & SANLK_SETEV_CUR_GENERATION)) {
 		hs = &(sp->host_status[he->host_id-1]);
 		he->generation = hs->owner_generation;
@@ -1604,7 +2266,7 @@ set:
 	memcpy(&sp->host_event, he, sizeof(struct sanlk_host_event));
 
 	if (flags & SANLK_SETEV_ALL_HOSTS) {
-		for (i = 0; i < DEFAULT_MAX_HOSTS; i++)
+		for (i = 0; i < sp->max_hosts; i++)
 			sp->host_status[i].set_bit_time = now;
 	}
 out:
@@ -1687,10 +2349,7 @@ static int stop_lockspace_thread(struct space *sp, int wait)
 		return -EINVAL;
 	}
 
-	if (wait)
-		rv = pthread_join(sp->thread, NULL);
-	else
-		rv = pthread_tryjoin_np(sp->thread, NULL);
+	rv = join_lockspace_thread(sp, wait);
 
 	return rv;
 }
@@ -9,7 +9,7 @@
 #ifndef __LOCKSPACE_H__
 #define __LOCKSPACE__H__
 
-/* See resource.h for lock ordering between spaces_mutex and resource_mutex. */
+/* See resource.h for lock ordering between spaces_mutex and the resource mutexes. */
 
 /* no locks */
 struct space *find_lockspace(const char *name);
@@ -20,6 +20,16 @@ int _lockspace_info(const char *space_name, struct space_info *spi);
 /* locks spaces_mutex */
 int lockspace_info(const char *space_name, struct space_info *spi);
 
+/* locks spaces_mutex, locks sp */
+void lockspace_add_lat(const char *space_name, struct lat_stats *lat);
+
+/* locks spaces_mutex, locks sp */
+void lockspace_add_retries(const char *space_name, uint32_t ballot_aborts,
+			   uint32_t sh_retries);
+
+/* locks spaces_mutex, locks sp */
+int lockspace_lat(const char *space_name, struct lat_stats *lat);
+
 /* locks spaces_mutex */
 int lockspace_disk(char *space_name, struct sync_disk *disk, int *sector_size);
 
@@ -36,14 +46,17 @@ int test_id_bit(int host_id, char *bitmap);
 void set_id_bit(int host_id, char *bitmap, char *c);
 
 /* locks sp */
-int check_our_lease(struct space *sp, int *check_all, char *check_buf);
+int check_our_lease(struct space *sp, int *check_all, char **check_buf);
 
-/* locks resource_mutex (add_host_event), locks resource_mutex (set_resource_examine) */
+/* locks host_event_mutex (add_host_event), locks shard mutexes (set_resource_examine) */
 void check_other_leases(struct space *sp, char *buf);
 
 /* locks spaces_mutex */
 int add_lockspace_start(struct sanlk_lockspace *ls, uint32_t io_timeout, struct space **sp_out);
 
+/* locks sp, locks spaces_mutex */
+int add_lockspace_check(struct space *sp, int *add_result);
+
 /* locks sp, locks spaces_mutex */
 int add_lockspace_wait(struct space *sp);
 
@@ -62,9 +75,31 @@ void free_lockspaces(int wait);
 /* locks spaces_mutex */
 int get_lockspaces(char *buf, int *len, int *count, int maxlen);
 
+/* values of a lockspace reported by "sanlock client metrics" */
+struct space_metrics {
+	char space_name[NAME_ID_SIZE+1];
+	int renewal_last_result;
+	uint64_t renewal_last_success;
+	int read_ms;  /* last renewal */
+	int write_ms; /* last renewal */
+	struct lat_stats lat;
+	uint64_t ballot_aborts;
+	uint64_t sh_retries;
+	int held; /* filled by resource_held_counts */
+};
+
+/* locks spaces_mutex, locks sp */
+int get_space_metrics(struct space_metrics **sms_out, int *count);
+
 /* locks spaces_mutex */
 int get_hosts(struct sanlk_lockspace *ls, char *buf, int *len, int *count, int maxlen);
 
+struct shm_build;
+
+/* locks spaces_mutex, locks sp */
+void shm_state_lockspaces(struct shm_build *lsb, struct shm_build *hostb,
+			  struct shm_build *renb);
+
 /* locks spaces_mutex, locks sp */
 int lockspace_set_event(struct sanlk_lockspace *ls, struct sanlk_host_event *he, uint32_t flags);
 
@@ -80,4 +115,8 @@ int send_event_callbacks(uint32_t space_id, uint64_t from_host_id, uint64_t from
 /* locks spaces_mutex, locks sp */
 int lockspace_set_config(struct sanlk_lockspace *ls, uint32_t flags, uint32_t cmd);
 
+int setup_renewal_sched(void);
+
+void close_renewal_sched(void);
+
 #endif
@@ -19,6 +19,7 @@
 #include <time.h>
 #include <syslog.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/syscall.h>
@@ -29,13 +30,18 @@
 #include "log.h"
 
 #define LOG_STR_LEN 512
-static char log_str[LOG_STR_LEN];
 
 static pthread_t thread_handle;
 
+/*
+ * log_mutex is only taken by the consumer side: log_thread_fn merging the
+ * per-thread rings, copy_log_dump, and a producer waking the log thread.
+ * Threads calling log_level do not take it for ordinary messages.
+ */
 static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
 
+static char log_str[LOG_STR_LEN];
 static char log_dump[LOG_DUMP_SIZE];
 static unsigned int log_point;
 static unsigned int log_wrap;
@@ -51,9 +57,71 @@ static unsigned int log_num_ents = LOG_DEFAULT_ENTRIES;
 static unsigned int log_head_ent; /* add at head */
 static unsigned int log_tail_ent; /* remove from tail */
 static unsigned int log_dropped;
+static uint64_t log_dropped_total;
 static unsigned int log_pending_ents;
 static unsigned int log_thread_done;
 
+/*
+ * Each thread that logs gets its own single-producer/single-consumer ring
+ * of raw messages: the owning thread adds at head, and the consumer (with
+ * log_mutex held) removes from tail.  The time prefix is formatted by the
+ * consumer from the raw timestamps.  Every message takes a global sequence
+ * number, and the consumer merges the rings in sequence order so the dump
+ * and logfile keep the order in which messages were logged.  A sequence
+ * number is only taken once the ring has room, so there are no gaps.
+ *
+ * A ring is a byte buffer holding each message at its own length, and
+ * rings are reused after their threads exit.  Once LOG_RINGS_MAX rings
+ * exist, further threads share one ring, adding to it under
+ * shared_ring_mutex, so the rings take at most about 1MB.
+ */
+
+#define LOG_RING_SIZE 8192 /* bytes, power of 2 */
+#define LOG_RING_WAKE (LOG_RING_SIZE / 2)
+#define LOG_RINGS_MAX 128
+#define LOG_MERGE_MS 100
+#define LOG_MERGE_TRIES 16
+
+#define LOG_RING_SKIP -1 /* level: the rest of the buffer is unused */
+
+struct ring_entry {
+	uint64_t seq;
+	uint64_t mono;
+	struct timeval tv;
+	int level;
+	int len; /* of str, without the \0 */
+	pid_t tid;
+	char str[];
+};
+
+/* an entry is followed by str and \0, and the next entry is aligned */
+#define RING_ENTRY_SIZE(len) \
+	((sizeof(struct ring_entry) + (len) + 1 + 7) & ~(unsigned int)7)
+
+struct log_ring {
+	struct list_head list;
+	unsigned int head; /* bytes, set by producer */
+	unsigned int tail; /* bytes, set by consumer */
+	unsigned int dropped;
+	int dead;
+	char buf[LOG_RING_SIZE] __attribute__((aligned(8)));
+};
+
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct list_head rings = LIST_HEAD_INIT(rings);
+static struct list_head rings_free = LIST_HEAD_INIT(rings_free);
+static int rings_count;
+static struct log_ring shared_ring;
+static pthread_mutex_t shared_ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int shared_ring_used;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static __thread struct log_ring *thread_ring;
+static __thread pid_t thread_tid;
+static uint64_t log_seq;      /* next sequence number to hand out */
+static uint64_t log_next_seq; /* next sequence number to merge */
+static unsigned int log_no_ring;
+
 static char logfile_path[PATH_MAX];
 static FILE *logfile_fp;
 
@@ -96,6 +164,7 @@ static void _log_save_ent(int level, int len)
 
 	if (log_pending_ents == log_num_ents) {
 		log_dropped++;
+		log_dropped_total++;
 		return;
 	}
 
@@ -108,61 +177,120 @@ static void _log_save_ent(int level, int len)
 }
 
 /*
- * This log function:
- * 1. formats the log message in the log_str buffer
- * 2. copies log_str into the log_dump circular buffer
- * 3. copies log_str into the log_ents circular array to be written to
- *    logfile and/or syslog (so callers don't block writing messages to files)
+ * The ring of an exiting thread is left on the list until the consumer
+ * has merged what remains in it, then it is moved to rings_free for reuse.
  */
 
-void log_level(uint32_t space_id, uint32_t res_id, char *name_in, int level, const char *fmt, ...)
+static void ring_exit(void *arg)
 {
-	va_list ap;
-	char name[NAME_ID_SIZE + 1];
-	int ret, pos = 0;
-	int len = LOG_STR_LEN - 2; /* leave room for \n\0 */
-	struct timeval cur_time;
-	struct tm time_info;
-	pid_t tid;
+	struct log_ring *ring = arg;
 
-	memset(name, 0, sizeof(name));
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
 
-	if (space_id && !res_id)
-		snprintf(name, NAME_ID_SIZE, "s%u ", space_id);
-	else if (!space_id && res_id)
-		snprintf(name, NAME_ID_SIZE, "r%u ", res_id);
-	else if (space_id && res_id)
-		snprintf(name, NAME_ID_SIZE, "s%u:r%u ", space_id, res_id);
-	else if (name_in)
-		snprintf(name, NAME_ID_SIZE, "%.8s ", name_in);
+static void ring_key_create(void)
+{
+	pthread_key_create(&ring_key, ring_exit);
+}
 
-	pthread_mutex_lock(&log_mutex);
+static struct log_ring *get_thread_ring(void)
+{
+	struct log_ring *ring = NULL;
+
+	if (thread_ring)
+		return thread_ring;
 
-	gettimeofday(&cur_time, NULL);
+	pthread_once(&ring_key_once, ring_key_create);
 
-    if (log_logfile_use_utc)
-	    gmtime_r(&cur_time.tv_sec, &time_info);
-    else
-	    localtime_r(&cur_time.tv_sec, &time_info);
+	thread_tid = syscall(SYS_gettid);
+
+	pthread_mutex_lock(&rings_mutex);
+	if (!list_empty(&rings_free)) {
+		ring = list_first_entry(&rings_free, struct log_ring, list);
+		list_del(&ring->list);
+	} else if (rings_count < LOG_RINGS_MAX) {
+		ring = malloc(sizeof(struct log_ring));
+		if (ring)
+			rings_count++;
+	}
+	if (ring) {
+		ring->head = 0;
+		ring->tail = 0;
+		ring->dropped = 0;
+		ring->dead = 0;
+		list_add_tail(&ring->list, &rings);
+	} else {
+		/* never freed, so it isn't tied to this thread's exit */
+		if (!shared_ring_used) {
+			shared_ring_used = 1;
+			list_add_tail(&shared_ring.list, &rings);
+		}
+		thread_ring = &shared_ring;
+		pthread_mutex_unlock(&rings_mutex);
+		return thread_ring;
+	}
+	pthread_mutex_unlock(&rings_mutex);
+
+	pthread_setspecific(ring_key, ring);
+	thread_ring = ring;
+	return ring;
+}
+
+/*
+ * The entry at the tail of a ring, or NULL if it's empty.  Space at the
+ * end of the buffer that an entry didn't fit in is passed over.  Called
+ * by the consumer.
+ */
+
+static struct ring_entry *ring_peek(struct log_ring *ring)
+{
+	struct ring_entry *re;
+	unsigned int off;
+
+	while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail) {
+		off = ring->tail % LOG_RING_SIZE;
+		re = (struct ring_entry *)(ring->buf + off);
+
+		if (LOG_RING_SIZE - off >= sizeof(struct ring_entry) &&
+		    re->level != LOG_RING_SKIP)
+			return re;
+
+		__atomic_store_n(&ring->tail, ring->tail + LOG_RING_SIZE - off,
+				 __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/*
+ * Format the time prefix from the raw timestamps and copy the message
+ * into log_dump, and into log_ents if it will be written to the logfile
+ * or syslog.  Called with log_mutex held.
+ */
+
+static void merge_entry(struct ring_entry *re)
+{
+	struct tm time_info;
+	int ret, pos = 0;
+	int len = LOG_STR_LEN - 2; /* leave room for \n\0 */
+
+	if (log_logfile_use_utc)
+		gmtime_r(&re->tv.tv_sec, &time_info);
+	else
+		localtime_r(&re->tv.tv_sec, &time_info);
 
 	ret = strftime(log_str + pos, len - pos,
 		       "%Y-%m-%d %H:%M:%S ", &time_info);
 	pos += ret;
 
-	tid = syscall(SYS_gettid);
-
-	ret = snprintf(log_str + pos, len - pos, "%llu [%u]: %s",
-		       (unsigned long long) monotime(), tid, name);
+	ret = snprintf(log_str + pos, len - pos, "%llu [%u]: ",
+		       (unsigned long long)re->mono, re->tid);
 	pos += ret;
 
-	va_start(ap, fmt);
-	ret = vsnprintf(log_str + pos, len - pos, fmt, ap);
-	va_end(ap);
-
-	if (ret >= len - pos)
-		pos = len - 1;
-	else
-		pos += ret;
+	ret = re->len;
+	if (ret > len - pos)
+		ret = len - pos;
+	memcpy(log_str + pos, re->str, ret);
+	pos += ret;
 
 	log_str[pos++] = '\n';
 	log_str[pos++] = '\0';
@@ -172,23 +300,242 @@ void log_level(uint32_t space_id, uint32_t res_id, char *name_in, int level, con
 	 * sent over unix socket
 	 */
 
-	_log_save_dump(level, pos - 1);
+	_log_save_dump(re->level, pos - 1);
 
 	/*
 	 * save some messages in circular array "log_ents" that a thread
 	 * writes to logfile/syslog
 	 */
 
-	if (level <= log_logfile_priority || level <= log_syslog_priority)
-		_log_save_ent(level, pos);
+	if (re->level <= log_logfile_priority || re->level <= log_syslog_priority)
+		_log_save_ent(re->level, pos);
+}
 
-	if (level <= log_stderr_priority)
-		fprintf(stderr, "%s", log_str);
+/*
+ * Move messages from the per-thread rings into log_dump and log_ents in
+ * sequence order.  A thread may have taken a sequence number and not yet
+ * published the entry; merging stops there and picks up again next time,
+ * so later messages from other threads are never placed ahead of it.
+ * Called with log_mutex held.
+ */
+
+static void merge_rings(void)
+{
+	struct log_ring *ring, *safe, *next;
+	struct ring_entry *re, *next_re;
+	unsigned int dropped;
+
+	pthread_mutex_lock(&rings_mutex);
+
+	while (1) {
+		next = NULL;
+		next_re = NULL;
+
+		list_for_each_entry(ring, &rings, list) {
+			re = ring_peek(ring);
+			if (re && re->seq == log_next_seq) {
+				next = ring;
+				next_re = re;
+				break;
+			}
+		}
+
+		if (!next)
+			break;
+
+		merge_entry(next_re);
+		__atomic_store_n(&next->tail, next->tail + RING_ENTRY_SIZE(next_re->len),
+				 __ATOMIC_RELEASE);
+		log_next_seq++;
+	}
+
+	list_for_each_entry_safe(ring, safe, &rings, list) {
+		dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+		if (dropped) {
+			log_dropped += dropped;
+			log_dropped_total += dropped;
+		}
+
+		if (ring == &shared_ring)
+			continue;
+		if (!__atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE))
+			continue;
+		if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail)
+			continue;
+
+		list_move(&ring->list, &rings_free);
+	}
 
+	dropped = __atomic_exchange_n(&log_no_ring, 0, __ATOMIC_RELAXED);
+	if (dropped) {
+		log_dropped += dropped;
+		log_dropped_total += dropped;
+	}
+
+	pthread_mutex_unlock(&rings_mutex);
+}
+
+static void wake_log_thread(void)
+{
+	pthread_mutex_lock(&log_mutex);
 	pthread_cond_signal(&log_cond);
 	pthread_mutex_unlock(&log_mutex);
 }
 
+static void log_stderr(struct timeval *tv, uint64_t mono, const char *str)
+{
+	struct tm time_info;
+	char tstr[32];
+
+	if (log_logfile_use_utc)
+		gmtime_r(&tv->tv_sec, &time_info);
+	else
+		localtime_r(&tv->tv_sec, &time_info);
+
+	strftime(tstr, sizeof(tstr), "%Y-%m-%d %H:%M:%S", &time_info);
+
+	fprintf(stderr, "%s %llu [%u]: %s\n", tstr,
+		(unsigned long long)mono, thread_tid, str);
+}
+
+/*
+ * This log function:
+ * 1. formats the log message into the calling thread's log ring along with
+ *    the raw timestamps, without taking any lock (except on the shared ring)
+ * 2. the log thread merges the rings of all threads in sequence order,
+ *    adding the time prefix and copying each message into the log_dump
+ *    circular buffer
+ * 3. and into the log_ents circular array to be written to logfile and/or
+ *    syslog (so callers don't block writing messages to files)
+ *
+ * If a thread's ring is full, the thread merges the rings itself; if that
+ * doesn't make room the message is dropped and counted, and the count is
+ * reported like messages dropped from log_ents.
+ */
+
+void log_level(uint32_t space_id, uint32_t res_id, char *name_in, int level, const char *fmt, ...)
+{
+	va_list ap;
+	char str[LOG_STR_LEN];
+	struct log_ring *ring;
+	struct ring_entry *re;
+	struct timeval tv;
+	uint64_t mono;
+	unsigned int head, off, used, skip, size;
+	int ret, pos = 0, tries = 0, shared;
+	int len = LOG_STR_LEN - 2; /* leave room for \n\0 */
+
+	ring = get_thread_ring();
+	if (!ring) {
+		__atomic_add_fetch(&log_no_ring, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	if (space_id && !res_id)
+		ret = snprintf(str, NAME_ID_SIZE, "s%u ", space_id);
+	else if (!space_id && res_id)
+		ret = snprintf(str, NAME_ID_SIZE, "r%u ", res_id);
+	else if (space_id && res_id)
+		ret = snprintf(str, NAME_ID_SIZE, "s%u:r%u ", space_id, res_id);
+	else if (name_in)
+		ret = snprintf(str, NAME_ID_SIZE, "%.8s ", name_in);
+	else
+		ret = 0;
+
+	if (ret >= NAME_ID_SIZE)
+		ret = NAME_ID_SIZE - 1;
+	pos += ret;
+
+	va_start(ap, fmt);
+	ret = vsnprintf(str + pos, len - pos, fmt, ap);
+	va_end(ap);
+
+	if (ret >= len - pos)
+		pos = len - 1;
+	else
+		pos += ret;
+
+	str[pos] = '\0';
+
+	/* an entry that doesn't fit at the end of the buffer goes at the start */
+	size = RING_ENTRY_SIZE(pos);
+
+	shared = (ring == &shared_ring);
+	if (shared)
+		pthread_mutex_lock(&shared_ring_mutex);
+
+	/* only the producer advances head, the consumer can only make room */
+	head = ring->head;
+	off = head % LOG_RING_SIZE;
+	skip = (LOG_RING_SIZE - off < size) ? LOG_RING_SIZE - off : 0;
+
+	used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	while (used + skip + size > LOG_RING_SIZE) {
+		/*
+		 * The log thread has fallen behind, so do the merge here
+		 * rather than lose the message.  It's only dropped if the
+		 * merge stays held up by another thread's unpublished entry.
+		 */
+		if (tries++ == LOG_MERGE_TRIES) {
+			__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+			if (shared)
+				pthread_mutex_unlock(&shared_ring_mutex);
+			return;
+		}
+		if (tries > 1)
+			sched_yield();
+
+		pthread_mutex_lock(&log_mutex);
+		merge_rings();
+		pthread_cond_signal(&log_cond);
+		pthread_mutex_unlock(&log_mutex);
+
+		used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	}
+
+	if (skip) {
+		if (skip >= sizeof(struct ring_entry))
+			((struct ring_entry *)(ring->buf + off))->level = LOG_RING_SKIP;
+		off = 0;
+	}
+
+	re = (struct ring_entry *)(ring->buf + off);
+	re->level = level;
+	re->tid = thread_tid;
+	re->len = pos;
+	memcpy(re->str, str, pos + 1);
+
+	/*
+	 * Take the sequence number just before publishing the entry to keep
+	 * short the window in which merging waits for it.
+	 */
+
+	re->seq = __atomic_fetch_add(&log_seq, 1, __ATOMIC_RELAXED);
+	re->mono = mono = monotime();
+	gettimeofday(&re->tv, NULL);
+	tv = re->tv;
+
+	__atomic_store_n(&ring->head, head + skip + size, __ATOMIC_RELEASE);
+
+	if (shared)
+		pthread_mutex_unlock(&shared_ring_mutex);
+
+	/* after publishing, so a blocked stderr doesn't hold up merging */
+
+	if (level <= log_stderr_priority)
+		log_stderr(&tv, mono, str);
+
+	/*
+	 * Messages only kept in log_dump are merged later, with other
+	 * messages or by a log dump; wake the log thread for messages to be
+	 * written out, or when the ring is filling up.
+	 */
+
+	if (level <= log_logfile_priority || level <= log_syslog_priority ||
+	    used + skip + size >= LOG_RING_WAKE)
+		wake_log_thread();
+}
+
 static void write_entry(int level, char *str)
 {
 	if ((level <= log_logfile_priority) && logfile_fp) {
@@ -206,12 +553,27 @@ static void write_dropped(int level, int num)
 	write_entry(level, str);
 }
 
+uint64_t log_dropped_count(void)
+{
+	uint64_t count;
+
+	pthread_mutex_lock(&log_mutex);
+	merge_rings();
+	count = log_dropped_total;
+	pthread_mutex_unlock(&log_mutex);
+
+	return count;
+}
+
 void copy_log_dump(char *buf, int *len)
 {
 	int tail_len;
 
 	pthread_mutex_lock(&log_mutex);
 
+	/* assemble the dump from what the threads have logged so far */
+	merge_rings();
+
 	if (!log_wrap && !log_point) {
 		*len = 0;
 	} else if (log_wrap) {
@@ -231,16 +593,37 @@ static void *log_thread_fn(void *arg GNUC_UNUSED)
 {
 	char str[LOG_STR_LEN];
 	struct entry *e;
+	struct timespec ts;
 	int level, prev_dropped = 0;
 
+	pthread_mutex_lock(&log_mutex);
+
 	while (1) {
-		pthread_mutex_lock(&log_mutex);
-		while (log_head_ent == log_tail_ent) {
-			if (log_thread_done) {
-				pthread_mutex_unlock(&log_mutex);
-				goto out;
+		merge_rings();
+
+		if (log_head_ent == log_tail_ent) {
+			if (log_thread_done)
+				break;
+
+			/*
+			 * When everything logged has been merged, sleep until
+			 * woken; debug messages logged meanwhile are merged by
+			 * the next wakeup or log dump.
+			 */
+
+			if (__atomic_load_n(&log_seq, __ATOMIC_RELAXED) == log_next_seq) {
+				pthread_cond_wait(&log_cond, &log_mutex);
+				continue;
+			}
+
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			ts.tv_nsec += LOG_MERGE_MS * 1000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
 			}
-			pthread_cond_wait(&log_cond, &log_mutex);
+			pthread_cond_timedwait(&log_cond, &log_mutex, &ts);
+			continue;
 		}
 
 		e = &log_ents[log_tail_ent++];
@@ -260,13 +643,17 @@ static void *log_thread_fn(void *arg GNUC_UNUSED)
 		}
 
 		write_entry(level, str);
+
+		pthread_mutex_lock(&log_mutex);
 	}
- out:
+
+	pthread_mutex_unlock(&log_mutex);
 	pthread_exit(NULL);
 }
 
 int setup_logging(void)
 {
+	pthread_condattr_t cattr;
 	int fd, rv;
 
 	snprintf(logfile_path, PATH_MAX, "%s/%s", SANLK_LOG_DIR,
@@ -288,6 +675,11 @@ int setup_logging(void)
 
 	openlog(DAEMON_NAME, LOG_CONS | LOG_PID, LOG_DAEMON);
 
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&log_cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
 	rv = pthread_create(&thread_handle, NULL, log_thread_fn, NULL);
 	if (rv)
 		return -1;
@@ -30,6 +30,7 @@ void log_level(uint32_t space_id, uint32_t res_id, char *name_in, int level, con
 int setup_logging(void);
 void close_logging(void);
 void copy_log_dump(char *buf, int *len);
+uint64_t log_dropped_count(void);
 
 #define log_debug(fmt, args...)               log_level(0, 0, NULL, LOG_DEBUG, fmt, ##args)
 #define log_space(space, fmt, args...)        log_level(space->space_id, 0, NULL, LOG_DEBUG, fmt, ##args)
@@ -19,7 +19,6 @@
 #include <time.h>
 #include <syslog.h>
 #include <pthread.h>
-#include <poll.h>
 #include <sched.h>
 #include <pwd.h>
 #include <grp.h>
@@ -36,6 +35,8 @@
 #include <sys/resource.h>
 #include <uuid/uuid.h>
 #include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 
 #define EXTERN
 #include "sanlock_internal.h"
@@ -56,6 +57,8 @@
 #include "timeouts.h"
 #include "paxos_lease.h"
 #include "env.h"
+#include "trace.h"
+#include "shm_state.h"
 
 #define SIGRUNPATH 100 /* anything that's not SIGTERM/SIGKILL */
 
@@ -79,7 +82,17 @@ int log_stderr_priority = -1; /* -D sets this to LOG_DEBUG */
 #define CLIENT_NALLOC 1024
 static int client_maxi;
 static int client_size = 0;
-static struct pollfd *pollfd;
+static int epfd = -1;
+
+/*
+ * Clients with a registered pid are indexed by pid, so a cmd on behalf of
+ * another pid finds its client without locking every client.  The buckets
+ * are chained through cl->pid_next.  client_pid_mutex protects the index
+ * and changes to cl->pid, and is taken after cl->mutex.
+ */
+#define CLIENT_PID_HASH 1024
+static int client_pid_head[CLIENT_PID_HASH];
+static pthread_mutex_t client_pid_mutex = PTHREAD_MUTEX_INITIALIZER;
 static char command[COMMAND_MAX];
 static int cmd_argc;
 static char **cmd_argv;
@@ -90,14 +103,40 @@ static pthread_mutex_t rand_mutex = PTHREAD_MUTEX_INITIALIZER;
 static const char *run_dir = NULL;
 static int privileged = 1;
 
+/*
+ * Each client fd is added to epfd with its ci as the event data, so main_loop
+ * only visits the clients with events.  A client fd is removed from epfd
+ * while its connection is suspended, or once its pid is dead.
+ */
+
+static void client_watch(int ci, int fd)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = ci;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EEXIST)
+		log_error("client_watch ci %d fd %d error %d", ci, fd, errno);
+}
+
+static void client_ignore(int ci, int fd)
+{
+	if (fd < 0)
+		return;
+
+	if (epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL) < 0 && errno != ENOENT)
+		log_error("client_ignore ci %d fd %d error %d", ci, fd, errno);
+}
+
 static void close_helper(void)
 {
+	client_ignore(helper_ci, helper_status_fd);
 	close(helper_kill_fd);
 	close(helper_status_fd);
 	helper_kill_fd = -1;
 	helper_status_fd = -1;
-	pollfd[helper_ci].fd = -1;
-	pollfd[helper_ci].events = 0;
 	helper_ci = -1;
 
 	/* don't set helper_pid = -1 until we've tried waitpid */
@@ -193,31 +232,86 @@ static int client_alloc(void)
 {
 	int i;
 
-	/* pollfd is one element longer as we use an additional element for the
-	 * eventfd notification mechanism */
 	client = malloc(CLIENT_NALLOC * sizeof(struct client));
-	pollfd = malloc((CLIENT_NALLOC+1) * sizeof(struct pollfd));
-
-	if (!client || !pollfd) {
-		log_error("can't alloc for client or pollfd array");
+	if (!client) {
+		log_error("can't alloc for client array");
 		return -ENOMEM;
 	}
 
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		log_error("can't create epoll fd %d", errno);
+		return -errno;
+	}
+
 	for (i = 0; i < CLIENT_NALLOC; i++) {
 		memset(&client[i], 0, sizeof(struct client));
-		memset(&pollfd[i], 0, sizeof(struct pollfd));
 
 		pthread_mutex_init(&client[i].mutex, NULL);
 		client[i].fd = -1;
 		client[i].pid = -1;
-
-		pollfd[i].fd = -1;
-		pollfd[i].events = 0;
+		client[i].pid_next = -1;
 	}
+
+	for (i = 0; i < CLIENT_PID_HASH; i++)
+		client_pid_head[i] = -1;
 	client_size = CLIENT_NALLOC;
 	return 0;
 }
 
+static int *client_pid_bucket(int pid)
+{
+	return &client_pid_head[(unsigned int)pid % CLIENT_PID_HASH];
+}
+
+/* set cl->pid, moving the client to the index entry for the new pid */
+
+void client_set_pid(int ci, int pid);
+void client_set_pid(int ci, int pid)
+{
+	struct client *cl = &client[ci];
+	int *next;
+
+	pthread_mutex_lock(&client_pid_mutex);
+
+	if (cl->pid > 0) {
+		for (next = client_pid_bucket(cl->pid); *next != -1; next = &client[*next].pid_next) {
+			if (*next == ci) {
+				*next = cl->pid_next;
+				break;
+			}
+		}
+		cl->pid_next = -1;
+	}
+
+	cl->pid = pid;
+
+	if (pid > 0) {
+		next = client_pid_bucket(pid);
+		cl->pid_next = *next;
+		*next = ci;
+	}
+
+	pthread_mutex_unlock(&client_pid_mutex);
+}
+
+static int find_client_pid(int pid)
+{
+	int ci;
+
+	if (pid <= 0)
+		return -1;
+
+	pthread_mutex_lock(&client_pid_mutex);
+	for (ci = *client_pid_bucket(pid); ci != -1; ci = client[ci].pid_next) {
+		if (client[ci].pid == pid)
+			break;
+	}
+	pthread_mutex_unlock(&client_pid_mutex);
+
+	return ci;
+}
+
 static void _client_free(int ci)
 {
 	struct client *cl = &client[ci];
@@ -247,8 +341,11 @@ static void _client_free(int ci)
 		goto out;
 	}
 
-	if (cl->fd != -1)
+	if (cl->fd != -1) {
+		/* stop epoll watching this connection */
+		client_ignore(ci, cl->fd);
 		close(cl->fd);
+	}
 
 	cl->used = 0;
 	cl->fd = -1;
@@ -271,10 +368,6 @@ static void _client_free(int ci)
 		free(cl->tokens);
 	cl->tokens = NULL;
 	cl->tokens_slots = 0;
-
-	/* make poll() ignore this connection */
-	pollfd[ci].fd = -1;
-	pollfd[ci].events = 0;
  out:
 	return;
 }
@@ -322,9 +415,8 @@ static int client_suspend(int ci)
 
 	cl->suspend = 1;
 
-	/* make poll() ignore this connection */
-	pollfd[ci].fd = -1;
-	pollfd[ci].events = 0;
+	/* make epoll ignore this connection */
+	client_ignore(ci, cl->fd);
  out:
 	pthread_mutex_unlock(&cl->mutex);
 
@@ -362,11 +454,10 @@ void client_resume(int ci)
 		log_debug("client_resume ci %d need_free", ci);
 		_client_free(ci);
 	} else {
-		/* make poll() watch this connection */
-		pollfd[ci].fd = cl->fd;
-		pollfd[ci].events = POLLIN;
+		/* make epoll watch this connection */
+		client_watch(ci, cl->fd);
 
-		/* interrupt any poll() that might already be running */
+		/* interrupt any epoll_wait() that might already be running */
 		eventfd_write(efd, 1);
 	}
  out:
@@ -387,9 +478,8 @@ static int client_add(int fd, void (*workfn)(int ci), void (*deadfn)(int ci))
 			cl->workfn = workfn;
 			cl->deadfn = deadfn ? deadfn : client_free;
 
-			/* make poll() watch this connection */
-			pollfd[i].fd = fd;
-			pollfd[i].events = POLLIN;
+			/* make epoll watch this connection */
+			client_watch(i, fd);
 
 			if (i > client_maxi)
 				client_maxi = i;
@@ -482,16 +572,15 @@ void client_pid_dead(int ci)
 
 	cmd_active = cl->cmd_active;
 	pid = cl->pid;
-	cl->pid = -1;
+	client_set_pid(ci, -1);
 	cl->pid_dead = 1;
 
 	/* when cmd_active is set and cmd_a,r,i_thread is done and takes
 	   cl->mutex to set cl->cmd_active to 0, it will see cl->pid_dead is 1
 	   and know they need to release cl->tokens and call client_free */
 
-	/* make poll() ignore this connection */
-	pollfd[ci].fd = -1;
-	pollfd[ci].events = 0;
+	/* make epoll ignore this connection */
+	client_ignore(ci, cl->fd);
 
 	pthread_mutex_unlock(&cl->mutex);
 
@@ -537,9 +626,10 @@ void client_pid_dead(int ci)
    (It needs to check that the lockspace for the new tokens hasn't failed
    while the tokens were being acquired.)
 
-   In kill_pids and all_pids_dead could we check cl->pid <= 0 without
-   taking cl->mutex, since client_pid_dead in the main thread is the
-   only place that changes that?  */
+   kill_pids and all_pids_dead check cl->pid <= 0 before taking cl->mutex,
+   so clients without a registered pid are skipped without locking them.
+   This is safe because cl->pid is only set (cmd_register) and cleared
+   (client_pid_dead) by the main thread, which is where these run.  */
 
 static int client_using_space(struct client *cl, struct space *sp)
 {
@@ -596,6 +686,9 @@ static void kill_pids(struct space *sp)
 		do_kill = 0;
 
 		cl = &client[ci];
+		if (cl->pid <= 0)
+			continue;
+
 		pthread_mutex_lock(&cl->mutex);
 
 		if (!cl->used)
@@ -669,6 +762,9 @@ static int all_pids_dead(struct space *sp)
 
 	for (ci = 0; ci <= client_maxi; ci++) {
 		cl = &client[ci];
+		if (cl->pid <= 0)
+			continue;
+
 		pthread_mutex_lock(&cl->mutex);
 
 		if (!cl->used)
@@ -705,7 +801,7 @@ static int all_pids_dead(struct space *sp)
 	if (sp->flags & SP_USED_BY_ORPHANS) {
 		/*
 		 * lock ordering: spaces_mutex (main_loop), then
-		 * resource_mutex (resource_orphan_count)
+		 * resource shard mutexes (resource_orphan_count)
 		 */
 		int orphans = resource_orphan_count(sp->space_name);
 		if (orphans) {
@@ -724,72 +820,116 @@ static int all_pids_dead(struct space *sp)
 	return 1;
 }
 
-static unsigned int time_diff(struct timeval *begin, struct timeval *end)
+#define STANDARD_CHECK_INTERVAL 1000 /* milliseconds */
+#define RECOVERY_CHECK_INTERVAL  200 /* milliseconds */
+
+#define MAX_EPOLL_EVENTS 64
+
+/* epoll event data for the non-client fds, beyond any ci */
+#define EP_EVENTFD 0xFFFFFFFF
+#define EP_TIMERFD 0xFFFFFFFE
+
+static int set_check_timer(int tfd, int interval_ms)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_interval.tv_sec = interval_ms / 1000;
+	its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+	its.it_value = its.it_interval;
+
+	return timerfd_settime(tfd, 0, &its, NULL);
+}
+
+static int add_loop_fd(int fd, uint32_t id)
 {
-	struct timeval result;
-	timersub(end, begin, &result);
-	return (result.tv_sec * 1000) + (result.tv_usec / 1000);
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = id;
+
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
 }
 
-#define STANDARD_CHECK_INTERVAL 1000 /* milliseconds */
-#define RECOVERY_CHECK_INTERVAL  200 /* milliseconds */
+/*
+ * Client connections are handled as epoll reports them.  The lockspace
+ * checks are done each time the timerfd expires, every check_interval.
+ */
 
 static int main_loop(void)
 {
 	void (*workfn) (int ci);
 	void (*deadfn) (int ci);
+	struct epoll_event events[MAX_EPOLL_EVENTS];
 	struct space *sp, *safe;
-	struct timeval now, last_check;
-	int poll_timeout, check_interval;
-	unsigned int ms;
-	int i, rv, empty, check_all;
-	char *check_buf = NULL;
-	int check_buf_len = 0;
-	uint64_t ebuf;
-
-	gettimeofday(&last_check, NULL);
-	poll_timeout = STANDARD_CHECK_INTERVAL;
+	int check_interval, timer_interval;
+	int i, n, ci, rv, tfd, empty, check_all;
+	char *check_buf;
+	uint64_t ebuf, expired;
+	uint32_t id;
+	int do_check;
+
+	tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (tfd < 0) {
+		log_error("main_loop timerfd_create error %d", errno);
+		return -1;
+	}
+
 	check_interval = STANDARD_CHECK_INTERVAL;
+	timer_interval = STANDARD_CHECK_INTERVAL;
 
-	while (1) {
-		/* as well as the clients, check the eventfd */
-		pollfd[client_maxi+1].fd = efd;
-		pollfd[client_maxi+1].events = POLLIN;
+	if (set_check_timer(tfd, check_interval) < 0 ||
+	    add_loop_fd(tfd, EP_TIMERFD) < 0 ||
+	    add_loop_fd(efd, EP_EVENTFD) < 0) {
+		log_error("main_loop epoll setup error %d", errno);
+		close(tfd);
+		return -1;
+	}
 
-		rv = poll(pollfd, client_maxi + 2, poll_timeout);
-		if (rv == -1 && errno == EINTR)
+	while (1) {
+		n = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, -1);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			log_error("main_loop epoll_wait error %d", errno);
 			continue;
-		if (rv < 0) {
-			/* not sure */
 		}
-		for (i = 0; i <= client_maxi + 1; i++) {
-			if (pollfd[i].fd == efd && pollfd[i].revents & POLLIN) {
+
+		do_check = 0;
+
+		for (i = 0; i < n; i++) {
+			id = events[i].data.u32;
+
+			if (id == EP_EVENTFD) {
 				/* a client_resume completed */
 				eventfd_read(efd, &ebuf);
 				continue;
 			}
-			if (client[i].fd < 0)
+			if (id == EP_TIMERFD) {
+				if (read(tfd, &expired, sizeof(expired)) == sizeof(expired))
+					do_check = 1;
 				continue;
-			if (pollfd[i].revents & POLLIN) {
-				workfn = client[i].workfn;
+			}
+
+			ci = id;
+			if (ci >= client_size || client[ci].fd < 0)
+				continue;
+			if (events[i].events & EPOLLIN) {
+				workfn = client[ci].workfn;
 				if (workfn)
-					workfn(i);
+					workfn(ci);
 			}
-			if (pollfd[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
-				deadfn = client[i].deadfn;
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				deadfn = client[ci].deadfn;
 				if (deadfn)
-					deadfn(i);
+					deadfn(ci);
 			}
 		}
 
-
-		gettimeofday(&now, NULL);
-		ms = time_diff(&last_check, &now);
-		if (ms < check_interval) {
-			poll_timeout = check_interval - ms;
+		if (!do_check)
 			continue;
-		}
-		last_check = now;
+
 		check_interval = STANDARD_CHECK_INTERVAL;
 
 		/*
@@ -829,18 +969,10 @@ static int main_loop(void)
 			 * check host_id lease renewal
 			 */
 
-			if (sp->align_size > check_buf_len) {
-				if (check_buf)
-					free(check_buf);
-				check_buf_len = sp->align_size;
-				check_buf = malloc(check_buf_len);
-			}
-			if (check_buf)
-				memset(check_buf, 0, check_buf_len);
-
 			check_all = 0;
+			check_buf = NULL;
 
-			rv = check_our_lease(sp, &check_all, check_buf);
+			rv = check_our_lease(sp, &check_all, &check_buf);
 			if (rv)
 				sp->renew_fail = 1;
 
@@ -852,7 +984,7 @@ static int main_loop(void)
 				kill_pids(sp);
 				check_interval = RECOVERY_CHECK_INTERVAL;
 
-			} else if (check_all) {
+			} else if (check_all && check_buf) {
 				check_other_leases(sp, check_buf);
 			}
 		}
@@ -870,14 +1002,15 @@ static int main_loop(void)
 		free_lockspaces(0);
 		rem_resources();
 
-		gettimeofday(&now, NULL);
-		ms = time_diff(&last_check, &now);
-		if (ms < check_interval)
-			poll_timeout = check_interval - ms;
-		else
-			poll_timeout = 1;
+		if (check_interval != timer_interval) {
+			if (set_check_timer(tfd, check_interval) < 0)
+				log_error("main_loop timerfd_settime error %d", errno);
+			else
+				timer_interval = check_interval;
+		}
 	}
 
+	close(tfd);
 	free_lockspaces(1);
 
 	daemon_shutdown_reply();
@@ -956,6 +1089,21 @@ static int thread_pool_add_work(struct cmd_args *ca)
 	return 0;
 }
 
+void thread_pool_stats(int *workers, int *free_workers, int *queued);
+void thread_pool_stats(int *workers, int *free_workers, int *queued)
+{
+	struct cmd_args *ca;
+	int count = 0;
+
+	pthread_mutex_lock(&pool.mutex);
+	*workers = pool.num_workers;
+	*free_workers = pool.free_workers;
+	list_for_each_entry(ca, &pool.work_data, list)
+		count++;
+	*queued = count;
+	pthread_mutex_unlock(&pool.mutex);
+}
+
 static void thread_pool_free(void)
 {
 	pthread_mutex_lock(&pool.mutex);
@@ -1042,7 +1190,7 @@ static void process_cmd_thread_registered(int ci_in, struct sm_header *h_recv)
 	struct cmd_args *ca;
 	struct client *cl;
 	int result = 0;
-	int rv, i, ci_target;
+	int rv, ci_target;
 
 	ca = malloc(sizeof(struct cmd_args));
 	if (!ca) {
@@ -1052,17 +1200,17 @@ static void process_cmd_thread_registered(int ci_in, struct sm_header *h_recv)
 
 	if (h_recv->data2 != -1) {
 		/* lease for another registered client with pid specified by data2 */
-		ci_target = -1;
+		ci_target = find_client_pid(h_recv->data2);
 
-		for (i = 0; i < client_size; i++) {
-			cl = &client[i];
+		if (ci_target >= 0) {
+			cl = &client[ci_target];
 			pthread_mutex_lock(&cl->mutex);
+
+			/* the pid may have exited since the lookup */
 			if (cl->pid != h_recv->data2) {
 				pthread_mutex_unlock(&cl->mutex);
-				continue;
+				ci_target = -1;
 			}
-			ci_target = i;
-			break;
 		}
 		if (ci_target < 0) {
 			if (h_recv->cmd != SM_CMD_INQUIRE) {
@@ -1221,6 +1369,9 @@ static void process_connection(int ci)
 	case SM_CMD_STATUS:
 	case SM_CMD_HOST_STATUS:
 	case SM_CMD_RENEWAL:
+	case SM_CMD_LATENCY:
+	case SM_CMD_METRICS:
+	case SM_CMD_TRACE:
 	case SM_CMD_LOG_DUMP:
 	case SM_CMD_GET_LOCKSPACES:
 	case SM_CMD_GET_HOSTS:
@@ -1230,6 +1381,7 @@ static void process_connection(int ci)
 		call_cmd_daemon(ci, &h, client_maxi);
 		break;
 	case SM_CMD_ADD_LOCKSPACE:
+	case SM_CMD_ADD_LOCKSPACES:
 	case SM_CMD_INQ_LOCKSPACE:
 	case SM_CMD_REM_LOCKSPACE:
 	case SM_CMD_REQUEST:
@@ -1673,6 +1825,9 @@ static int do_daemon(void)
 	setup_signals();
 	setup_logging();
 
+	if (trace_init() < 0)
+		log_error("trace buffer not allocated");
+
 	if (strcmp(run_dir, DEFAULT_RUN_DIR))
 		log_warn("Using non-standard run directory '%s'", run_dir);
 
@@ -1702,10 +1857,17 @@ static int do_daemon(void)
 	if (rv < 0)
 		goto out_threads;
 
-	setup_token_manager();
+	rv = setup_token_manager();
 	if (rv < 0)
 		goto out_threads;
 
+	setup_acquire_threads();
+
+	setup_renewal_sched();
+
+	/* monitoring can still use the socket if this fails */
+	setup_shm_state(run_dir);
+
 	/* initialize global eventfd for client_resume notification */
 	if ((efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
 		log_error("couldn't create eventfd");
@@ -1714,6 +1876,12 @@ static int do_daemon(void)
 
 	main_loop();
 
+	close_shm_state();
+
+	close_renewal_sched();
+
+	close_acquire_threads();
+
 	close_token_manager();
 
  out_threads:
@@ -1843,6 +2011,9 @@ static void print_usage(void)
 	printf("sanlock client gets [-h 0|1]\n");
 	printf("sanlock client host_status -s LOCKSPACE [-D]\n");
 	printf("sanlock client renewal -s LOCKSPACE\n");
+	printf("sanlock client latency -s LOCKSPACE\n");
+	printf("sanlock client metrics\n");
+	printf("sanlock client trace\n");
 	printf("sanlock client set_event -s LOCKSPACE -i <host_id> [-g gen] -e <event> -d <data>\n");
 	printf("sanlock client set_config -s LOCKSPACE [-u 0|1] [-O 0|1]\n");
 	printf("sanlock client log_dump\n");
@@ -1953,6 +2124,12 @@ static int read_command_line(int argc, char *argv[])
 			com.action = ACT_HOST_STATUS;
 		else if (!strcmp(act, "renewal"))
 			com.action = ACT_RENEWAL;
+		else if (!strcmp(act, "latency"))
+			com.action = ACT_LATENCY;
+		else if (!strcmp(act, "metrics"))
+			com.action = ACT_METRICS;
+		else if (!strcmp(act, "trace"))
+			com.action = ACT_TRACE;
 		else if (!strcmp(act, "gets"))
 			com.action = ACT_GETS;
 		else if (!strcmp(act, "log_dump"))
@@ -2084,7 +2261,7 @@ static int read_command_line(int argc, char *argv[])
 		case 'a':
 			com.all = atoi(optionarg);
 			com.aio_arg = atoi(optionarg);
-			if (com.aio_arg && com.aio_arg != 1)
+			if (com.aio_arg && com.aio_arg != 1 && com.aio_arg != 3)
 				com.aio_arg = 1;
 			break;
 		case 't':
@@ -2348,6 +2525,21 @@ static void read_config_file(void)
 			get_val_int(line, &val);
 			com.sh_retries = val;
 
+		} else if (!strcmp(str, "resource_workers")) {
+			get_val_int(line, &val);
+			if (val >= 1 && val <= MAX_RESOURCE_WORKERS)
+				com.resource_workers = val;
+
+		} else if (!strcmp(str, "renewal_threads")) {
+			get_val_int(line, &val);
+			if (val >= 0 && val <= MAX_RENEWAL_THREADS)
+				com.renewal_threads = val;
+
+		} else if (!strcmp(str, "use_aio")) {
+			get_val_int(line, &val);
+			if (val >= 0 && val <= 3)
+				com.aio_arg = val;
+
 		} else if (!strcmp(str, "uname")) {
 			memset(str, 0, sizeof(str));
 			get_val_str(line, str);
@@ -2640,6 +2832,18 @@ static int do_client(void)
 		rv = sanlock_renewal(com.lockspace.name);
 		break;
 
+	case ACT_LATENCY:
+		rv = sanlock_latency(com.lockspace.name);
+		break;
+
+	case ACT_METRICS:
+		rv = sanlock_metrics(LOG_DUMP_SIZE);
+		break;
+
+	case ACT_TRACE:
+		rv = sanlock_trace(LOG_DUMP_SIZE);
+		break;
+
 	case ACT_GETS:
 		rv = do_client_gets();
 		break;
@@ -3269,6 +3473,8 @@ int main(int argc, char *argv[])
 	com.aio_arg = DEFAULT_USE_AIO;
 	com.pid = -1;
 	com.sh_retries = DEFAULT_SH_RETRIES;
+	com.resource_workers = DEFAULT_RESOURCE_WORKERS;
+	com.renewal_threads = DEFAULT_RENEWAL_THREADS;
 	com.quiet_fail = DEFAULT_QUIET_FAIL;
 	com.renewal_read_extend_sec_set = 0;
 	com.renewal_read_extend_sec = 0;
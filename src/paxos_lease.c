@@ -31,8 +31,10 @@
 #include "paxos_lease.h"
 #include "resource.h"
 #include "timeouts.h"
+#include "crc32c.h"
+#include "latency.h"
+#include "trace.h"
 
-uint32_t crc32c(uint32_t crc, uint8_t *data, size_t length);
 int get_rand(int a, int b);
 
 /*
@@ -63,6 +65,47 @@ static uint32_t roundup_power_of_two(uint32_t val)
 	return val;
 }
 
+/*
+ * A host cannot hold a host_id past the host leases initialized in its
+ * lockspace, so dblocks beyond the lockspace's max_hosts are never written
+ * by a live host and don't need to be read or examined.  For a resource
+ * initialized with the default 2000 hosts in a lockspace created for a few
+ * hosts, this reduces each dblock read from the whole lease area to a few
+ * sectors.  The full num_hosts is used when the lockspace size is unknown.
+ */
+
+static int lease_max_hosts(struct token *token)
+{
+	if (!token->ls_max_hosts || (token->host_id > token->ls_max_hosts))
+		return 0;
+	return token->ls_max_hosts;
+}
+
+int paxos_lease_hosts(struct token *token, int num_hosts)
+{
+	int max_hosts = lease_max_hosts(token);
+
+	if (max_hosts && (max_hosts < num_hosts))
+		return max_hosts;
+	return num_hosts;
+}
+
+/* the length read for the leader, request and all dblocks in use */
+
+int paxos_read_len(struct token *token)
+{
+	int max_hosts = lease_max_hosts(token);
+	int len;
+
+	if (!max_hosts)
+		return token->align_size;
+
+	len = roundup_power_of_two(max_hosts + 2) * token->sector_size;
+	if (len > token->align_size)
+		return token->align_size;
+	return len;
+}
+
 uint32_t leader_checksum(struct leader_record *lr)
 {
 	return crc32c((uint32_t)~1, (uint8_t *)lr, LEADER_CHECKSUM_LEN);
@@ -162,7 +205,7 @@ static int write_dblock_mblock_sh(struct task *task,
 	struct paxos_dblock pd_end;
 	struct mode_block mb;
 	struct mode_block mb_end;
-	char *iobuf, **p_iobuf;
+	char *iobuf;
 	uint64_t offset;
 	uint32_t checksum;
 	int iobuf_len, rv, sector_size;
@@ -177,12 +220,12 @@ static int write_dblock_mblock_sh(struct task *task,
 	if (!iobuf_len)
 		return -EINVAL;
 
-	p_iobuf = &iobuf;
-
-	rv = posix_memalign((void *)p_iobuf, getpagesize(), iobuf_len);
+	rv = alloc_iobuf(&iobuf, iobuf_len);
 	if (rv)
 		return -ENOMEM;
 
+	memset(iobuf, 0, iobuf_len);
+
 	offset = disk->offset + ((2 + host_id - 1) * sector_size);
 
 	paxos_dblock_out(pd, &pd_end);
@@ -209,7 +252,7 @@ static int write_dblock_mblock_sh(struct task *task,
 	}
 
 	if (rv != SANLK_AIO_TIMEOUT)
-		free(iobuf);
+		free_iobuf(iobuf, iobuf_len);
 	return rv;
 }
 
@@ -245,6 +288,102 @@ static int write_dblock(struct task *task,
 	return rv;
 }
 
+/*
+ * Write our dblock to all the lease disks in parallel, instead of one disk
+ * after the other with write_dblock.  Returns the number of disks written,
+ * and the last error in *error.  Waits for the writes to all the disks (not
+ * just a majority) so that a slow write can't land after a later write of
+ * our dblock on the same disk.
+ */
+
+static int write_dblocks(struct task *task,
+			 struct token *token,
+			 uint64_t host_id,
+			 struct paxos_dblock *pd,
+			 int *error)
+{
+	struct disk_io ios[SANLK_MAX_DISKS];
+	struct paxos_dblock pd_end;
+	struct mode_block mb;
+	struct mode_block mb_end;
+	struct sync_disk *disk;
+	char *iobuf;
+	uint32_t checksum;
+	int num_disks = token->r.num_disks;
+	int sector_size = token->sector_size;
+	int num_writes;
+	int d, rv;
+
+	if ((sector_size != 512) && (sector_size != 4096)) {
+		*error = -EINVAL;
+		return 0;
+	}
+
+	/* 1 leader block + 1 request block;
+	   host_id N is block offset N-1 */
+
+	paxos_dblock_out(pd, &pd_end);
+
+	/*
+	 * N.B. must compute checksum after the data has been byte swapped.
+	 */
+	checksum = dblock_checksum(&pd_end);
+	pd->checksum = checksum;
+	pd_end.checksum = cpu_to_le32(checksum);
+
+	if (token->flags & T_WRITE_DBLOCK_MBLOCK_SH) {
+		/* special case to preserve our SH mode block within the dblock */
+		memset(&mb, 0, sizeof(mb));
+		mb.flags = MBLOCK_SHARED;
+		mb.generation = token->host_generation;
+		mode_block_out(&mb, &mb_end);
+	}
+
+	*error = 0;
+
+	for (d = 0; d < num_disks; d++) {
+		disk = &token->disks[d];
+
+		rv = alloc_iobuf(&iobuf, sector_size);
+		if (rv) {
+			num_disks = d;
+			*error = -ENOMEM;
+			break;
+		}
+
+		memset(iobuf, 0, sector_size);
+		memcpy(iobuf, (char *)&pd_end, sizeof(struct paxos_dblock));
+
+		if (token->flags & T_WRITE_DBLOCK_MBLOCK_SH)
+			memcpy(iobuf + MBLOCK_OFFSET, (char *)&mb_end, sizeof(struct mode_block));
+
+		ios[d].fd = disk->fd;
+		ios[d].offset = disk->offset + ((2 + host_id - 1) * sector_size);
+		ios[d].iobuf = iobuf;
+		ios[d].iobuf_len = sector_size;
+		ios[d].rv = 0;
+	}
+
+	num_writes = write_iobuf_disks(ios, num_disks, num_disks, task, token->io_timeout);
+
+	for (d = 0; d < num_disks; d++) {
+		rv = ios[d].rv;
+
+		if (rv < 0) {
+			log_errot(token, "write_dblocks host_id %llu offset %llu rv %d %s",
+				  (unsigned long long)host_id,
+				  (unsigned long long)ios[d].offset,
+				  rv, token->disks[d].path);
+			*error = rv;
+		}
+
+		if (rv != SANLK_AIO_TIMEOUT)
+			free_iobuf(ios[d].iobuf, ios[d].iobuf_len);
+	}
+
+	return num_writes;
+}
+
 static int write_leader(struct task *task,
 		        struct token *token,
 			struct sync_disk *disk,
@@ -452,7 +591,7 @@ static int verify_dblock(struct token *token, struct paxos_dblock *pd, uint32_t
 
 static int run_ballot(struct task *task, struct token *token, uint32_t flags,
 		      int num_hosts, uint64_t next_lver, uint64_t our_mbal,
-		      struct paxos_dblock *dblock_out)
+		      struct paxos_dblock *dblock_out, int *contenders)
 {
 	char bk_debug[BK_DEBUG_SIZE];
 	char bk_str[BK_STR_SIZE];
@@ -463,8 +602,8 @@ static int run_ballot(struct task *task, struct token *token, uint32_t flags,
 	struct paxos_dblock *bk_end;
 	struct paxos_dblock *bk;
 	struct sync_disk *disk;
+	struct disk_io ios[SANLK_MAX_DISKS];
 	char *iobuf[SANLK_MAX_DISKS];
-	char **p_iobuf[SANLK_MAX_DISKS];
 	uint32_t checksum;
 	int num_disks = token->r.num_disks;
 	int num_writes, num_reads;
@@ -474,7 +613,11 @@ static int run_ballot(struct task *task, struct token *token, uint32_t flags,
 	int phase2 = 0;
 	int d, q, rv = 0;
 	int q_max = -1;
+	int count_d = -1;
 	int error;
+	uint64_t begin;
+
+	*contenders = 0;
 
 	sector_count = roundup_power_of_two(num_hosts + 2);
 
@@ -484,9 +627,7 @@ static int run_ballot(struct task *task, struct token *token, uint32_t flags,
 		return -EINVAL;
 
 	for (d = 0; d < num_disks; d++) {
-		p_iobuf[d] = &iobuf[d];
-
-		rv = posix_memalign((void *)p_iobuf[d], getpagesize(), iobuf_len);
+		rv = alloc_iobuf(&iobuf[d], iobuf_len);
 		if (rv)
 			return rv;
 	}
@@ -507,6 +648,9 @@ static int run_ballot(struct task *task, struct token *token, uint32_t flags,
 		  (unsigned long long)next_lver,
 		  (unsigned long long)our_mbal);
 
+	trace_event(TRACE_BALLOT_PHASE, 1, token->res_id, token->host_id,
+		    next_lver, our_mbal);
+
 	memset(&dblock, 0, sizeof(struct paxos_dblock));
 	dblock.mbal = our_mbal;
 	dblock.lver = next_lver;
@@ -514,15 +658,10 @@ static int run_ballot(struct task *task, struct token *token, uint32_t flags,
 
 	memset(&bk_max, 0, sizeof(struct paxos_dblock));
 
-	num_writes = 0;
-
-	for (d = 0; d < num_disks; d++) {
-		/* acquire io: write 1 */
-		rv = write_dblock(task, token, &token->disks[d], token->host_id, &dblock);
-		if (rv < 0)
-			continue;
-		num_writes++;
-	}
+	/* acquire io: write 1 */
+	begin = lat_begin();
+	num_writes = write_dblocks(task, token, token->host_id, &dblock, &rv);
+	lat_end(&token->lat, LAT_PHASE1_WRITE, begin, !majority_disks(num_disks, num_writes));
 
 	if (!majority_disks(num_disks, num_writes)) {
 		log_errot(token, "ballot %llu dblock write error %d",
@@ -534,22 +673,36 @@ static int run_ballot(struct task *task, struct token *token, uint32_t flags,
 	memset(bk_debug, 0, sizeof(bk_debug));
 	bk_debug_count = 0;
 
-	num_reads = 0;
-
 	for (d = 0; d < num_disks; d++) {
 		disk = &token->disks[d];
 
-		if (!iobuf[d])
-			continue;
 		memset(iobuf[d], 0, iobuf_len);
 
-		/* acquire io: read 2 */
-		rv = read_iobuf(disk->fd, disk->offset, iobuf[d], iobuf_len, task, token->io_timeout, NULL);
+		ios[d].fd = disk->fd;
+		ios[d].offset = disk->offset;
+		ios[d].iobuf = iobuf[d];
+		ios[d].iobuf_len = iobuf_len;
+		ios[d].rv = 0;
+	}
+
+	/*
+	 * Read all disks in parallel and stop waiting once a majority have
+	 * been read.  A read still in progress on a slow disk keeps its iobuf
+	 * until the event is reaped, like a read that times out.
+	 */
+
+	/* acquire io: read 2 */
+	begin = lat_begin();
+	num_reads = read_iobuf_disks(ios, num_disks, (num_disks / 2) + 1,
+				     task, token->io_timeout);
+	lat_end(&token->lat, LAT_PHASE1_READ, begin, !majority_disks(num_disks, num_reads));
+
+	for (d = 0; d < num_disks; d++) {
+		rv = ios[d].rv;
 		if (rv == SANLK_AIO_TIMEOUT)
 			iobuf[d] = NULL;
 		if (rv < 0)
 			continue;
-		num_reads++;
 
 		for (q = 0; q < num_hosts; q++) {
 			bk_end = (struct paxos_dblock *)(iobuf[d] + ((2 + q)*sector_size));
@@ -590,6 +743,12 @@ static int run_ballot(struct task *task, struct token *token, uint32_t flags,
 			if (bk->lver < dblock.lver)
 				continue;
 
+			/* other hosts running a ballot for this lver, counted on one disk */
+			if (count_d < 0)
+				count_d = d;
+			if (d == count_d && q != token->host_id - 1)
+				(*contenders)++;
+
 			if (bk->lver > dblock.lver) {
 				log_warnt(token, "ballot %llu abort1 larger lver in bk[%d] %llu:%llu:%llu:%llu:%llu:%llu "
 					  "our dblock %llu:%llu:%llu:%llu:%llu:%llu",
@@ -610,6 +769,9 @@ static int run_ballot(struct task *task, struct token *token, uint32_t flags,
 				log_token(token, "ballot %llu phase1 read %s",
 					  (unsigned long long)next_lver, bk_debug);
 
+				trace_event(TRACE_BALLOT_ABORT, 1, token->res_id, q,
+					    bk->lver, bk->mbal);
+
 				error = SANLK_DBLOCK_LVER;
 				goto out;
 			}
@@ -636,6 +798,9 @@ static int run_ballot(struct task *task, struct token *token, uint32_t flags,
 				log_token(token, "ballot %llu phase1 read %s",
 					  (unsigned long long)next_lver, bk_debug);
 
+				trace_event(TRACE_BALLOT_ABORT, 1, token->res_id, q,
+					    bk->lver, bk->mbal);
+
 				error = SANLK_DBLOCK_MBAL;
 				goto out;
 			}
@@ -727,15 +892,13 @@ static int run_ballot(struct task *task, struct token *token, uint32_t flags,
 		  (unsigned long long)dblock.inp3,
 		  q_max);
 
-	num_writes = 0;
+	trace_event(TRACE_BALLOT_PHASE, 2, token->res_id, token->host_id,
+		    dblock.lver, dblock.inp);
 
-	for (d = 0; d < num_disks; d++) {
-		/* acquire io: write 2 */
-		rv = write_dblock(task, token, &token->disks[d], token->host_id, &dblock);
-		if (rv < 0)
-			continue;
-		num_writes++;
-	}
+	/* acquire io: write 2 */
+	begin = lat_begin();
+	num_writes = write_dblocks(task, token, token->host_id, &dblock, &rv);
+	lat_end(&token->lat, LAT_PHASE2_WRITE, begin, !majority_disks(num_disks, num_writes));
 
 	if (!majority_disks(num_disks, num_writes)) {
 		log_errot(token, "ballot %llu our dblock write2 error %d",
@@ -747,22 +910,45 @@ static int run_ballot(struct task *task, struct token *token, uint32_t flags,
 	memset(bk_debug, 0, sizeof(bk_debug));
 	bk_debug_count = 0;
 
-	num_reads = 0;
-
 	for (d = 0; d < num_disks; d++) {
 		disk = &token->disks[d];
 
-		if (!iobuf[d])
-			continue;
+		if (!iobuf[d]) {
+			/* the previous read from this disk is still in progress */
+			rv = alloc_iobuf(&iobuf[d], iobuf_len);
+			if (rv) {
+				iobuf[d] = NULL;
+				error = -ENOMEM;
+				goto out;
+			}
+		}
 		memset(iobuf[d], 0, iobuf_len);
 
-		/* acquire io: read 3 */
-		rv = read_iobuf(disk->fd, disk->offset, iobuf[d], iobuf_len, task, token->io_timeout, NULL);
+		ios[d].fd = disk->fd;
+		ios[d].offset = disk->offset;
+		ios[d].iobuf = iobuf[d];
+		ios[d].iobuf_len = iobuf_len;
+		ios[d].rv = 0;
+	}
+
+	/*
+	 * Read all disks in parallel and stop waiting once a majority have
+	 * been read.  A read still in progress on a slow disk keeps its iobuf
+	 * until the event is reaped, like a read that times out.
+	 */
+
+	/* acquire io: read 3 */
+	begin = lat_begin();
+	num_reads = read_iobuf_disks(ios, num_disks, (num_disks / 2) + 1,
+				     task, token->io_timeout);
+	lat_end(&token->lat, LAT_PHASE2_READ, begin, !majority_disks(num_disks, num_reads));
+
+	for (d = 0; d < num_disks; d++) {
+		rv = ios[d].rv;
 		if (rv == SANLK_AIO_TIMEOUT)
 			iobuf[d] = NULL;
 		if (rv < 0)
 			continue;
-		num_reads++;
 
 		for (q = 0; q < num_hosts; q++) {
 			bk_end = (struct paxos_dblock *)(iobuf[d] + ((2 + q)*sector_size));
@@ -829,6 +1015,9 @@ static int run_ballot(struct task *task, struct token *token, uint32_t flags,
 				log_token(token, "ballot %llu phase2 read %s",
 					  (unsigned long long)next_lver, bk_debug);
 
+				trace_event(TRACE_BALLOT_ABORT, 2, token->res_id, q,
+					    bk->lver, bk->mbal);
+
 				error = SANLK_DBLOCK_LVER;
 				goto out;
 			}
@@ -855,6 +1044,9 @@ static int run_ballot(struct task *task, struct token *token, uint32_t flags,
 				log_token(token, "ballot %llu phase2 read %s",
 					  (unsigned long long)next_lver, bk_debug);
 
+				trace_event(TRACE_BALLOT_ABORT, 2, token->res_id, q,
+					    bk->lver, bk->mbal);
+
 				error = SANLK_DBLOCK_MBAL;
 				goto out;
 			}
@@ -880,9 +1072,16 @@ static int run_ballot(struct task *task, struct token *token, uint32_t flags,
 		/* don't free iobufs that have timed out */
 		if (!iobuf[d])
 			continue;
-		free(iobuf[d]);
+		free_iobuf(iobuf[d], iobuf_len);
 	}
 
+	trace_event(TRACE_BALLOT_DONE, phase2 ? 2 : 1, token->res_id, error,
+		    next_lver, our_mbal);
+
+	/* count an abort as an error of the read that found the larger mbal/lver */
+	if ((error == SANLK_DBLOCK_MBAL) || (error == SANLK_DBLOCK_LVER))
+		token->lat.op[phase2 ? LAT_PHASE2_READ : LAT_PHASE1_READ].errors++;
+
 	if (phase2 && (error < 0) &&
 	    ((error == SANLK_DBLOCK_READ) || (error == SANLK_DBLOCK_WRITE))) {
 		/*
@@ -1087,7 +1286,7 @@ int paxos_read_buf(struct task *task,
 		   struct token *token,
 		   char **buf_out)
 {
-	char *iobuf, **p_iobuf;
+	char *iobuf;
 	struct sync_disk *disk = &token->disks[0];
 	int rv, iobuf_len;
 
@@ -1097,13 +1296,11 @@ int paxos_read_buf(struct task *task,
 		return -EINVAL;
 	}
 
-	iobuf_len = token->align_size;
+	iobuf_len = paxos_read_len(token);
 	if (iobuf_len < 0)
 		return iobuf_len;
 
-	p_iobuf = &iobuf;
-
-	rv = posix_memalign((void *)p_iobuf, getpagesize(), iobuf_len);
+	rv = alloc_iobuf(&iobuf, iobuf_len);
 	if (rv)
 		return rv;
 
@@ -1281,21 +1478,19 @@ static int _lease_read_one(struct task *task,
 	struct leader_record leader_end;
 	struct paxos_dblock our_dblock_end;
 	struct paxos_dblock bk;
-	char *iobuf, **p_iobuf;
+	char *iobuf;
 	uint32_t host_id = token->host_id;
 	uint32_t sector_size = token->sector_size;
 	uint32_t checksum;
 	struct paxos_dblock *bk_end;
 	uint64_t tmp_mbal = 0;
-	int q, tmp_q = -1, rv, iobuf_len;
+	int q, tmp_q = -1, rv, iobuf_len, num_hosts;
 
-	iobuf_len = token->align_size;
+	iobuf_len = paxos_read_len(token);
 	if (iobuf_len < 0)
 		return iobuf_len;
 
-	p_iobuf = &iobuf;
-
-	rv = posix_memalign((void *)p_iobuf, getpagesize(), iobuf_len);
+	rv = alloc_iobuf(&iobuf, iobuf_len);
 	if (rv)
 		return rv;
 
@@ -1321,7 +1516,9 @@ static int _lease_read_one(struct task *task,
 	memset(bk_debug, 0, sizeof(bk_debug));
 	bk_debug_count = 0;
 
-	for (q = 0; q < leader_ret->num_hosts; q++) {
+	num_hosts = paxos_lease_hosts(token, leader_ret->num_hosts);
+
+	for (q = 0; q < num_hosts; q++) {
 		bk_end = (struct paxos_dblock *)(iobuf + ((2 + q) * sector_size));
 
 		checksum = dblock_checksum(bk_end);
@@ -1373,7 +1570,7 @@ static int _lease_read_one(struct task *task,
 
  out:
 	if (rv != SANLK_AIO_TIMEOUT)
-		free(iobuf);
+		free_iobuf(iobuf, iobuf_len);
 	return rv;
 }
 
@@ -1491,8 +1688,11 @@ static int paxos_lease_read(struct task *task, struct token *token, uint32_t fla
 			    uint64_t *max_mbal, const char *caller, int log_bk_vals)
 {
 	struct paxos_dblock our_dblock;
+	uint64_t begin;
 	int rv, q = -1;
 
+	begin = lat_begin();
+
 	if (token->r.num_disks > 1)
 		rv = _lease_read_num(task, token, flags,
 				     leader_ret, &our_dblock, max_mbal, &q, caller);
@@ -1500,6 +1700,8 @@ static int paxos_lease_read(struct task *task, struct token *token, uint32_t fla
 		rv = _lease_read_one(task, token, flags, &token->disks[0],
 				     leader_ret, &our_dblock, max_mbal, &q, caller, log_bk_vals);
 
+	lat_end(&token->lat, LAT_LEADER_READ, begin, rv < 0);
+
 	if (rv == SANLK_OK)
 		log_token(token, "%s leader %llu owner %llu %llu %llu max mbal[%d] %llu "
 			  "our_dblock %llu %llu %llu %llu %llu %llu",
@@ -1556,6 +1758,37 @@ static int write_new_leader(struct task *task,
 	return SANLK_OK;
 }
 
+/*
+ * Delay before retrying after another host's ballot aborted ours, or after
+ * another host briefly held a lease we want shared.  Random delays that
+ * stay short keep colliding when many hosts chase the same lease, and
+ * long ones waste time when there are few.  So each retry waits a random
+ * time between a base delay and three times the previous delay
+ * ("decorrelated jitter"), up to a cap.  The base is a ballot's io time
+ * (scaled by io_timeout) times the number of other hosts seen running a
+ * ballot for the same lver, so a larger herd spreads out more.
+ */
+
+#define RETRY_BASE_US_PER_SEC	1000	/* per second of io_timeout, 10ms at default */
+#define RETRY_MAX_US_PER_SEC	100000	/* per second of io_timeout, 1s at default */
+
+int paxos_retry_delay(struct token *token, int contenders, int prev_us)
+{
+	int io_timeout = token->io_timeout ? token->io_timeout : DEFAULT_IO_TIMEOUT;
+	int base_us, max_us, us;
+
+	base_us = io_timeout * RETRY_BASE_US_PER_SEC * (contenders > 1 ? contenders : 1);
+	max_us = io_timeout * RETRY_MAX_US_PER_SEC;
+	if (base_us > max_us)
+		base_us = max_us;
+
+	us = get_rand(base_us, prev_us * 3 > base_us ? prev_us * 3 : base_us);
+	if (us < 0)
+		us = base_us + token->host_id * 100;
+
+	return us > max_us ? max_us : us;
+}
+
 /*
  * If we hang or crash after completing a ballot successfully, but before
  * commiting the leader_record, then the next host that runs a ballot (with the
@@ -1582,6 +1815,9 @@ static int write_new_leader(struct task *task,
  * 	write_new_leader()	1 write  512 bytes (1 leader sector)
  *
  * 				6 i/os = 3 1MB reads, 3 512 byte writes
+ *
+ * The reads are limited to the host leases of the lockspace when it has
+ * fewer than num_hosts, see paxos_lease_hosts().
  */
 
 int paxos_lease_acquire(struct task *task,
@@ -1606,9 +1842,11 @@ int paxos_lease_acquire(struct task *task,
 	uint64_t max_mbal;
 	uint64_t num_mbal;
 	uint64_t our_mbal;
+	uint64_t begin;
 	int copy_cur_leader;
 	int disk_open = 0;
-	int error, rv, us;
+	int contenders = 0;
+	int error, rv, us = 0;
 	int ls_sector_size;
 	int other_io_timeout, other_host_dead_seconds;
 
@@ -1710,7 +1948,7 @@ int paxos_lease_acquire(struct task *task,
 		}
 		host_id_disk.fd = -1;
 
-		rv = open_disks_fd(&host_id_disk, 1);
+		rv = open_disks_fd_cached(&host_id_disk, 1, cur_leader.space_name);
 		if (rv < 0) {
 			log_errot(token, "paxos_acquire open host_id_disk error %d", rv);
 			error = SANLK_ACQUIRE_IDDISK;
@@ -1873,6 +2111,7 @@ int paxos_lease_acquire(struct task *task,
 				  (unsigned long long)cur_leader.owner_id,
 				  (unsigned long long)cur_leader.owner_generation,
 				  (unsigned long long)cur_leader.timestamp);
+			memcpy(leader_ret, &cur_leader, sizeof(struct leader_record));
 			error = SANLK_ACQUIRE_OWNED_RETRY;
 			goto out;
 		}
@@ -2021,15 +2260,15 @@ int paxos_lease_acquire(struct task *task,
 		goto restart;
 	}
 
-	error = run_ballot(task, token, flags, cur_leader.num_hosts, next_lver, our_mbal, &dblock);
+	error = run_ballot(task, token, flags, paxos_lease_hosts(token, cur_leader.num_hosts),
+			   next_lver, our_mbal, &dblock, &contenders);
 
 	if ((error == SANLK_DBLOCK_MBAL) || (error == SANLK_DBLOCK_LVER)) {
-		us = get_rand(0, 1000000);
-		if (us < 0)
-			us = token->host_id * 100;
+		us = paxos_retry_delay(token, contenders, us);
+		token->ballot_aborts++;
 
-		log_token(token, "paxos_acquire %llu retry delay %d us",
-			  (unsigned long long)next_lver, us);
+		log_token(token, "paxos_acquire %llu retry delay %d us contenders %d",
+			  (unsigned long long)next_lver, us, contenders);
 
 		usleep(us);
 		our_mbal += cur_leader.max_hosts;
@@ -2075,7 +2314,11 @@ int paxos_lease_acquire(struct task *task,
 
 	new_leader.checksum = 0; /* set after leader_record_out */
 
+	begin = lat_begin();
 	error = write_new_leader(task, token, &new_leader, "paxos_acquire");
+	lat_end(&token->lat, LAT_COMMIT_WRITE, begin, error < 0);
+	trace_event(TRACE_COMMIT, 0, token->res_id, error, new_leader.lver,
+		    new_leader.owner_id);
 	if (error < 0) {
 		/* See comment in run_ballot about this flag. */
 		token->flags |= T_RETRACT_PAXOS;
@@ -2340,7 +2583,7 @@ int paxos_lease_init(struct task *task,
 		     struct token *token,
 		     int num_hosts, int max_hosts, int write_clear)
 {
-	char *iobuf, **p_iobuf;
+	char *iobuf;
 	struct leader_record leader;
 	struct leader_record leader_end;
 	struct request_record rr;
@@ -2377,9 +2620,7 @@ int paxos_lease_init(struct task *task,
 
 	iobuf_len = align_size;
 
-	p_iobuf = &iobuf;
-
-	rv = posix_memalign((void *)p_iobuf, getpagesize(), iobuf_len);
+	rv = alloc_iobuf(&iobuf, iobuf_len);
 	if (rv)
 		return rv;
 
@@ -2433,7 +2674,7 @@ int paxos_lease_init(struct task *task,
 	}
 
 	if (!aio_timeout)
-		free(iobuf);
+		free_iobuf(iobuf, iobuf_len);
 
 	return 0;
 }
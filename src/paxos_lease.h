@@ -24,6 +24,8 @@ int paxos_lease_leader_read(struct task *task,
 			    struct leader_record *leader_ret,
 			    const char *caller);
 
+int paxos_retry_delay(struct token *token, int contenders, int prev_us);
+
 int paxos_lease_acquire(struct task *task,
 			struct token *token,
 			uint32_t flags,
@@ -52,6 +54,10 @@ int paxos_read_resource(struct task *task,
 			struct token *token,
 			struct sanlk_resource *res);
 
+int paxos_lease_hosts(struct token *token, int num_hosts);
+
+int paxos_read_len(struct token *token);
+
 int paxos_read_buf(struct task *task,
                    struct token *token,
                    char **buf_out);
@@ -24,6 +24,7 @@
 #include <sys/time.h>
 
 #include "sanlock_internal.h"
+#include "sanlock_admin.h"
 #include "diskio.h"
 #include "ondisk.h"
 #include "log.h"
@@ -33,29 +34,220 @@
 #include "task.h"
 #include "timeouts.h"
 #include "helper.h"
+#include "latency.h"
+#include "shm_state.h"
 
 /* from cmd.c */
-void send_state_resource(int fd, struct resource *r, const char *list_name, int pid, uint32_t token_id);
+void add_state_resource(struct state_buf *sb, struct resource *r, const char *list_name, int pid, uint32_t token_id);
+void add_state_lat(struct state_buf *sb, const char *space_name, const char *res_name, struct lat_stats *lat);
+void state_buf_flush(struct state_buf *sb);
 
 /* from main.c */
 int get_rand(int a, int b);
 
-static pthread_t resource_pt;
-static int resource_thread_stop;
-static int resource_thread_work;
-static int resource_thread_work_examine;
-static struct list_head resources_free;
-static struct list_head resources_held;
-static struct list_head resources_add;
-static struct list_head resources_rem;
-static struct list_head resources_orphan;
-static pthread_mutex_t resource_mutex;
+static pthread_t *resource_pts;
+static int resource_pts_count;
+static pthread_t host_event_pt;
+
+/*
+ * The resource state is divided into shards by a hash of the lockspace and
+ * resource name, so operations on unrelated resources don't contend for one
+ * lock.  Each shard has its own mutex protecting its add, held, rem and orphan
+ * lists, the hash table indexing them, its free list, the per-lockspace
+ * counts of its resources, and its resource_thread work flags.
+ *
+ * A pool of resource_thread workers (resource_workers config, default 4) does
+ * async releases and examines, so a slow release on one disk doesn't hold up
+ * the others.  Host event callbacks are done by a separate host_event_thread
+ * so they are not delayed behind release i/o.
+ *
+ * A resource (and each token for it) always maps to the same shard.
+ * Operations on one resource lock only its shard; operations on a lockspace
+ * or on everything (state reporting, purging, examine, orphans) lock the
+ * shards one at a time.
+ *
+ * resource_thread_mutex protects the resource_thread wakeup,
+ * host_event_mutex protects host_events, and acquire_wait_mutex protects
+ * acquire_waiters.
+ *
+ * Lock ordering:
+ * spaces_mutex, then one shard mutex, then resource_thread_mutex.
+ * host_event_mutex and acquire_wait_mutex are not held with any other lock.
+ *
+ * Only one shard mutex is held at a time, and spaces_mutex (i.e. lockspace.c
+ * functions) must not be called with a shard mutex held.  lock_shard checks
+ * the first, and check_resource_unlocked, called from lockspace.c functions
+ * used by the resource code, checks the second.
+ */
+
+#define RESOURCE_SHARDS 16
+#define RESOURCE_SHARD_HASH 256
+
+#define FREE_RES_COUNT 128
+#define FREE_RES_COUNT_SHARD (FREE_RES_COUNT / RESOURCE_SHARDS)
+
+#define RES_LIST_NONE   0
+#define RES_LIST_ADD    1
+#define RES_LIST_HELD   2
+#define RES_LIST_REM    3
+#define RES_LIST_ORPHAN 4
+
+/* counts of a lockspace's resources on the add, held, rem and orphan lists */
+
+struct resource_space {
+	struct list_head list;
+	char space_name[NAME_ID_SIZE];
+	int used;
+	int held;
+	int orphans;
+};
+
+struct resource_shard {
+	pthread_mutex_t mutex;
+	struct list_head resources_free;
+	struct list_head resources_held;
+	struct list_head resources_add;
+	struct list_head resources_rem;
+	struct list_head resources_orphan;
+	struct list_head hash[RESOURCE_SHARD_HASH];
+	struct list_head spaces;
+	int spaces_invalid;
+	int free_count;
+	int thread_work;
+	int thread_work_examine;
+};
+
+static struct resource_shard resource_shards[RESOURCE_SHARDS];
+
+static pthread_mutex_t resource_thread_mutex;
 static pthread_cond_t resource_cond;
+static int resource_thread_wake;
+static int resource_thread_stop;
+
+static pthread_mutex_t host_event_mutex;
+static pthread_cond_t host_event_cond;
 static struct list_head host_events;
-static int resources_free_count;
+static int host_event_stop;
+
+static pthread_mutex_t resource_id_mutex;
 static uint32_t resource_id_counter = 1;
 
-#define FREE_RES_COUNT 128
+/*
+ * An acquire with SANLK_ACQUIRE_WAIT that finds its resources held parks
+ * its worker thread in acquire_wait() instead of returning the error to a
+ * client that would sleep and retry.  The waiter is woken when a local
+ * holder releases one of its resources, and otherwise sleeps until the
+ * owner's lease could have expired, or polls the leader with a backoff
+ * while the owner is alive.
+ */
+
+struct acquire_waiter {
+	struct list_head list;
+	struct token **tokens;
+	int count;
+	int woken;
+	pthread_cond_t cond;
+};
+
+static pthread_mutex_t acquire_wait_mutex;
+static struct list_head acquire_waiters;
+static int acquire_waiters_count;
+
+static __thread int shard_locked;
+
+static uint32_t resource_hash_key(const char *space_name, const char *res_name)
+{
+	uint32_t h = 2166136261U;
+	int i;
+
+	for (i = 0; i < NAME_ID_SIZE && space_name[i]; i++)
+		h = (h ^ (uint8_t)space_name[i]) * 16777619U;
+
+	h = (h ^ ':') * 16777619U;
+
+	for (i = 0; i < NAME_ID_SIZE && res_name[i]; i++)
+		h = (h ^ (uint8_t)res_name[i]) * 16777619U;
+
+	return h;
+}
+
+static struct resource_shard *name_shard(const char *space_name, const char *res_name)
+{
+	return &resource_shards[resource_hash_key(space_name, res_name) % RESOURCE_SHARDS];
+}
+
+static struct resource_shard *token_shard(struct token *token)
+{
+	return name_shard(token->r.lockspace_name, token->r.name);
+}
+
+static struct resource_shard *resource_shard(struct resource *r)
+{
+	return name_shard(r->r.lockspace_name, r->r.name);
+}
+
+static struct list_head *shard_bucket(struct resource_shard *sh,
+				      const char *space_name, const char *res_name)
+{
+	uint32_t key = resource_hash_key(space_name, res_name);
+
+	return &sh->hash[(key / RESOURCE_SHARDS) % RESOURCE_SHARD_HASH];
+}
+
+static void lock_shard(struct resource_shard *sh)
+{
+	if (shard_locked)
+		log_error("lock order: shard %d locked while holding another",
+			  (int)(sh - resource_shards));
+
+	pthread_mutex_lock(&sh->mutex);
+	shard_locked++;
+}
+
+static void unlock_shard(struct resource_shard *sh)
+{
+	shard_locked--;
+	pthread_mutex_unlock(&sh->mutex);
+}
+
+void check_resource_unlocked(const char *caller)
+{
+	if (shard_locked)
+		log_error("lock order: %s called with resource shard locked", caller);
+}
+
+static void wake_resource_thread(void)
+{
+	pthread_mutex_lock(&resource_thread_mutex);
+	resource_thread_wake = 1;
+	pthread_cond_signal(&resource_cond);
+	pthread_mutex_unlock(&resource_thread_mutex);
+}
+
+static void wake_acquire_waiters(struct token *token)
+{
+	struct acquire_waiter *aw;
+	struct token *wt;
+	int i;
+
+	pthread_mutex_lock(&acquire_wait_mutex);
+	list_for_each_entry(aw, &acquire_waiters, list) {
+		for (i = 0; i < aw->count; i++) {
+			wt = aw->tokens[i];
+			/* a waiter releasing its own acquired tokens */
+			if (wt == token)
+				continue;
+			if (strncmp(wt->r.lockspace_name, token->r.lockspace_name, NAME_ID_SIZE))
+				continue;
+			if (strncmp(wt->r.name, token->r.name, NAME_ID_SIZE))
+				continue;
+			aw->woken = 1;
+			pthread_cond_signal(&aw->cond);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&acquire_wait_mutex);
+}
 
 /*
  * There's not much advantage to saving resource structs and reusing them again
@@ -64,9 +256,12 @@ static uint32_t resource_id_counter = 1;
  * isn't logged each time it's requested.  There may be some other
  * optimizations that could be added.  We may want per-lockspace lists of
  * resources, or purge free resources when lockspaces are removed.
+ *
+ * A free resource is only reused for the same lockspace and resource name,
+ * so it's saved on the free list of the shard for that name.
  */
 
-static void free_resource(struct resource *r)
+static void free_resource(struct resource_shard *sh, struct resource *r)
 {
 	struct resource *rtmp = NULL;
 	struct resource *rmin = NULL;
@@ -74,15 +269,15 @@ static void free_resource(struct resource *r)
 	if (r->lvb)
 		free(r->lvb);
 
-	if (resources_free_count < FREE_RES_COUNT) {
-		resources_free_count++;
-		list_add(&r->list, &resources_free);
+	if (sh->free_count < FREE_RES_COUNT_SHARD) {
+		sh->free_count++;
+		list_add(&r->list, &sh->resources_free);
 		return;
 	}
 
 	/* the max are being saved, free the least used before saving this one */
 
-	list_for_each_entry_reverse(rtmp, &resources_free, list) {
+	list_for_each_entry_reverse(rtmp, &sh->resources_free, list) {
 		if (!rtmp->reused) {
 			list_del(&rtmp->list);
 			free(rtmp);
@@ -98,15 +293,16 @@ static void free_resource(struct resource *r)
 		free(rmin);
 	}
  out:
-	list_add(&r->list, &resources_free);
+	list_add(&r->list, &sh->resources_free);
 }
 
-static struct resource *get_free_resource(struct token *token, int *token_matches)
+static struct resource *get_free_resource(struct resource_shard *sh, struct token *token,
+					  int *token_matches)
 {
 	struct resource *r;
 
 	/* find a previous r that matches token */
-	list_for_each_entry(r, &resources_free, list) {
+	list_for_each_entry(r, &sh->resources_free, list) {
 		if (strcmp(r->r.lockspace_name, token->r.lockspace_name))
 			continue;
 		if (strcmp(r->r.name, token->r.name))
@@ -117,7 +313,7 @@ static struct resource *get_free_resource(struct token *token, int *token_matche
 			continue;
 
 		*token_matches = 1;
-		resources_free_count--;
+		sh->free_count--;
 		list_del(&r->list);
 		r->reused++;
 		return r;
@@ -126,32 +322,306 @@ static struct resource *get_free_resource(struct token *token, int *token_matche
 	return NULL;
 }
 
+static struct resource_space *find_resource_space(struct resource_shard *sh,
+						  const char *space_name)
+{
+	struct resource_space *rs;
+
+	list_for_each_entry(rs, &sh->spaces, list) {
+		if (!strncmp(rs->space_name, space_name, NAME_ID_SIZE))
+			return rs;
+	}
+	return NULL;
+}
+
+static int res_list_num(struct resource_shard *sh, struct list_head *head)
+{
+	if (head == &sh->resources_add)
+		return RES_LIST_ADD;
+	if (head == &sh->resources_held)
+		return RES_LIST_HELD;
+	if (head == &sh->resources_rem)
+		return RES_LIST_REM;
+	if (head == &sh->resources_orphan)
+		return RES_LIST_ORPHAN;
+	return RES_LIST_NONE;
+}
+
+/* update the shard hash and space counts for r moving to list num */
+
+static void resource_index(struct resource_shard *sh, struct resource *r, int num)
+{
+	struct resource_space *rs;
+
+	if (r->on_list == num)
+		return;
+
+	rs = find_resource_space(sh, r->r.lockspace_name);
+
+	if (r->on_list == RES_LIST_NONE) {
+		list_add(&r->hash_list, shard_bucket(sh, r->r.lockspace_name, r->r.name));
+
+		if (!rs) {
+			rs = malloc(sizeof(struct resource_space));
+			if (!rs) {
+				/* the counts can't be trusted after this */
+				log_error("resource_index no mem %.48s", r->r.lockspace_name);
+				sh->spaces_invalid = 1;
+			} else {
+				memset(rs, 0, sizeof(struct resource_space));
+				memcpy(rs->space_name, r->r.lockspace_name, NAME_ID_SIZE);
+				list_add(&rs->list, &sh->spaces);
+			}
+		}
+		if (rs)
+			rs->used++;
+	} else if (num == RES_LIST_NONE) {
+		list_del(&r->hash_list);
+
+		if (rs)
+			rs->used--;
+	}
+
+	if (rs) {
+		if (r->on_list == RES_LIST_ORPHAN)
+			rs->orphans--;
+		if (num == RES_LIST_ORPHAN)
+			rs->orphans++;
+		if (r->on_list == RES_LIST_HELD)
+			rs->held--;
+		if (num == RES_LIST_HELD)
+			rs->held++;
+
+		if (!rs->used) {
+			list_del(&rs->list);
+			free(rs);
+		}
+	}
+
+	r->on_list = num;
+}
+
+/* put r on one of the shard's add, held, rem or orphan lists */
+
+static void move_resource(struct resource_shard *sh, struct resource *r,
+			  struct list_head *head)
+{
+	if (r->on_list == RES_LIST_NONE)
+		list_add(&r->list, head);
+	else
+		list_move(&r->list, head);
+
+	resource_index(sh, r, res_list_num(sh, head));
+}
+
+/* take r off of the add, held, rem or orphan list it's on */
+
+static void del_resource(struct resource_shard *sh, struct resource *r)
+{
+	list_del(&r->list);
+	resource_index(sh, r, RES_LIST_NONE);
+}
+
+static struct resource *find_resource_name(struct resource_shard *sh,
+					   const char *space_name,
+					   const char *res_name,
+					   struct list_head *head)
+{
+	struct resource *r;
+	int num = res_list_num(sh, head);
+
+	list_for_each_entry(r, shard_bucket(sh, space_name, res_name), hash_list) {
+		if (r->on_list != num)
+			continue;
+		if (strncmp(r->r.lockspace_name, space_name, NAME_ID_SIZE))
+			continue;
+		if (strncmp(r->r.name, res_name, NAME_ID_SIZE))
+			continue;
+		return r;
+	}
+	return NULL;
+}
+
+static struct resource *find_resource(struct resource_shard *sh, struct token *token,
+				      struct list_head *head)
+{
+	return find_resource_name(sh, token->r.lockspace_name, token->r.name, head);
+}
+
 /* N.B. the reporting function looks for the
    strings "add" and "rem", so if changed, they
    should be changed in both places. */
 
-void send_state_resources(int fd)
+void add_state_resources(struct state_buf *sb)
 {
+	struct resource_shard *sh;
 	struct resource *r;
 	struct token *token;
+	int i;
+
+	for (i = 0; i < RESOURCE_SHARDS; i++) {
+		sh = &resource_shards[i];
+
+		lock_shard(sh);
+		list_for_each_entry(r, &sh->resources_held, list) {
+			list_for_each_entry(token, &r->tokens, list)
+				add_state_resource(sb, r, "held", token->pid, token->token_id);
+		}
+
+		list_for_each_entry(r, &sh->resources_add, list) {
+			list_for_each_entry(token, &r->tokens, list)
+				add_state_resource(sb, r, "add", token->pid, token->token_id);
+		}
+
+		list_for_each_entry(r, &sh->resources_rem, list)
+			add_state_resource(sb, r, "rem", r->pid, 0);
+
+		list_for_each_entry(r, &sh->resources_orphan, list)
+			add_state_resource(sb, r, "orphan", r->pid, 0);
+		unlock_shard(sh);
+
+		state_buf_flush(sb);
+	}
+}
+
+static int shm_add_resource(struct shm_build *resb, struct resource *r,
+			    int pid, uint32_t flags)
+{
+	struct sanlk_shm_resource *sr;
+
+	sr = shm_build_add(resb, sizeof(struct sanlk_shm_resource));
+	if (!sr)
+		return -ENOMEM;
+
+	memcpy(sr->lockspace_name, r->r.lockspace_name, NAME_ID_SIZE);
+	memcpy(sr->name, r->r.name, NAME_ID_SIZE);
+	sr->lver = r->leader.lver;
+	sr->pid = pid;
+	sr->res_flags = (r->flags & R_SHARED) ? SANLK_RES_SHARED : 0;
+	sr->flags = flags;
+	return 0;
+}
+
+/* the same resources as "sanlock client status", see add_state_resources */
+
+void shm_state_resources(struct shm_build *resb)
+{
+	struct resource_shard *sh;
+	struct resource *r;
+	struct token *token;
+	int i, rv = 0;
+
+	for (i = 0; i < RESOURCE_SHARDS && !rv; i++) {
+		sh = &resource_shards[i];
 
-	pthread_mutex_lock(&resource_mutex);
-	list_for_each_entry(r, &resources_held, list) {
-		list_for_each_entry(token, &r->tokens, list)
-			send_state_resource(fd, r, "held", token->pid, token->token_id);
+		lock_shard(sh);
+		list_for_each_entry(r, &sh->resources_held, list) {
+			list_for_each_entry(token, &r->tokens, list) {
+				if (!rv)
+					rv = shm_add_resource(resb, r, token->pid, 0);
+			}
+		}
+
+		list_for_each_entry(r, &sh->resources_add, list) {
+			list_for_each_entry(token, &r->tokens, list) {
+				if (!rv)
+					rv = shm_add_resource(resb, r, token->pid, SANLK_SHM_RES_ADD);
+			}
+		}
+
+		list_for_each_entry(r, &sh->resources_rem, list) {
+			if (!rv)
+				rv = shm_add_resource(resb, r, r->pid, SANLK_SHM_RES_REM);
+		}
+
+		list_for_each_entry(r, &sh->resources_orphan, list) {
+			if (!rv)
+				rv = shm_add_resource(resb, r, r->pid, SANLK_SHM_RES_ORPHAN);
+		}
+		unlock_shard(sh);
 	}
+}
+
+static void add_lat_list(struct state_buf *sb, const char *space_name, struct list_head *head)
+{
+	struct resource *r;
+
+	list_for_each_entry(r, head, list) {
+		if (strncmp(r->r.lockspace_name, space_name, NAME_ID_SIZE))
+			continue;
+		add_state_lat(sb, space_name, r->r.name, &r->lat);
+	}
+}
+
+static struct space_metrics *find_space_metrics(struct space_metrics *sms, int count,
+						const char *space_name)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (!strncmp(sms[i].space_name, space_name, NAME_ID_SIZE))
+			return &sms[i];
+	}
+	return NULL;
+}
+
+/*
+ * One pass over the shards fills in sm->held for every lockspace,
+ * using the per shard lockspace counts rather than the resources.
+ */
+
+void resource_held_counts(struct space_metrics *sms, int count)
+{
+	struct resource_shard *sh;
+	struct resource_space *rs;
+	struct space_metrics *sm;
+	struct resource *r;
+	int i;
+
+	for (i = 0; i < count; i++)
+		sms[i].held = 0;
+
+	for (i = 0; i < RESOURCE_SHARDS; i++) {
+		sh = &resource_shards[i];
 
-	list_for_each_entry(r, &resources_add, list) {
-		list_for_each_entry(token, &r->tokens, list)
-			send_state_resource(fd, r, "add", token->pid, token->token_id);
+		lock_shard(sh);
+		if (sh->spaces_invalid) {
+			list_for_each_entry(r, &sh->resources_held, list) {
+				sm = find_space_metrics(sms, count, r->r.lockspace_name);
+				if (sm)
+					sm->held++;
+			}
+		} else {
+			list_for_each_entry(rs, &sh->spaces, list) {
+				sm = find_space_metrics(sms, count, rs->space_name);
+				if (sm)
+					sm->held += rs->held;
+			}
+		}
+		unlock_shard(sh);
 	}
+}
 
-	list_for_each_entry(r, &resources_rem, list)
-		send_state_resource(fd, r, "rem", r->pid, 0);
+/* free resources are included since they keep the counts for reuse */
 
-	list_for_each_entry(r, &resources_orphan, list)
-		send_state_resource(fd, r, "orphan", r->pid, 0);
-	pthread_mutex_unlock(&resource_mutex);
+void add_lat_resources(struct state_buf *sb, const char *space_name)
+{
+	struct resource_shard *sh;
+	int i;
+
+	for (i = 0; i < RESOURCE_SHARDS; i++) {
+		sh = &resource_shards[i];
+
+		lock_shard(sh);
+		add_lat_list(sb, space_name, &sh->resources_held);
+		add_lat_list(sb, space_name, &sh->resources_add);
+		add_lat_list(sb, space_name, &sh->resources_rem);
+		add_lat_list(sb, space_name, &sh->resources_orphan);
+		add_lat_list(sb, space_name, &sh->resources_free);
+		unlock_shard(sh);
+
+		state_buf_flush(sb);
+	}
 }
 
 int read_resource_owners(struct task *task, struct token *token,
@@ -169,7 +639,9 @@ int read_resource_owners(struct task *task, struct token *token,
 	char *lease_buf_dblock;
 	char *lease_buf = NULL;
 	char *hosts_buf = NULL;
+	int lease_buf_len;
 	int host_count = 0;
+	int num_hosts;
 	int i, rv;
 
 	disk = &token->disks[0];
@@ -186,12 +658,14 @@ int read_resource_owners(struct task *task, struct token *token,
 
 	/* we could in-line paxos_read_buf here like we do in read_mode_block */
  retry:
+	lease_buf_len = paxos_read_len(token);
+
 	rv = paxos_read_buf(task, token, &lease_buf);
 	if (rv < 0) {
 		log_errot(token, "read_resource_owners read_buf rv %d", rv);
 
 		if (lease_buf && (rv != SANLK_AIO_TIMEOUT))
-			free(lease_buf);
+			free_iobuf(lease_buf, lease_buf_len);
 		return rv;
 	}
 
@@ -205,7 +679,7 @@ int read_resource_owners(struct task *task, struct token *token,
 		/* user flag was wrong */
 		token->sector_size = 4096;
 		token->align_size  = sector_size_to_align_size(4096);
-		free(lease_buf);
+		free_iobuf(lease_buf, lease_buf_len);
 		lease_buf = NULL;
 		goto retry;
 	}
@@ -218,11 +692,12 @@ int read_resource_owners(struct task *task, struct token *token,
 		goto out;
 
 	res->lver = leader.lver;
+	num_hosts = paxos_lease_hosts(token, leader.num_hosts);
 
 	if (leader.timestamp && leader.owner_id)
 		host_count++;
 
-	for (i = 0; i < leader.num_hosts; i++) {
+	for (i = 0; i < num_hosts; i++) {
 		lease_buf_dblock = lease_buf + ((2 + i) * token->sector_size);
 		mb_end = (struct mode_block *)(lease_buf_dblock + MBLOCK_OFFSET);
 
@@ -274,7 +749,7 @@ int read_resource_owners(struct task *task, struct token *token,
 		host++;
 	}
 
-	for (i = 0; i < leader.num_hosts; i++) {
+	for (i = 0; i < num_hosts; i++) {
 		lease_buf_dblock = lease_buf + ((2 + i) * token->sector_size);
 		mb_end = (struct mode_block *)(lease_buf_dblock + MBLOCK_OFFSET);
 
@@ -296,7 +771,7 @@ int read_resource_owners(struct task *task, struct token *token,
  out:
 	*send_len = host_count * sizeof(struct sanlk_host);
 	*send_buf = hosts_buf;
-	free(lease_buf);
+	free_iobuf(lease_buf, lease_buf_len);
 	return rv;
 }
 
@@ -393,8 +868,9 @@ static int write_host_block(struct task *task, struct token *token,
 	struct mode_block mb;
 	struct mode_block mb_end;
 	struct paxos_dblock pd_end;
-	char *iobuf, **p_iobuf;
+	char *iobuf;
 	uint64_t offset;
+	uint64_t begin;
 	uint32_t checksum;
 	int num_disks = token->r.num_disks;
 	int iobuf_len, rv, d;
@@ -405,9 +881,7 @@ static int write_host_block(struct task *task, struct token *token,
 	if (!iobuf_len)
 		return -EINVAL;
 
-	p_iobuf = &iobuf;
-
-	rv = posix_memalign((void *)p_iobuf, getpagesize(), iobuf_len);
+	rv = alloc_iobuf(&iobuf, iobuf_len);
 	if (rv)
 		return -ENOMEM;
 
@@ -435,6 +909,8 @@ static int write_host_block(struct task *task, struct token *token,
 		memcpy(iobuf + MBLOCK_OFFSET, &mb_end, sizeof(struct mode_block));
 	}
 
+	begin = lat_begin();
+
 	for (d = 0; d < num_disks; d++) {
 		disk = &token->disks[d];
 
@@ -445,6 +921,8 @@ static int write_host_block(struct task *task, struct token *token,
 			break;
 	}
 
+	lat_end(&token->lat, LAT_MODE_WRITE, begin, rv < 0);
+
 	if (rv < 0) {
 		log_errot(token, "write_host_block host_id %llu flags %x gen %llu rv %d",
 			  (unsigned long long)host_id, mb_flags, (unsigned long long)mb_gen, rv);
@@ -467,7 +945,7 @@ static int write_host_block(struct task *task, struct token *token,
 	}
 
 	if (rv != SANLK_AIO_TIMEOUT)
-		free(iobuf);
+		free_iobuf(iobuf, iobuf_len);
 	return rv;
 }
 
@@ -500,7 +978,7 @@ static int read_mode_block(struct task *task, struct token *token,
 	struct sync_disk *disk;
 	struct mode_block *mb_end;
 	struct mode_block mb;
-	char *iobuf, **p_iobuf;
+	char *iobuf;
 	uint64_t offset;
 	int num_disks = token->r.num_disks;
 	int iobuf_len, rv, d;
@@ -511,9 +989,7 @@ static int read_mode_block(struct task *task, struct token *token,
 	if (!iobuf_len)
 		return -EINVAL;
 
-	p_iobuf = &iobuf;
-
-	rv = posix_memalign((void *)p_iobuf, getpagesize(), iobuf_len);
+	rv = alloc_iobuf(&iobuf, iobuf_len);
 	if (rv)
 		return -ENOMEM;
 
@@ -537,7 +1013,7 @@ static int read_mode_block(struct task *task, struct token *token,
 	}
 
 	if (rv != SANLK_AIO_TIMEOUT)
-		free(iobuf);
+		free_iobuf(iobuf, iobuf_len);
 
 	return rv;
 }
@@ -620,7 +1096,7 @@ static int read_lvb_block(struct task *task, struct token *token)
 	struct sync_disk *disk;
 	struct resource *r;
 	char *iobuf;
-	uint64_t offset;
+	uint64_t offset, begin;
 	int iobuf_len, rv;
 
 	r = token->resource;
@@ -632,7 +1108,9 @@ static int read_lvb_block(struct task *task, struct token *token)
 	if (!r->lvb)
 		return 0;
 
+	begin = lat_begin();
 	rv = read_iobuf(disk->fd, offset, iobuf, iobuf_len, task, token->io_timeout, NULL);
+	lat_end(&token->lat, LAT_LVB_READ, begin, rv < 0);
 
 	return rv;
 }
@@ -641,7 +1119,7 @@ static int write_lvb_block(struct task *task, struct resource *r, struct token *
 {
 	struct sync_disk *disk;
 	char *iobuf;
-	uint64_t offset;
+	uint64_t offset, begin;
 	int iobuf_len, rv;
 
 	disk = &token->disks[0];
@@ -652,78 +1130,92 @@ static int write_lvb_block(struct task *task, struct resource *r, struct token *
 	if (!r->lvb)
 		return 0;
 
+	begin = lat_begin();
 	rv = write_iobuf(disk->fd, offset, iobuf, iobuf_len, task, token->io_timeout, NULL);
+	lat_end(&token->lat, LAT_LVB_WRITE, begin, rv < 0);
 
 	return rv;
 }
 
+/*
+ * Add the io timed in the token since it was last saved to the totals
+ * for the resource and lockspace.
+ */
+
+static void save_token_lat(struct resource_shard *sh, struct resource *r,
+			   struct token *token)
+{
+	lock_shard(sh);
+	lat_add(&r->lat, &token->lat);
+	unlock_shard(sh);
+
+	lockspace_add_lat(token->r.lockspace_name, &token->lat);
+	memset(&token->lat, 0, sizeof(token->lat));
+}
+
 int res_set_lvb(struct sanlk_resource *res, char *lvb, int lvblen)
 {
+	struct resource_shard *sh = name_shard(res->lockspace_name, res->name);
 	struct resource *r;
 	int rv = -ENOENT;
 
-	pthread_mutex_lock(&resource_mutex);
-	list_for_each_entry(r, &resources_held, list) {
-		if (strncmp(r->r.lockspace_name, res->lockspace_name, NAME_ID_SIZE))
-			continue;
-		if (strncmp(r->r.name, res->name, NAME_ID_SIZE))
-			continue;
-
-		if (!r->lvb) {
-			rv = -EINVAL;
-			break;
-		}
+	lock_shard(sh);
+	r = find_resource_name(sh, res->lockspace_name, res->name, &sh->resources_held);
+	if (!r)
+		goto out;
 
-		if (lvblen > r->leader.sector_size) {
-			rv = -E2BIG;
-			break;
-		}
+	if (!r->lvb) {
+		rv = -EINVAL;
+		goto out;
+	}
 
-		memcpy(r->lvb, lvb, lvblen);
-		r->flags |= R_LVB_WRITE_RELEASE;
-		rv = 0;
-		break;
+	if (lvblen > r->leader.sector_size) {
+		rv = -E2BIG;
+		goto out;
 	}
-	pthread_mutex_unlock(&resource_mutex);
+
+	memcpy(r->lvb, lvb, lvblen);
+	r->flags |= R_LVB_WRITE_RELEASE;
+	rv = 0;
+ out:
+	unlock_shard(sh);
 
 	return rv;
 }
 
 int res_get_lvb(struct sanlk_resource *res, char **lvb_out, int *lvblen)
 {
+	struct resource_shard *sh = name_shard(res->lockspace_name, res->name);
 	struct resource *r;
 	char *lvb;
 	int rv = -ENOENT;
 	int len = *lvblen;
 
-	pthread_mutex_lock(&resource_mutex);
-	list_for_each_entry(r, &resources_held, list) {
-		if (strncmp(r->r.lockspace_name, res->lockspace_name, NAME_ID_SIZE))
-			continue;
-		if (strncmp(r->r.name, res->name, NAME_ID_SIZE))
-			continue;
-
-		if (!r->lvb) {
-			rv = -EINVAL;
-			break;
-		}
+	lock_shard(sh);
+	r = find_resource_name(sh, res->lockspace_name, res->name, &sh->resources_held);
+	if (!r)
+		goto out;
 
-		if (!len)
-			len = r->leader.sector_size;
+	if (!r->lvb) {
+		rv = -EINVAL;
+		goto out;
+	}
 
-		lvb = malloc(len);
-		if (!lvb) {
-			rv = -ENOMEM;
-			break;
-		}
+	if (!len)
+		len = r->leader.sector_size;
 
-		memcpy(lvb, r->lvb, len);
-		*lvb_out = lvb;
-		*lvblen = len;
-		rv = 0;
-		break;
+	lvb = malloc(len);
+	if (!lvb) {
+		rv = -ENOMEM;
+		goto out;
 	}
-	pthread_mutex_unlock(&resource_mutex);
+
+	memcpy(lvb, r->lvb, len);
+	*lvb_out = lvb;
+	*lvblen = len;
+	rv = 0;
+ out:
+	unlock_shard(sh);
 
 	return rv;
 }
@@ -899,6 +1391,7 @@ static int _release_token(struct task *task, struct token *token,
 {
 	struct leader_record leader;
 	struct resource *r = token->resource;
+	struct resource_shard *sh = token_shard(token);
 	uint64_t lver;
 	uint32_t r_flags = 0;
 	int retry_async = 0;
@@ -912,20 +1405,21 @@ static int _release_token(struct task *task, struct token *token,
 	   acquiring the same resource.  While on the rem list, the resource
 	   can't be used by anyone. */
 
-	pthread_mutex_lock(&resource_mutex);
+	lock_shard(sh);
 	list_del(&token->list);
 	if (list_empty(&r->tokens)) {
-		list_move(&r->list, &resources_rem);
+		move_resource(sh, r, &sh->resources_rem);
 		last_token = 1;
 	}
 	lver = r->leader.lver;
 	r_flags = r->flags;
-	pthread_mutex_unlock(&resource_mutex);
+	unlock_shard(sh);
 
 	if ((r_flags & R_SHARED) && !last_token) {
 		/* will release when final sh token is released */
 		log_token(token, "release_token more shared");
 		close_disks(token->disks, token->r.num_disks);
+		save_token_lat(sh, r, token);
 		return SANLK_OK;
 	}
 
@@ -946,7 +1440,8 @@ static int _release_token(struct task *task, struct token *token,
 		goto out;
 
 	if (!opened) {
-		rv = open_disks_fd(token->disks, token->r.num_disks);
+		rv = open_disks_fd_cached(token->disks, token->r.num_disks,
+					  token->r.lockspace_name);
 		if (rv < 0) {
 			log_errot(token, "release_token open error %d", rv);
 			ret = rv;
@@ -1066,15 +1561,21 @@ static int _release_token(struct task *task, struct token *token,
 
 	close_disks(token->disks, token->r.num_disks);
  out:
+	save_token_lat(sh, r, token);
+
 	if (!retry_async) {
 		if (ret != SANLK_OK)
 			log_token(token, "release_token error %d r_flags %x", ret, r_flags);
 		else
 			log_token(token, "release_token done r_flags %x", r_flags);
-		pthread_mutex_lock(&resource_mutex);
-		list_del(&r->list);
-		free_resource(r);
-		pthread_mutex_unlock(&resource_mutex);
+		lock_shard(sh);
+		del_resource(sh, r);
+		free_resource(sh, r);
+		unlock_shard(sh);
+
+		/* zero lver is a failed acquire closing its disks */
+		if (lver)
+			wake_acquire_waiters(token);
 		return ret;
 	}
 
@@ -1087,9 +1588,9 @@ static int _release_token(struct task *task, struct token *token,
 	 */
 
 	log_errot(token, "release_token timeout r_flags %x", r_flags);
-	pthread_mutex_lock(&resource_mutex);
+	lock_shard(sh);
 	r->flags |= R_THREAD_RELEASE;
-	pthread_mutex_unlock(&resource_mutex);
+	unlock_shard(sh);
 	return SANLK_AIO_TIMEOUT;
 }
 
@@ -1106,7 +1607,14 @@ static int release_token_opened(struct task *task, struct token *token)
 int release_token(struct task *task, struct token *token,
 		  struct sanlk_resource *resrename)
 {
-	return _release_token(task, token, resrename, 0, 0);
+	int rv;
+
+	rv = _release_token(task, token, resrename, 0, 0);
+
+	counter_inc(counters.releases);
+	if (rv < 0)
+		counter_inc(counters.release_errors);
+	return rv;
 }
 
 /* We're releasing a token from the main thread, in which we don't want to block,
@@ -1116,41 +1624,51 @@ int release_token(struct task *task, struct token *token,
 void release_token_async(struct token *token)
 {
 	struct resource *r = token->resource;
+	struct resource_shard *sh = token_shard(token);
+	int wake = 0;
 
-	pthread_mutex_lock(&resource_mutex);
+	lock_shard(sh);
 	list_del(&token->list);
 	if (list_empty(&r->tokens)) {
 		if (token->space_dead || !r->leader.lver) {
 			/* don't bother trying to release if the lockspace
 			   is dead (release will probably fail), or the
 			   lease was never acquired */
-			list_del(&r->list);
-			free_resource(r);
+			del_resource(sh, r);
+			free_resource(sh, r);
 		} else if (token->acquire_flags & SANLK_RES_PERSISTENT) {
-			list_move(&r->list, &resources_orphan);
+			move_resource(sh, r, &sh->resources_orphan);
 		} else {
 			r->flags |= R_THREAD_RELEASE;
-			resource_thread_work = 1;
-			list_move(&r->list, &resources_rem);
-			pthread_cond_signal(&resource_cond);
+			sh->thread_work = 1;
+			move_resource(sh, r, &sh->resources_rem);
+			wake = 1;
 		}
 	}
-	pthread_mutex_unlock(&resource_mutex);
+	unlock_shard(sh);
+
+	if (wake)
+		wake_resource_thread();
 }
 
-static struct resource *find_resource(struct token *token,
-				      struct list_head *head)
+/* fallback for shard space counts that are not valid */
+
+static int count_space_resources(struct resource_shard *sh,
+				 const char *space_name, int orphans_only)
 {
+	struct list_head *heads[4] = { &sh->resources_orphan, &sh->resources_held,
+				       &sh->resources_add, &sh->resources_rem };
 	struct resource *r;
+	int count = 0;
+	int i;
 
-	list_for_each_entry(r, head, list) {
-		if (strncmp(r->r.lockspace_name, token->r.lockspace_name, NAME_ID_SIZE))
-			continue;
-		if (strncmp(r->r.name, token->r.name, NAME_ID_SIZE))
-			continue;
-		return r;
+	for (i = 0; i < (orphans_only ? 1 : 4); i++) {
+		list_for_each_entry(r, heads[i], list) {
+			if (!strncmp(r->r.lockspace_name, space_name, NAME_ID_SIZE))
+				count++;
+		}
 	}
-	return NULL;
+	return count;
 }
 
 /*
@@ -1160,45 +1678,48 @@ static struct resource *find_resource(struct token *token,
 
 int lockspace_is_used(struct sanlk_lockspace *ls)
 {
-	struct resource *r;
+	struct resource_shard *sh;
+	struct resource_space *rs;
+	int used = 0;
+	int i;
 
-	pthread_mutex_lock(&resource_mutex);
-	list_for_each_entry(r, &resources_held, list) {
-		if (!strncmp(r->r.lockspace_name, ls->name, NAME_ID_SIZE))
-			goto yes;
-	}
-	list_for_each_entry(r, &resources_add, list) {
-		if (!strncmp(r->r.lockspace_name, ls->name, NAME_ID_SIZE))
-			goto yes;
-	}
-	list_for_each_entry(r, &resources_rem, list) {
-		if (!strncmp(r->r.lockspace_name, ls->name, NAME_ID_SIZE))
-			goto yes;
-	}
-	list_for_each_entry(r, &resources_orphan, list) {
-		if (!strncmp(r->r.lockspace_name, ls->name, NAME_ID_SIZE))
-			goto yes;
+	for (i = 0; i < RESOURCE_SHARDS && !used; i++) {
+		sh = &resource_shards[i];
+
+		lock_shard(sh);
+		if (sh->spaces_invalid) {
+			used = count_space_resources(sh, ls->name, 0) ? 1 : 0;
+		} else {
+			rs = find_resource_space(sh, ls->name);
+			used = (rs && rs->used) ? 1 : 0;
+		}
+		unlock_shard(sh);
 	}
-	pthread_mutex_unlock(&resource_mutex);
-	return 0;
- yes:
-	pthread_mutex_unlock(&resource_mutex);
-	return 1;
+	return used;
 }
 
 int resource_orphan_count(char *space_name)
 {
-	struct resource *r;
+	struct resource_shard *sh;
+	struct resource_space *rs;
 	int count = 0;
+	int i;
 
-	pthread_mutex_lock(&resource_mutex);
-	list_for_each_entry(r, &resources_orphan, list) {
-		if (!strncmp(r->r.lockspace_name, space_name, NAME_ID_SIZE))
-			count++;
+	for (i = 0; i < RESOURCE_SHARDS; i++) {
+		sh = &resource_shards[i];
+
+		lock_shard(sh);
+		if (sh->spaces_invalid) {
+			count += count_space_resources(sh, space_name, 1);
+		} else {
+			rs = find_resource_space(sh, space_name);
+			if (rs)
+				count += rs->orphans;
+		}
+		unlock_shard(sh);
 	}
-	pthread_mutex_unlock(&resource_mutex);
 	return count;
-}	
+}
 
 static void copy_disks(void *dst, void *src, int num_disks)
 {
@@ -1221,31 +1742,39 @@ static void copy_disks(void *dst, void *src, int num_disks)
 	}
 }
 
-static struct resource *get_resource(struct token *token, int *new_id)
+static struct resource *get_resource(struct resource_shard *sh, struct token *token,
+				     int *new_id)
 {
 	struct resource *r;
 	int token_matches = 0;
 	uint32_t res_id = 0;
 	uint32_t reused = 0;
+	uint32_t ballot_aborts = 0, sh_retries = 0;
+	struct lat_stats lat;
 	int disks_len, r_len;
 
 	disks_len = token->r.num_disks * sizeof(struct sync_disk);
 	r_len = sizeof(struct resource) + disks_len;
 
-	r = get_free_resource(token, &token_matches);
+	r = get_free_resource(sh, token, &token_matches);
 
 	if (r && token_matches) {
 		res_id = r->res_id;
 		reused = r->reused;
+		ballot_aborts = r->ballot_aborts;
+		sh_retries = r->sh_retries;
+		memcpy(&lat, &r->lat, sizeof(lat));
 		*new_id = 0;
-	} else if (r) {
-		res_id = resource_id_counter++;
-		*new_id = 1;
 	} else {
-		r = malloc(r_len);
-		if (!r)
-			return NULL;
+		if (!r) {
+			r = malloc(r_len);
+			if (!r)
+				return NULL;
+		}
+		pthread_mutex_lock(&resource_id_mutex);
 		res_id = resource_id_counter++;
+		pthread_mutex_unlock(&resource_id_mutex);
+		memset(&lat, 0, sizeof(lat));
 		*new_id = 1;
 	}
 
@@ -1254,6 +1783,9 @@ static struct resource *get_resource(struct token *token, int *new_id)
 	/* preserved from one use to the next */
 	r->res_id = res_id;
 	r->reused = reused;
+	r->ballot_aborts = ballot_aborts;
+	r->sh_retries = sh_retries;
+	memcpy(&r->lat, &lat, sizeof(lat));
 
 	memcpy(&r->r, &token->r, sizeof(struct sanlk_resource));
 	r->io_timeout = token->io_timeout;
@@ -1497,6 +2029,7 @@ static int convert_ex2sh_token(struct task *task, struct resource *r, struct tok
 int convert_token(struct task *task, struct sanlk_resource *res, struct token *cl_token,
 		  uint32_t cmd_flags)
 {
+	struct resource_shard *sh = token_shard(cl_token);
 	struct resource *r;
 	struct token *tk;
 	struct token *token = NULL;
@@ -1505,11 +2038,11 @@ int convert_token(struct task *task, struct sanlk_resource *res, struct token *c
 
 	/* we could probably grab cl_token->r, but it's good to verify */
 
-	pthread_mutex_lock(&resource_mutex);
+	lock_shard(sh);
 
-	r = find_resource(cl_token, &resources_held);
+	r = find_resource(sh, cl_token, &sh->resources_held);
 	if (!r) {
-		pthread_mutex_unlock(&resource_mutex);
+		unlock_shard(sh);
 		log_error("convert_token resource not found %.48s:%.48s",
 			  cl_token->r.lockspace_name, cl_token->r.name);
 		rv = -ENOENT;
@@ -1525,7 +2058,7 @@ int convert_token(struct task *task, struct sanlk_resource *res, struct token *c
 		if (tk->acquire_flags & SANLK_RES_SHARED)
 			sh_count++;
 	}
-	pthread_mutex_unlock(&resource_mutex);
+	unlock_shard(sh);
 
 	if (!token) {
 		log_errot(cl_token, "convert_token token not found pid %d %.48s:%.48s",
@@ -1558,7 +2091,8 @@ int convert_token(struct task *task, struct sanlk_resource *res, struct token *c
 		goto out;
 	}
 
-	rv = open_disks_fd(token->disks, token->r.num_disks);
+	rv = open_disks_fd_cached(token->disks, token->r.num_disks,
+				  token->r.lockspace_name);
 	if (rv < 0) {
 		log_errot(token, "convert_token open error %d", rv);
 		goto out;
@@ -1583,10 +2117,12 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 {
 	struct leader_record leader;
 	struct paxos_dblock dblock;
+	struct resource_shard *sh = token_shard(token);
 	struct resource *r;
 	uint64_t acquire_lver = 0;
 	uint32_t new_num_hosts = 0;
 	int sh_retries = 0;
+	int sh_delay_us = 0;
 	int live_count = 0;
 	int allow_orphan = 0;
 	int only_orphan = 0;
@@ -1606,31 +2142,35 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 	if (cmd_flags & SANLK_ACQUIRE_OWNER_NOWAIT)
 		owner_nowait = 1;
 
-	pthread_mutex_lock(&resource_mutex);
+	/* a waiting acquire sleeps in acquire_wait until the owner expires */
+	if ((cmd_flags & SANLK_ACQUIRE_WAIT) && !(token->flags & T_OWNER_WAIT))
+		owner_nowait = 1;
+
+	lock_shard(sh);
 
 	/*
 	 * Check if this resource already exists on any of the resource lists.
 	 */
 
-	r = find_resource(token, &resources_rem);
+	r = find_resource(sh, token, &sh->resources_rem);
 	if (r) {
 		token->res_id = r->res_id;
 		if (!com.quiet_fail)
 			log_errot(token, "acquire_token resource being removed");
-		pthread_mutex_unlock(&resource_mutex);
+		unlock_shard(sh);
 		return -EAGAIN;
 	}
 
-	r = find_resource(token, &resources_add);
+	r = find_resource(sh, token, &sh->resources_add);
 	if (r) {
 		token->res_id = r->res_id;
 		if (!com.quiet_fail)
 			log_errot(token, "acquire_token resource being added");
-		pthread_mutex_unlock(&resource_mutex);
+		unlock_shard(sh);
 		return -EBUSY;
 	}
 
-	r = find_resource(token, &resources_held);
+	r = find_resource(sh, token, &sh->resources_held);
 	if (r && (token->acquire_flags & SANLK_RES_SHARED) && (r->flags & R_SHARED)) {
 		/* multiple shared holders allowed */
 		token->res_id = r->res_id;
@@ -1638,7 +2178,7 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 		copy_disks(&token->r.disks, &r->r.disks, token->r.num_disks);
 		token->resource = r;
 		list_add(&token->list, &r->tokens);
-		pthread_mutex_unlock(&resource_mutex);
+		unlock_shard(sh);
 		return SANLK_OK;
 	}
 
@@ -1646,17 +2186,17 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 		token->res_id = r->res_id;
 		if (!com.quiet_fail)
 			log_errot(token, "acquire_token resource exists");
-		pthread_mutex_unlock(&resource_mutex);
+		unlock_shard(sh);
 		return -EEXIST;
 	}
 
 	/* caller did not ask for orphan, but an orphan exists */
 
-	r = find_resource(token, &resources_orphan);
+	r = find_resource(sh, token, &sh->resources_orphan);
 	if (r && !allow_orphan) {
 		token->res_id = r->res_id;
 		log_errot(token, "acquire_token found orphan");
-		pthread_mutex_unlock(&resource_mutex);
+		unlock_shard(sh);
 		return -EUCLEAN;
 	}
 
@@ -1666,7 +2206,7 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 	    (r->flags & R_SHARED) && !(token->acquire_flags & SANLK_RES_SHARED)) {
 		token->res_id = r->res_id;
 		log_errot(token, "acquire_token orphan is shared");
-		pthread_mutex_unlock(&resource_mutex);
+		unlock_shard(sh);
 		return -EUCLEAN;
 	}
 
@@ -1676,7 +2216,7 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 	    !(r->flags & R_SHARED) && (token->acquire_flags & SANLK_RES_SHARED)) {
 		token->res_id = r->res_id;
 		log_errot(token, "acquire_token orphan is exclusive");
-		pthread_mutex_unlock(&resource_mutex);
+		unlock_shard(sh);
 		return -EUCLEAN;
 	}
 
@@ -1688,11 +2228,12 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 		log_token(token, "acquire_token adopt shared orphan");
 		token->resource = r;
 		list_add(&token->list, &r->tokens);
-		list_move(&r->list, &resources_held);
-		pthread_mutex_unlock(&resource_mutex);
+		move_resource(sh, r, &sh->resources_held);
+		unlock_shard(sh);
 
 		/* do this to initialize some token fields */
-		rv = open_disks(token->disks, token->r.num_disks);
+		rv = open_disks_cached(token->disks, token->r.num_disks,
+				       token->r.lockspace_name);
 		if (rv < 0) {
 			/* TODO: what parts above need to be undone? */
 			log_errot(token, "acquire_token sh orphan open error %d", rv);
@@ -1713,11 +2254,12 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 		r->pid = token->pid;
 		token->resource = r;
 		list_add(&token->list, &r->tokens);
-		list_move(&r->list, &resources_held);
-		pthread_mutex_unlock(&resource_mutex);
+		move_resource(sh, r, &sh->resources_held);
+		unlock_shard(sh);
 
 		/* do this to initialize some token fields */
-		rv = open_disks(token->disks, token->r.num_disks);
+		rv = open_disks_cached(token->disks, token->r.num_disks,
+				       token->r.lockspace_name);
 		if (rv < 0) {
 			/* TODO: what parts above need to be undone? */
 			log_errot(token, "acquire_token orphan open error %d", rv);
@@ -1731,7 +2273,7 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 	/* caller only wants to acquire an orphan */
 
 	if (cmd_flags & only_orphan) {
-		pthread_mutex_unlock(&resource_mutex);
+		unlock_shard(sh);
 		return -ENOENT;
 	}
 
@@ -1739,19 +2281,19 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 	 * The resource does not exist, so create it.
 	 */
 
-	r = get_resource(token, &new_id);
+	r = get_resource(sh, token, &new_id);
 	if (!r) {
-		pthread_mutex_unlock(&resource_mutex);
+		unlock_shard(sh);
 		return -ENOMEM;
 	}
 
 	memcpy(r->killpath, killpath, SANLK_HELPER_PATH_LEN);
 	memcpy(r->killargs, killargs, SANLK_HELPER_ARGS_LEN);
 	list_add(&token->list, &r->tokens);
-	list_add(&r->list, &resources_add);
+	move_resource(sh, r, &sh->resources_add);
 	token->res_id = r->res_id;
 	token->resource = r;
-	pthread_mutex_unlock(&resource_mutex);
+	unlock_shard(sh);
 
 	if (new_id) {
 		/* save a record of what this id is for later debugging */
@@ -1762,7 +2304,8 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 			  (unsigned long long)token->r.disks[0].offset);
 	}
 
-	rv = open_disks(token->disks, token->r.num_disks);
+	rv = open_disks_cached(token->disks, token->r.num_disks,
+			       token->r.lockspace_name);
 	if (rv < 0) {
 		log_errot(token, "acquire_token open error %d", rv);
 		release_token_nodisk(task, token);
@@ -1774,10 +2317,22 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
  retry:
 	memset(&leader, 0, sizeof(struct leader_record));
 
+	token->ballot_aborts = 0;
+	token->shared_count = 0;
+	memset(token->shared_bitmap, 0, HOSTID_BITMAP_SIZE);
+
 	rv = acquire_disk(task, token, acquire_lver, new_num_hosts, owner_nowait, &leader, &dblock);
 
+	token->owner_id = leader.owner_id;
+	token->owner_generation = leader.owner_generation;
+
 	/* token sector_size starts as ls sector_size, but can change in paxos acquire */
 	r->sector_size = token->sector_size;
+	r->ballot_aborts += token->ballot_aborts;
+	save_token_lat(sh, r, token);
+
+	if (token->ballot_aborts)
+		lockspace_add_retries(token->r.lockspace_name, token->ballot_aborts, 0);
 
 	if (rv == SANLK_ACQUIRE_IDLIVE || rv == SANLK_ACQUIRE_OWNED || rv == SANLK_ACQUIRE_OTHER) {
 		/*
@@ -1792,9 +2347,11 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 		 */
 		if ((token->acquire_flags & SANLK_RES_SHARED) && (leader.flags & LFL_SHORT_HOLD)) {
 			if (sh_retries++ < com.sh_retries) {
-				int us = get_rand(0, 1000000);
-				log_token(token, "acquire_token sh_retry %d %d", rv, us);
-				usleep(us);
+				sh_delay_us = paxos_retry_delay(token, 0, sh_delay_us);
+				log_token(token, "acquire_token sh_retry %d %d", rv, sh_delay_us);
+				r->sh_retries++;
+				lockspace_add_retries(token->r.lockspace_name, 0, 1);
+				usleep(sh_delay_us);
 				goto retry;
 			}
 			/* zero r->leader means not owned and release will just close */
@@ -1932,13 +2489,163 @@ int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 
 	close_disks(token->disks, token->r.num_disks);
 
-	pthread_mutex_lock(&resource_mutex);
-	list_move(&r->list, &resources_held);
-	pthread_mutex_unlock(&resource_mutex);
+	save_token_lat(sh, r, token);
+
+	lock_shard(sh);
+	move_resource(sh, r, &sh->resources_held);
+	unlock_shard(sh);
 
 	return SANLK_OK;
 }
 
+/*
+ * Parked waiters occupy worker threads, so leave the min number of workers
+ * for other commands; a waiting acquire that finds no room fails as usual.
+ */
+
+struct acquire_waiter *acquire_wait_add(struct token *tokens[], int count)
+{
+	struct acquire_waiter *aw;
+	pthread_condattr_t cattr;
+
+	aw = malloc(sizeof(struct acquire_waiter));
+	if (!aw)
+		return NULL;
+	memset(aw, 0, sizeof(struct acquire_waiter));
+	aw->tokens = tokens;
+	aw->count = count;
+
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&aw->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	pthread_mutex_lock(&acquire_wait_mutex);
+	if (acquire_waiters_count >= com.max_worker_threads - DEFAULT_MIN_WORKER_THREADS) {
+		pthread_mutex_unlock(&acquire_wait_mutex);
+		log_debug("acquire_wait_add waiters %d max", acquire_waiters_count);
+		pthread_cond_destroy(&aw->cond);
+		free(aw);
+		return NULL;
+	}
+	acquire_waiters_count++;
+	list_add_tail(&aw->list, &acquire_waiters);
+	pthread_mutex_unlock(&acquire_wait_mutex);
+	return aw;
+}
+
+void acquire_wait_rem(struct acquire_waiter *aw)
+{
+	pthread_mutex_lock(&acquire_wait_mutex);
+	list_del(&aw->list);
+	acquire_waiters_count--;
+	pthread_mutex_unlock(&acquire_wait_mutex);
+
+	pthread_cond_destroy(&aw->cond);
+	free(aw);
+}
+
+int acquire_wait_retry(int result)
+{
+	switch (result) {
+	case SANLK_ACQUIRE_IDLIVE:
+	case SANLK_ACQUIRE_OWNED:
+	case SANLK_ACQUIRE_OTHER:
+	case SANLK_ACQUIRE_OWNED_RETRY:
+	case SANLK_ACQUIRE_SHRETRY:
+	case -EEXIST:
+	case -EBUSY:
+	case -EAGAIN:
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * The wait for each resource that failed:
+ *
+ * . The owner has not renewed its host_id lease since we last saw it
+ *   alive (OWNED_RETRY): sleep until host_dead_seconds after it was last
+ *   seen alive, when the ballot can take the lease.  If our host_status
+ *   doesn't know when the owner was alive, the next ballot waits for it
+ *   as an acquire without the flag does.
+ *
+ * . Otherwise the owner is alive, or the resource is busy locally: poll
+ *   after 1, 2, 4, ... seconds, up to the io_timeout.  A local release
+ *   wakes the waiter right away.
+ *
+ * The waiter sleeps until the earliest of these, or the deadline.
+ * Returns -ETIMEDOUT when the deadline has passed.
+ */
+
+int acquire_wait(struct acquire_waiter *aw, int results[], uint64_t deadline,
+		 int attempt)
+{
+	struct host_status hs;
+	struct token *token;
+	struct timespec ts;
+	uint64_t now, wake = 0, token_wake, expire;
+	int i, rv;
+
+	now = monotime();
+
+	if (deadline && now >= deadline)
+		return -ETIMEDOUT;
+
+	for (i = 0; i < aw->count; i++) {
+		token = aw->tokens[i];
+
+		if (!acquire_wait_retry(results[i]))
+			continue;
+
+		token_wake = now + (1 << (attempt < 5 ? attempt : 5));
+		if (token_wake > now + token->io_timeout)
+			token_wake = now + token->io_timeout;
+
+		if (results[i] == SANLK_ACQUIRE_OWNED_RETRY) {
+			memset(&hs, 0, sizeof(hs));
+			rv = host_info(token->r.lockspace_name, token->owner_id, &hs);
+
+			if (!rv && hs.last_live &&
+			    hs.owner_id == token->owner_id &&
+			    hs.owner_generation == token->owner_generation) {
+				expire = hs.last_live + calc_host_dead_seconds(hs.io_timeout) + 1;
+				token_wake = (expire > now) ? expire : now + 1;
+			} else {
+				token->flags |= T_OWNER_WAIT;
+			}
+
+			log_token(token, "acquire_wait owner %llu %llu last_live %llu wake %llu",
+				  (unsigned long long)token->owner_id,
+				  (unsigned long long)token->owner_generation,
+				  (unsigned long long)hs.last_live,
+				  (unsigned long long)token_wake);
+		}
+
+		if (!wake || token_wake < wake)
+			wake = token_wake;
+	}
+
+	if (!wake)
+		return 0;
+
+	if (deadline && wake > deadline)
+		wake = deadline;
+
+	memset(&ts, 0, sizeof(ts));
+	ts.tv_sec = wake;
+
+	pthread_mutex_lock(&acquire_wait_mutex);
+	while (!aw->woken && !external_shutdown) {
+		rv = pthread_cond_timedwait(&aw->cond, &acquire_wait_mutex, &ts);
+		if (rv == ETIMEDOUT)
+			break;
+	}
+	aw->woken = 0;
+	pthread_mutex_unlock(&acquire_wait_mutex);
+	return 0;
+}
+
 int request_token(struct task *task, struct token *token, uint32_t force_mode,
 		  uint64_t *owner_id, int next_lver)
 {
@@ -1948,7 +2655,8 @@ int request_token(struct task *task, struct token *token, uint32_t force_mode,
 
 	memset(&req, 0, sizeof(req));
 
-	rv = open_disks(token->disks, token->r.num_disks);
+	rv = open_disks_cached(token->disks, token->r.num_disks,
+			       token->r.lockspace_name);
 	if (rv < 0) {
 		log_errot(token, "request_token open error %d", rv);
 		return rv;
@@ -2061,19 +2769,20 @@ static void do_request(struct token *tt, int pid, uint32_t force_mode)
 	char killpath[SANLK_HELPER_PATH_LEN];
 	char killargs[SANLK_HELPER_ARGS_LEN];
 	struct helper_msg hm;
+	struct resource_shard *sh = token_shard(tt);
 	struct resource *r;
 	uint32_t flags;
 	int rv, found = 0;
 
-	pthread_mutex_lock(&resource_mutex);
-	r = find_resource(tt, &resources_held);
+	lock_shard(sh);
+	r = find_resource(sh, tt, &sh->resources_held);
 	if (r && r->pid == pid) {
 		found = 1;
 		flags = r->flags;
 		memcpy(killpath, r->killpath, SANLK_HELPER_PATH_LEN);
 		memcpy(killargs, r->killargs, SANLK_HELPER_ARGS_LEN);
 	}
-	pthread_mutex_unlock(&resource_mutex);
+	unlock_shard(sh);
 
 	if (!found) {
 		log_error("do_request pid %d %.48s:%.48s not found",
@@ -2123,23 +2832,29 @@ static void do_request(struct token *tt, int pid, uint32_t force_mode)
 
 int set_resource_examine(char *space_name, char *res_name)
 {
+	struct resource_shard *sh;
 	struct resource *r;
 	int count = 0;
+	int i;
 
-	pthread_mutex_lock(&resource_mutex);
-	list_for_each_entry(r, &resources_held, list) {
-		if (strncmp(r->r.lockspace_name, space_name, NAME_ID_SIZE))
-			continue;
-		if (res_name && strncmp(r->r.name, res_name, NAME_ID_SIZE))
-			continue;
-		r->flags |= R_THREAD_EXAMINE;
-		resource_thread_work = 1;
-		resource_thread_work_examine = 1;
-		count++;
+	for (i = 0; i < RESOURCE_SHARDS; i++) {
+		sh = &resource_shards[i];
+
+		lock_shard(sh);
+		list_for_each_entry(r, &sh->resources_held, list) {
+			if (strncmp(r->r.lockspace_name, space_name, NAME_ID_SIZE))
+				continue;
+			if (res_name && strncmp(r->r.name, res_name, NAME_ID_SIZE))
+				continue;
+			r->flags |= R_THREAD_EXAMINE;
+			sh->thread_work = 1;
+			sh->thread_work_examine = 1;
+			count++;
+		}
+		unlock_shard(sh);
 	}
 	if (count)
-		pthread_cond_signal(&resource_cond);
-	pthread_mutex_unlock(&resource_mutex);
+		wake_resource_thread();
 
 	return count;
 }
@@ -2191,13 +2906,15 @@ static void resource_thread_release(struct task *task, struct resource *r, struc
 {
 	struct leader_record leader;
 	struct space_info spi;
+	struct resource_shard *sh = resource_shard(r);
 	uint32_t r_flags;
 	int retry_async = 0;
 	int rv;
 
 	r_flags = r->flags;
 
-	rv = open_disks_fd(token->disks, token->r.num_disks);
+	rv = open_disks_fd_cached(token->disks, token->r.num_disks,
+				  token->r.lockspace_name);
 	if (rv < 0) {
 		log_errot(token, "release async open error %d", rv);
 		goto out;
@@ -2296,20 +3013,24 @@ static void resource_thread_release(struct task *task, struct resource *r, struc
  out_close:
 	close_disks(token->disks, token->r.num_disks);
  out:
+	save_token_lat(sh, r, token);
+
 	if (!retry_async) {
+		counter_inc(counters.releases);
 		log_token(token, "release async done r_flags %x", r_flags);
-		pthread_mutex_lock(&resource_mutex);
-		list_del(&r->list);
-		free_resource(r);
-		pthread_mutex_unlock(&resource_mutex);
+		lock_shard(sh);
+		del_resource(sh, r);
+		free_resource(sh, r);
+		unlock_shard(sh);
+		wake_acquire_waiters(token);
 		return;
 	}
 
 	/* Keep the resource on the list to keep trying. */
 	log_token(token, "release async timeout r_flags %x", r_flags);
-	pthread_mutex_lock(&resource_mutex);
+	lock_shard(sh);
 	r->flags |= R_THREAD_RELEASE;
-	pthread_mutex_unlock(&resource_mutex);
+	unlock_shard(sh);
 }
 
 static void resource_thread_examine(struct task *task, struct token *tt, int pid, uint64_t lver)
@@ -2317,7 +3038,8 @@ static void resource_thread_examine(struct task *task, struct token *tt, int pid
 	struct request_record req;
 	int rv;
 
-	rv = open_disks_fd(tt->disks, tt->r.num_disks);
+	rv = open_disks_fd_cached(tt->disks, tt->r.num_disks,
+				  tt->r.lockspace_name);
 	if (rv < 0) {
 		log_errot(tt, "examine open error %d", rv);
 		return;
@@ -2371,32 +3093,139 @@ void add_host_event(uint32_t space_id, struct sanlk_host_event *he,
 	rhe->from_host_id = from_host_id;
 	rhe->from_generation = from_generation;
 
-	pthread_mutex_lock(&resource_mutex);
+	pthread_mutex_lock(&host_event_mutex);
 	list_add_tail(&rhe->list, &host_events);
-	resource_thread_work = 1;
-	pthread_cond_signal(&resource_cond);
-	pthread_mutex_unlock(&resource_mutex);
+	pthread_cond_signal(&host_event_cond);
+	pthread_mutex_unlock(&host_event_mutex);
 }
 
-static struct recv_he *find_host_event(void)
+static void *host_event_thread(void *arg GNUC_UNUSED)
 {
-	if (list_empty(&host_events))
-		return NULL;
-	return list_first_entry(&host_events, struct recv_he, list);
+	struct recv_he *rhe;
+
+	while (1) {
+		pthread_mutex_lock(&host_event_mutex);
+		while (list_empty(&host_events)) {
+			if (host_event_stop) {
+				pthread_mutex_unlock(&host_event_mutex);
+				return NULL;
+			}
+			pthread_cond_wait(&host_event_cond, &host_event_mutex);
+		}
+		rhe = list_first_entry(&host_events, struct recv_he, list);
+		list_del(&rhe->list);
+		pthread_mutex_unlock(&host_event_mutex);
+
+		send_event_callbacks(rhe->space_id, rhe->from_host_id, rhe->from_generation, &rhe->he);
+		free(rhe);
+	}
+	return NULL;
 }
 
-static void *resource_thread(void *arg GNUC_UNUSED)
+/*
+ * Find the next release or examine work in one shard, copy what's needed
+ * from r into tt, and return 1 with the shard unlocked.  Returns 0 with
+ * the shard's work flags cleared when it has nothing to do.
+ */
+
+static int get_shard_work(struct resource_shard *sh, struct token *tt, int tt_len,
+			  int *release, int *pid, uint64_t *lver)
 {
-	struct task task;
 	struct resource *r;
+
+	lock_shard(sh);
+
+	if (!sh->thread_work) {
+		unlock_shard(sh);
+		return 0;
+	}
+
+	/* FIXME: it's not nice how we copy a bunch of stuff
+	 * from token to r so that we can later copy it back from
+	 * r into a temp token.  The whole duplication of stuff
+	 * between token and r would be nice to clean up. */
+
+	memset(tt, 0, tt_len);
+	tt->disks = (struct sync_disk *)&tt->r.disks[0];
+
+	r = find_resource_thread(&sh->resources_rem, R_THREAD_RELEASE);
+	if (r) {
+		memcpy(&tt->r, &r->r, sizeof(struct sanlk_resource));
+		copy_disks(&tt->r.disks, &r->r.disks, r->r.num_disks);
+		tt->host_id = r->host_id;
+		tt->host_generation = r->host_generation;
+		tt->res_id = r->res_id;
+		tt->io_timeout = r->io_timeout;
+		tt->sector_size = r->sector_size;
+		tt->align_size = sector_size_to_align_size(r->sector_size);
+		tt->resource = r;
+
+		/*
+		 * Set the time after which we should try to release this
+		 * resource again if this current attempt times out.
+		 */
+		if (!r->thread_release_retry)
+			r->thread_release_retry = monotime() + r->io_timeout;
+		else
+			r->thread_release_retry = monotime() + (r->io_timeout * 2);
+
+		r->flags &= ~R_THREAD_RELEASE;
+		unlock_shard(sh);
+		*release = 1;
+		return 1;
+	}
+
+	/*
+	 * We don't want to search all of resources_held each time
+	 * we are woken unless we know there is something to examine.
+	 */
+	if (!sh->thread_work_examine)
+		goto find_done;
+
+	r = find_resource_thread(&sh->resources_held, R_THREAD_EXAMINE);
+	if (r) {
+		/* make copies of things we need because we can't use r
+		   once we unlock the mutex since it could be released */
+
+		memcpy(&tt->r, &r->r, sizeof(struct sanlk_resource));
+		copy_disks(&tt->r.disks, &r->r.disks, r->r.num_disks);
+		tt->host_id = r->host_id;
+		tt->host_generation = r->host_generation;
+		tt->res_id = r->res_id;
+		tt->io_timeout = r->io_timeout;
+		tt->sector_size = r->sector_size;
+		tt->align_size = sector_size_to_align_size(r->sector_size);
+		*pid = r->pid;
+		*lver = r->leader.lver;
+
+		r->flags &= ~R_THREAD_EXAMINE;
+		unlock_shard(sh);
+		*release = 0;
+		return 1;
+	}
+
+ find_done:
+	sh->thread_work = 0;
+	sh->thread_work_examine = 0;
+	unlock_shard(sh);
+	return 0;
+}
+
+static void *resource_thread(void *arg)
+{
+	struct task task;
 	struct token *tt = NULL;
-	struct recv_he *rhe;
-	uint64_t lver;
-	int pid, tt_len;
+	uint64_t lver = 0;
+	int num = (int)(long)arg;
+	int pid = 0, tt_len;
+	int i, release;
 
 	memset(&task, 0, sizeof(struct task));
 	setup_task_aio(&task, main_task.use_aio, RESOURCE_AIO_CB_SIZE);
-	sprintf(task.name, "%s", "resource");
+	if (num)
+		sprintf(task.name, "resource%d", num);
+	else
+		sprintf(task.name, "%s", "resource");
 
 	/* a fake/tmp token struct we copy necessary res info into,
 	   because other functions take a token struct arg */
@@ -2409,94 +3238,37 @@ static void *resource_thread(void *arg GNUC_UNUSED)
 	}
 
 	while (1) {
-		pthread_mutex_lock(&resource_mutex);
-		while (!resource_thread_work) {
+		pthread_mutex_lock(&resource_thread_mutex);
+		while (!resource_thread_wake) {
 			if (resource_thread_stop) {
-				pthread_mutex_unlock(&resource_mutex);
+				pthread_mutex_unlock(&resource_thread_mutex);
 				goto out;
 			}
-			pthread_cond_wait(&resource_cond, &resource_mutex);
+			pthread_cond_wait(&resource_cond, &resource_thread_mutex);
 		}
 
-		rhe = find_host_event();
-		if (rhe) {
-			list_del(&rhe->list);
-			pthread_mutex_unlock(&resource_mutex);
-			send_event_callbacks(rhe->space_id, rhe->from_host_id, rhe->from_generation, &rhe->he);
-			free(rhe);
-			continue;
-		}
+		resource_thread_wake = 0;
+		pthread_mutex_unlock(&resource_thread_mutex);
 
-		/* FIXME: it's not nice how we copy a bunch of stuff
-		 * from token to r so that we can later copy it back from
-		 * r into a temp token.  The whole duplication of stuff
-		 * between token and r would be nice to clean up. */
-
-		memset(tt, 0, tt_len);
-		tt->disks = (struct sync_disk *)&tt->r.disks[0];
-
-		r = find_resource_thread(&resources_rem, R_THREAD_RELEASE);
-		if (r) {
-			memcpy(&tt->r, &r->r, sizeof(struct sanlk_resource));
-			copy_disks(&tt->r.disks, &r->r.disks, r->r.num_disks);
-			tt->host_id = r->host_id;
-			tt->host_generation = r->host_generation;
-			tt->res_id = r->res_id;
-			tt->io_timeout = r->io_timeout;
-			tt->sector_size = r->sector_size;
-			tt->align_size = sector_size_to_align_size(r->sector_size);
-			tt->resource = r;
-
-			/*
-			 * Set the time after which we should try to release this
-			 * resource again if this current attempt times out.
-			 */
-			if (!r->thread_release_retry)
-				r->thread_release_retry = monotime() + r->io_timeout;
-			else
-				r->thread_release_retry = monotime() + (r->io_timeout * 2);
+		/*
+		 * Take one piece of work from the first shard that has some.
+		 * Before doing it, wake another worker to look for more, so
+		 * work is spread across the pool while this one waits on i/o.
+		 * Once nothing more is found, the workers go back to waiting.
+		 */
 
-			r->flags &= ~R_THREAD_RELEASE;
-			pthread_mutex_unlock(&resource_mutex);
+		for (i = 0; i < RESOURCE_SHARDS; i++) {
+			if (!get_shard_work(&resource_shards[i], tt, tt_len, &release, &pid, &lver))
+				continue;
 
-			resource_thread_release(&task, r, tt);
-			continue;
-		}
+			wake_resource_thread();
 
-		/*
-		 * We don't want to search all of resource_held each time
-		 * we are woken unless we know there is something to examine.
-		 */
-		if (!resource_thread_work_examine)
-			goto find_done;
-
-		r = find_resource_thread(&resources_held, R_THREAD_EXAMINE);
-		if (r) {
-			/* make copies of things we need because we can't use r
-			   once we unlock the mutex since it could be released */
-
-			memcpy(&tt->r, &r->r, sizeof(struct sanlk_resource));
-			copy_disks(&tt->r.disks, &r->r.disks, r->r.num_disks);
-			tt->host_id = r->host_id;
-			tt->host_generation = r->host_generation;
-			tt->res_id = r->res_id;
-			tt->io_timeout = r->io_timeout;
-			tt->sector_size = r->sector_size;
-			tt->align_size = sector_size_to_align_size(r->sector_size);
-			pid = r->pid;
-			lver = r->leader.lver;
-
-			r->flags &= ~R_THREAD_EXAMINE;
-			pthread_mutex_unlock(&resource_mutex);
-
-			resource_thread_examine(&task, tt, pid, lver);
-			continue;
+			if (release)
+				resource_thread_release(&task, tt->resource, tt);
+			else
+				resource_thread_examine(&task, tt, pid, lver);
+			break;
 		}
-
- find_done:
-		resource_thread_work = 0;
-		resource_thread_work_examine = 0;
-		pthread_mutex_unlock(&resource_mutex);
 	}
  out:
 	if (tt)
@@ -2507,55 +3279,77 @@ static void *resource_thread(void *arg GNUC_UNUSED)
 
 int release_orphan(struct sanlk_resource *res)
 {
+	struct resource_shard *sh;
 	struct resource *r, *safe;
 	int count = 0;
+	int i;
 
-	pthread_mutex_lock(&resource_mutex);
-	list_for_each_entry_safe(r, safe, &resources_orphan, list) {
-		if (strncmp(r->r.lockspace_name, res->lockspace_name, NAME_ID_SIZE))
-			continue;
+	for (i = 0; i < RESOURCE_SHARDS; i++) {
+		sh = &resource_shards[i];
 
-		if (!res->name[0] || !strncmp(r->r.name, res->name, NAME_ID_SIZE)) {
-			log_debug("release orphan %.48s:%.48s", r->r.lockspace_name, r->r.name);
-			r->flags |= R_THREAD_RELEASE;
-			list_move(&r->list, &resources_rem);
-			count++;
+		lock_shard(sh);
+		list_for_each_entry_safe(r, safe, &sh->resources_orphan, list) {
+			if (strncmp(r->r.lockspace_name, res->lockspace_name, NAME_ID_SIZE))
+				continue;
+
+			if (!res->name[0] || !strncmp(r->r.name, res->name, NAME_ID_SIZE)) {
+				log_debug("release orphan %.48s:%.48s", r->r.lockspace_name, r->r.name);
+				r->flags |= R_THREAD_RELEASE;
+				move_resource(sh, r, &sh->resources_rem);
+				sh->thread_work = 1;
+				count++;
+			}
 		}
+		unlock_shard(sh);
 	}
 
-	if (count) {
-		resource_thread_work = 1;
-		pthread_cond_signal(&resource_cond);
-	}
-	pthread_mutex_unlock(&resource_mutex);
+	if (count)
+		wake_resource_thread();
 
 	return count;
 }
 
-static void purge_resource_list(struct list_head *head, char *space_name, const char *list_name)
+void purge_resource_orphans(char *space_name)
 {
+	struct resource_shard *sh;
 	struct resource *r, *safe;
+	int i;
 
-	pthread_mutex_lock(&resource_mutex);
-	list_for_each_entry_safe(r, safe, head, list) {
-		if (strncmp(r->r.lockspace_name, space_name, NAME_ID_SIZE))
-			continue;
-		if (list_name)
-			log_debug("purge %s %.48s:%.48s", list_name, r->r.lockspace_name, r->r.name);
-		list_del(&r->list);
-		free(r);
-	}
-	pthread_mutex_unlock(&resource_mutex);
-}
+	for (i = 0; i < RESOURCE_SHARDS; i++) {
+		sh = &resource_shards[i];
 
-void purge_resource_orphans(char *space_name)
-{
-	purge_resource_list(&resources_orphan, space_name, "orphan_list");
+		lock_shard(sh);
+		list_for_each_entry_safe(r, safe, &sh->resources_orphan, list) {
+			if (strncmp(r->r.lockspace_name, space_name, NAME_ID_SIZE))
+				continue;
+			log_debug("purge orphan_list %.48s:%.48s", r->r.lockspace_name, r->r.name);
+			del_resource(sh, r);
+			free(r);
+		}
+		unlock_shard(sh);
+	}
 }
 
 void purge_resource_free(char *space_name)
 {
-	purge_resource_list(&resources_free, space_name, "free_list");
+	struct resource_shard *sh;
+	struct resource *r, *safe;
+	int i;
+
+	for (i = 0; i < RESOURCE_SHARDS; i++) {
+		sh = &resource_shards[i];
+
+		lock_shard(sh);
+		list_for_each_entry_safe(r, safe, &sh->resources_free, list) {
+			if (strncmp(r->r.lockspace_name, space_name, NAME_ID_SIZE))
+				continue;
+			log_debug("purge free_list %.48s:%.48s", r->r.lockspace_name, r->r.name);
+			list_del(&r->list);
+			sh->free_count--;
+			free(r);
+		}
+		unlock_shard(sh);
+	}
 }
 
 /*
@@ -2567,39 +3361,101 @@ void purge_resource_free(char *space_name)
 
 void rem_resources(void)
 {
-	pthread_mutex_lock(&resource_mutex);
-	if (!list_empty(&resources_rem) && !resource_thread_work) {
-		resource_thread_work = 1;
-		pthread_cond_signal(&resource_cond);
+	struct resource_shard *sh;
+	int i, work = 0;
+
+	for (i = 0; i < RESOURCE_SHARDS; i++) {
+		sh = &resource_shards[i];
+
+		lock_shard(sh);
+		if (!list_empty(&sh->resources_rem) && !sh->thread_work) {
+			sh->thread_work = 1;
+			work = 1;
+		}
+		unlock_shard(sh);
 	}
-	pthread_mutex_unlock(&resource_mutex);
+
+	if (work)
+		wake_resource_thread();
 }
 
 int setup_token_manager(void)
 {
-	int rv;
+	struct resource_shard *sh;
+	int i, j, rv;
 
-	pthread_mutex_init(&resource_mutex, NULL);
+	for (i = 0; i < RESOURCE_SHARDS; i++) {
+		sh = &resource_shards[i];
+
+		pthread_mutex_init(&sh->mutex, NULL);
+		INIT_LIST_HEAD(&sh->resources_add);
+		INIT_LIST_HEAD(&sh->resources_rem);
+		INIT_LIST_HEAD(&sh->resources_held);
+		INIT_LIST_HEAD(&sh->resources_free);
+		INIT_LIST_HEAD(&sh->resources_orphan);
+		INIT_LIST_HEAD(&sh->spaces);
+
+		for (j = 0; j < RESOURCE_SHARD_HASH; j++)
+			INIT_LIST_HEAD(&sh->hash[j]);
+	}
+
+	pthread_mutex_init(&resource_thread_mutex, NULL);
+	pthread_mutex_init(&resource_id_mutex, NULL);
+	pthread_mutex_init(&host_event_mutex, NULL);
 	pthread_cond_init(&resource_cond, NULL);
-	INIT_LIST_HEAD(&resources_add);
-	INIT_LIST_HEAD(&resources_rem);
-	INIT_LIST_HEAD(&resources_held);
-	INIT_LIST_HEAD(&resources_free);
-	INIT_LIST_HEAD(&resources_orphan);
+	pthread_cond_init(&host_event_cond, NULL);
 	INIT_LIST_HEAD(&host_events);
+	pthread_mutex_init(&acquire_wait_mutex, NULL);
+	INIT_LIST_HEAD(&acquire_waiters);
 
-	rv = pthread_create(&resource_pt, NULL, resource_thread, NULL);
+	rv = pthread_create(&host_event_pt, NULL, host_event_thread, NULL);
 	if (rv)
 		return -1;
-	return 0;
+
+	resource_pts = malloc(com.resource_workers * sizeof(pthread_t));
+	if (!resource_pts)
+		goto fail;
+
+	for (i = 0; i < com.resource_workers; i++) {
+		rv = pthread_create(&resource_pts[i], NULL, resource_thread, (void *)(long)i);
+		if (rv) {
+			log_error("resource_thread %d create error %d", i, rv);
+			break;
+		}
+		resource_pts_count++;
+	}
+
+	/* run with fewer resource threads, but not with none */
+	if (resource_pts_count)
+		return 0;
+
+	free(resource_pts);
+	resource_pts = NULL;
+ fail:
+	pthread_mutex_lock(&host_event_mutex);
+	host_event_stop = 1;
+	pthread_cond_signal(&host_event_cond);
+	pthread_mutex_unlock(&host_event_mutex);
+	pthread_join(host_event_pt, NULL);
+	return -1;
 }
 
 void close_token_manager(void)
 {
-	pthread_mutex_lock(&resource_mutex);
+	int i;
+
+	pthread_mutex_lock(&resource_thread_mutex);
 	resource_thread_stop = 1;
-	pthread_cond_signal(&resource_cond);
-	pthread_mutex_unlock(&resource_mutex);
-	pthread_join(resource_pt, NULL);
+	pthread_cond_broadcast(&resource_cond);
+	pthread_mutex_unlock(&resource_thread_mutex);
+
+	for (i = 0; i < resource_pts_count; i++)
+		pthread_join(resource_pts[i], NULL);
+
+	pthread_mutex_lock(&host_event_mutex);
+	host_event_stop = 1;
+	pthread_cond_signal(&host_event_cond);
+	pthread_mutex_unlock(&host_event_mutex);
+	pthread_join(host_event_pt, NULL);
 }
 
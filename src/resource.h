@@ -10,48 +10,78 @@
 #define __RESOURCE_H__
 
 /*
- * We mostly avoid holding resource_mutex and spaces_mutex at once.  When they
- * are held at once, the order is spaces_mutex, then resource_mutex.
+ * We mostly avoid holding a resource shard mutex and spaces_mutex at once.
+ * When they are held at once, the order is spaces_mutex, then the shard
+ * mutex, then resource_thread_mutex.  Only one shard mutex is held at a time.
  */
 
-/* locks resource_mutex */
-void send_state_resources(int fd);
+struct state_buf;
 
-/* locks resource_mutex */
+/* locks each resource shard mutex in turn */
+void add_state_resources(struct state_buf *sb);
+
+/* locks each resource shard mutex in turn */
+void add_lat_resources(struct state_buf *sb, const char *space_name);
+
+struct shm_build;
+
+/* locks each resource shard mutex in turn */
+void shm_state_resources(struct shm_build *resb);
+
+struct space_metrics;
+
+/* locks each resource shard mutex in turn */
+void resource_held_counts(struct space_metrics *sms, int count);
+
+/* locks each resource shard mutex in turn */
 int lockspace_is_used(struct sanlk_lockspace *ls);
 
-/* locks resource_mutex */
+/* locks each resource shard mutex in turn */
 int resource_orphan_count(char *space_name);
 
 /* no locks */
 void check_mode_block(struct token *token, uint64_t next_lver, int q, char *dblock);
 
-/* locks resource_mutex */
+/* locks the resource's shard mutex */
 int convert_token(struct task *task, struct sanlk_resource *res, struct token *cl_token, uint32_t cmd_flags);
 
-/* locks resource_mutex */
+/* locks the resource's shard mutex */
 int acquire_token(struct task *task, struct token *token, uint32_t cmd_flags,
 		  char *killpath, char *killargs);
 
+struct acquire_waiter;
 
-/* locks resource_mutex */
+/* locks acquire_wait_mutex */
+struct acquire_waiter *acquire_wait_add(struct token *tokens[], int count);
+
+/* locks acquire_wait_mutex */
+void acquire_wait_rem(struct acquire_waiter *aw);
+
+/* no locks */
+int acquire_wait_retry(int result);
+
+/* locks acquire_wait_mutex, calls host_info */
+int acquire_wait(struct acquire_waiter *aw, int results[], uint64_t deadline,
+		 int attempt);
+
+/* locks the resource's shard mutex */
 int release_token(struct task *task, struct token *token,
 		  struct sanlk_resource *resrename);
 
-/* locks resource_mutex */
+/* locks the resource's shard mutex */
 void release_token_async(struct token *token);
 
 /* no locks */
 int request_token(struct task *task, struct token *token, uint32_t force_mode,
 		  uint64_t *owner_id, int next_lver);
 
-/* locks resource_mutex */
+/* locks each resource shard mutex in turn */
 int set_resource_examine(char *space_name, char *res_name);
 
-/* locks resource_mutex */
+/* locks the resource's shard mutex */
 int res_set_lvb(struct sanlk_resource *res, char *lvb, int lvblen);
 
-/* locks resource_mutex */
+/* locks the resource's shard mutex */
 int res_get_lvb(struct sanlk_resource *res, char **lvb_out, int *lvblen);
 
 /* no locks */
@@ -59,20 +89,23 @@ int read_resource_owners(struct task *task, struct token *token,
                          struct sanlk_resource *res,
                          char **send_buf, int *send_len, int *count);
 
-/* locks resource_mutex */
+/* locks each resource shard mutex in turn */
 void rem_resources(void);
 
-/* locks resource_mutex */
+/* locks each resource shard mutex in turn */
 int release_orphan(struct sanlk_resource *res);
 
-/* locks resource_mutex */
+/* locks each resource shard mutex in turn */
 void purge_resource_orphans(char *space_name);
 void purge_resource_free(char *space_name);
 
-/* locks resource_mutex */
+/* locks host_event_mutex */
 void add_host_event(uint32_t space_id, struct sanlk_host_event *he,
 		    uint64_t from_host_id, uint64_t from_generation);
 
+/* logs an error if the calling thread holds a resource shard mutex */
+void check_resource_unlocked(const char *caller);
+
 int setup_token_manager(void);
 void close_token_manager(void);
 
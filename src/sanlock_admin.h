@@ -48,6 +48,26 @@ int sanlock_add_lockspace(struct sanlk_lockspace *ls, uint32_t flags);
 int sanlock_add_lockspace_timeout(struct sanlk_lockspace *ls, uint32_t flags,
 				  uint32_t io_timeout);
 
+/*
+ * add_lockspaces adds count lockspaces with one request.  The daemon
+ * acquires their host_ids concurrently, so it takes about as long as
+ * adding one lockspace.  results[i] is set to the add_lockspace result
+ * for lss[i] as each add completes.
+ *
+ * With SANLK_ADD_ASYNC, it returns once all adds are started, and results[i]
+ * is 0 if the add of lss[i] was started.
+ *
+ * add_lockspaces returns:
+ * 0: results are set for all lockspaces
+ * -EINVAL: count is 0 or more than SANLK_ADD_LOCKSPACES_MAX
+ * < 0: other errors sending the request or receiving results
+ */
+
+#define SANLK_ADD_LOCKSPACES_MAX 1024
+
+int sanlock_add_lockspaces(struct sanlk_lockspace *lss, int count,
+			   uint32_t flags, uint32_t io_timeout, int *results);
+
 /*
  * inq_lockspace returns:
  * 0: the lockspace exists and is currently held
@@ -417,4 +437,94 @@ int sanlock_set_event(const char *ls_name, struct sanlk_host_event *he, uint32_t
 int sanlock_get_event(int fd, uint32_t flags, struct sanlk_host_event *he,
 		      uint64_t *from_host_id, uint64_t *from_generation);
 
+/*
+ * Shared memory state
+ *
+ * The daemon publishes a snapshot of its lockspaces, their hosts, their
+ * renewal history, and the resources it holds, in the file SANLK_SHM_NAME
+ * in its run dir, and updates it each second.  A monitoring program can
+ * read the snapshot without connecting to the daemon, so polling it costs
+ * the daemon nothing.
+ *
+ * sanlock_state_snapshot() copies a consistent snapshot into a buffer it
+ * allocates, which begins with sanlk_shm_header; the caller frees it.
+ * The sections are located with the SANLK_SHM_ macros below.
+ *
+ * Each sanlk_shm_lockspace refers to its hosts (the same sanlk_host as
+ * sanlock_get_hosts, for hosts with a delta lease timestamp) and its
+ * renewals (oldest first) by index into the host and renewal sections.
+ *
+ * update_time is the daemon's monotonic time (CLOCK_MONOTONIC seconds) of
+ * the update, which shows how recent the snapshot is.  The daemon removes
+ * the file when it exits; -ENOENT is returned if the file doesn't exist.
+ */
+
+#define SANLK_SHM_NAME "sanlock.state"
+#define SANLK_SHM_MAGIC 0x04282024
+#define SANLK_SHM_VERSION 0x00000001
+
+struct sanlk_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;		/* bytes, including this header */
+	uint32_t seq;		/* odd while being updated */
+	uint64_t update_time;
+	uint32_t ls_count;
+	uint32_t ls_offset;
+	uint32_t host_count;
+	uint32_t host_offset;
+	uint32_t renewal_count;
+	uint32_t renewal_offset;
+	uint32_t res_count;
+	uint32_t res_offset;
+};
+
+struct sanlk_shm_lockspace {
+	struct sanlk_lockspace ls;	/* flags SANLK_LSF_ADD, SANLK_LSF_REM */
+	uint64_t host_generation;
+	uint64_t renewal_last_attempt;
+	uint64_t renewal_last_success;
+	int32_t renewal_last_result;
+	uint32_t io_timeout;
+	uint32_t space_dead;
+	uint32_t host_first;
+	uint32_t host_count;
+	uint32_t renewal_first;
+	uint32_t renewal_count;
+	uint32_t pad;
+};
+
+struct sanlk_shm_renewal {
+	uint64_t timestamp;
+	int32_t read_ms;
+	int32_t write_ms;
+	int32_t next_timeouts;
+	int32_t next_errors;
+};
+
+#define SANLK_SHM_RES_ADD	0x00000001 /* being acquired */
+#define SANLK_SHM_RES_REM	0x00000002 /* being released */
+#define SANLK_SHM_RES_ORPHAN	0x00000004
+
+struct sanlk_shm_resource {
+	char lockspace_name[SANLK_NAME_LEN];
+	char name[SANLK_NAME_LEN];
+	uint64_t lver;
+	int32_t pid;
+	uint32_t res_flags;	/* SANLK_RES_SHARED */
+	uint32_t flags;		/* SANLK_SHM_RES_ */
+	uint32_t pad;
+};
+
+#define SANLK_SHM_LOCKSPACES(h) \
+	((struct sanlk_shm_lockspace *)((char *)(h) + (h)->ls_offset))
+#define SANLK_SHM_HOSTS(h) \
+	((struct sanlk_host *)((char *)(h) + (h)->host_offset))
+#define SANLK_SHM_RENEWALS(h) \
+	((struct sanlk_shm_renewal *)((char *)(h) + (h)->renewal_offset))
+#define SANLK_SHM_RESOURCES(h) \
+	((struct sanlk_shm_resource *)((char *)(h) + (h)->res_offset))
+
+int sanlock_state_snapshot(struct sanlk_shm_header **snap, uint32_t flags);
+
 #endif
@@ -84,6 +84,38 @@ struct delta_extra {
 #define T_RESTRICT_SIGTERM	 0x00000002 /* inherited from client->restricted */
 #define T_RETRACT_PAXOS		 0x00000004
 #define T_WRITE_DBLOCK_MBLOCK_SH 0x00000008 /* make paxos layer include mb SHARED with dblock */
+#define T_OWNER_WAIT		 0x00000010 /* ACQUIRE_WAIT, let the ballot wait for the owner to expire */
+
+/* lease io timed in latency histograms, see latency.c */
+
+enum {
+	LAT_LEADER_READ = 0,	/* paxos_lease_read of the lease area */
+	LAT_PHASE1_WRITE,
+	LAT_PHASE1_READ,
+	LAT_PHASE2_WRITE,
+	LAT_PHASE2_READ,
+	LAT_COMMIT_WRITE,	/* write_new_leader after a ballot */
+	LAT_MODE_WRITE,		/* write_host_block */
+	LAT_LVB_READ,
+	LAT_LVB_WRITE,
+	LAT_DELTA_READ,		/* delta lease renewal */
+	LAT_DELTA_WRITE,
+	LAT_OPS
+};
+
+#define LAT_BUCKETS 20
+
+struct lat_hist {
+	uint64_t count;
+	uint64_t total_us;
+	uint32_t max_us;
+	uint32_t errors;	/* failed io, or aborted ballot for phase reads */
+	uint32_t bucket[LAT_BUCKETS];
+};
+
+struct lat_stats {
+	struct lat_hist op[LAT_OPS];
+};
 
 struct token {
 	/* values copied from acquire res arg */
@@ -107,8 +139,13 @@ struct token {
 	uint32_t res_id;
 	int sector_size;
 	int align_size;
+	int ls_max_hosts; /* copied from sp->max_hosts, bounds dblock reads */
 	int space_dead; /* copied from sp->space_dead, set by main thread */
 	int shared_count; /* set during ballot by paxos_lease_acquire */
+	uint32_t ballot_aborts; /* counted by paxos_lease_acquire */
+	uint64_t owner_id; /* leader owner seen by the last acquire_token */
+	uint64_t owner_generation;
+	struct lat_stats lat; /* io timed since the last acquire/release */
 	char shared_bitmap[HOSTID_BITMAP_SIZE]; /* bit set for host_id with SH */
 
 	struct sync_disk *disks; /* shorthand, points to r.disks[0] */
@@ -126,7 +163,9 @@ struct token {
 
 struct resource {
 	struct list_head list;
+	struct list_head hash_list;  /* resource_hash, while on a list below */
 	struct list_head tokens;     /* only one token when ex, multiple sh */
+	int on_list;                 /* RES_LIST_ add/held/rem/orphan */
 	uint64_t host_id;
 	uint64_t host_generation;
 	uint32_t io_timeout;
@@ -134,6 +173,9 @@ struct resource {
 	int sector_size;
 	uint32_t res_id;
 	uint32_t reused;
+	uint32_t ballot_aborts; /* ballots aborted and retried by acquire */
+	uint32_t sh_retries;    /* acquires retried for a short hold by another host */
+	struct lat_stats lat;
 	uint32_t flags;
 	uint64_t thread_release_retry;
 	char *lvb;
@@ -152,10 +194,20 @@ struct lease_status {
 	uint64_t acquire_last_success;
 	uint64_t renewal_last_attempt;
 	uint64_t renewal_last_success;
-
+	int acquire_wait;  /* seconds of acquire_delay waited so far */
+	int acquire_delay; /* seconds delta_lease_acquire waits for an old owner */
+
+	/*
+	 * The delta leases read by the last renewal are passed from the
+	 * lockspace thread to the main loop by swapping buffers rather than
+	 * copying them.  The renewal read buffer (task iobuf) is swapped with
+	 * renewal_read_buf after each read, and check_our_lease swaps
+	 * renewal_read_buf with check_buf when renewal_read_count has changed.
+	 */
 	uint32_t renewal_read_count;
 	uint32_t renewal_read_check;
 	char *renewal_read_buf;
+	char *check_buf; /* only used by main loop */
 };
 
 struct host_status {
@@ -169,6 +221,8 @@ struct host_status {
 	uint64_t set_bit_time;
 	uint16_t io_timeout;
 	uint16_t lease_bad;
+	uint32_t disk_checksum; /* on-disk leader checksum at last check */
+	uint64_t disk_timestamp; /* on-disk leader timestamp at last check */
 	char owner_name[NAME_ID_SIZE];
 };
 
@@ -186,6 +240,8 @@ struct renewal_history {
 #define SP_EXTERNAL_USED   0x00000001
 #define SP_USED_BY_ORPHANS 0x00000002
 
+struct lockspace_renewal;
+
 struct space {
 	struct list_head list;
 	char space_name[NAME_ID_SIZE];
@@ -200,23 +256,29 @@ struct space {
 	uint32_t renewal_read_extend_sec; /* defaults to io_timeout */
 	int sector_size;
 	int align_size;
+	int max_hosts; /* host leases on disk, the length of host_status */
 	int renew_fail;
 	int space_dead;
 	int killing_pids;
 	int external_remove;
 	int thread_stop;
+	int thread_joined;
 	int wd_fd;
 	int event_fds[MAX_EVENT_FDS];
 	struct sanlk_host_event host_event;
 	uint64_t set_event_time;
 	pthread_t thread;
-	pthread_mutex_t mutex; /* protects lease_status, thread_stop  */
+	pthread_mutex_t mutex; /* protects lease_status, thread_stop, lat */
 	struct lease_status lease_status;
-	struct host_status host_status[DEFAULT_MAX_HOSTS];
+	struct host_status *host_status; /* set before added to spaces */
 	struct renewal_history *renewal_history;
 	int renewal_history_size;
 	int renewal_history_next;
 	int renewal_history_prev;
+	struct lat_stats lat; /* delta io, and resource io once done */
+	uint64_t ballot_aborts; /* resource acquire ballots aborted and retried */
+	uint64_t sh_retries;    /* resource acquires retried for a short hold */
+	struct lockspace_renewal *renewal; /* set when renewed by the renewal scheduler */
 };
 
 /* Update lockspace_info() to copy any fields from struct space
@@ -229,31 +291,39 @@ struct space_info {
 	uint64_t host_generation;
 	int sector_size;
 	int align_size;
+	int max_hosts;
 	int killing_pids;
 };
 
+/* ballots submit io to all disks at once, see read_iobuf_disks */
+
 #define HOSTID_AIO_CB_SIZE 4
-#define WORKER_AIO_CB_SIZE 2
-#define DIRECT_AIO_CB_SIZE 1
-#define RESOURCE_AIO_CB_SIZE 2
-#define LIB_AIO_CB_SIZE 1
+#define WORKER_AIO_CB_SIZE (2 * SANLK_MAX_DISKS)
+#define DIRECT_AIO_CB_SIZE SANLK_MAX_DISKS
+#define RESOURCE_AIO_CB_SIZE (2 * SANLK_MAX_DISKS)
+#define LIB_AIO_CB_SIZE SANLK_MAX_DISKS
 
 struct aicb {
 	int used;
 	char *buf;
+	int buf_len; /* allocated length of buf, may exceed the io length */
 	struct iocb iocb;
 };
 
+struct uring;
+
 struct task {
 	char name[NAME_ID_SIZE+1];   /* for log messages */
 
 	unsigned int io_count;       /* stats */
 	unsigned int to_count;       /* stats */
 
-	int use_aio;
+	int use_aio;                 /* 0 sync, 1 libaio, 2 posix aio, 3 io_uring */
 	int cb_size;
 	char *iobuf;
+	int iobuf_len;
 	io_context_t aio_ctx;
+	struct uring *uring;
 	struct aicb *read_iobuf_timeout_aicb;
 	struct aicb *callbacks;
 };
@@ -276,6 +346,7 @@ struct client {
 	int need_free;
 	int kill_count;
 	int tokens_slots;
+	int pid_next; /* next ci in pid hash bucket, -1 at end */
 	uint32_t flags;
 	uint32_t restricted;
 	uint64_t kill_last;
@@ -307,6 +378,10 @@ EXTERN struct client *client;
 #define DEFAULT_SOCKET_MODE (S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP)
 #define DEFAULT_MIN_WORKER_THREADS 2
 #define DEFAULT_MAX_WORKER_THREADS 8
+#define DEFAULT_RESOURCE_WORKERS 4
+#define MAX_RESOURCE_WORKERS 64
+#define DEFAULT_RENEWAL_THREADS 0 /* 0 is a thread per lockspace */
+#define MAX_RENEWAL_THREADS 64
 #define DEFAULT_SH_RETRIES 8
 #define DEFAULT_QUIET_FAIL 1
 #define DEFAULT_RENEWAL_HISTORY_SIZE 180 /* about 1 hour with 20 sec renewal interval */
@@ -327,6 +402,8 @@ struct command_line {
 	int names_log_priority;
 	int mlock_level;
 	int max_worker_threads;
+	int resource_workers;
+	int renewal_threads;
 	int aio_arg;
 	int io_timeout_arg;
 	int set_bitmap_seconds;
@@ -402,6 +479,9 @@ enum {
 	ACT_SET_CONFIG,
 	ACT_WRITE_LEADER,
 	ACT_RENEWAL,
+	ACT_LATENCY,
+	ACT_METRICS,
+	ACT_TRACE,
 };
 
 EXTERN int external_shutdown;
@@ -417,6 +497,24 @@ EXTERN uint64_t helper_last_status;
 EXTERN uint32_t helper_full_count;
 EXTERN int efd;
 
+/* daemon counters reported by "sanlock client metrics" */
+
+struct daemon_counters {
+	uint64_t acquires;
+	uint64_t acquire_errors;
+	uint64_t acquire_retries; /* by SANLK_ACQUIRE_WAIT, not in acquires */
+	uint64_t releases;
+	uint64_t release_errors;
+	uint64_t io_count;	/* all tasks, like task io_count */
+	uint64_t io_timeouts;	/* all tasks, like task to_count */
+};
+
+#define counter_inc(x) __atomic_add_fetch(&(x), 1, __ATOMIC_RELAXED)
+#define counter_add(x, n) __atomic_add_fetch(&(x), (n), __ATOMIC_RELAXED)
+#define counter_get(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+EXTERN struct daemon_counters counters;
+
 EXTERN struct list_head spaces;
 EXTERN struct list_head spaces_rem;
 EXTERN struct list_head spaces_add;
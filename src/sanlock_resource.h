@@ -48,12 +48,27 @@
  * If the lock cannot be granted immediately
  * because the owner's lease needs to time out, do
  * not wait, but return -SANLK_ACQUIRE_OWNED_RETRY.
+ *
+ * SANLK_ACQUIRE_WAIT
+ * If the lock is held by another host or process,
+ * the daemon keeps the request and tries again when
+ * the lock could have become free: when a local holder
+ * releases it, when the owner's lease would expire if
+ * the owner has stopped renewing, and periodically
+ * while the owner is alive.  The request fails with
+ * the last error if the lock is not acquired before
+ * the deadline given to sanlock_acquire_wait (none
+ * with sanlock_acquire.)  When a request has several
+ * resources, the daemon releases the ones it acquired
+ * before waiting, and tries the whole set again, so
+ * nothing is held while waiting.
  */
 
 #define SANLK_ACQUIRE_LVB		0x00000001
 #define SANLK_ACQUIRE_ORPHAN		0x00000002
 #define SANLK_ACQUIRE_ORPHAN_ONLY	0x00000004
 #define SANLK_ACQUIRE_OWNER_NOWAIT	0x00000008
+#define SANLK_ACQUIRE_WAIT		0x00000010
 
 /*
  * release flags
@@ -137,6 +152,15 @@ int sanlock_acquire(int sock, int pid, uint32_t flags, int res_count,
 		    struct sanlk_resource *res_args[],
 		    struct sanlk_options *opt_in);
 
+/*
+ * sanlock_acquire with SANLK_ACQUIRE_WAIT, giving up
+ * after wait_sec seconds (0 waits without a deadline.)
+ */
+
+int sanlock_acquire_wait(int sock, int pid, uint32_t flags, int res_count,
+			 struct sanlk_resource *res_args[],
+			 struct sanlk_options *opt_in, uint32_t wait_sec);
+
 int sanlock_release(int sock, int pid, uint32_t flags, int res_count,
 		    struct sanlk_resource *res_args[]);
 
@@ -54,6 +54,10 @@ enum {
 	SM_CMD_SET_EVENT         = 32,
 	SM_CMD_SET_CONFIG        = 33,
 	SM_CMD_RENEWAL           = 34,
+	SM_CMD_ADD_LOCKSPACES    = 35,
+	SM_CMD_LATENCY           = 36,
+	SM_CMD_METRICS           = 37,
+	SM_CMD_TRACE             = 38,
 };
 
 #define SM_CB_GET_EVENT 1
@@ -64,11 +68,18 @@ struct sm_header {
 	uint32_t cmd; /* SM_CMD_ */
 	uint32_t cmd_flags;
 	uint32_t length;
-	uint32_t seq;
+	uint32_t seq; /* SM_CMD_ACQUIRE with SANLK_ACQUIRE_WAIT: wait seconds */
 	uint32_t data;
 	uint32_t data2;
 };
 
+/* SM_CMD_ADD_LOCKSPACES reply, one per lockspace as each add completes */
+
+struct sm_add_result {
+	uint32_t index; /* in the request's array of sanlk_lockspace */
+	int32_t result;
+};
+
 #define SANLK_STATE_MAXSTR	4096
 
 #define SANLK_STATE_DAEMON      1
@@ -77,6 +88,7 @@ struct sm_header {
 #define SANLK_STATE_RESOURCE    4
 #define SANLK_STATE_HOST	5
 #define SANLK_STATE_RENEWAL	6
+#define SANLK_STATE_LATENCY	7
 
 struct sanlk_state {
 	uint32_t type; /* SANLK_STATE_ */
@@ -0,0 +1,265 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+/*
+ * Shared memory state snapshot for monitoring, see sanlock_admin.h.
+ *
+ * A thread rebuilds the snapshot each second, taking the same locks as the
+ * status commands only while copying out the lockspace and resource state,
+ * then writes it into the mapped file under a seqlock: the header seq is
+ * made odd before the update and even after it, and a reader retries its
+ * copy if seq was odd or has changed.
+ *
+ * The file only grows, so a reader's mapping of an older size stays valid,
+ * and the reader remaps when the header size is larger than its mapping.
+ * The file is unlinked and created again when the daemon starts, so
+ * readers of a previous daemon's file are not affected.
+ */
+
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "sanlock_internal.h"
+#include "sanlock_admin.h"
+#include "log.h"
+#include "lockspace.h"
+#include "resource.h"
+#include "shm_state.h"
+
+#define SHM_STATE_INTERVAL 1 /* seconds */
+#define SHM_ALIGN(x) (((x) + 7) & ~7)
+
+static pthread_t shm_thread;
+static pthread_mutex_t shm_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shm_cond;
+static int shm_stop;
+static int shm_fd = -1;
+static int shm_error_logged;
+static char *shm_map;
+static size_t shm_map_len;
+static char shm_path[PATH_MAX];
+
+void *shm_build_add(struct shm_build *b, int len)
+{
+	char *buf;
+	void *ent;
+	int size;
+
+	if (b->len + len > b->size) {
+		size = b->size ? b->size : 4096;
+		while (size < b->len + len)
+			size *= 2;
+
+		buf = realloc(b->buf, size);
+		if (!buf)
+			return NULL;
+		b->buf = buf;
+		b->size = size;
+	}
+
+	ent = b->buf + b->len;
+	memset(ent, 0, len);
+	b->len += len;
+	b->count++;
+	return ent;
+}
+
+static int shm_resize(size_t len)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	char *map;
+
+	len = (len + page - 1) & ~(page - 1);
+
+	if (len <= shm_map_len)
+		return 0;
+
+	if (ftruncate(shm_fd, len) < 0)
+		return -errno;
+
+	if (shm_map)
+		map = mremap(shm_map, shm_map_len, len, MREMAP_MAYMOVE);
+	else
+		map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	if (map == MAP_FAILED)
+		return -errno;
+
+	shm_map = map;
+	shm_map_len = len;
+	return 0;
+}
+
+static void shm_update(void)
+{
+	struct shm_build lsb, hostb, renb, resb;
+	struct sanlk_shm_header *h;
+	uint32_t ls_offset, host_offset, renewal_offset, res_offset, size, seq;
+	int rv;
+
+	memset(&lsb, 0, sizeof(lsb));
+	memset(&hostb, 0, sizeof(hostb));
+	memset(&renb, 0, sizeof(renb));
+	memset(&resb, 0, sizeof(resb));
+
+	shm_state_lockspaces(&lsb, &hostb, &renb);
+	shm_state_resources(&resb);
+
+	ls_offset = SHM_ALIGN(sizeof(struct sanlk_shm_header));
+	host_offset = ls_offset + SHM_ALIGN(lsb.len);
+	renewal_offset = host_offset + SHM_ALIGN(hostb.len);
+	res_offset = renewal_offset + SHM_ALIGN(renb.len);
+	size = res_offset + resb.len;
+
+	rv = shm_resize(size);
+	if (rv < 0) {
+		if (!shm_error_logged++)
+			log_error("shm_state resize %u error %d", size, rv);
+		goto out;
+	}
+
+	h = (struct sanlk_shm_header *)shm_map;
+
+	seq = h->seq;
+	__atomic_store_n(&h->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	h->magic = SANLK_SHM_MAGIC;
+	h->version = SANLK_SHM_VERSION;
+	h->size = size;
+	h->update_time = monotime();
+	h->ls_count = lsb.count;
+	h->ls_offset = ls_offset;
+	h->host_count = hostb.count;
+	h->host_offset = host_offset;
+	h->renewal_count = renb.count;
+	h->renewal_offset = renewal_offset;
+	h->res_count = resb.count;
+	h->res_offset = res_offset;
+
+	if (lsb.len)
+		memcpy(shm_map + ls_offset, lsb.buf, lsb.len);
+	if (hostb.len)
+		memcpy(shm_map + host_offset, hostb.buf, hostb.len);
+	if (renb.len)
+		memcpy(shm_map + renewal_offset, renb.buf, renb.len);
+	if (resb.len)
+		memcpy(shm_map + res_offset, resb.buf, resb.len);
+
+	__atomic_store_n(&h->seq, seq + 2, __ATOMIC_RELEASE);
+ out:
+	free(lsb.buf);
+	free(hostb.buf);
+	free(renb.buf);
+	free(resb.buf);
+}
+
+static void *shm_thread_fn(void *arg GNUC_UNUSED)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&shm_mutex);
+	while (!shm_stop) {
+		pthread_mutex_unlock(&shm_mutex);
+		shm_update();
+		pthread_mutex_lock(&shm_mutex);
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += SHM_STATE_INTERVAL;
+
+		while (!shm_stop) {
+			if (pthread_cond_timedwait(&shm_cond, &shm_mutex, &ts) == ETIMEDOUT)
+				break;
+		}
+	}
+	pthread_mutex_unlock(&shm_mutex);
+	return NULL;
+}
+
+int setup_shm_state(const char *run_dir)
+{
+	pthread_condattr_t cattr;
+	int rv;
+
+	snprintf(shm_path, PATH_MAX, "%s/%s", run_dir, SANLK_SHM_NAME);
+
+	unlink(shm_path);
+
+	shm_fd = open(shm_path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, DEFAULT_SOCKET_MODE);
+	if (shm_fd < 0) {
+		rv = -errno;
+		log_error("shm_state open %s error %d", shm_path, rv);
+		return rv;
+	}
+
+	/* readable by the same users as the socket */
+	if (fchmod(shm_fd, DEFAULT_SOCKET_MODE) < 0 ||
+	    fchown(shm_fd, com.uid, com.gid) < 0)
+		log_error("shm_state permissions %s error %d", shm_path, errno);
+
+	rv = shm_resize(sizeof(struct sanlk_shm_header));
+	if (rv < 0) {
+		log_error("shm_state map %s error %d", shm_path, rv);
+		goto fail;
+	}
+
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&shm_cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	rv = pthread_create(&shm_thread, NULL, shm_thread_fn, NULL);
+	if (rv) {
+		log_error("shm_state thread error %d", rv);
+		rv = -rv;
+		goto fail;
+	}
+	return 0;
+
+ fail:
+	if (shm_map)
+		munmap(shm_map, shm_map_len);
+	shm_map = NULL;
+	shm_map_len = 0;
+	close(shm_fd);
+	shm_fd = -1;
+	unlink(shm_path);
+	return rv;
+}
+
+void close_shm_state(void)
+{
+	if (shm_fd < 0)
+		return;
+
+	pthread_mutex_lock(&shm_mutex);
+	shm_stop = 1;
+	pthread_cond_signal(&shm_cond);
+	pthread_mutex_unlock(&shm_mutex);
+	pthread_join(shm_thread, NULL);
+
+	unlink(shm_path);
+	munmap(shm_map, shm_map_len);
+	shm_map = NULL;
+	shm_map_len = 0;
+	close(shm_fd);
+	shm_fd = -1;
+}
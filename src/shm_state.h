@@ -0,0 +1,28 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#ifndef __SHM_STATE_H__
+#define __SHM_STATE_H__
+
+/* one section of the snapshot, an array of count entries */
+
+struct shm_build {
+	char *buf;
+	int len;
+	int size;
+	uint32_t count;
+};
+
+/* returns a zeroed entry at the end of the section, or NULL */
+void *shm_build_add(struct shm_build *b, int len);
+
+int setup_shm_state(const char *run_dir);
+
+void close_shm_state(void);
+
+#endif
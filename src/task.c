@@ -23,8 +23,10 @@
 #include <sys/time.h>
 
 #include "sanlock_internal.h"
+#include "diskio.h"
 #include "log.h"
 #include "task.h"
+#include "uring.h"
 
 void setup_task_aio(struct task *task, int use_aio, int cb_size)
 {
@@ -44,9 +46,19 @@ void setup_task_aio(struct task *task, int use_aio, int cb_size)
 	if (!cb_size)
 		return;
 
-	rv = io_setup(cb_size, &task->aio_ctx);
-	if (rv < 0)
-		goto fail;
+	if (use_aio == 3) {
+		rv = uring_setup(task, cb_size);
+		if (rv < 0) {
+			log_taskw(task, "io_uring setup error %d using libaio", rv);
+			task->use_aio = 1;
+		}
+	}
+
+	if (task->use_aio == 1) {
+		rv = io_setup(cb_size, &task->aio_ctx);
+		if (rv < 0)
+			goto fail;
+	}
 
 	task->cb_size = cb_size;
 	task->callbacks = malloc(cb_size * sizeof(struct aicb));
@@ -58,11 +70,54 @@ void setup_task_aio(struct task *task, int use_aio, int cb_size)
 	return;
 
  fail_setup:
-	io_destroy(task->aio_ctx);
+	if (task->use_aio == 3)
+		uring_close(task);
+	else
+		io_destroy(task->aio_ctx);
  fail:
 	task->use_aio = 0;
 }
 
+/*
+ * Linux aio (use_aio 1) and io_uring (use_aio 3) share the aio code in
+ * diskio.c through these.
+ */
+
+int task_aio_submit(struct task *task, long nr, struct iocb **iocbs)
+{
+	if (task->use_aio == 3)
+		return uring_submit(task, nr, iocbs);
+	return io_submit(task->aio_ctx, nr, iocbs);
+}
+
+int task_aio_getevents(struct task *task, long min_nr, long nr,
+		       struct io_event *events, struct timespec *ts)
+{
+	if (task->use_aio == 3)
+		return uring_getevents(task, min_nr, nr, events, ts);
+	return io_getevents(task->aio_ctx, min_nr, nr, events, ts);
+}
+
+/*
+ * An fd used by the task until it closes aio can be registered with the
+ * ring (see uring_register_fd).  Nothing is needed for libaio.
+ */
+
+void task_aio_register_fd(struct task *task, int fd)
+{
+	if (task->use_aio == 3)
+		uring_register_fd(task, fd);
+}
+
+/* ios on a ring are not canceled, they're reaped later like a failed cancel */
+
+int task_aio_cancel(struct task *task, struct iocb *iocb, struct io_event *event)
+{
+	if (task->use_aio == 3)
+		return -EINVAL;
+	return io_cancel(task->aio_ctx, iocb, event);
+}
+
 void close_task_aio(struct task *task)
 {
 	struct timespec ts;
@@ -113,7 +168,7 @@ void close_task_aio(struct task *task)
 
 		memset(&event, 0, sizeof(event));
 
-		rv = io_getevents(task->aio_ctx, 1, 1, &event, &ts);
+		rv = task_aio_getevents(task, 1, 1, &event, &ts);
 		if (rv == -EINTR)
 			continue;
 		if (rv < 0)
@@ -129,7 +184,7 @@ void close_task_aio(struct task *task)
 				  ev_aicb, ev_iocb, ev_aicb->buf, event.res, event.res2);
 
 			ev_aicb->used = 0;
-			free(ev_aicb->buf);
+			free_iobuf(ev_aicb->buf, ev_aicb->buf_len);
 			ev_aicb->buf = NULL;
 		}
 	}
@@ -137,7 +192,10 @@ void close_task_aio(struct task *task)
 	if (used)
 		log_taskd(task, "close_task_aio destroy %d incomplete ops", used);
 
-	io_destroy(task->aio_ctx);
+	if (task->use_aio == 3)
+		uring_close(task);
+	else
+		io_destroy(task->aio_ctx);
 
 	if (used)
 		log_taske(task, "close_task_aio destroyed %d incomplete ops", used);
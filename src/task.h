@@ -11,5 +11,10 @@
 
 void setup_task_aio(struct task *task, int use_aio, int cb_size);
 void close_task_aio(struct task *task);
+int task_aio_submit(struct task *task, long nr, struct iocb **iocbs);
+int task_aio_getevents(struct task *task, long min_nr, long nr,
+		       struct io_event *events, struct timespec *ts);
+int task_aio_cancel(struct task *task, struct iocb *iocb, struct io_event *event);
+void task_aio_register_fd(struct task *task, int fd);
 
 #endif
@@ -0,0 +1,178 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+/*
+ * Binary trace of lease operations.
+ *
+ * Events are fixed size records in a ring that is always on in the daemon.
+ * Recording an event takes a slot with one atomic increment and fills in
+ * the record, nothing is formatted or locked, so it can be left on at full
+ * load.  The ring is copied out by "sanlock client trace", which prints the
+ * timeline of the most recent events.
+ *
+ * A record's seq is cleared while it's being written and set last, so the
+ * copy skips records that are being overwritten.
+ *
+ * The ring is only allocated by the daemon, the library doesn't record.
+ */
+
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "sanlock_internal.h"
+#include "trace.h"
+
+#define TRACE_RECS 16384 /* power of 2 */
+
+static struct trace_rec *trace_recs;
+static uint64_t trace_seq;
+static __thread uint32_t trace_tid;
+
+int trace_init(void)
+{
+	trace_recs = calloc(TRACE_RECS, sizeof(struct trace_rec));
+	if (!trace_recs)
+		return -ENOMEM;
+	return 0;
+}
+
+uint64_t trace_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* returns the time of the event, or 0 if tracing is not set up */
+
+uint64_t trace_event(int event, int op, uint32_t id, int32_t result,
+		     uint64_t a1, uint64_t a2)
+{
+	struct trace_rec *rec;
+	uint64_t seq, ns;
+
+	if (!trace_recs)
+		return 0;
+
+	if (!trace_tid)
+		trace_tid = syscall(SYS_gettid);
+
+	ns = trace_ns();
+
+	seq = __atomic_add_fetch(&trace_seq, 1, __ATOMIC_RELAXED);
+	rec = &trace_recs[seq & (TRACE_RECS - 1)];
+
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	rec->ns = ns;
+	rec->tid = trace_tid;
+	rec->event = event;
+	rec->op = op;
+	rec->id = id;
+	rec->result = result;
+	rec->a1 = a1;
+	rec->a2 = a2;
+
+	__atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+
+	return ns;
+}
+
+/*
+ * Copy a trace_header followed by the records still in the ring, oldest
+ * first, into buf.  Returns the number of bytes copied.
+ */
+
+int trace_copy(char *buf, int size)
+{
+	struct trace_header *th = (struct trace_header *)buf;
+	struct trace_rec *out = (struct trace_rec *)(buf + sizeof(struct trace_header));
+	struct trace_rec *rec;
+	struct timespec ts;
+	uint64_t last, seq, first, check;
+	int max, count = 0;
+
+	if (size < (int)sizeof(struct trace_header))
+		return 0;
+
+	memset(th, 0, sizeof(struct trace_header));
+	th->magic = TRACE_MAGIC;
+	th->rec_size = sizeof(struct trace_rec);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	th->now_real_ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	th->now_ns = trace_ns();
+
+	last = __atomic_load_n(&trace_seq, __ATOMIC_ACQUIRE);
+	th->seq = last;
+
+	if (!trace_recs || !last)
+		return sizeof(struct trace_header);
+
+	max = (size - sizeof(struct trace_header)) / sizeof(struct trace_rec);
+	if (max > TRACE_RECS)
+		max = TRACE_RECS;
+
+	first = (last > (uint64_t)max) ? last - max + 1 : 1;
+
+	for (seq = first; seq <= last; seq++) {
+		rec = &trace_recs[seq & (TRACE_RECS - 1)];
+
+		if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != seq)
+			continue;
+
+		memcpy(&out[count], rec, sizeof(struct trace_rec));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		/* overwritten while copying */
+		check = __atomic_load_n(&rec->seq, __ATOMIC_RELAXED);
+		if (check != seq)
+			continue;
+
+		out[count].seq = seq;
+		count++;
+	}
+
+	th->rec_count = count;
+
+	return sizeof(struct trace_header) + count * sizeof(struct trace_rec);
+}
+
+const char *trace_event_str(int event)
+{
+	switch (event) {
+	case TRACE_BALLOT_PHASE:
+		return "ballot_phase";
+	case TRACE_BALLOT_ABORT:
+		return "ballot_abort";
+	case TRACE_BALLOT_DONE:
+		return "ballot_done";
+	case TRACE_COMMIT:
+		return "commit";
+	case TRACE_IO_SUBMIT:
+		return "io_submit";
+	case TRACE_IO_DONE:
+		return "io_done";
+	case TRACE_IO_TIMEOUT:
+		return "io_timeout";
+	case TRACE_RENEWAL:
+		return "renewal";
+	default:
+		return "unknown";
+	}
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/*
+ * Trace events, the meaning of the record fields for each:
+ *
+ * BALLOT_PHASE  id res_id, op phase, result host_id, a1 lver, a2 mbal|inp
+ * BALLOT_ABORT  id res_id, op phase, result q, a1 bk lver, a2 bk mbal
+ * BALLOT_DONE   id res_id, op phase, result error, a1 lver, a2 mbal
+ * COMMIT        id res_id, result error, a1 lver, a2 owner_id
+ * IO_SUBMIT     id fd, op rd|wr, result len, a1 offset
+ * IO_DONE       id fd, op rd|wr, result rv, a1 offset, a2 usec
+ * IO_TIMEOUT    id fd, op rd|wr, result rv, a1 offset, a2 usec
+ * RENEWAL       id space_id, result error, a1 read ms, a2 write ms (-1 if not done)
+ */
+
+#define TRACE_BALLOT_PHASE	1
+#define TRACE_BALLOT_ABORT	2
+#define TRACE_BALLOT_DONE	3
+#define TRACE_COMMIT		4
+#define TRACE_IO_SUBMIT		5
+#define TRACE_IO_DONE		6
+#define TRACE_IO_TIMEOUT	7
+#define TRACE_RENEWAL		8
+
+#define TRACE_OP_RD		1
+#define TRACE_OP_WR		2
+
+struct trace_rec {
+	uint64_t seq;		/* 0 while being written */
+	uint64_t ns;		/* CLOCK_MONOTONIC */
+	uint32_t tid;
+	uint16_t event;
+	uint16_t op;
+	uint32_t id;
+	int32_t result;
+	uint64_t a1;
+	uint64_t a2;
+};
+
+#define TRACE_MAGIC 0x54524331 /* TRC1 */
+
+/* precedes the records sent by SM_CMD_TRACE */
+
+struct trace_header {
+	uint32_t magic;
+	uint32_t rec_size;
+	uint32_t rec_count;
+	uint32_t pad;
+	uint64_t now_ns;	/* CLOCK_MONOTONIC when copied */
+	uint64_t now_real_ns;	/* CLOCK_REALTIME when copied */
+	uint64_t seq;		/* number of events recorded */
+};
+
+int trace_init(void);
+uint64_t trace_ns(void);
+uint64_t trace_event(int event, int op, uint32_t id, int32_t result,
+		     uint64_t a1, uint64_t a2);
+int trace_copy(char *buf, int size);
+const char *trace_event_str(int event);
+
+#endif
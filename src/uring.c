@@ -0,0 +1,495 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+/*
+ * io_uring engine for lease io (use_aio 3).
+ *
+ * This provides the same submit/getevents interface as libaio so that the
+ * linux aio code in diskio.c (callback slots, timeouts, reaping timed out
+ * ios later) is shared by both.  Each io is still described by the iocb in
+ * its aicb, the sqe user_data points back to that iocb, and completions are
+ * returned as io_events.
+ *
+ * The ring is driven with raw syscalls; no library is needed.  A task can
+ * register long lived fds (the lockspace thread's delta lease disk) as fixed
+ * files, and task->iobuf (the delta lease renewal buffer) is registered as a
+ * fixed buffer, which avoids the per-io file and page lookups in the kernel.
+ * The renewal thread rotates task->iobuf through the lockspace's
+ * renewal_read_buf and check_buf, so the table holds the last three
+ * task->iobufs.
+ */
+
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "sanlock_internal.h"
+#include "log.h"
+#include "uring.h"
+
+#define URING_FILES 8
+#define URING_BUFS 3
+
+struct uring {
+	int ring_fd;
+	unsigned int sq_entries;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_len;
+	size_t cq_len;
+	size_t sqes_len;
+	int files[URING_FILES];     /* fixed file table, unused is -1 */
+	struct iovec bufs[URING_BUFS]; /* registered fixed buffers */
+	int bufs_stale[URING_BUFS];  /* buffer was given up by the task */
+	int bufs_count;
+	int bufs_error;             /* registering failed, don't retry */
+	int inflight;
+};
+
+static int sys_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+			   unsigned int flags, void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_unmap(struct uring *u)
+{
+	if (u->sqes && u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_len);
+	if (u->cq_ptr && u->cq_ptr != MAP_FAILED && u->cq_ptr != u->sq_ptr)
+		munmap(u->cq_ptr, u->cq_len);
+	if (u->sq_ptr && u->sq_ptr != MAP_FAILED)
+		munmap(u->sq_ptr, u->sq_len);
+}
+
+int uring_setup(struct task *task, int entries)
+{
+	struct io_uring_params p;
+	struct uring *u;
+	int i, rv;
+
+	u = malloc(sizeof(struct uring));
+	if (!u)
+		return -ENOMEM;
+	memset(u, 0, sizeof(struct uring));
+
+	memset(&p, 0, sizeof(p));
+
+	u->ring_fd = sys_uring_setup(entries, &p);
+	if (u->ring_fd < 0) {
+		rv = -errno;
+		log_taskd(task, "io_uring setup error %d", rv);
+		free(u);
+		return rv;
+	}
+
+	/* getevents needs a timeout, which needs the EXT_ARG enter */
+
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		log_taskd(task, "io_uring features %x no ext_arg", p.features);
+		rv = -EOPNOTSUPP;
+		goto fail;
+	}
+
+	u->sq_entries = p.sq_entries;
+	u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_len > u->sq_len)
+			u->sq_len = u->cq_len;
+		u->cq_len = u->sq_len;
+	}
+
+	u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED) {
+		rv = -errno;
+		goto fail;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		u->cq_ptr = u->sq_ptr;
+	} else {
+		u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_CQ_RING);
+		if (u->cq_ptr == MAP_FAILED) {
+			rv = -errno;
+			goto fail;
+		}
+	}
+
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		rv = -errno;
+		goto fail;
+	}
+
+	u->sq_head = (unsigned int *)((char *)u->sq_ptr + p.sq_off.head);
+	u->sq_tail = (unsigned int *)((char *)u->sq_ptr + p.sq_off.tail);
+	u->sq_mask = (unsigned int *)((char *)u->sq_ptr + p.sq_off.ring_mask);
+	u->sq_array = (unsigned int *)((char *)u->sq_ptr + p.sq_off.array);
+	u->cq_head = (unsigned int *)((char *)u->cq_ptr + p.cq_off.head);
+	u->cq_tail = (unsigned int *)((char *)u->cq_ptr + p.cq_off.tail);
+	u->cq_mask = (unsigned int *)((char *)u->cq_ptr + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->cq_ptr + p.cq_off.cqes);
+
+	/* an empty fixed file table, filled by uring_register_fd */
+
+	for (i = 0; i < URING_FILES; i++)
+		u->files[i] = -1;
+
+	rv = sys_uring_register(u->ring_fd, IORING_REGISTER_FILES, u->files, URING_FILES);
+	if (rv < 0) {
+		log_taskd(task, "io_uring register files error %d", errno);
+		/* fixed files are not used */
+		for (i = 0; i < URING_FILES; i++)
+			u->files[i] = -2;
+	}
+
+	task->uring = u;
+	return 0;
+
+ fail:
+	uring_unmap(u);
+	close(u->ring_fd);
+	free(u);
+	return rv;
+}
+
+void uring_close(struct task *task)
+{
+	struct uring *u = task->uring;
+
+	if (!u)
+		return;
+
+	uring_unmap(u);
+	close(u->ring_fd);
+	free(u);
+	task->uring = NULL;
+}
+
+/*
+ * Register an fd that the task will use for the rest of its life as a fixed
+ * file.  The fixed file table holds its own reference to the file, so an fd
+ * must only be registered if the task will do no io on another file using
+ * the same fd number, i.e. the fd is not closed before the task closes aio.
+ */
+
+int uring_register_fd(struct task *task, int fd)
+{
+	struct io_uring_files_update up;
+	struct uring *u = task->uring;
+	int i, rv;
+
+	if (!u)
+		return -EINVAL;
+
+	for (i = 0; i < URING_FILES; i++) {
+		if (u->files[i] == fd)
+			return i;
+	}
+
+	for (i = 0; i < URING_FILES; i++) {
+		if (u->files[i] == -1)
+			break;
+	}
+	if (i == URING_FILES)
+		return -ENOSPC;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = i;
+	up.fds = (uint64_t)(uintptr_t)&fd;
+
+	rv = sys_uring_register(u->ring_fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+	if (rv < 0) {
+		rv = -errno;
+		log_taskd(task, "io_uring register fd %d error %d", fd, rv);
+		return rv;
+	}
+
+	u->files[i] = fd;
+	return i;
+}
+
+/*
+ * Buffers can only be registered as a set, and unregistering them waits for
+ * any io using them, so the table is only changed while the ring is idle.
+ * After each successful read, the renewal thread swaps task->iobuf with the
+ * lockspace's renewal_read_buf, which the main loop swaps with check_buf, so
+ * task->iobuf is one of three buffers.  The table keeps the current
+ * task->iobuf and the ones before it, newest first; once all three are
+ * registered, the swaps don't change the table.  A timed out read can leave
+ * task->iobuf in flight, after which the delta lease code allocates a new
+ * task->iobuf; that one is registered once the old read has been reaped.
+ *
+ * The registration pins the pages of a buffer, so once a buffer given up by
+ * the task is reaped (and then freed), its entry is marked stale and not used
+ * as a fixed buffer again, even if a new task->iobuf is allocated at the same
+ * address.
+ */
+
+static int find_reg_buf(struct uring *u, char *buf, int len)
+{
+	char *base;
+	int i;
+
+	for (i = 0; i < u->bufs_count; i++) {
+		if (u->bufs_stale[i])
+			continue;
+		base = u->bufs[i].iov_base;
+		if (buf >= base && buf + len <= base + u->bufs[i].iov_len)
+			return i;
+	}
+	return -1;
+}
+
+static void update_reg_buf(struct task *task, struct uring *u)
+{
+	struct iovec bufs[URING_BUFS];
+	int count = 0;
+	int i, rv;
+
+	if (u->inflight)
+		return;
+
+	bufs[count].iov_base = task->iobuf;
+	bufs[count].iov_len = task->iobuf_len;
+	count++;
+
+	/* keep the previous task->iobufs, which the renewal thread will
+	   swap back in after later reads */
+
+	for (i = 0; i < u->bufs_count && count < URING_BUFS; i++) {
+		if (u->bufs_stale[i] || u->bufs[i].iov_base == task->iobuf)
+			continue;
+		bufs[count++] = u->bufs[i];
+	}
+
+	if (u->bufs_count)
+		sys_uring_register(u->ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+
+	memset(u->bufs, 0, sizeof(u->bufs));
+	memset(u->bufs_stale, 0, sizeof(u->bufs_stale));
+	u->bufs_count = 0;
+
+	rv = sys_uring_register(u->ring_fd, IORING_REGISTER_BUFFERS, bufs, count);
+	if (rv < 0) {
+		log_taskd(task, "io_uring register buffers %d error %d", count, errno);
+		u->bufs_error = 1;
+		return;
+	}
+
+	memcpy(u->bufs, bufs, count * sizeof(struct iovec));
+	u->bufs_count = count;
+}
+
+static int fixed_file(struct uring *u, int fd)
+{
+	int i;
+
+	for (i = 0; i < URING_FILES; i++) {
+		if (u->files[i] == fd)
+			return i;
+	}
+	return -1;
+}
+
+int uring_submit(struct task *task, long nr, struct iocb **iocbs)
+{
+	struct uring *u = task->uring;
+	struct io_uring_sqe *sqe;
+	struct iocb *iocb;
+	char *buf;
+	unsigned int head, tail, idx;
+	int i, file, fixed_buf, rv;
+
+	if (!u)
+		return -EINVAL;
+
+	if (task->iobuf && !u->bufs_error &&
+	    find_reg_buf(u, task->iobuf, task->iobuf_len) < 0)
+		update_reg_buf(task, u);
+
+	head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	tail = *u->sq_tail;
+
+	if (u->sq_entries - (tail - head) < nr)
+		return -EAGAIN;
+
+	for (i = 0; i < nr; i++) {
+		iocb = iocbs[i];
+		buf = iocb->u.c.buf;
+
+		idx = tail & *u->sq_mask;
+		sqe = &u->sqes[idx];
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+		fixed_buf = find_reg_buf(u, buf, iocb->u.c.nbytes);
+
+		if (iocb->aio_lio_opcode == IO_CMD_PREAD)
+			sqe->opcode = (fixed_buf >= 0) ? IORING_OP_READ_FIXED : IORING_OP_READ;
+		else
+			sqe->opcode = (fixed_buf >= 0) ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+
+		file = fixed_file(u, iocb->aio_fildes);
+		if (file >= 0) {
+			sqe->fd = file;
+			sqe->flags |= IOSQE_FIXED_FILE;
+		} else {
+			sqe->fd = iocb->aio_fildes;
+		}
+
+		sqe->addr = (uint64_t)(uintptr_t)buf;
+		sqe->len = iocb->u.c.nbytes;
+		sqe->off = iocb->u.c.offset;
+		sqe->buf_index = (fixed_buf >= 0) ? fixed_buf : 0;
+		sqe->user_data = (uint64_t)(uintptr_t)iocb;
+
+		u->sq_array[idx] = idx;
+		tail++;
+	}
+
+	__atomic_store_n(u->sq_tail, tail, __ATOMIC_RELEASE);
+
+ retry:
+	rv = sys_uring_enter(u->ring_fd, nr, 0, 0, NULL, 0);
+	if (rv < 0 && errno == EINTR)
+		goto retry;
+
+	/*
+	 * The callers follow io_submit, and release the ios that were not
+	 * submitted.  Sqes the kernel did not consume are still in the ring
+	 * and would be submitted by the next enter, so take them back.
+	 * Without SQPOLL the kernel reads sqes only in enter, and in order,
+	 * so the unconsumed ones are the last nr - rv before the tail.
+	 */
+
+	if (rv < 0) {
+		rv = -errno;
+		__atomic_store_n(u->sq_tail, tail - nr, __ATOMIC_RELEASE);
+		return rv;
+	}
+
+	if (rv < nr) {
+		log_taskd(task, "io_uring submit %d of %ld", rv, nr);
+		__atomic_store_n(u->sq_tail, tail - (nr - rv), __ATOMIC_RELEASE);
+	}
+
+	u->inflight += rv;
+	return rv;
+}
+
+static int reap_cqes(struct task *task, struct uring *u, long nr,
+		     struct io_event *events)
+{
+	struct io_uring_cqe *cqe;
+	struct iocb *iocb;
+	unsigned int head, tail;
+	int i, n = 0;
+
+	head = *u->cq_head;
+	tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+
+	while (head != tail && n < nr) {
+		cqe = &u->cqes[head & *u->cq_mask];
+
+		iocb = (struct iocb *)(uintptr_t)cqe->user_data;
+
+		for (i = 0; i < u->bufs_count; i++) {
+			if ((char *)iocb->u.c.buf == u->bufs[i].iov_base &&
+			    task->iobuf != u->bufs[i].iov_base)
+				u->bufs_stale[i] = 1;
+		}
+
+		memset(&events[n], 0, sizeof(struct io_event));
+		events[n].obj = iocb;
+		events[n].res = (unsigned long)(long)cqe->res;
+		events[n].res2 = 0;
+
+		head++;
+		n++;
+	}
+
+	__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+	u->inflight -= n;
+	return n;
+}
+
+/* same return values as io_getevents: number of events, 0 on timeout */
+
+int uring_getevents(struct task *task, long min_nr, long nr,
+		    struct io_event *events, struct timespec *ts)
+{
+	struct uring *u = task->uring;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec kts;
+	int n, rv;
+
+	if (!u)
+		return -EINVAL;
+
+	n = reap_cqes(task, u, nr, events);
+	if (n >= min_nr)
+		return n;
+
+	memset(&arg, 0, sizeof(arg));
+	memset(&kts, 0, sizeof(kts));
+
+	if (ts) {
+		kts.tv_sec = ts->tv_sec;
+		kts.tv_nsec = ts->tv_nsec;
+		arg.ts = (uint64_t)(uintptr_t)&kts;
+	}
+
+	rv = sys_uring_enter(u->ring_fd, 0, min_nr - n,
+			     IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			     &arg, sizeof(arg));
+	if (rv < 0 && errno != ETIME) {
+		if (n)
+			return n;
+		return -errno;
+	}
+
+	n += reap_cqes(task, u, nr - n, events + n);
+	return n;
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+#ifndef __URING_H__
+#define __URING_H__
+
+int uring_setup(struct task *task, int entries);
+void uring_close(struct task *task);
+int uring_register_fd(struct task *task, int fd);
+
+/* same interface as io_submit/io_getevents */
+
+int uring_submit(struct task *task, long nr, struct iocb **iocbs);
+int uring_getevents(struct task *task, long min_nr, long nr,
+		    struct io_event *events, struct timespec *ts);
+
+#endif
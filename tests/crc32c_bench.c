@@ -0,0 +1,123 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+/*
+ * Check that each crc32c implementation supported by this cpu matches the
+ * byte at a time table version, then time each one.
+ *
+ * crc32c_bench [seconds]
+ */
+
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/crc32c.h"
+
+/* dblock and leader checksum lengths, a sector, a 1M align_size */
+static const size_t bench_lens[] = { 64, 256, 512, 4096, 1048576 };
+
+#define MAX_LEN (1048576 + 64)
+
+static double now_sec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int check_impls(struct crc32c_impl *impls, int count, uint8_t *buf)
+{
+	uint32_t crc, want;
+	size_t off, len;
+	int i, n, errors = 0;
+
+	/* mostly short lengths, with some long enough for the folding path */
+
+	for (n = 0; n < 10100; n++) {
+		off = random() % 64;
+		if (n < 10000)
+			len = random() % 4096;
+		else
+			len = random() % (MAX_LEN - 64);
+		crc = (n & 1) ? (uint32_t)~1 : (uint32_t)random();
+
+		want = impls[0].fn(crc, buf + off, len);
+
+		for (i = 1; i < count; i++) {
+			if (impls[i].fn(crc, buf + off, len) == want)
+				continue;
+			printf("%s mismatch off %zu len %zu\n", impls[i].name, off, len);
+			errors++;
+		}
+	}
+	return errors;
+}
+
+int main(int argc, char *argv[])
+{
+	struct crc32c_impl *impls;
+	uint8_t *buf;
+	uint32_t crc;
+	double secs = 0.5, begin, end;
+	uint64_t bytes, calls;
+	size_t l;
+	int count, i;
+
+	if (argc > 1)
+		secs = atof(argv[1]);
+
+	buf = malloc(MAX_LEN);
+	if (!buf)
+		return 1;
+
+	srandom(1);
+	for (l = 0; l < MAX_LEN; l++)
+		buf[l] = random();
+
+	count = crc32c_get_impls(&impls);
+
+	printf("crc32c using %s, %d implementations supported\n",
+	       crc32c_impl_name(), count);
+
+	if (check_impls(impls, count, buf)) {
+		printf("FAIL\n");
+		return 1;
+	}
+	printf("all implementations match\n");
+
+	for (l = 0; l < sizeof(bench_lens) / sizeof(bench_lens[0]); l++) {
+		for (i = 0; i < count; i++) {
+			crc = ~1;
+			calls = 0;
+			bytes = 0;
+			begin = now_sec();
+
+			do {
+				crc = impls[i].fn(crc, buf, bench_lens[l]);
+				calls++;
+				bytes += bench_lens[l];
+				end = now_sec();
+			} while (end - begin < secs);
+
+			printf("len %8zu %-8s %10.1f MB/s %8.1f ns/call (%08x)\n",
+			       bench_lens[l], impls[i].name,
+			       bytes / (end - begin) / 1e6,
+			       (end - begin) * 1e9 / calls, crc);
+		}
+	}
+
+	free(buf);
+	return 0;
+}
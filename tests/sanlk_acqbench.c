@@ -0,0 +1,197 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+/*
+ * Measure acquire latency as the number of leases held by the daemon grows.
+ *
+ * sanlk_acqbench [-i] <lockspace_name> <lease_path> <count>
+ *
+ * The lockspace must already be joined.  Resources "acqbench<N>" are at
+ * offset N * 1MB in lease_path (512 byte sectors); -i initializes them
+ * first.  Each child process registers and holds SANLK_MAX_RESOURCES of the
+ * leases; children run one after another until count leases are held, and
+ * the average and max acquire time is printed for each 1000 leases held.
+ * All leases are released when the children are killed at the end.
+ */
+
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "sanlock.h"
+#include "sanlock_admin.h"
+#include "sanlock_resource.h"
+
+#define LEASE_SIZE (1024 * 1024)
+#define BATCH 1000
+
+static char *ls_name;
+static char *lease_path;
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void set_res(struct sanlk_resource *res, int n)
+{
+	memset(res, 0, sizeof(struct sanlk_resource) + sizeof(struct sanlk_disk));
+	snprintf(res->lockspace_name, SANLK_NAME_LEN, "%s", ls_name);
+	snprintf(res->name, SANLK_NAME_LEN, "acqbench%d", n);
+	snprintf(res->disks[0].path, SANLK_PATH_LEN, "%s", lease_path);
+	res->disks[0].offset = (uint64_t)n * LEASE_SIZE;
+	res->num_disks = 1;
+}
+
+/* acquire leases first..first+num-1, write each acquire time to the pipe */
+
+static void child(int first, int num, int wfd)
+{
+	char buf[sizeof(struct sanlk_resource) + sizeof(struct sanlk_disk)];
+	struct sanlk_resource *res = (struct sanlk_resource *)buf;
+	uint64_t begin, usec;
+	int fd, i, rv;
+
+	fd = sanlock_register();
+	if (fd < 0) {
+		fprintf(stderr, "register error %d\n", fd);
+		exit(1);
+	}
+
+	for (i = 0; i < num; i++) {
+		set_res(res, first + i);
+
+		begin = now_usec();
+		rv = sanlock_acquire(fd, -1, 0, 1, &res, NULL);
+		usec = now_usec() - begin;
+
+		if (rv < 0) {
+			fprintf(stderr, "acquire %s error %d\n", res->name, rv);
+			usec = (uint64_t)-1;
+		}
+
+		if (write(wfd, &usec, sizeof(usec)) != sizeof(usec))
+			exit(1);
+	}
+
+	/* hold the leases until killed */
+	while (1)
+		pause();
+}
+
+int main(int argc, char *argv[])
+{
+	char buf[sizeof(struct sanlk_resource) + sizeof(struct sanlk_disk)];
+	struct sanlk_resource *res = (struct sanlk_resource *)buf;
+	uint64_t usec, total = 0, max = 0;
+	pid_t *pids;
+	int pfd[2];
+	int do_init = 0, count, num, held = 0, batch = 0, errors = 0;
+	int nchild = 0, i, rv;
+
+	if (argc > 1 && !strcmp(argv[1], "-i")) {
+		do_init = 1;
+		argc--;
+		argv++;
+	}
+
+	if (argc < 4) {
+		printf("%s [-i] <lockspace_name> <lease_path> <count>\n", argv[0]);
+		return 1;
+	}
+
+	ls_name = argv[1];
+	lease_path = argv[2];
+	count = atoi(argv[3]);
+
+	if (do_init) {
+		for (i = 0; i < count; i++) {
+			set_res(res, i);
+			rv = sanlock_write_resource(res, 0, 0, 0);
+			if (rv < 0) {
+				printf("write_resource %s error %d\n", res->name, rv);
+				return 1;
+			}
+		}
+		printf("initialized %d resources\n", count);
+	}
+
+	pids = calloc(count / SANLK_MAX_RESOURCES + 1, sizeof(pid_t));
+	if (!pids || pipe(pfd) < 0)
+		return 1;
+
+	printf("held     avg_usec   max_usec\n");
+
+	while (held < count) {
+		num = count - held;
+		if (num > SANLK_MAX_RESOURCES)
+			num = SANLK_MAX_RESOURCES;
+
+		pids[nchild] = fork();
+		if (pids[nchild] < 0)
+			break;
+		if (!pids[nchild]) {
+			close(pfd[0]);
+			child(held, num, pfd[1]);
+		}
+		nchild++;
+
+		for (i = 0; i < num; i++) {
+			if (read(pfd[0], &usec, sizeof(usec)) != sizeof(usec))
+				goto out;
+
+			held++;
+
+			if (usec == (uint64_t)-1) {
+				errors++;
+				continue;
+			}
+
+			total += usec;
+			if (usec > max)
+				max = usec;
+
+			if (++batch == BATCH) {
+				printf("%-8d %-10llu %-10llu\n", held,
+				       (unsigned long long)(total / batch),
+				       (unsigned long long)max);
+				total = 0;
+				max = 0;
+				batch = 0;
+			}
+		}
+	}
+
+	if (batch)
+		printf("%-8d %-10llu %-10llu\n", held,
+		       (unsigned long long)(total / batch),
+		       (unsigned long long)max);
+ out:
+	if (errors)
+		printf("%d acquire errors\n", errors);
+
+	for (i = 0; i < nchild; i++)
+		kill(pids[i], SIGKILL);
+	for (i = 0; i < nchild; i++)
+		waitpid(pids[i], NULL, 0);
+
+	free(pids);
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright 2010-2011 Red Hat, Inc.
+ *
+ * This copyrighted material is made available to anyone wishing to use,
+ * modify, copy, or redistribute it subject to the terms and conditions
+ * of the GNU General Public License v2 or (at your option) any later version.
+ */
+
+/*
+ * Measure daemon throughput with many processes working on unrelated
+ * resources at once, i.e. contention in the daemon's resource locking.
+ *
+ * sanlk_contend [-i] [-a] <lockspace_name> <lease_path> <workers> <seconds>
+ *
+ * The lockspace must already be joined.  Each worker process uses its own
+ * resource "contend<N>" at offset N * 1MB in lease_path (512 byte sectors);
+ * -i initializes them first.  By default each worker acquires its lease with
+ * an lvb and then repeatedly reads the lvb, which only involves the daemon's
+ * resource lookup.  With -a each worker repeatedly acquires and releases its
+ * lease instead.  The total and per worker operations per second are printed.
+ */
+
+#include <inttypes.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "sanlock.h"
+#include "sanlock_admin.h"
+#include "sanlock_resource.h"
+
+#define LEASE_SIZE (1024 * 1024)
+
+static char *ls_name;
+static char *lease_path;
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void set_res(struct sanlk_resource *res, int n)
+{
+	memset(res, 0, sizeof(struct sanlk_resource) + sizeof(struct sanlk_disk));
+	snprintf(res->lockspace_name, SANLK_NAME_LEN, "%s", ls_name);
+	snprintf(res->name, SANLK_NAME_LEN, "contend%d", n);
+	snprintf(res->disks[0].path, SANLK_PATH_LEN, "%s", lease_path);
+	res->disks[0].offset = (uint64_t)n * LEASE_SIZE;
+	res->num_disks = 1;
+}
+
+/* run operations on resource n for seconds, write the op count to the pipe */
+
+static void worker(int n, int seconds, int do_acquire, int wfd)
+{
+	char buf[sizeof(struct sanlk_resource) + sizeof(struct sanlk_disk)];
+	struct sanlk_resource *res = (struct sanlk_resource *)buf;
+	char lvb[512];
+	uint64_t end, ops = 0;
+	int fd, rv;
+
+	set_res(res, n);
+
+	fd = sanlock_register();
+	if (fd < 0) {
+		fprintf(stderr, "register error %d\n", fd);
+		goto out;
+	}
+
+	if (!do_acquire) {
+		rv = sanlock_acquire(fd, -1, SANLK_ACQUIRE_LVB, 1, &res, NULL);
+		if (rv < 0) {
+			fprintf(stderr, "acquire %s error %d\n", res->name, rv);
+			goto out;
+		}
+	}
+
+	end = now_usec() + (uint64_t)seconds * 1000000;
+
+	while (now_usec() < end) {
+		if (do_acquire) {
+			rv = sanlock_acquire(fd, -1, 0, 1, &res, NULL);
+			if (rv < 0) {
+				fprintf(stderr, "acquire %s error %d\n", res->name, rv);
+				break;
+			}
+			rv = sanlock_release(fd, -1, 0, 1, &res);
+			if (rv < 0) {
+				fprintf(stderr, "release %s error %d\n", res->name, rv);
+				break;
+			}
+		} else {
+			rv = sanlock_get_lvb(0, res, lvb, sizeof(lvb));
+			if (rv < 0) {
+				fprintf(stderr, "get_lvb %s error %d\n", res->name, rv);
+				break;
+			}
+		}
+		ops++;
+	}
+ out:
+	if (write(wfd, &ops, sizeof(ops)) != sizeof(ops))
+		exit(1);
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	char buf[sizeof(struct sanlk_resource) + sizeof(struct sanlk_disk)];
+	struct sanlk_resource *res = (struct sanlk_resource *)buf;
+	uint64_t ops, total = 0;
+	pid_t pid;
+	int pfd[2];
+	int do_init = 0, do_acquire = 0, workers, seconds;
+	int i, rv;
+
+	while (argc > 1 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-i"))
+			do_init = 1;
+		else if (!strcmp(argv[1], "-a"))
+			do_acquire = 1;
+		else
+			break;
+		argc--;
+		argv++;
+	}
+
+	if (argc < 5) {
+		printf("%s [-i] [-a] <lockspace_name> <lease_path> <workers> <seconds>\n", argv[0]);
+		return 1;
+	}
+
+	ls_name = argv[1];
+	lease_path = argv[2];
+	workers = atoi(argv[3]);
+	seconds = atoi(argv[4]);
+
+	if (workers < 1 || seconds < 1)
+		return 1;
+
+	if (do_init) {
+		for (i = 0; i < workers; i++) {
+			set_res(res, i);
+			rv = sanlock_write_resource(res, 0, 0, 0);
+			if (rv < 0) {
+				printf("write_resource %s error %d\n", res->name, rv);
+				return 1;
+			}
+		}
+		printf("initialized %d resources\n", workers);
+	}
+
+	if (pipe(pfd) < 0)
+		return 1;
+
+	for (i = 0; i < workers; i++) {
+		pid = fork();
+		if (pid < 0)
+			return 1;
+		if (!pid) {
+			close(pfd[0]);
+			worker(i, seconds, do_acquire, pfd[1]);
+		}
+	}
+	close(pfd[1]);
+
+	for (i = 0; i < workers; i++) {
+		if (read(pfd[0], &ops, sizeof(ops)) != sizeof(ops))
+			break;
+		total += ops;
+	}
+
+	while (wait(NULL) > 0)
+		;
+
+	printf("%s workers %d ops %llu ops/sec %llu per worker %llu\n",
+	       do_acquire ? "acquire_release" : "get_lvb", workers,
+	       (unsigned long long)total,
+	       (unsigned long long)(total / seconds),
+	       (unsigned long long)(total / seconds / workers));
+	return 0;
+}
@@ -19,7 +19,6 @@
 #include <errno.h>
 #include <limits.h>
 #include <time.h>
-#include <poll.h>
 #include <syslog.h>
 #include <dirent.h>
 #include <signal.h>
@@ -32,6 +31,7 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/signalfd.h>
+#include <sys/epoll.h>
 #include <linux/watchdog.h>
 
 #include "wdmd.h"
@@ -105,10 +105,9 @@ struct client {
 };
 
 #define CLIENT_NALLOC 16
-static int client_maxi;
 static int client_size = 0;
 static struct client *client = NULL;
-static struct pollfd *pollfd = NULL;
+static int epfd = -1;
 
 
 #define log_debug(fmt, args...) \
@@ -151,29 +150,26 @@ static void client_alloc(void)
 
 	if (!client) {
 		client = malloc(CLIENT_NALLOC * sizeof(struct client));
-		pollfd = malloc(CLIENT_NALLOC * sizeof(struct pollfd));
+		epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (epfd < 0)
+			log_error("can't create epoll fd %d", errno);
 	} else {
 		client = realloc(client, (client_size + CLIENT_NALLOC) *
 				 sizeof(struct client));
-		pollfd = realloc(pollfd, (client_size + CLIENT_NALLOC) *
-				 sizeof(struct pollfd));
-		if (!pollfd)
-			log_error("can't alloc for pollfd");
 	}
-	if (!client || !pollfd)
+	if (!client)
 		log_error("can't alloc for client array");
 
 	for (i = client_size; i < client_size + CLIENT_NALLOC; i++) {
 		memset(&client[i], 0, sizeof(struct client));
 		client[i].fd = -1;
-		pollfd[i].fd = -1;
-		pollfd[i].revents = 0;
 	}
 	client_size += CLIENT_NALLOC;
 }
 
 static int client_add(int fd, void (*workfn)(int ci), void (*deadfn)(int ci))
 {
+	struct epoll_event ev;
 	int i;
 
 	if (!client)
@@ -185,10 +181,12 @@ static int client_add(int fd, void (*workfn)(int ci), void (*deadfn)(int ci))
 			client[i].workfn = workfn;
 			client[i].deadfn = deadfn;
 			client[i].fd = fd;
-			pollfd[i].fd = fd;
-			pollfd[i].events = POLLIN;
-			if (i > client_maxi)
-				client_maxi = i;
+
+			memset(&ev, 0, sizeof(ev));
+			ev.events = EPOLLIN;
+			ev.data.u32 = i;
+			if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+				log_error("client_add epoll_ctl fd %d error %d", fd, errno);
 			return i;
 		}
 	}
@@ -202,6 +200,7 @@ static void client_pid_dead(int ci)
 	if (!client[ci].expire) {
 		log_debug("client_pid_dead ci %d", ci);
 
+		epoll_ctl(epfd, EPOLL_CTL_DEL, client[ci].fd, NULL);
 		close(client[ci].fd);
 
 		/* refcount automatically dropped if a client with
@@ -211,8 +210,6 @@ static void client_pid_dead(int ci)
 		memset(&client[ci], 0, sizeof(struct client));
 
 		client[ci].fd = -1;
-		pollfd[ci].fd = -1;
-		pollfd[ci].events = 0;
 	} else {
 		/*
 		 * Leave used and expire set so that test_clients will continue
@@ -237,13 +234,12 @@ static void client_pid_dead(int ci)
 			  (unsigned long long)client[ci].expire,
 			  client[ci].name);
 
+		epoll_ctl(epfd, EPOLL_CTL_DEL, client[ci].fd, NULL);
 		close(client[ci].fd);
 
 		client[ci].pid_dead = 1;
 
 		client[ci].fd = -1;
-		pollfd[ci].fd = -1;
-		pollfd[ci].events = 0;
 	}
 }
 
@@ -1295,15 +1291,18 @@ static void close_shm(void)
 	close(shm_fd);
 }
 
+#define MAX_EPOLL_EVENTS 16
+
 static int test_loop(void)
 {
 	void (*workfn) (int ci);
 	void (*deadfn) (int ci);
+	struct epoll_event events[MAX_EPOLL_EVENTS];
 	uint64_t test_time;
 	int poll_timeout;
 	int sleep_seconds;
 	int fail_count;
-	int rv, i;
+	int n, i, ci;
 
 	pet_watchdog();
 
@@ -1311,24 +1310,25 @@ static int test_loop(void)
 	poll_timeout = test_interval * 1000;
 
 	while (1) {
-		rv = poll(pollfd, client_maxi + 1, poll_timeout);
-		if (rv == -1 && errno == EINTR)
+		n = epoll_wait(epfd, events, MAX_EPOLL_EVENTS, poll_timeout);
+		if (n == -1 && errno == EINTR)
 			continue;
-		if (rv < 0) {
+		if (n < 0) {
 			/* not sure */
 		}
-		for (i = 0; i <= client_maxi; i++) {
-			if (client[i].fd < 0)
+		for (i = 0; i < n; i++) {
+			ci = events[i].data.u32;
+			if (ci >= client_size || client[ci].fd < 0)
 				continue;
-			if (pollfd[i].revents & POLLIN) {
-				workfn = client[i].workfn;
+			if (events[i].events & EPOLLIN) {
+				workfn = client[ci].workfn;
 				if (workfn)
-					workfn(i);
+					workfn(ci);
 			}
-			if (pollfd[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
-				deadfn = client[i].deadfn;
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				deadfn = client[ci].deadfn;
 				if (deadfn)
-					deadfn(i);
+					deadfn(ci);
 			}
 		}
 